@@ -0,0 +1,659 @@
+#ifndef DFS_CATALOG_H
+#define DFS_CATALOG_H
+
+/*
+ * S1's catalog of what is stored where.
+ *
+ * Every file stored through S1 has an entry: its logical path (relative to
+ * the stores, as in ~S1/<path>), the nodes that hold a copy, its size, a CRC-32
+ * of its contents when S1 saw them go by, a version that counts the times
+ * it was stored, and when.  The entries live in an append-only log,
+ * <store>/.catalog, mapped into memory: storing a file appends a PUT
+ * record, removing it a DEL record, each with a CRC of its own so that a
+ * record torn by a crash ends the log when it is read back.
+ *
+ * Each process keeps a hash table from path to the offset of the path's
+ * latest record, so a lookup is one probe and a comparison against the
+ * mapped log.  The log itself and a small control block are shared by all
+ * S1 processes (the control block is mapped before the first fork): an
+ * append takes the block's process-shared lock, and a process that finds
+ * the log longer than what its table has seen replays the new records
+ * first.  Once the log is mostly superseded records it is compacted: the
+ * live records are written to a new file, which is synced and renamed over
+ * the log, and the other processes, seeing the generation change, map the
+ * new file and rebuild their tables from it.
+ *
+ * A record can also be made conditional on the version the file had when
+ * it was read (dfs_catalog_move, dfs_catalog_forget), so that moving a
+ * file to another node changes over in one record, and only if nothing
+ * stored or removed the file in the meantime.
+ *
+ * A log from before files had more than one copy ("DFSCAT1", one node per
+ * record) is rewritten in the current format when the catalog is opened.
+ *
+ * Appends are not synced: a crash of the machine can lose the latest
+ * records, never the rest of the log.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "dfs_proto.h"
+
+#define DFS_CATALOG_NAME ".catalog"
+#define DFS_CATALOG_MAGIC 0x44465343u        /* "DFSC", at the start of each record */
+#define DFS_CATALOG_FORMAT "DFSCAT2"         /* At the start of the file */
+#define DFS_CATALOG_HEADER 64                /* File header: the format and room to spare */
+#define DFS_CATALOG_GROW (1024 * 1024)       /* The file grows by at least this much */
+#define DFS_CATALOG_COMPACT_MIN (1024 * 1024) /* Smaller logs are never compacted */
+#define DFS_CATALOG_COPIES 8                 /* Most nodes one file is recorded on */
+
+enum { DFS_CATALOG_PUT = 1, DFS_CATALOG_PUT_NOSUM, DFS_CATALOG_DEL };
+
+struct dfs_catalog_record {
+    uint32_t magic;
+    uint32_t crc;                /* Of the rest of the record, path included */
+    uint8_t type;
+    uint8_t copies;              /* How many of nodes are set */
+    uint16_t path_len;
+    uint32_t checksum;           /* CRC-32 of the file, for DFS_CATALOG_PUT */
+    uint64_t size;
+    uint64_t version;
+    int64_t mtime;
+    uint8_t nodes[DFS_CATALOG_COPIES];  /* The ids of the nodes with a copy */
+    char path[];                 /* Then padding to 8 bytes */
+};
+
+// A record of a "DFSCAT1" log, which had one node per file
+struct dfs_catalog_record_v1 {
+    uint32_t magic;
+    uint32_t crc;
+    uint8_t type;
+    uint8_t node;
+    uint16_t path_len;
+    uint32_t checksum;
+    uint64_t size;
+    uint64_t version;
+    int64_t mtime;
+    char path[];
+};
+
+// What the catalog knows about a file
+struct dfs_catalog_info {
+    int nodes[DFS_CATALOG_COPIES];  /* The nodes with a copy, copies of them */
+    int copies;
+    uint64_t size;
+    uint32_t checksum;
+    int has_checksum;
+    uint64_t version;
+    int64_t mtime;
+};
+
+// Shared by every S1 process
+struct dfs_catalog_shared {
+    pthread_mutex_t lock;        /* Process-shared and robust */
+    _Atomic uint64_t used;       /* End of the last complete record */
+    _Atomic uint64_t file_size;
+    _Atomic uint32_t gen;        /* Bumped by each compaction */
+    uint64_t live;               /* Bytes of records that are still current */
+    uint64_t entries;
+    _Atomic uint64_t lookups, hits, appends, compactions;
+};
+
+struct dfs_catalog_slot {
+    uint32_t hash;
+    uint32_t unused;
+    uint64_t off;                /* 0 for an empty slot */
+};
+
+static struct {
+    char path[1100];
+    struct dfs_catalog_shared *shared;
+    int fd;
+    unsigned char *map;
+    size_t map_len;
+    uint32_t gen;
+    uint64_t replayed;           /* The table reflects the log up to here */
+    struct dfs_catalog_slot *slots;
+    size_t cap, count;
+} dfs_catalog = { .fd = -1 };
+
+static inline uint32_t dfs_catalog_hash(const char *path, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    return h;
+}
+
+static inline size_t dfs_catalog_record_len(size_t path_len) {
+    return (sizeof(struct dfs_catalog_record) + path_len + 7) & ~(size_t)7;
+}
+
+static inline struct dfs_catalog_record *dfs_catalog_at(uint64_t off) {
+    return (struct dfs_catalog_record *)(dfs_catalog.map + off);
+}
+
+// The record at off, if a complete and intact one ends before end
+static inline struct dfs_catalog_record *dfs_catalog_valid(uint64_t off, uint64_t end) {
+    if (off + sizeof(struct dfs_catalog_record) > end)
+        return NULL;
+    struct dfs_catalog_record *r = dfs_catalog_at(off);
+    if (r->magic != DFS_CATALOG_MAGIC || off + dfs_catalog_record_len(r->path_len) > end ||
+        r->type < DFS_CATALOG_PUT || r->type > DFS_CATALOG_DEL || r->copies > DFS_CATALOG_COPIES)
+        return NULL;
+    uint32_t crc = crc32(0, (const unsigned char *)r + 8, sizeof(*r) - 8 + r->path_len);
+    return crc == r->crc ? r : NULL;
+}
+
+// The slot of path in the table: its own, or the empty one it would take
+static inline size_t dfs_catalog_probe(const char *path, size_t len, uint32_t hash) {
+    size_t mask = dfs_catalog.cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct dfs_catalog_slot *s = &dfs_catalog.slots[i];
+        if (!s->off)
+            return i;
+        if (s->hash == hash) {
+            struct dfs_catalog_record *r = dfs_catalog_at(s->off);
+            if (r->path_len == len && memcmp(r->path, path, len) == 0)
+                return i;
+        }
+    }
+}
+
+// Take the lock, recovering it from a process that died holding it (the
+// record it was writing is past used, so the log is whole)
+static inline void dfs_catalog_lock(void) {
+    if (pthread_mutex_lock(&dfs_catalog.shared->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&dfs_catalog.shared->lock);
+}
+
+static inline void dfs_catalog_unlock(void) {
+    pthread_mutex_unlock(&dfs_catalog.shared->lock);
+}
+
+static inline int dfs_catalog_grow_table(void) {
+    size_t old_cap = dfs_catalog.cap, cap = old_cap ? 2 * old_cap : 1024;
+    struct dfs_catalog_slot *old = dfs_catalog.slots;
+    struct dfs_catalog_slot *slots = calloc(cap, sizeof(*slots));
+    if (!slots)
+        return -1;
+    dfs_catalog.slots = slots;
+    dfs_catalog.cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].off) {
+            struct dfs_catalog_record *r = dfs_catalog_at(old[i].off);
+            slots[dfs_catalog_probe(r->path, r->path_len, old[i].hash)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// Empty slot i, moving up any entry that probed past it
+static inline void dfs_catalog_remove_slot(size_t i) {
+    size_t mask = dfs_catalog.cap - 1;
+    for (size_t j = (i + 1) & mask; dfs_catalog.slots[j].off; j = (j + 1) & mask) {
+        size_t home = dfs_catalog.slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            dfs_catalog.slots[i] = dfs_catalog.slots[j];
+            i = j;
+        }
+    }
+    dfs_catalog.slots[i].off = 0;
+    dfs_catalog.count--;
+}
+
+// Bring the table up to date with the record at off. Returns -1 if the
+// table could not grow.
+static inline int dfs_catalog_apply(uint64_t off) {
+    struct dfs_catalog_record *r = dfs_catalog_at(off);
+    if ((dfs_catalog.count + 1) * 10 > dfs_catalog.cap * 7 && dfs_catalog_grow_table() < 0)
+        return -1;
+    uint32_t hash = dfs_catalog_hash(r->path, r->path_len);
+    size_t i = dfs_catalog_probe(r->path, r->path_len, hash);
+    if (r->type == DFS_CATALOG_DEL) {
+        if (dfs_catalog.slots[i].off)
+            dfs_catalog_remove_slot(i);
+        return 0;
+    }
+    if (!dfs_catalog.slots[i].off)
+        dfs_catalog.count++;
+    dfs_catalog.slots[i].hash = hash;
+    dfs_catalog.slots[i].off = off;
+    return 0;
+}
+
+// Map the first len bytes of the log (at least what is mapped now)
+static inline int dfs_catalog_map(size_t len) {
+    if (len <= dfs_catalog.map_len)
+        return 0;
+    void *map = dfs_catalog.map ? mremap(dfs_catalog.map, dfs_catalog.map_len, len, MREMAP_MAYMOVE)
+                                : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, dfs_catalog.fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    dfs_catalog.map = map;
+    dfs_catalog.map_len = len;
+    return 0;
+}
+
+// Drop the table and map the log afresh, after a compaction
+static inline int dfs_catalog_reopen(void) {
+    if (dfs_catalog.map)
+        munmap(dfs_catalog.map, dfs_catalog.map_len);
+    if (dfs_catalog.fd >= 0)
+        close(dfs_catalog.fd);
+    dfs_catalog.map = NULL;
+    dfs_catalog.map_len = 0;
+    memset(dfs_catalog.slots, 0, dfs_catalog.cap * sizeof(*dfs_catalog.slots));
+    dfs_catalog.count = 0;
+    dfs_catalog.replayed = DFS_CATALOG_HEADER;
+    dfs_catalog.gen = atomic_load(&dfs_catalog.shared->gen);
+    dfs_catalog.fd = open(dfs_catalog.path, O_RDWR | O_CLOEXEC);
+    return dfs_catalog.fd < 0 ? -1 : 0;
+}
+
+// Replay what other processes have appended since this one last looked.
+// Called with the lock held.
+static inline int dfs_catalog_catch_up(void) {
+    if (dfs_catalog.gen != atomic_load(&dfs_catalog.shared->gen) && dfs_catalog_reopen() < 0)
+        return -1;
+    uint64_t used = atomic_load(&dfs_catalog.shared->used);
+    if (dfs_catalog_map(atomic_load(&dfs_catalog.shared->file_size)) < 0)
+        return -1;
+    while (dfs_catalog.replayed < used) {
+        struct dfs_catalog_record *r = dfs_catalog_valid(dfs_catalog.replayed, used);
+        if (!r || dfs_catalog_apply(dfs_catalog.replayed) < 0)
+            return -1;
+        dfs_catalog.replayed += dfs_catalog_record_len(r->path_len);
+    }
+    return 0;
+}
+
+// Catch up, taking the lock only if there is anything to catch up on
+static inline int dfs_catalog_sync(void) {
+    if (dfs_catalog.gen == atomic_load(&dfs_catalog.shared->gen) &&
+        dfs_catalog.replayed == atomic_load(&dfs_catalog.shared->used))
+        return 0;
+    dfs_catalog_lock();
+    int rc = dfs_catalog_catch_up();
+    dfs_catalog_unlock();
+    return rc;
+}
+
+// Write the current records to a new log and put it in place of the old
+// one. Called with the lock held and the table up to date.
+static inline int dfs_catalog_compact(void) {
+    char tmp[1200];
+    snprintf(tmp, sizeof(tmp), "%s.new", dfs_catalog.path);
+    size_t size = DFS_CATALOG_HEADER + dfs_catalog.shared->live + DFS_CATALOG_GROW;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    unsigned char *map = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Catalog compaction failed");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return -1;
+    }
+
+    // The live records, in table order; then the table points into the new log
+    memcpy(map, DFS_CATALOG_FORMAT, 8);
+    uint64_t end = DFS_CATALOG_HEADER;
+    for (size_t i = 0; i < dfs_catalog.cap; i++) {
+        if (!dfs_catalog.slots[i].off)
+            continue;
+        struct dfs_catalog_record *r = dfs_catalog_at(dfs_catalog.slots[i].off);
+        size_t len = dfs_catalog_record_len(r->path_len);
+        memcpy(map + end, r, len);
+        end += len;
+    }
+    if (msync(map, end, MS_SYNC) < 0 || fsync(fd) < 0 || rename(tmp, dfs_catalog.path) < 0) {
+        perror("Catalog compaction failed");
+        munmap(map, size);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    uint64_t was = atomic_load(&dfs_catalog.shared->used);
+    end = DFS_CATALOG_HEADER;
+    for (size_t i = 0; i < dfs_catalog.cap; i++) {
+        if (!dfs_catalog.slots[i].off)
+            continue;
+        size_t len = dfs_catalog_record_len(dfs_catalog_at(dfs_catalog.slots[i].off)->path_len);
+        dfs_catalog.slots[i].off = end;
+        end += len;
+    }
+    munmap(dfs_catalog.map, dfs_catalog.map_len);
+    close(dfs_catalog.fd);
+    dfs_catalog.fd = fd;
+    dfs_catalog.map = map;
+    dfs_catalog.map_len = size;
+    dfs_catalog.replayed = end;
+    atomic_store(&dfs_catalog.shared->used, end);
+    atomic_store(&dfs_catalog.shared->file_size, size);
+    dfs_catalog.shared->live = end - DFS_CATALOG_HEADER;
+    dfs_catalog.gen = atomic_fetch_add(&dfs_catalog.shared->gen, 1) + 1;
+    atomic_fetch_add(&dfs_catalog.shared->compactions, 1);
+    printf("Compacted the catalog from %llu to %llu bytes (%zu entries)\n", (unsigned long long)was,
+           (unsigned long long)end, dfs_catalog.count);
+    return 0;
+}
+
+// The "DFSCAT1" record at off, if a complete and intact one ends before end
+static inline struct dfs_catalog_record_v1 *dfs_catalog_valid_v1(uint64_t off, uint64_t end) {
+    if (off + sizeof(struct dfs_catalog_record_v1) > end)
+        return NULL;
+    struct dfs_catalog_record_v1 *r = (struct dfs_catalog_record_v1 *)(dfs_catalog.map + off);
+    size_t len = (sizeof(*r) + r->path_len + 7) & ~(size_t)7;
+    if (r->magic != DFS_CATALOG_MAGIC || off + len > end || r->type < DFS_CATALOG_PUT || r->type > DFS_CATALOG_DEL)
+        return NULL;
+    uint32_t crc = crc32(0, (const unsigned char *)r + 8, sizeof(*r) - 8 + r->path_len);
+    return crc == r->crc ? r : NULL;
+}
+
+// Rewrite the "DFSCAT1" log of size bytes that is mapped now in the current
+// format, each file on the one node it had, and put it in place of the old
+// one. Returns the new file's size, or -1 if it could not be written.
+static inline int64_t dfs_catalog_upgrade(uint64_t size) {
+    uint64_t off = DFS_CATALOG_HEADER, need = DFS_CATALOG_HEADER + DFS_CATALOG_GROW;
+    struct dfs_catalog_record_v1 *old;
+    for (; (old = dfs_catalog_valid_v1(off, size)) != NULL; off += (sizeof(*old) + old->path_len + 7) & ~(size_t)7)
+        need += dfs_catalog_record_len(old->path_len);
+
+    char tmp[1200];
+    snprintf(tmp, sizeof(tmp), "%s.new", dfs_catalog.path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    unsigned char *map = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, need) == 0)
+        map = mmap(NULL, need, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Catalog upgrade failed");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return -1;
+    }
+
+    memcpy(map, DFS_CATALOG_FORMAT, 8);
+    uint64_t end = DFS_CATALOG_HEADER;
+    for (off = DFS_CATALOG_HEADER; (old = dfs_catalog_valid_v1(off, size)) != NULL;
+         off += (sizeof(*old) + old->path_len + 7) & ~(size_t)7) {
+        struct dfs_catalog_record *r = (struct dfs_catalog_record *)(map + end);
+        r->magic = DFS_CATALOG_MAGIC;
+        r->type = old->type;
+        r->copies = old->type != DFS_CATALOG_DEL;
+        r->nodes[0] = old->node;
+        r->path_len = old->path_len;
+        r->checksum = old->checksum;
+        r->size = old->size;
+        r->version = old->version;
+        r->mtime = old->mtime;
+        memcpy(r->path, old->path, old->path_len);
+        r->crc = crc32(0, (const unsigned char *)r + 8, sizeof(*r) - 8 + r->path_len);
+        end += dfs_catalog_record_len(r->path_len);
+    }
+    if (msync(map, end, MS_SYNC) < 0 || fsync(fd) < 0 || rename(tmp, dfs_catalog.path) < 0) {
+        perror("Catalog upgrade failed");
+        munmap(map, need);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    munmap(dfs_catalog.map, dfs_catalog.map_len);
+    close(dfs_catalog.fd);
+    dfs_catalog.fd = fd;
+    dfs_catalog.map = map;
+    dfs_catalog.map_len = need;
+    printf("Rewrote the catalog in format %s (%llu bytes of log)\n", DFS_CATALOG_FORMAT, (unsigned long long)end);
+    return need;
+}
+
+// Open (or create) the catalog at root/.catalog. Must be called before the
+// first fork, so that every process shares it. Returns -1 if there is none.
+static inline int dfs_catalog_open(const char *root) {
+    snprintf(dfs_catalog.path, sizeof(dfs_catalog.path), "%s/%s", root, DFS_CATALOG_NAME);
+    struct dfs_catalog_shared *shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("Catalog unavailable");
+        return -1;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    struct stat st;
+    dfs_catalog.fd = open(dfs_catalog.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (dfs_catalog.fd < 0 || fstat(dfs_catalog.fd, &st) < 0 ||
+        (st.st_size < DFS_CATALOG_GROW && ftruncate(dfs_catalog.fd, st.st_size = DFS_CATALOG_GROW) < 0) ||
+        dfs_catalog_map(st.st_size) < 0 || dfs_catalog_grow_table() < 0) {
+        perror("Catalog unavailable");
+        if (dfs_catalog.fd >= 0)
+            close(dfs_catalog.fd);
+        dfs_catalog.fd = -1;
+        munmap(shared, sizeof(*shared));
+        return -1;
+    }
+    if (memcmp(dfs_catalog.map, "DFSCAT1", 8) == 0 && (st.st_size = dfs_catalog_upgrade(st.st_size)) < 0) {
+        close(dfs_catalog.fd);
+        dfs_catalog.fd = -1;
+        munmap(dfs_catalog.map, dfs_catalog.map_len);
+        dfs_catalog.map = NULL;
+        munmap(shared, sizeof(*shared));
+        return -1;
+    }
+    dfs_catalog.shared = shared;
+    if (memcmp(dfs_catalog.map, DFS_CATALOG_FORMAT, 8) != 0) {
+        if (memcmp(dfs_catalog.map, "\0\0\0\0\0\0\0\0", 8) != 0)
+            fprintf(stderr, "%s is not a catalog; starting a new one\n", dfs_catalog.path);
+        memset(dfs_catalog.map, 0, st.st_size);
+        memcpy(dfs_catalog.map, DFS_CATALOG_FORMAT, 8);
+    }
+
+    // Read the log up to the first record that is not whole
+    uint64_t off = DFS_CATALOG_HEADER;
+    struct dfs_catalog_record *r;
+    while ((r = dfs_catalog_valid(off, st.st_size)) != NULL && dfs_catalog_apply(off) == 0)
+        off += dfs_catalog_record_len(r->path_len);
+    dfs_catalog.replayed = off;
+    atomic_store(&shared->used, off);
+    atomic_store(&shared->file_size, st.st_size);
+    for (size_t i = 0; i < dfs_catalog.cap; i++) {
+        if (dfs_catalog.slots[i].off)
+            shared->live += dfs_catalog_record_len(dfs_catalog_at(dfs_catalog.slots[i].off)->path_len);
+    }
+    shared->entries = dfs_catalog.count;
+    printf("Catalog: %zu file(s), %llu bytes of log\n", dfs_catalog.count, (unsigned long long)off);
+    if (off > DFS_CATALOG_COMPACT_MIN && off - DFS_CATALOG_HEADER > 2 * shared->live)
+        dfs_catalog_compact();
+    return 0;
+}
+
+static inline void dfs_catalog_fill(const struct dfs_catalog_record *r, struct dfs_catalog_info *info) {
+    info->copies = r->copies;
+    for (int i = 0; i < r->copies; i++)
+        info->nodes[i] = r->nodes[i];
+    info->size = r->size;
+    info->checksum = r->checksum;
+    info->has_checksum = r->type == DFS_CATALOG_PUT;
+    info->version = r->version;
+    info->mtime = r->mtime;
+}
+
+// Look up the file at path (relative to the stores). Returns 1 with info
+// filled in, or 0 if the catalog has no such file.
+static inline int dfs_catalog_lookup(const char *path, struct dfs_catalog_info *info) {
+    if (!dfs_catalog.shared || dfs_catalog_sync() < 0)
+        return 0;
+    atomic_fetch_add(&dfs_catalog.shared->lookups, 1);
+    size_t len = strlen(path);
+    struct dfs_catalog_slot *s = &dfs_catalog.slots[dfs_catalog_probe(path, len, dfs_catalog_hash(path, len))];
+    if (!s->off)
+        return 0;
+    dfs_catalog_fill(dfs_catalog_at(s->off), info);
+    atomic_fetch_add(&dfs_catalog.shared->hits, 1);
+    return 1;
+}
+
+// Whether the file info describes has a copy on node
+static inline int dfs_catalog_has(const struct dfs_catalog_info *info, int node) {
+    for (int i = 0; i < info->copies; i++) {
+        if (info->nodes[i] == node)
+            return 1;
+    }
+    return 0;
+}
+
+// Append a record for path, on copies nodes; with expect other than 0, only
+// if the file's current version is expect. Returns the file's new version,
+// 0 if nothing was written (a removal of a file the catalog did not have,
+// or a version other than expect), or -1 if the record could not be written.
+static inline int64_t dfs_catalog_append(int type, const char *path, const int *nodes, int copies, uint64_t size,
+                                         uint32_t checksum, uint64_t expect) {
+    size_t path_len = strlen(path);
+    if (!dfs_catalog.shared || path_len == 0 || path_len > DFS_NAME_MAX || copies > DFS_CATALOG_COPIES)
+        return -1;
+    dfs_catalog_lock();
+    if (dfs_catalog_catch_up() < 0) {
+        dfs_catalog_unlock();
+        return -1;
+    }
+
+    // The file's previous record, if it has one
+    struct dfs_catalog_slot *s = &dfs_catalog.slots[dfs_catalog_probe(path, path_len, dfs_catalog_hash(path, path_len))];
+    struct dfs_catalog_record *old = s->off ? dfs_catalog_at(s->off) : NULL;
+    uint64_t version = old ? old->version + 1 : 1;
+    size_t old_len = old ? dfs_catalog_record_len(old->path_len) : 0;
+    if ((type == DFS_CATALOG_DEL && !old) || (expect && (!old || old->version != expect))) {
+        dfs_catalog_unlock();
+        return 0;
+    }
+
+    // Make room, then write the record before it counts as part of the log
+    size_t len = dfs_catalog_record_len(path_len);
+    uint64_t used = atomic_load(&dfs_catalog.shared->used);
+    uint64_t file_size = atomic_load(&dfs_catalog.shared->file_size);
+    if (used + len > file_size) {
+        file_size += file_size / 4 > DFS_CATALOG_GROW ? file_size / 4 : DFS_CATALOG_GROW;
+        if (ftruncate(dfs_catalog.fd, file_size) < 0 || dfs_catalog_map(file_size) < 0) {
+            perror("Catalog append failed");
+            dfs_catalog_unlock();
+            return -1;
+        }
+        atomic_store(&dfs_catalog.shared->file_size, file_size);
+    }
+    struct dfs_catalog_record *r = dfs_catalog_at(used);
+    memset(r, 0, len);
+    r->magic = DFS_CATALOG_MAGIC;
+    r->type = type;
+    r->copies = copies;
+    for (int i = 0; i < copies; i++)
+        r->nodes[i] = nodes[i];
+    r->path_len = path_len;
+    r->checksum = checksum;
+    r->size = size;
+    r->version = version;
+    r->mtime = time(NULL);
+    memcpy(r->path, path, path_len);
+    r->crc = crc32(0, (const unsigned char *)r + 8, sizeof(*r) - 8 + path_len);
+    atomic_store(&dfs_catalog.shared->used, used + len);
+    dfs_catalog_apply(used);
+    dfs_catalog.replayed = used + len;
+    atomic_fetch_add(&dfs_catalog.shared->appends, 1);
+
+    // Keep count of what is still current, and compact once most of it is not
+    dfs_catalog.shared->live += (type == DFS_CATALOG_DEL ? 0 : len) - old_len;
+    dfs_catalog.shared->entries = dfs_catalog.count;
+    if (used + len > DFS_CATALOG_COMPACT_MIN && used + len - DFS_CATALOG_HEADER > 2 * dfs_catalog.shared->live)
+        dfs_catalog_compact();
+    dfs_catalog_unlock();
+    return version;
+}
+
+// Record that path was stored on copies nodes: size bytes, with the given
+// CRC-32 of its contents if has_checksum is set. Returns its version, or -1.
+static inline int64_t dfs_catalog_put(const char *path, const int *nodes, int copies, uint64_t size,
+                                      uint32_t checksum, int has_checksum) {
+    return dfs_catalog_append(has_checksum ? DFS_CATALOG_PUT : DFS_CATALOG_PUT_NOSUM, path, nodes, copies, size,
+                              checksum, 0);
+}
+
+// Record that path was removed
+static inline void dfs_catalog_remove(const char *path) {
+    dfs_catalog_append(DFS_CATALOG_DEL, path, NULL, 0, 0, 0, 0);
+}
+
+// Record that path now has its copies on copies nodes, if it is still the
+// file info describes; its size and CRC stay as they were. Returns its new
+// version, 0 if it was stored or removed since info was read, or -1.
+static inline int64_t dfs_catalog_move(const char *path, const struct dfs_catalog_info *info, const int *nodes,
+                                       int copies) {
+    return dfs_catalog_append(info->has_checksum ? DFS_CATALOG_PUT : DFS_CATALOG_PUT_NOSUM, path, nodes, copies,
+                              info->size, info->checksum, info->version);
+}
+
+// Record that path was removed, if it is still at version: a file found
+// missing is forgotten, unless it was stored again meanwhile
+static inline void dfs_catalog_forget(const char *path, uint64_t version) {
+    dfs_catalog_append(DFS_CATALOG_DEL, path, NULL, 0, 0, 0, version);
+}
+
+// Call fn for every file in the catalog, in no particular order. fn must
+// not change the catalog. Returns -1 if the catalog is unavailable.
+static inline int dfs_catalog_each(void (*fn)(const char *path, const struct dfs_catalog_info *info, void *arg),
+                                   void *arg) {
+    if (!dfs_catalog.shared || dfs_catalog_sync() < 0)
+        return -1;
+    char path[DFS_NAME_MAX + 1];
+    struct dfs_catalog_info info;
+    for (size_t i = 0; i < dfs_catalog.cap; i++) {
+        if (!dfs_catalog.slots[i].off)
+            continue;
+        struct dfs_catalog_record *r = dfs_catalog_at(dfs_catalog.slots[i].off);
+        memcpy(path, r->path, r->path_len);
+        path[r->path_len] = '\0';
+        dfs_catalog_fill(r, &info);
+        fn(path, &info, arg);
+    }
+    return 0;
+}
+
+// The catalog's counters, one "name value" line each; returns their length
+static inline int dfs_catalog_stats(char *buf, size_t size) {
+    if (!dfs_catalog.shared)
+        return 0;
+    struct dfs_catalog_shared *s = dfs_catalog.shared;
+    int n = snprintf(buf, size,
+                     "catalog_files %llu\n"
+                     "catalog_log_bytes %llu\n"
+                     "catalog_live_bytes %llu\n"
+                     "catalog_lookups %llu\n"
+                     "catalog_hits %llu\n"
+                     "catalog_appends %llu\n"
+                     "catalog_compactions %llu\n",
+                     (unsigned long long)s->entries, (unsigned long long)atomic_load(&s->used),
+                     (unsigned long long)s->live, (unsigned long long)atomic_load(&s->lookups),
+                     (unsigned long long)atomic_load(&s->hits), (unsigned long long)atomic_load(&s->appends),
+                     (unsigned long long)atomic_load(&s->compactions));
+    return n < 0 ? 0 : n >= (int)size ? (int)size - 1 : n;
+}
+
+#endif /* DFS_CATALOG_H */
@@ -0,0 +1,224 @@
+#ifndef DFS_CLUSTER_H
+#define DFS_CLUSTER_H
+
+/*
+ * The storage nodes behind S1, and which of them a file goes to.
+ *
+ * S1 reads the cluster map from a file (s1 -c <file>), one node per line:
+ *
+ *   <id> <name> <host>:<port> <weight> <type>
+ *
+ * for instance "5 S2b 127.0.0.1:3042 1 .pdf" for a second server of .pdf
+ * files started with "./s2 -p 3042 -n S2b".  The id (2 to 255; S1 itself
+ * is 1) is what the catalog records for the files on the node, so it stays
+ * with the node for good; the name is its store's name (~/<name>), unique
+ * in the map.  A node takes one type, the only one its server lists, tars
+ * and finds.  Blank lines and lines starting with '#' are skipped.
+ * Without a file the map is the original three servers: S2 (.pdf), S3
+ * (.txt) and S4 (.zip).  A node with weight 0 is being drained: it gets no
+ * new files, and S1 moves the ones it has to the others before it leaves
+ * the map.
+ *
+ * A new file goes to one of the nodes that accept its type, chosen by
+ * weighted rendezvous hashing of its path: each such node scores the path
+ * as -weight / ln(h), where h is a hash of the node's id and the path
+ * taken into (0, 1), and the highest score wins.  A node with twice the
+ * weight gets twice the files; adding a node to n others takes about
+ * 1/(n+1) of the type's files from them, every one of which goes to the
+ * new node, and removing a node moves only the files it had.  With
+ * replication (s1 -R), a file's copies go to the nodes with the highest
+ * scores, as many as it has copies, so the same holds for each copy.
+ */
+
+#include <math.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "dfs_io.h"
+
+#define DFS_CLUSTER_MAX 32       /* Storage nodes in a map */
+#define DFS_CLUSTER_LOCAL 1      /* The id of S1's own store */
+
+struct dfs_node {
+    int id;
+    char name[32];
+    char host[256];
+    int port;
+    struct sockaddr_in addr;     /* host and port, resolved once */
+    double weight;
+    char type[16];
+};
+
+static struct {
+    struct dfs_node nodes[DFS_CLUSTER_MAX];
+    int count;
+} dfs_cluster;
+
+static inline struct dfs_node *dfs_cluster_node(int id) {
+    for (int i = 0; i < dfs_cluster.count; i++) {
+        if (dfs_cluster.nodes[i].id == id)
+            return &dfs_cluster.nodes[i];
+    }
+    return NULL;
+}
+
+static inline int dfs_cluster_accepts(const struct dfs_node *n, const char *type) {
+    return strcmp(n->type, type) == 0;
+}
+
+// Add a node to the map. Returns -1 with the reason on stderr if the node
+// does not fit in the map.
+static inline int dfs_cluster_add(int id, const char *name, const char *host, int port, double weight,
+                                  const char *type) {
+    struct dfs_node *n = &dfs_cluster.nodes[dfs_cluster.count];
+    if (dfs_cluster.count == DFS_CLUSTER_MAX) {
+        fprintf(stderr, "Cluster map: more than %d nodes\n", DFS_CLUSTER_MAX);
+        return -1;
+    }
+    if (id <= DFS_CLUSTER_LOCAL || id > 255 || dfs_cluster_node(id)) {
+        fprintf(stderr, "Cluster map: node id %d is out of range or taken\n", id);
+        return -1;
+    }
+    for (int i = 0; i < dfs_cluster.count; i++) {
+        if (strcmp(dfs_cluster.nodes[i].name, name) == 0 || strcmp(name, "S1") == 0) {
+            fprintf(stderr, "Cluster map: node name %s is taken\n", name);
+            return -1;
+        }
+    }
+    if (strlen(name) >= sizeof(n->name) || strchr(name, '/') || strlen(host) >= sizeof(n->host) ||
+        port <= 0 || port > 65535 || !(weight >= 0)) {
+        fprintf(stderr, "Cluster map: bad name, address or weight for node %d\n", id);
+        return -1;
+    }
+    if (strchr(type, ',')) {
+        fprintf(stderr, "Cluster map: node %s has several types; a storage server serves one\n", name);
+        return -1;
+    }
+    if (type[0] != '.' || strlen(type) < 2 || strlen(type) >= sizeof(n->type)) {
+        fprintf(stderr, "Cluster map: bad type '%s' for node %s\n", type, name);
+        return -1;
+    }
+
+    memset(n, 0, sizeof(*n));
+    n->id = id;
+    snprintf(n->name, sizeof(n->name), "%s", name);
+    snprintf(n->host, sizeof(n->host), "%s", host);
+    n->port = port;
+    n->weight = weight;
+    snprintf(n->type, sizeof(n->type), "%s", type);
+
+    // Look the host up now, so that no request ever waits on it
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+    int err = getaddrinfo(host, NULL, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Cluster map: cannot resolve %s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    n->addr = *(struct sockaddr_in *)res->ai_addr;
+    n->addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    dfs_cluster.count++;
+    return 0;
+}
+
+// The map S1 had before there were map files
+static inline void dfs_cluster_default(void) {
+    dfs_cluster.count = 0;
+    dfs_cluster_add(2, "S2", SERVER_ADDR, 3032, 1, ".pdf");
+    dfs_cluster_add(3, "S3", SERVER_ADDR, 3034, 1, ".txt");
+    dfs_cluster_add(4, "S4", SERVER_ADDR, 3036, 1, ".zip");
+}
+
+// Read the map from the file at path. Returns -1, having said why on
+// stderr, if it cannot be read or a line is not a valid node.
+static inline int dfs_cluster_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    dfs_cluster.count = 0;
+    char line[1024];
+    int line_no = 0, rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        line_no++;
+        char name[64], host[300], type[128], extra;
+        int id, port;
+        double weight;
+        const char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (sscanf(p, "%d %63s %299[^: \t]:%d %lf %127s %c", &id, name, host, &port, &weight, type, &extra) != 6) {
+            fprintf(stderr, "%s:%d: expected <id> <name> <host>:<port> <weight> <type>\n", path, line_no);
+            rc = -1;
+        } else if (dfs_cluster_add(id, name, host, port, weight, type) < 0) {
+            fprintf(stderr, "%s:%d: node not added\n", path, line_no);
+            rc = -1;
+        }
+    }
+    fclose(f);
+    if (rc == 0 && dfs_cluster.count == 0) {
+        fprintf(stderr, "%s: no nodes\n", path);
+        rc = -1;
+    }
+    return rc;
+}
+
+// The rendezvous score of node n for the file at path (FNV-1a of the id and
+// the path, mixed so that nearby ids give unrelated scores)
+static inline double dfs_cluster_score(const struct dfs_node *n, const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    h = (h ^ (uint64_t)n->id) * 1099511628211ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+        h = (h ^ *p) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    double u = ((h >> 11) + 0.5) / 9007199254740992.0;  /* In (0, 1) */
+    return -n->weight / log(u);
+}
+
+// The nodes a new file at path (relative to the stores) goes to, up to
+// count of them: the highest scores first. Returns how many there are, 0
+// if no node takes its type.
+static inline int dfs_cluster_place_n(const char *path, struct dfs_node **best, int count) {
+    const char *slash = strrchr(path, '/'), *type = strrchr(path, '.');
+    if (!type || (slash && type < slash))
+        return 0;
+    double scores[DFS_CLUSTER_MAX];
+    int found = 0;
+    for (int i = 0; i < dfs_cluster.count; i++) {
+        struct dfs_node *n = &dfs_cluster.nodes[i];
+        if (!dfs_cluster_accepts(n, type) || n->weight == 0)
+            continue;
+        double score = dfs_cluster_score(n, path);
+        int at = found < count ? found++ : count;
+        for (; at > 0 && scores[at - 1] < score; at--) {
+            if (at < count) {
+                best[at] = best[at - 1];
+                scores[at] = scores[at - 1];
+            }
+        }
+        if (at < count) {
+            best[at] = n;
+            scores[at] = score;
+        }
+    }
+    return found;
+}
+
+// The node a new file at path (relative to the stores) goes to, or NULL if
+// no node takes its type
+static inline struct dfs_node *dfs_cluster_place(const char *path) {
+    struct dfs_node *best;
+    return dfs_cluster_place_n(path, &best, 1) ? best : NULL;
+}
+
+#endif /* DFS_CLUSTER_H */
@@ -0,0 +1,317 @@
+#ifndef DFS_FILE_H
+#define DFS_FILE_H
+
+/*
+ * File transfer helpers shared by S1 and the storage servers.
+ *
+ * Upload payloads are moved in fixed-size chunks as they arrive instead of
+ * being collected in memory first, so a transfer costs one chunk buffer no
+ * matter how large the file is.  Downloads are served with sendfile(), which
+ * hands page cache pages straight to the socket without copying them
+ * through user space at all.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_index.h"
+
+#define DFS_CHUNK_SIZE (64 * 1024)  /* Bytes moved per read/write step */
+#define DFS_SENDFILE_CHUNK (1024 * 1024)  /* Most bytes handed to one sendfile() call */
+
+// Sizes and offsets are 64-bit on the wire; file offsets must be too
+_Static_assert(sizeof(off_t) == 8, "build with -D_FILE_OFFSET_BITS=64 for files over 2 GB");
+
+// Write exactly len bytes to a file. Returns 0 on success, -1 on error.
+static inline int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write exactly len bytes at offset, leaving the file position alone, so
+// several threads can fill different parts of one file.
+// Returns 0 on success, -1 on error.
+static inline int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Sync the directory holding path, so that a file just renamed into it is
+// on disk under its new name. Returns 0, or -1 on error.
+static inline int dfs_sync_dir(const char *path) {
+    char dir[1100];
+    const char *slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + (slash == path) : 1, slash ? path : ".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int rc = fd >= 0 && fsync(fd) == 0 ? 0 : -1;
+    if (fd >= 0)
+        close(fd);
+    return rc;
+}
+
+// Receive a reply payload into path as it arrives: len bytes, or if
+// chunked is set a chunked payload (see DFS_FLAG_CHUNKED) whose size is
+// only known at the end; *received (if not NULL) gets the byte count. The
+// data goes to a temporary file next to path that is renamed over it once
+// complete, so a broken transfer never leaves a truncated file behind;
+// with sync set, the file and its directory are synced before returning.
+// Returns DFS_OK, DFS_EIO if the file could not be written (the payload is
+// still consumed, so the connection stays usable), or -1 if the connection broke.
+static inline int dfs_recv_payload_file(int sock, const char *path, uint64_t len, int chunked, int sync,
+                                        uint64_t *received) {
+    static unsigned int tmp_counter = 0;
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.part%d_%u", path, getpid(),
+             __sync_fetch_and_add(&tmp_counter, 1));
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        perror("Error creating upload file");
+
+    char buffer[DFS_CHUNK_SIZE];
+    uint64_t total = 0;
+    int broken = 0;
+    for (;;) {
+        // len counts down what is left of the payload, or of the current chunk
+        if (len == 0) {
+            if (!chunked)
+                break;
+            if (dfs_recv_chunk_head(sock, &len) < 0) {
+                broken = 1;
+                break;
+            }
+            if (len == 0)
+                break;  // End marker
+        }
+        ssize_t n = recv_some(sock, buffer, len < sizeof(buffer) ? len : sizeof(buffer));
+        if (n <= 0) {
+            broken = 1;
+            break;
+        }
+        len -= n;
+        total += n;
+        // After a write error keep reading, so the stream stays in sync
+        if (fd >= 0 && write_all(fd, buffer, n) < 0) {
+            perror("Error writing upload file");
+            close(fd);
+            unlink(tmp_path);
+            fd = -1;
+        }
+    }
+    if (received)
+        *received = total;
+
+    if (broken) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        return -1;
+    }
+    if (fd < 0)
+        return DFS_EIO;
+    int synced = !sync || fsync(fd) == 0;
+    if (close(fd) != 0 || !synced || rename(tmp_path, path) != 0) {
+        perror("Error storing upload file");
+        unlink(tmp_path);
+        return DFS_EIO;
+    }
+    if (sync && dfs_sync_dir(path) < 0) {
+        perror("Error syncing upload file");
+        return DFS_EIO;
+    }
+    return DFS_OK;
+}
+
+// Receive len payload bytes into path as they arrive (see dfs_recv_payload_file)
+static inline int dfs_recv_file(int sock, const char *path, uint64_t len) {
+    return dfs_recv_payload_file(sock, path, len, 0, 0, NULL);
+}
+
+// Send len bytes of fd, starting at offset, to sock. Each sendfile() call
+// moves at most DFS_SENDFILE_CHUNK bytes and short writes simply continue
+// from the new offset; EAGAIN goes through dfs_wait like every other send.
+// Falls back to pread()/send() if sendfile is not supported for fd.
+// Returns 0, or -1 on error (including the file shrinking underneath us).
+static inline int dfs_sendfile_all(int sock, int fd, uint64_t offset, uint64_t len) {
+    int use_sendfile = 1;
+    while (len > 0) {
+        size_t want = len < DFS_SENDFILE_CHUNK ? len : DFS_SENDFILE_CHUNK;
+        ssize_t n;
+        if (use_sendfile) {
+            off_t off = offset;
+            n = sendfile(sock, fd, &off, want);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = 0;
+                continue;
+            }
+        } else {
+            char buffer[DFS_CHUNK_SIZE];
+            n = pread(fd, buffer, want < sizeof(buffer) ? want : sizeof(buffer), offset);
+            if (n > 0 && send_all(sock, buffer, n) < 0)
+                return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && dfs_wait(sock, POLLOUT) == 0)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;  // File got shorter than the size we announced
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Work out which bytes of a size-byte file a DOWNLOAD range asks for.
+// range is empty for the whole file, "offset:length" or "offset" for a
+// slice (a missing or zero length runs to the end of the file), or "-N"
+// for the last N bytes. Lengths past the end are cut at the end of the
+// file. Returns 0, or -1 if the range is malformed or starts past the end.
+static inline int dfs_parse_range(const char *range, uint64_t size, uint64_t *offset, uint64_t *length) {
+    *offset = 0;
+    *length = size;
+    if (!range || !*range)
+        return 0;
+
+    char *end;
+    errno = 0;
+    if (range[0] == '-') {
+        if (range[1] < '0' || range[1] > '9')
+            return -1;
+        uint64_t tail = strtoull(range + 1, &end, 10);
+        if (errno || *end)
+            return -1;
+        *length = tail < size ? tail : size;
+        *offset = size - *length;
+        return 0;
+    }
+
+    if (range[0] < '0' || range[0] > '9')
+        return -1;
+    uint64_t start = strtoull(range, &end, 10), count = 0;
+    if (errno || start > size)
+        return -1;
+    if (*end == ':') {
+        const char *p = end + 1;
+        if (*p) {
+            if (*p < '0' || *p > '9')
+                return -1;
+            count = strtoull(p, &end, 10);
+            if (errno)
+                return -1;
+        } else {
+            end = (char *)p;
+        }
+    }
+    if (*end)
+        return -1;
+    *offset = start;
+    *length = (count == 0 || count > size - start) ? size - start : count;
+    return 0;
+}
+
+// Reply to req with the regular file at path, or just the bytes selected
+// by range (see dfs_parse_range; NULL or "" for the whole file), in
+// constant memory whatever its size. Returns 1 if sent, 0 if the file
+// could not be served (an error status was sent instead), or -1 if the
+// connection broke mid-response and must be dropped.
+static inline int dfs_send_file(int sock, const struct dfs_header *req, const char *path, const char *range) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("File open error");
+        return dfs_send_status(sock, req, DFS_ENOENT) == 0 ? 0 : -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        fprintf(stderr, "Not a regular file: %s\n", path);
+        return dfs_send_status(sock, req, DFS_ENOENT) == 0 ? 0 : -1;
+    }
+
+    uint64_t offset, length;
+    if (dfs_parse_range(range, st.st_size, &offset, &length) < 0) {
+        close(fd);
+        fprintf(stderr, "Invalid byte range '%s' for %s (%llu bytes)\n", range, path,
+                (unsigned long long)st.st_size);
+        return dfs_send_status(sock, req, DFS_EINVAL) == 0 ? 0 : -1;
+    }
+
+    // MSG_MORE holds the header back so it leaves in the same segment as
+    // the start of the file instead of in a tiny packet of its own
+    struct dfs_header h = {
+        .opcode = req->opcode,
+        .flags = DFS_FLAG_REPLY,
+        .status = DFS_OK,
+        .request_id = req->request_id,
+        .payload_len = length
+    };
+    unsigned char header[DFS_HEADER_SIZE];
+    dfs_encode_header(&h, header);
+
+    int rc = send_all_flags(sock, header, sizeof(header), length > 0 ? MSG_MORE : 0);
+    if (rc == 0)
+        rc = dfs_sendfile_all(sock, fd, offset, length);
+    if (rc < 0)
+        perror("Error sending file data");
+    close(fd);
+    return rc < 0 ? -1 : 1;
+}
+
+// Reply to a STAT request with the size and modification time of the
+// regular file at path. Returns 1 if sent, 0 if it does not exist (an
+// error status was sent instead), or -1 if the connection broke.
+static inline int dfs_send_stat(int sock, const struct dfs_header *req, const char *path) {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    int found = dfs_index_stat(path, &size, &mtime);
+    struct stat st;
+    // A miss may only be a tree that has not caught up yet (see dfs_index.h)
+    if (found != 1 && (found = stat(path, &st) == 0 && S_ISREG(st.st_mode))) {
+        size = st.st_size;
+        mtime = st.st_mtime;
+    }
+    if (!found)
+        return dfs_send_status(sock, req, DFS_ENOENT) == 0 ? 0 : -1;
+
+    unsigned char info[16];
+    dfs_put64(info, size);
+    dfs_put64(info + 8, mtime);
+    return dfs_send_reply(sock, req, DFS_OK, info, sizeof(info)) == 0 ? 1 : -1;
+}
+
+#endif /* DFS_FILE_H */
@@ -0,0 +1,352 @@
+#ifndef DFS_FIND_H
+#define DFS_FIND_H
+
+/*
+ * FIND: search a whole subtree of every store in one request.
+ *
+ * The query travels as text in the aux field of the request,
+ *
+ *   glob|regex min_size max_size min_mtime max_mtime pattern
+ *
+ * with "-" for a bound that is not set, and the name field is the
+ * directory to search, relative to the store ("" for all of it).  A glob
+ * without '/' is matched against each file's name (fnmatch), one with '/'
+ * against the file's path below the directory searched, as is a regex
+ * (POSIX extended, unanchored).  Only regular files match; sizes are in
+ * bytes and times in seconds since the epoch, both bounds inclusive.
+ *
+ * The reply is chunked.  Each chunk holds whole match records,
+ *
+ *   length (2 bytes)  of the path
+ *   size   (8 bytes)
+ *   mtime  (8 bytes)
+ *   path              relative to the store
+ *
+ * at most DFS_FIND_BATCH_BYTES of them, so S1 can pass on the chunks of
+ * every server as they arrive.  An indexed store (dfs_index.h) is searched
+ * in memory under the read lock; the matches are gathered first and sent
+ * once the lock is released.  Otherwise the directories are read as the
+ * search goes and each chunk is sent as it fills.
+ */
+
+#include <fnmatch.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_index.h"
+
+#define DFS_FIND_BATCH_BYTES (64 * 1024)  /* Largest chunk of matches */
+#define DFS_FIND_RECORD_HEAD 18
+
+struct dfs_find_query {
+    int regex;                   /* Pattern is a regex rather than a glob */
+    uint64_t min_size, max_size;
+    int64_t min_mtime, max_mtime;
+    char pattern[DFS_NAME_MAX + 1];
+    int whole_path;              /* Match the path below the search root, not the name */
+    regex_t re;                  /* Compiled pattern, if regex */
+};
+
+// Read one bound of a query: "-" leaves *value as it is
+static inline const char *dfs_find_bound(const char *p, int is_signed, void *value) {
+    while (*p == ' ')
+        p++;
+    if (*p == '-' && (p[1] == ' ' || !p[1]))
+        return p + 1;
+    char *end;
+    errno = 0;
+    if (is_signed)
+        *(int64_t *)value = strtoll(p, &end, 10);
+    else
+        *(uint64_t *)value = strtoull(p, &end, 10);
+    return end == p || errno || *end != ' ' ? NULL : end;
+}
+
+// Parse the aux field of a FIND request into q. Returns 0, or -1 if it is
+// not a valid query. A parsed regex query must be freed with dfs_find_free.
+static inline int dfs_find_parse(const char *text, struct dfs_find_query *q) {
+    memset(q, 0, sizeof(*q));
+    q->max_size = UINT64_MAX;
+    q->min_mtime = INT64_MIN;
+    q->max_mtime = INT64_MAX;
+    const char *p = text;
+    if (strncmp(p, "glob ", 5) == 0) {
+        p += 5;
+    } else if (strncmp(p, "regex ", 6) == 0) {
+        q->regex = 1;
+        p += 6;
+    } else {
+        return -1;
+    }
+    if (!(p = dfs_find_bound(p, 0, &q->min_size)) || !(p = dfs_find_bound(p, 0, &q->max_size)) ||
+        !(p = dfs_find_bound(p, 1, &q->min_mtime)) || !(p = dfs_find_bound(p, 1, &q->max_mtime)) ||
+        *p != ' ' || !p[1])
+        return -1;
+    snprintf(q->pattern, sizeof(q->pattern), "%s", p + 1);
+    q->whole_path = q->regex || strchr(q->pattern, '/') != NULL;
+    if (q->regex && regcomp(&q->re, q->pattern, REG_EXTENDED | REG_NOSUB) != 0)
+        return -1;
+    return 0;
+}
+
+static inline void dfs_find_free(struct dfs_find_query *q) {
+    if (q->regex)
+        regfree(&q->re);
+}
+
+// Write q as the aux field of a FIND request. Returns -1 if it does not fit.
+static inline int dfs_find_format(const struct dfs_find_query *q, char *buf, size_t size) {
+    char bounds[4][24];
+    snprintf(bounds[0], sizeof(bounds[0]), "%llu", (unsigned long long)q->min_size);
+    snprintf(bounds[1], sizeof(bounds[1]), "%llu", (unsigned long long)q->max_size);
+    snprintf(bounds[2], sizeof(bounds[2]), "%lld", (long long)q->min_mtime);
+    snprintf(bounds[3], sizeof(bounds[3]), "%lld", (long long)q->max_mtime);
+    int n = snprintf(buf, size, "%s %s %s %s %s %s", q->regex ? "regex" : "glob",
+                     q->min_size ? bounds[0] : "-", q->max_size != UINT64_MAX ? bounds[1] : "-",
+                     q->min_mtime != INT64_MIN ? bounds[2] : "-", q->max_mtime != INT64_MAX ? bounds[3] : "-",
+                     q->pattern);
+    return n < 0 || (size_t)n >= size || n > DFS_NAME_MAX ? -1 : 0;
+}
+
+// Whether a file's name matches: below is its path under the search root,
+// name the last part of it
+static inline int dfs_find_match_name(const struct dfs_find_query *q, const char *below, const char *name) {
+    if (q->regex)
+        return regexec(&q->re, below, 0, NULL, 0) == 0;
+    return fnmatch(q->pattern, q->whole_path ? below : name, 0) == 0;
+}
+
+static inline int dfs_find_match_stat(const struct dfs_find_query *q, uint64_t size, int64_t mtime) {
+    return size >= q->min_size && size <= q->max_size && mtime >= q->min_mtime && mtime <= q->max_mtime;
+}
+
+// Whether subdir names a directory below a store's root ("" for the root)
+static inline int dfs_find_subdir_ok(const char *subdir) {
+    for (const char *p = subdir; *p; ) {
+        size_t n = strcspn(p, "/");
+        if ((n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        p += n + (p[n] == '/');
+    }
+    return subdir[0] != '/';
+}
+
+// A search under way: the path being visited and the matches not yet sent,
+// already framed as chunks (each an 8-byte length and its records)
+struct dfs_find {
+    const struct dfs_find_query *q;
+    int sock;
+    char path[DFS_INDEX_PATH_MAX];  /* Relative to the store */
+    size_t root_len;                /* Where the part below the search root starts */
+    unsigned char *buf;
+    size_t len, cap, chunk;         /* chunk: offset of the open chunk */
+    int held;                       /* Gather rather than send (index locked) */
+    int failed;                     /* Out of memory, or the connection broke */
+    uint64_t matches;
+};
+
+// Close the open chunk, if it has any records, and start another
+static inline void dfs_find_close_chunk(struct dfs_find *f) {
+    if (f->len - f->chunk > 8) {
+        dfs_put64(f->buf + f->chunk, f->len - f->chunk - 8);
+        f->chunk = f->len;
+    } else {
+        f->len = f->chunk;
+    }
+}
+
+// Send the closed chunks
+static inline void dfs_find_flush(struct dfs_find *f) {
+    if (f->chunk > 0 && !f->failed && send_all_flags(f->sock, f->buf, f->chunk, MSG_MORE) < 0)
+        f->failed = 1;
+    memmove(f->buf, f->buf + f->chunk, f->len - f->chunk);
+    f->len -= f->chunk;
+    f->chunk = 0;
+}
+
+// Add the match at f->path (path_len long)
+static inline void dfs_find_add(struct dfs_find *f, size_t path_len, uint64_t size, int64_t mtime) {
+    size_t need = DFS_FIND_RECORD_HEAD + path_len;
+    if (f->len - f->chunk + need > DFS_FIND_BATCH_BYTES) {
+        dfs_find_close_chunk(f);
+        if (!f->held)
+            dfs_find_flush(f);
+    }
+    if (f->len == f->chunk)
+        need += 8;  // Room for the new chunk's length
+    if (f->len + need > f->cap) {
+        size_t cap = f->cap ? 2 * f->cap : DFS_FIND_BATCH_BYTES + 8;
+        while (cap < f->len + need)
+            cap *= 2;
+        unsigned char *buf = realloc(f->buf, cap);
+        if (!buf) {
+            f->failed = 1;
+            return;
+        }
+        f->buf = buf;
+        f->cap = cap;
+    }
+    if (f->len == f->chunk)
+        f->len += 8;
+    unsigned char *p = f->buf + f->len;
+    p[0] = path_len >> 8;
+    p[1] = path_len;
+    dfs_put64(p + 2, size);
+    dfs_put64(p + 10, (uint64_t)mtime);
+    memcpy(p + DFS_FIND_RECORD_HEAD, f->path, path_len);
+    f->len += DFS_FIND_RECORD_HEAD + path_len;
+    f->matches++;
+}
+
+// Append name to f->path, which is len long. Returns the new length, or 0
+// if it does not fit.
+static inline size_t dfs_find_enter(struct dfs_find *f, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    size_t sep = len > 0;
+    if (len + sep + name_len >= sizeof(f->path) || len + sep + name_len > 0xffff)
+        return 0;
+    if (sep)
+        f->path[len] = '/';
+    memcpy(f->path + len + sep, name, name_len + 1);
+    return len + sep + name_len;
+}
+
+// The part of f->path below the search root
+static inline const char *dfs_find_below(const struct dfs_find *f) {
+    return f->path + f->root_len + (f->root_len > 0 && f->path[f->root_len] == '/');
+}
+
+// Search the indexed directory dir, whose path is f->path (len long)
+static inline void dfs_find_index_dir(struct dfs_find *f, const struct dfs_index_dir *dir, size_t len,
+                                      const char *ext) {
+    size_t ext_len = ext ? strlen(ext) : 0;
+    for (unsigned i = 0; i < dir->count && !f->failed; i++) {
+        const struct dfs_index_entry *e = &dir->entries[i];
+        size_t path_len = dfs_find_enter(f, len, e->name);
+        if (path_len == 0)
+            continue;
+        if (e->dir) {
+            dfs_find_index_dir(f, e->dir, path_len, ext);
+            continue;
+        }
+        size_t name_len = strlen(e->name);
+        if (name_len > ext_len && strcmp(e->name + name_len - ext_len, ext ? ext : "") == 0 &&
+            dfs_find_match_stat(f->q, e->size, e->mtime) && dfs_find_match_name(f->q, dfs_find_below(f), e->name))
+            dfs_find_add(f, path_len, e->size, e->mtime);
+    }
+    f->path[len] = '\0';
+}
+
+// Search the directory at f->path (len long) under root, reading it from disk
+static inline void dfs_find_disk_dir(struct dfs_find *f, const char *root, size_t len, const char *ext) {
+    char full[DFS_INDEX_PATH_MAX + 1024];
+    snprintf(full, sizeof(full), "%s%s%s", root, len ? "/" : "", f->path);
+    DIR *d = opendir(full);
+    if (!d)
+        return;
+    size_t ext_len = ext ? strlen(ext) : 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && !f->failed) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        size_t path_len = dfs_find_enter(f, len, entry->d_name);
+        if (path_len == 0)
+            continue;
+        if (entry->d_type == DT_DIR) {
+            dfs_find_disk_dir(f, root, path_len, ext);
+            continue;
+        }
+
+        // The name decides before the file is looked at
+        size_t name_len = strlen(entry->d_name);
+        struct stat st;
+        if ((entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) || name_len <= ext_len ||
+            strcmp(entry->d_name + name_len - ext_len, ext ? ext : "") != 0 ||
+            !dfs_find_match_name(f->q, dfs_find_below(f), entry->d_name) ||
+            fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (S_ISREG(st.st_mode) && dfs_find_match_stat(f->q, st.st_size, st.st_mtime))
+            dfs_find_add(f, path_len, st.st_size, st.st_mtime);
+    }
+    closedir(d);
+    f->path[len] = '\0';
+}
+
+// Send the chunks of the files under root/subdir ending in ext (any, if
+// NULL) that match q, without the reply's head or end, so S1 can add them
+// to a reply of its own. subdir must pass dfs_find_subdir_ok; if it is not
+// a directory nothing matches. Returns the number of matches, or -1 if the
+// connection broke.
+static inline long long dfs_find_send_matches(int sock, const char *root, const char *subdir, const char *ext,
+                                              const struct dfs_find_query *q) {
+    struct dfs_find f = { .q = q, .sock = sock };
+    snprintf(f.path, sizeof(f.path), "%s", subdir);
+    f.root_len = strlen(f.path);
+    while (f.root_len > 0 && f.path[f.root_len - 1] == '/')
+        f.path[--f.root_len] = '\0';
+    char full[DFS_INDEX_PATH_MAX + 1024];
+    snprintf(full, sizeof(full), "%s%s%s", root, f.root_len ? "/" : "", f.path);
+
+    struct dfs_index_dir *dir;
+    struct dfs_index_entry *e;
+    pthread_rwlock_rdlock(&dfs_index.lock);
+    int found = dfs_index_walk(full, &dir, &e);
+    if (found == 1 && e)
+        dir = e->dir;
+    if (found == 1 && dir) {
+        f.held = 1;
+        dfs_find_index_dir(&f, dir, f.root_len, ext);
+        f.held = 0;
+    }
+    pthread_rwlock_unlock(&dfs_index.lock);
+    if (found == DFS_INDEX_UNKNOWN)
+        dfs_find_disk_dir(&f, root, f.root_len, ext);
+
+    dfs_find_close_chunk(&f);
+    dfs_find_flush(&f);
+    free(f.buf);
+    return f.failed ? -1 : (long long)f.matches;
+}
+
+// Reply to a FIND request for the files under root/subdir ending in ext.
+// Returns 1 if sent, 0 if an error status was sent instead, or -1 if the
+// connection broke mid-reply.
+static inline int dfs_send_find(int sock, const struct dfs_header *req, const char *root, const char *subdir,
+                                const char *ext, const char *query) {
+    struct dfs_find_query q;
+    if (dfs_find_parse(query, &q) < 0) {
+        fprintf(stderr, "Invalid search: %s\n", query);
+        return dfs_send_status(sock, req, DFS_EINVAL) == 0 ? 0 : -1;
+    }
+
+    // Check the directory before the reply starts
+    char full[DFS_INDEX_PATH_MAX + 1024];
+    struct stat st;
+    snprintf(full, sizeof(full), "%s/%s", root, subdir);
+    if (!dfs_find_subdir_ok(subdir) || stat(full, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        dfs_find_free(&q);
+        return dfs_send_status(sock, req, DFS_ENOENT) == 0 ? 0 : -1;
+    }
+
+    long long matches = -1;
+    if (dfs_send_chunked_head(sock, req, DFS_OK, 0) == 0)
+        matches = dfs_find_send_matches(sock, root, subdir, ext, &q);
+    dfs_find_free(&q);
+    if (matches < 0 || dfs_send_chunk_end(sock) < 0) {
+        perror("Error sending search results");
+        return -1;
+    }
+    printf("Found %lld file(s) matching '%s' under %s/%s\n", matches, query, root, subdir);
+    return 1;
+}
+
+#endif /* DFS_FIND_H */
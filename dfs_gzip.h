@@ -0,0 +1,316 @@
+#ifndef DFS_GZIP_H
+#define DFS_GZIP_H
+
+/*
+ * Parallel gzip for chunked replies, in the style of pigz.
+ *
+ * The stream is cut into blocks of DFS_GZIP_BLOCK bytes and every block is
+ * compressed on its own into a complete gzip member.  Concatenated members
+ * are themselves a valid gzip file, so the blocks can be compressed on
+ * several threads at once and still go out in order, one chunk per member.
+ * The caller fills the next blocks while the workers compress the earlier
+ * ones, and only waits when every slot is in use.  It waits with dfs_wait()
+ * on an eventfd the workers signal, so an S1 epoll worker parks the request
+ * instead of stalling its other clients.
+ *
+ * With no worker threads each block is compressed by the caller as soon as
+ * it is full: the single-threaded path, kept for comparison.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <zlib.h>
+#include <sys/eventfd.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+
+#define DFS_GZIP_BLOCK (1 << 20)  /* Uncompressed bytes per gzip member */
+#define DFS_GZIP_LEVEL 6
+#define DFS_GZIP_THREADS_MAX 64
+
+enum { DFS_GZIP_FREE, DFS_GZIP_QUEUED, DFS_GZIP_BUSY, DFS_GZIP_DONE, DFS_GZIP_FAILED };
+
+struct dfs_gzip_block {
+    unsigned char *in, *out;
+    size_t in_len, out_len, out_size;
+    int state;
+};
+
+// A compressed chunked payload being written to a socket
+struct dfs_gzip {
+    int sock;
+    int threads;                  // Worker threads (0: compress on the caller's thread)
+    int slots;                    // Blocks in flight
+    int event_fd;                 // Signalled each time a worker finishes a block
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    struct dfs_gzip_block *blocks;  // Block seq lives in blocks[seq % slots]
+    uint64_t fill_seq;            // Block being filled by the caller
+    uint64_t work_seq;            // Next block for a worker
+    uint64_t send_seq;            // Next block to send
+    int stopping;
+    uint64_t in_bytes, out_bytes;
+    uint64_t cpu_ns;              // CPU time spent compressing, over all threads
+};
+
+static inline uint64_t dfs_gzip_thread_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Compress one block into a gzip member of its own. Returns 0 or -1.
+static inline int dfs_gzip_compress(struct dfs_gzip_block *b) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, DFS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    zs.next_in = b->in;
+    zs.avail_in = b->in_len;
+    zs.next_out = b->out;
+    zs.avail_out = b->out_size;
+    int rc = deflate(&zs, Z_FINISH);
+    b->out_len = b->out_size - zs.avail_out;
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+static void *dfs_gzip_worker(void *arg) {
+    struct dfs_gzip *gz = arg;
+    pthread_mutex_lock(&gz->lock);
+    for (;;) {
+        while (!gz->stopping && gz->work_seq == gz->fill_seq)
+            pthread_cond_wait(&gz->queued, &gz->lock);
+        if (gz->stopping)
+            break;
+        struct dfs_gzip_block *b = &gz->blocks[gz->work_seq++ % gz->slots];
+        b->state = DFS_GZIP_BUSY;
+        pthread_mutex_unlock(&gz->lock);
+
+        uint64_t started = dfs_gzip_thread_ns();
+        int rc = dfs_gzip_compress(b);
+        uint64_t used = dfs_gzip_thread_ns() - started;
+
+        pthread_mutex_lock(&gz->lock);
+        b->state = rc == 0 ? DFS_GZIP_DONE : DFS_GZIP_FAILED;
+        gz->cpu_ns += used;
+        uint64_t one = 1;
+        if (write(gz->event_fd, &one, sizeof(one)) < 0)
+            perror("Error signalling compressed block");
+    }
+    pthread_mutex_unlock(&gz->lock);
+    return NULL;
+}
+
+// Stop the workers and free everything
+static inline void dfs_gzip_free(struct dfs_gzip *gz) {
+    if (!gz)
+        return;
+    pthread_mutex_lock(&gz->lock);
+    gz->stopping = 1;
+    pthread_cond_broadcast(&gz->queued);
+    pthread_mutex_unlock(&gz->lock);
+    for (int i = 0; i < gz->threads; i++)
+        pthread_join(gz->workers[i], NULL);
+    for (int i = 0; i < gz->slots; i++) {
+        free(gz->blocks[i].in);
+        free(gz->blocks[i].out);
+    }
+    if (gz->event_fd >= 0)
+        close(gz->event_fd);
+    pthread_cond_destroy(&gz->queued);
+    pthread_mutex_destroy(&gz->lock);
+    free(gz->blocks);
+    free(gz->workers);
+    free(gz);
+}
+
+// Start compressing a chunked payload to sock on threads worker threads
+// (0 to compress on the caller's thread). The reply head must already be
+// sent. Returns NULL if out of memory or threads.
+static inline struct dfs_gzip *dfs_gzip_open(int sock, int threads) {
+    struct dfs_gzip *gz = calloc(1, sizeof(*gz));
+    if (!gz)
+        return NULL;
+    gz->sock = sock;
+    gz->slots = threads > 0 ? 2 * threads : 1;
+    gz->event_fd = threads > 0 ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->queued, NULL);
+    gz->blocks = calloc(gz->slots, sizeof(*gz->blocks));
+    gz->workers = calloc(threads > 0 ? threads : 1, sizeof(*gz->workers));
+    int ok = gz->blocks && gz->workers && (threads == 0 || gz->event_fd >= 0);
+    for (int i = 0; ok && i < gz->slots; i++) {
+        gz->blocks[i].out_size = compressBound(DFS_GZIP_BLOCK) + 32;  // Room for the gzip header and trailer
+        gz->blocks[i].in = malloc(DFS_GZIP_BLOCK);
+        gz->blocks[i].out = malloc(gz->blocks[i].out_size);
+        ok = gz->blocks[i].in && gz->blocks[i].out;
+    }
+    for (; ok && gz->threads < threads; gz->threads++)
+        ok = pthread_create(&gz->workers[gz->threads], NULL, dfs_gzip_worker, gz) == 0;
+    if (!ok) {
+        perror("Error starting compression");
+        dfs_gzip_free(gz);
+        return NULL;
+    }
+    return gz;
+}
+
+// Send the compressed blocks that are ready, in order, waiting for the
+// workers until a slot is free to fill, or with finish until every block
+// has gone. Returns 0, or -1 if the connection broke or zlib failed.
+static inline int dfs_gzip_drain(struct dfs_gzip *gz, int finish) {
+    for (;;) {
+        pthread_mutex_lock(&gz->lock);
+        struct dfs_gzip_block *b = &gz->blocks[gz->send_seq % gz->slots];
+        int state = gz->send_seq < gz->fill_seq ? b->state : DFS_GZIP_FREE;
+        int in_flight = gz->fill_seq - gz->send_seq;
+        pthread_mutex_unlock(&gz->lock);
+
+        if (state == DFS_GZIP_FAILED) {
+            fprintf(stderr, "Compression failed\n");
+            return -1;
+        }
+        if (state == DFS_GZIP_DONE) {
+            unsigned char head[8];
+            dfs_put64(head, b->out_len);
+            if (send_all_flags(gz->sock, head, sizeof(head), MSG_MORE) < 0 ||
+                send_all(gz->sock, b->out, b->out_len) < 0)
+                return -1;
+            pthread_mutex_lock(&gz->lock);
+            gz->out_bytes += b->out_len;
+            b->state = DFS_GZIP_FREE;
+            gz->send_seq++;
+            pthread_mutex_unlock(&gz->lock);
+            continue;
+        }
+        if (in_flight == 0 || (!finish && in_flight < gz->slots))
+            return 0;
+
+        // The oldest block is still being compressed
+        uint64_t count;
+        if (dfs_wait(gz->event_fd, POLLIN) < 0)
+            return -1;
+        if (read(gz->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return -1;
+    }
+}
+
+// Hand the block being filled to the workers, or compress and send it
+// here when there are none. Returns 0 or -1.
+static inline int dfs_gzip_submit(struct dfs_gzip *gz) {
+    struct dfs_gzip_block *b = &gz->blocks[gz->fill_seq % gz->slots];
+    if (b->in_len == 0)
+        return 0;
+    gz->in_bytes += b->in_len;
+
+    if (gz->threads == 0) {
+        uint64_t started = dfs_gzip_thread_ns();
+        int rc = dfs_gzip_compress(b);
+        gz->cpu_ns += dfs_gzip_thread_ns() - started;
+        unsigned char head[8];
+        dfs_put64(head, b->out_len);
+        b->in_len = 0;
+        if (rc < 0)
+            fprintf(stderr, "Compression failed\n");
+        if (rc < 0 || send_all_flags(gz->sock, head, sizeof(head), MSG_MORE) < 0 ||
+            send_all(gz->sock, b->out, b->out_len) < 0)
+            return -1;
+        gz->out_bytes += b->out_len;
+        return 0;
+    }
+
+    pthread_mutex_lock(&gz->lock);
+    b->state = DFS_GZIP_QUEUED;
+    gz->fill_seq++;
+    pthread_cond_signal(&gz->queued);
+    pthread_mutex_unlock(&gz->lock);
+
+    // Make sure the next slot is free to fill
+    if (dfs_gzip_drain(gz, 0) < 0)
+        return -1;
+    gz->blocks[gz->fill_seq % gz->slots].in_len = 0;
+    return 0;
+}
+
+// Free space in the block being filled; *avail is set to how much.
+// Returns NULL if the connection broke.
+static inline unsigned char *dfs_gzip_space(struct dfs_gzip *gz, size_t *avail) {
+    struct dfs_gzip_block *b = &gz->blocks[gz->fill_seq % gz->slots];
+    if (b->in_len == DFS_GZIP_BLOCK) {
+        if (dfs_gzip_submit(gz) < 0)
+            return NULL;
+        b = &gz->blocks[gz->fill_seq % gz->slots];
+    }
+    *avail = DFS_GZIP_BLOCK - b->in_len;
+    return b->in + b->in_len;
+}
+
+// Add len bytes to the stream
+static inline int dfs_gzip_write(struct dfs_gzip *gz, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        size_t avail;
+        unsigned char *space = dfs_gzip_space(gz, &avail);
+        if (!space)
+            return -1;
+        size_t n = len < avail ? len : avail;
+        memcpy(space, p, n);
+        gz->blocks[gz->fill_seq % gz->slots].in_len += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Add len bytes of the file fd, from offset on
+static inline int dfs_gzip_read_file(struct dfs_gzip *gz, int fd, uint64_t offset, uint64_t len) {
+    while (len > 0) {
+        size_t avail;
+        unsigned char *space = dfs_gzip_space(gz, &avail);
+        if (!space)
+            return -1;
+        ssize_t n = pread(fd, space, len < avail ? len : avail, offset);
+        if (n <= 0) {
+            perror("Error reading file to compress");
+            return -1;
+        }
+        gz->blocks[gz->fill_seq % gz->slots].in_len += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Add the next len bytes received from sock
+static inline int dfs_gzip_recv(struct dfs_gzip *gz, int sock, uint64_t len) {
+    while (len > 0) {
+        size_t avail;
+        unsigned char *space = dfs_gzip_space(gz, &avail);
+        if (!space)
+            return -1;
+        ssize_t n = recv_some(sock, space, len < avail ? len : avail);
+        if (n <= 0)
+            return -1;
+        gz->blocks[gz->fill_seq % gz->slots].in_len += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Compress and send whatever is left, then end the chunked payload
+static inline int dfs_gzip_finish(struct dfs_gzip *gz) {
+    if (dfs_gzip_submit(gz) < 0 || (gz->threads > 0 && dfs_gzip_drain(gz, 1) < 0))
+        return -1;
+    return dfs_send_chunk_end(gz->sock);
+}
+
+#endif /* DFS_GZIP_H */
@@ -0,0 +1,507 @@
+#ifndef DFS_INDEX_H
+#define DFS_INDEX_H
+
+/*
+ * In-memory index of a store's namespace.
+ *
+ * A server that opens the index reads its whole store once into a tree of
+ * directories, each holding its entries (name, size, modification time)
+ * sorted in listing order.  From then on the tree follows the store: the
+ * server notes each change it makes itself before replying (dfs_index_note),
+ * so a client sees its own upload or removal in the very next listing, and
+ * a thread reading inotify picks up changes made by anything else.
+ * Listings, STAT and the existence checks of downloads and removals are
+ * answered from the tree under a read lock, without a system call when
+ * the file is there.  A file the tree does not have is looked for on disk
+ * too: the tree may not have caught up yet with a file another process
+ * wrote, such as another of S1's epoll workers, each with a tree of its
+ * own.
+ *
+ * Whoever wants to know about changes too sets dfs_index_changed, which is
+ * called for each entry that changes, with the lock held.
+ *
+ * A store the index cannot follow (no inotify, out of watches, ...) is not
+ * indexed at all: every query then answers DFS_INDEX_UNKNOWN and the caller
+ * asks the filesystem, as before.  So do paths outside the store and paths
+ * with "." or ".." in them.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "dfs_proto.h"
+#include "dfs_list.h"
+
+#define DFS_INDEX_UNKNOWN (-2)    /* Not indexed: ask the filesystem */
+#define DFS_INDEX_PATH_MAX 4096
+#define DFS_INDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                          IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct dfs_index_dir;
+
+struct dfs_index_entry {
+    char *name;
+    uint64_t size;
+    int64_t mtime;
+    struct dfs_index_dir *dir;       // The subdirectory, or NULL for a file
+};
+
+struct dfs_index_dir {
+    struct dfs_index_dir *parent;
+    const char *name;                // Owned by the parent's entry
+    int wd;                          // inotify watch, -1 if none
+    unsigned count, cap;
+    struct dfs_index_entry *entries; // In listing order
+};
+
+static struct {
+    pthread_rwlock_t lock;
+    char root[1024];
+    size_t root_len;
+    struct dfs_index_dir *top;       // NULL while the store is not indexed
+    int inotify;
+    struct dfs_index_dir **watched;  // Directories by watch descriptor
+    size_t watched_cap;
+} dfs_index = { .lock = PTHREAD_RWLOCK_INITIALIZER, .inotify = -1 };
+
+// Called with the path, relative to the store, of each entry that is added,
+// removed or changed, or with NULL when the whole store was read again
+static void (*dfs_index_changed)(const char *path);
+
+// Position of name among dir's entries, or where it would go
+static inline unsigned dfs_index_search(const struct dfs_index_dir *dir, const char *name, int *found) {
+    unsigned lo = 0, hi = dir->count;
+    *found = 0;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        int c = dfs_list_compare(dir->entries[mid].name, name);
+        if (c == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static inline int dfs_index_compare_entries(const void *a, const void *b) {
+    return dfs_list_compare(((const struct dfs_index_entry *)a)->name, ((const struct dfs_index_entry *)b)->name);
+}
+
+// The full path of dir
+static inline void dfs_index_path(const struct dfs_index_dir *dir, char *buf, size_t size) {
+    if (!dir->parent) {
+        snprintf(buf, size, "%s", dfs_index.root);
+        return;
+    }
+    dfs_index_path(dir->parent, buf, size);
+    size_t len = strlen(buf);
+    snprintf(buf + len, size - len, "/%s", dir->name);
+}
+
+// Free dir and everything below it, and stop watching them
+static inline void dfs_index_free(struct dfs_index_dir *dir) {
+    for (unsigned i = 0; i < dir->count; i++) {
+        if (dir->entries[i].dir)
+            dfs_index_free(dir->entries[i].dir);
+        free(dir->entries[i].name);
+    }
+    if (dir->wd >= 0) {
+        inotify_rm_watch(dfs_index.inotify, dir->wd);  // Fails harmlessly if it is gone already
+        dfs_index.watched[dir->wd] = NULL;
+    }
+    free(dir->entries);
+    free(dir);
+}
+
+// Open a slot for a new entry at position i of dir
+static inline struct dfs_index_entry *dfs_index_insert(struct dfs_index_dir *dir, unsigned i, const char *name) {
+    if (dir->count == dir->cap) {
+        unsigned cap = dir->cap ? 2 * dir->cap : 8;
+        struct dfs_index_entry *entries = realloc(dir->entries, cap * sizeof(*entries));
+        if (!entries)
+            return NULL;
+        dir->entries = entries;
+        dir->cap = cap;
+    }
+    struct dfs_index_entry *e = &dir->entries[i];
+    char *copy = strdup(name);
+    if (!copy)
+        return NULL;
+    memmove(e + 1, e, (dir->count - i) * sizeof(*e));
+    dir->count++;
+    e->name = copy;
+    e->size = 0;
+    e->mtime = 0;
+    e->dir = NULL;
+    return e;
+}
+
+// A new, empty directory node for entry e of parent
+static inline struct dfs_index_dir *dfs_index_new_dir(struct dfs_index_dir *parent, struct dfs_index_entry *e) {
+    struct dfs_index_dir *dir = calloc(1, sizeof(*dir));
+    if (dir) {
+        dir->parent = parent;
+        dir->name = e ? e->name : NULL;
+        dir->wd = -1;
+    }
+    return dir;
+}
+
+// Watch the directory at path and read it into dir, which is empty, along
+// with every directory below it. Returns -1 if part of it cannot be followed.
+static inline int dfs_index_fill(struct dfs_index_dir *dir, const char *path) {
+    dir->wd = inotify_add_watch(dfs_index.inotify, path, DFS_INDEX_EVENTS);
+    if (dir->wd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR)
+            return 0;  // Gone already; the event for its parent drops it
+        fprintf(stderr, "Cannot watch %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if ((size_t)dir->wd >= dfs_index.watched_cap) {
+        size_t cap = dfs_index.watched_cap ? 2 * dfs_index.watched_cap : 64;
+        while (cap <= (size_t)dir->wd)
+            cap *= 2;
+        struct dfs_index_dir **watched = realloc(dfs_index.watched, cap * sizeof(*watched));
+        if (!watched)
+            return -1;
+        memset(watched + dfs_index.watched_cap, 0, (cap - dfs_index.watched_cap) * sizeof(*watched));
+        dfs_index.watched = watched;
+        dfs_index.watched_cap = cap;
+    }
+    dfs_index.watched[dir->wd] = dir;
+
+    // Anything created from here on is both read now and reported later,
+    // which does no harm: an update only makes an entry match the disk
+    DIR *d = opendir(path);
+    if (!d)
+        return 0;
+    int rc = 0;
+    struct dirent *entry;
+    while (rc == 0 && (entry = readdir(d)) != NULL) {
+        struct stat st;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+            continue;
+        struct dfs_index_entry *e = dfs_index_insert(dir, dir->count, entry->d_name);
+        if (!e) {
+            rc = -1;
+            break;
+        }
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+        if (S_ISDIR(st.st_mode)) {
+            char sub[DFS_INDEX_PATH_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+            rc = (e->dir = dfs_index_new_dir(dir, e)) ? dfs_index_fill(e->dir, sub) : -1;
+        }
+    }
+    closedir(d);
+    qsort(dir->entries, dir->count, sizeof(*dir->entries), dfs_index_compare_entries);
+    return rc;
+}
+
+// Make dir's entry for name match the disk. Returns -1 if a new directory
+// cannot be followed.
+static inline int dfs_index_update(struct dfs_index_dir *dir, const char *name) {
+    char path[DFS_INDEX_PATH_MAX];
+    dfs_index_path(dir, path, sizeof(path));
+    size_t len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/%s", name);
+
+    struct stat st;
+    int exists = lstat(path, &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode));
+    int found;
+    unsigned i = dfs_index_search(dir, name, &found);
+    struct dfs_index_entry *e = found ? &dir->entries[i] : NULL;
+    if (dfs_index_changed && (!found || !exists || e->size != (uint64_t)st.st_size || e->mtime != st.st_mtime))
+        dfs_index_changed(path + dfs_index.root_len + 1);
+    if (found && (!exists || !S_ISDIR(st.st_mode) != !e->dir)) {
+        // Gone, or replaced by a file where there was a directory or the reverse
+        if (e->dir)
+            dfs_index_free(e->dir);
+        free(e->name);
+        memmove(e, e + 1, (dir->count - i - 1) * sizeof(*e));
+        dir->count--;
+        found = 0;
+    }
+    if (!exists)
+        return 0;
+    if (!found) {
+        if ((e = dfs_index_insert(dir, i, name)) == NULL)
+            return -1;
+        if (S_ISDIR(st.st_mode) && ((e->dir = dfs_index_new_dir(dir, e)) == NULL || dfs_index_fill(e->dir, path) < 0))
+            return -1;
+    }
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    return 0;
+}
+
+// Stop indexing the store; called with the lock held for writing
+static inline void dfs_index_drop(const char *why) {
+    if (!dfs_index.top)
+        return;
+    fprintf(stderr, "Not indexing %s any more (%s); asking the filesystem instead\n", dfs_index.root, why);
+    dfs_index_free(dfs_index.top);
+    dfs_index.top = NULL;
+    if (dfs_index_changed)
+        dfs_index_changed(NULL);
+}
+
+// Read the whole store afresh; called with the lock held for writing
+static inline int dfs_index_build(void) {
+    if (dfs_index.top)
+        dfs_index_free(dfs_index.top);
+    dfs_index.top = dfs_index_new_dir(NULL, NULL);
+    if (!dfs_index.top || dfs_index_fill(dfs_index.top, dfs_index.root) < 0 || dfs_index.top->wd < 0) {
+        dfs_index_drop("it cannot be read");
+        return -1;
+    }
+    if (dfs_index_changed)
+        dfs_index_changed(NULL);
+    return 0;
+}
+
+// Follow changes to the store made by other processes
+static inline void *dfs_index_watch(void *arg) {
+    (void)arg;
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(dfs_index.inotify, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        pthread_rwlock_wrlock(&dfs_index.lock);
+        if (n <= 0) {
+            perror("Error reading inotify events");
+            dfs_index_drop("inotify failed");
+            pthread_rwlock_unlock(&dfs_index.lock);
+            return NULL;
+        }
+        const struct inotify_event *ev;
+        for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost, so nothing short of a fresh read will do
+                if (dfs_index.top)
+                    dfs_index_build();
+                continue;
+            }
+            if (!dfs_index.top || ev->len == 0 || ev->wd < 0 || (size_t)ev->wd >= dfs_index.watched_cap ||
+                !dfs_index.watched[ev->wd])
+                continue;
+            if (dfs_index_update(dfs_index.watched[ev->wd], ev->name) < 0)
+                dfs_index_drop("a directory cannot be watched");
+        }
+        pthread_rwlock_unlock(&dfs_index.lock);
+    }
+}
+
+// Index the store at root and keep following it. Returns 0, or -1 if the
+// store is left unindexed.
+static inline int dfs_index_open(const char *root) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snprintf(dfs_index.root, sizeof(dfs_index.root), "%s", root);
+    dfs_index.root_len = strlen(dfs_index.root);
+    mkdir(root, 0777);
+
+    if ((dfs_index.inotify = inotify_init1(IN_CLOEXEC)) < 0) {
+        perror("inotify_init1 failed; not indexing the store");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&dfs_index.lock);
+    int rc = dfs_index_build();
+    pthread_rwlock_unlock(&dfs_index.lock);
+    pthread_t thread;
+    if (rc < 0 || pthread_create(&thread, NULL, dfs_index_watch, NULL) != 0) {
+        pthread_rwlock_wrlock(&dfs_index.lock);
+        dfs_index_drop("no watcher");
+        pthread_rwlock_unlock(&dfs_index.lock);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Indexed %s in %.1f ms\n", root,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+// Find the entry at path: *dir is the directory it is in and *entry the
+// entry itself, NULL for the store's root. Returns 1, 0 if there is no such
+// entry, or DFS_INDEX_UNKNOWN. Called with the lock held.
+static inline int dfs_index_walk(const char *path, struct dfs_index_dir **dir, struct dfs_index_entry **entry) {
+    if (!dfs_index.top || strncmp(path, dfs_index.root, dfs_index.root_len) != 0 ||
+        (path[dfs_index.root_len] != '/' && path[dfs_index.root_len] != '\0'))
+        return DFS_INDEX_UNKNOWN;
+
+    struct dfs_index_dir *cur = dfs_index.top;
+    *dir = cur;
+    *entry = NULL;
+    for (const char *p = path + dfs_index.root_len; *p; ) {
+        while (*p == '/')
+            p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0)
+            break;
+        char name[DFS_LIST_NAME_MAX + 1];
+        if ((len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return DFS_INDEX_UNKNOWN;
+        if (!cur || len > DFS_LIST_NAME_MAX)
+            return 0;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        int found;
+        unsigned i = dfs_index_search(cur, name, &found);
+        if (!found)
+            return 0;
+        *dir = cur;
+        *entry = &cur->entries[i];
+        cur = cur->entries[i].dir;
+        p += len;
+    }
+    return 1;
+}
+
+// Size and modification time of the regular file at path. Returns 1, 0 if
+// there is no such file, or DFS_INDEX_UNKNOWN.
+static inline int dfs_index_stat(const char *path, uint64_t *size, int64_t *mtime) {
+    struct dfs_index_dir *dir;
+    struct dfs_index_entry *e;
+    pthread_rwlock_rdlock(&dfs_index.lock);
+    int found = dfs_index_walk(path, &dir, &e);
+    if (found == 1 && (!e || e->dir))
+        found = 0;
+    if (found == 1) {
+        *size = e->size;
+        *mtime = e->mtime;
+    }
+    pthread_rwlock_unlock(&dfs_index.lock);
+    return found;
+}
+
+// Whether there is a file at path; the disk has the last word on a miss
+static inline int dfs_index_exists(const char *path) {
+    uint64_t size;
+    int64_t mtime;
+    return dfs_index_stat(path, &size, &mtime) == 1 || access(path, F_OK) == 0;
+}
+
+// dfs_list_scan, answered from the index when path is indexed
+static inline int dfs_index_scan(const char *path, const char *ext, const char *after, struct dfs_list_writer *w) {
+    struct dfs_index_dir *dir;
+    struct dfs_index_entry *e;
+    pthread_rwlock_rdlock(&dfs_index.lock);
+    int found = dfs_index_walk(path, &dir, &e);
+    if (found == DFS_INDEX_UNKNOWN) {
+        pthread_rwlock_unlock(&dfs_index.lock);
+        return dfs_list_scan(path, ext, after, w);
+    }
+    if (e)
+        dir = e->dir;
+    if (dfs_list_writer_init(w) < 0 || !found || !dir) {
+        pthread_rwlock_unlock(&dfs_index.lock);
+        return -1;
+    }
+
+    // The entries are in listing order already: start after the cursor
+    int more = 0;
+    unsigned i = 0;
+    size_t ext_len = ext ? strlen(ext) : 0;
+    if (after && *after) {
+        i = dfs_index_search(dir, after, &found);
+        i += found;
+    }
+    for (; i < dir->count; i++) {
+        const char *name = dir->entries[i].name;
+        size_t len = strlen(name);
+        if (dir->entries[i].dir || len <= ext_len || strcmp(name + len - ext_len, ext ? ext : "") != 0)
+            continue;
+        if (w->count == DFS_LIST_BATCH) {
+            more = 1;
+            break;
+        }
+        dfs_list_put(w, name);
+    }
+    pthread_rwlock_unlock(&dfs_index.lock);
+    return more;
+}
+
+// Bring the index up to date with a change this process has just made at
+// path, so the next request sees it whether or not inotify has caught up
+static inline void dfs_index_note(const char *path) {
+    pthread_rwlock_wrlock(&dfs_index.lock);
+    if (!dfs_index.top || strncmp(path, dfs_index.root, dfs_index.root_len) != 0 ||
+        path[dfs_index.root_len] != '/') {
+        pthread_rwlock_unlock(&dfs_index.lock);
+        return;
+    }
+
+    // Walk down to the directory the change is in, taking in any new ones
+    struct dfs_index_dir *cur = dfs_index.top;
+    const char *p = path + dfs_index.root_len;
+    char name[DFS_LIST_NAME_MAX + 1];
+    int rc = 0;
+    while (cur && rc == 0) {
+        while (*p == '/')
+            p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0 || len > DFS_LIST_NAME_MAX || (len == 1 && p[0] == '.') ||
+            (len == 2 && p[0] == '.' && p[1] == '.'))
+            break;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+        if (strspn(p, "/") == strlen(p)) {
+            rc = dfs_index_update(cur, name);
+            break;
+        }
+        int found;
+        unsigned i = dfs_index_search(cur, name, &found);
+        if (!found || !cur->entries[i].dir) {
+            if ((rc = dfs_index_update(cur, name)) < 0)
+                break;
+            i = dfs_index_search(cur, name, &found);
+        }
+        cur = found ? cur->entries[i].dir : NULL;
+    }
+    if (rc < 0)
+        dfs_index_drop("a directory cannot be watched");
+    pthread_rwlock_unlock(&dfs_index.lock);
+}
+
+// Reply to a LISTFILES request with the batch of names in path ending in
+// ext that follows the cursor after. Returns how many names were sent, or
+// -1 if the directory could not be read (DFS_ENOENT was sent instead) or
+// the connection broke.
+static inline int dfs_send_listing(int sock, const struct dfs_header *req, const char *path, const char *ext,
+                                   const char *after) {
+    struct dfs_list_writer w;
+    int more = dfs_index_scan(path, ext, after, &w);
+    int rc;
+    if (more < 0) {
+        fprintf(stderr, "Cannot list %s\n", path);
+        rc = dfs_send_status(sock, req, w.buf ? DFS_ENOENT : DFS_EIO);
+    } else {
+        rc = dfs_send_reply_flags(sock, req, DFS_OK, more ? DFS_FLAG_MORE : 0, w.buf, w.len);
+    }
+    free(w.buf);
+    return rc < 0 || more < 0 ? -1 : (int)w.count;
+}
+
+#endif /* DFS_INDEX_H */
@@ -0,0 +1,161 @@
+#ifndef DFS_IO_H
+#define DFS_IO_H
+
+/*
+ * Socket helpers shared by the client and all servers.
+ *
+ * Every send/recv in the system goes through send_all()/recv_all() so short
+ * reads and writes are handled in one place.  The helpers also work on
+ * non-blocking sockets: when the kernel returns EAGAIN they call dfs_wait(),
+ * which by default blocks in poll().  S1's epoll workers swap dfs_wait for a
+ * version that parks the current request and returns to the event loop.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#define SERVER_ADDR "127.0.0.1"
+
+typedef int (*dfs_wait_fn)(int fd, short events);
+
+// Default wait: block this thread until fd is ready
+static inline int dfs_poll_wait(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static dfs_wait_fn dfs_wait = dfs_poll_wait;
+static int dfs_io_nonblock = 0;  /* Create outgoing sockets non-blocking */
+
+// Send exactly len bytes with extra send() flags (e.g. MSG_MORE).
+// Returns 0 on success, -1 on error.
+static inline int send_all_flags(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL | flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && dfs_wait(sock, POLLOUT) == 0)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send exactly len bytes. Returns 0 on success, -1 on error.
+static inline int send_all(int sock, const void *buf, size_t len) {
+    return send_all_flags(sock, buf, len, 0);
+}
+
+// Send every byte described by iov in as few syscalls as possible.
+// The iov array is modified. Returns 0 on success, -1 on error.
+static inline int writev_all(int sock, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && dfs_wait(sock, POLLOUT) == 0)
+                continue;
+            return -1;
+        }
+        // Skip the fully written entries and trim the partially written one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Receive exactly len bytes. Returns 0 on success, -1 on error or EOF.
+static inline int recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n == 0)
+            return -1;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && dfs_wait(sock, POLLIN) == 0)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Receive up to len bytes (at least one). Returns bytes read, 0 on EOF, -1 on error.
+static inline ssize_t recv_some(int sock, void *buf, size_t len) {
+    for (;;) {
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && dfs_wait(sock, POLLIN) == 0)
+            continue;
+        return -1;
+    }
+}
+
+// Connect to a server at addr. Returns the socket or -1.
+static inline int connect_to_addr(const struct sockaddr_in *addr) {
+    int type = SOCK_STREAM | SOCK_CLOEXEC | (dfs_io_nonblock ? SOCK_NONBLOCK : 0);
+    int sock = socket(AF_INET, type, 0);
+    if (sock < 0)
+        return -1;
+
+    if (connect(sock, (const struct sockaddr*)addr, sizeof(*addr)) < 0) {
+        if (errno != EINPROGRESS || dfs_wait(sock, POLLOUT) != 0) {
+            close(sock);
+            return -1;
+        }
+        // Non-blocking connect finished; pick up its result
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            close(sock);
+            errno = err;
+            return -1;
+        }
+    }
+    return sock;
+}
+
+// Connect to a server on SERVER_ADDR. Returns the socket or -1.
+static inline int connect_to_server(int port) {
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = inet_addr(SERVER_ADDR)
+    };
+    return connect_to_addr(&serv_addr);
+}
+
+#endif /* DFS_IO_H */
@@ -0,0 +1,134 @@
+#ifndef DFS_JOURNAL_H
+#define DFS_JOURNAL_H
+
+/*
+ * Modification journal of a store, for incremental tar archives.
+ *
+ * Each server appends a record to <store>/.journal whenever it stores or
+ * removes a file: the time, '+' or '-', and the path relative to the
+ * store.  A record goes out in a single O_APPEND write, so the threads and
+ * processes of a server never interleave their records.  An incremental
+ * TARFETCH reads only the part of the journal written since the client's
+ * last sync, so finding out what changed never walks the store.
+ *
+ * The TARFETCH payload says where to start, one line per store:
+ *
+ *   since <unix time>          records from that time on
+ *   <store> <id> <offset>      records after that position in the journal
+ *
+ * A store without a line of its own reads its whole journal.  Along with
+ * the files that are new or changed, the archive holds for each store the
+ * paths deleted in that time (.dfs/<store>.deleted) and the position it got
+ * to (.dfs/<store>.cursor), which is what the next sync sends back.  The
+ * removal of a copy whose file lives on on another node (DFS_FLAG_MOVED,
+ * when S1 moves or drops copies) is no deletion and is not recorded.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfs_proto.h"
+#include "dfs_file.h"
+
+#define DFS_JOURNAL_NAME ".journal"
+#define DFS_JOURNAL_HEADER 12  /* time in ns (8), op (1), unused (1), path length (2) */
+
+// The store this process journals; nothing is recorded until it is set
+static const char *dfs_journal_store;
+static char dfs_journal_root[1024];
+
+// Start journalling changes to the store named store ("S1".."S4") at root
+static inline void dfs_journal_open(const char *store, const char *root) {
+    dfs_journal_store = store;
+    snprintf(dfs_journal_root, sizeof(dfs_journal_root), "%s", root);
+}
+
+// Record that the file at path was stored ('+') or removed ('-').
+// Paths outside the store are ignored.
+static inline void dfs_journal_note(const char *path, char op) {
+    size_t root_len = strlen(dfs_journal_root);
+    if (!dfs_journal_store || strncmp(path, dfs_journal_root, root_len) != 0 || path[root_len] != '/')
+        return;
+
+    // The path relative to the store, without doubled slashes
+    unsigned char record[DFS_JOURNAL_HEADER + DFS_NAME_MAX];
+    size_t len = 0;
+    for (const char *p = path + root_len; *p && len < DFS_NAME_MAX; p++) {
+        if (*p == '/' && (len == 0 || record[DFS_JOURNAL_HEADER + len - 1] == '/'))
+            continue;
+        record[DFS_JOURNAL_HEADER + len++] = *p;
+    }
+    if (len == 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    dfs_put64(record, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+    record[8] = op;
+    record[9] = 0;
+    dfs_put16(record + 10, len);
+
+    char journal[1100];
+    snprintf(journal, sizeof(journal), "%s/%s", dfs_journal_root, DFS_JOURNAL_NAME);
+    int fd = open(journal, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0 || write_all(fd, record, DFS_JOURNAL_HEADER + len) < 0)
+        perror("Error writing journal");
+    if (fd >= 0)
+        close(fd);
+}
+
+// Read the sync point of a TARFETCH request into *spec (NULL if there is
+// none, otherwise to be freed). Returns 0, 1 if it was too long and has been
+// skipped (the request should be refused), or -1 if the connection broke.
+static inline int dfs_recv_sync_point(int sock, const struct dfs_header *req, char **spec) {
+    *spec = NULL;
+    if (req->payload_len == 0)
+        return 0;
+    if (req->payload_len > DFS_SYNC_MAX)
+        return dfs_skip_payload(sock, req->payload_len) < 0 ? -1 : 1;
+    *spec = dfs_recv_payload(sock, req->payload_len);
+    return *spec ? 0 : -1;
+}
+
+// One path touched since the sync point; the newest record wins
+struct dfs_change {
+    const char *path;
+    uint16_t len;
+    uint32_t order;
+};
+
+static inline int dfs_compare_changes(const void *a, const void *b) {
+    const struct dfs_change *x = a, *y = b;
+    int n = memcmp(x->path, y->path, x->len < y->len ? x->len : y->len);
+    if (n == 0)
+        n = (x->len > y->len) - (x->len < y->len);
+    return n ? n : (x->order > y->order) - (x->order < y->order);
+}
+
+// Work out where this store's sync starts from the TARFETCH payload:
+// either a time (*since, in ns) or a journal offset for journal id.
+static inline void dfs_journal_start(const char *spec, uint64_t id, uint64_t *since, uint64_t *offset) {
+    *since = 0;
+    *offset = 0;
+    size_t store_len = strlen(dfs_journal_store);
+    for (const char *line = spec; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        unsigned long long a, b;
+        if (sscanf(line, "since %llu", &a) == 1) {
+            *since = a * 1000000000ULL;
+        } else if (strncmp(line, dfs_journal_store, store_len) == 0 && line[store_len] == ' ' &&
+                   sscanf(line + store_len, "%llu %llu", &a, &b) == 2) {
+            if (a == id)
+                *offset = b;
+            else if (a != 0)
+                printf("Journal of %s was replaced since the last sync; reading all of it\n", dfs_journal_store);
+        }
+    }
+}
+
+#endif /* DFS_JOURNAL_H */
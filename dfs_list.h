@@ -0,0 +1,210 @@
+#ifndef DFS_LIST_H
+#define DFS_LIST_H
+
+/*
+ * Directory listings in sorted, prefix-compressed batches.
+ *
+ * Names are listed in one order everywhere: by file type (.c, .pdf, .txt,
+ * .zip, then anything else), then by name.  A batch holds at most
+ * DFS_LIST_BATCH names, each as a record of
+ *
+ *   shared (1 byte)   bytes in common with the previous name in the batch
+ *   length (1 byte)   bytes that follow
+ *   suffix            the rest of the name
+ *
+ * so a run of names like report-0001.pdf .. report-0999.pdf costs a few
+ * bytes each.  A storage server answers LISTFILES with one batch; the aux
+ * field of the request is the cursor, the last name of the previous batch,
+ * and DFS_FLAG_MORE on the reply says there is another batch after this
+ * one.  The server keeps no state between batches: it scans the directory
+ * again, keeping only the DFS_LIST_BATCH smallest names after the cursor,
+ * so a directory of any size is listed in constant memory.  S1 merges the
+ * sorted batches of all the stores into one chunked reply to the client,
+ * one batch per chunk.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "dfs_proto.h"
+
+#define DFS_LIST_BATCH 256       /* Names per batch */
+#define DFS_LIST_NAME_MAX 255    /* Longest name (one directory entry) */
+#define DFS_LIST_BATCH_BYTES (DFS_LIST_BATCH * (2 + DFS_LIST_NAME_MAX))
+
+// Position of a name's file type in listing order
+static inline int dfs_list_rank(const char *name) {
+    static const char *const types[] = { ".c", ".pdf", ".txt", ".zip" };
+    const char *ext = strrchr(name, '.');
+    for (int i = 0; ext && i < 4; i++) {
+        if (strcmp(ext, types[i]) == 0)
+            return i;
+    }
+    return 4;
+}
+
+// Listing order: by file type, then by name
+static inline int dfs_list_compare(const char *a, const char *b) {
+    int ra = dfs_list_rank(a), rb = dfs_list_rank(b);
+    return ra != rb ? ra - rb : strcmp(a, b);
+}
+
+// A batch being encoded into buf (DFS_LIST_BATCH_BYTES long)
+struct dfs_list_writer {
+    unsigned char *buf;
+    size_t len;
+    unsigned count;
+    char prev[DFS_LIST_NAME_MAX + 1];
+};
+
+static inline int dfs_list_writer_init(struct dfs_list_writer *w) {
+    w->buf = malloc(DFS_LIST_BATCH_BYTES);
+    w->len = 0;
+    w->count = 0;
+    w->prev[0] = '\0';
+    return w->buf ? 0 : -1;
+}
+
+// Start the next batch in the same buffer
+static inline void dfs_list_writer_reset(struct dfs_list_writer *w) {
+    w->len = 0;
+    w->count = 0;
+    w->prev[0] = '\0';
+}
+
+// Append a name; the batch must not be full and names must come in order
+static inline void dfs_list_put(struct dfs_list_writer *w, const char *name) {
+    size_t len = strlen(name), shared = 0;
+    if (len > DFS_LIST_NAME_MAX)
+        len = DFS_LIST_NAME_MAX;
+    while (shared < len && w->prev[shared] == name[shared])
+        shared++;
+    w->buf[w->len++] = shared;
+    w->buf[w->len++] = len - shared;
+    memcpy(w->buf + w->len, name + shared, len - shared);
+    w->len += len - shared;
+    memcpy(w->prev, name, len);
+    w->prev[len] = '\0';
+    w->count++;
+}
+
+// Reads the names back out of a batch
+struct dfs_list_reader {
+    const unsigned char *p, *end;
+    char name[DFS_LIST_NAME_MAX + 1];  // The last name read
+    int bad;                           // Set if a record did not make sense
+};
+
+static inline void dfs_list_reader_init(struct dfs_list_reader *r, const void *batch, size_t len) {
+    r->p = batch;
+    r->end = r->p + len;
+    r->name[0] = '\0';
+    r->bad = 0;
+}
+
+// The next name in the batch, or NULL at its end (or on a bad record)
+static inline const char *dfs_list_next(struct dfs_list_reader *r) {
+    if (r->p == r->end)
+        return NULL;
+    size_t shared = r->p[0], len = r->end - r->p >= 2 ? r->p[1] : 0;
+    if (r->end - r->p < 2 || shared > strlen(r->name) || (size_t)(r->end - r->p - 2) < len ||
+        shared + len > DFS_LIST_NAME_MAX) {
+        r->bad = 1;
+        return NULL;
+    }
+    memcpy(r->name + shared, r->p + 2, len);
+    r->name[shared + len] = '\0';
+    r->p += 2 + len;
+    return r->name;
+}
+
+// Max-heap on listing order, for keeping the smallest names seen so far
+static inline void dfs_list_sift_down(char (*heap)[DFS_LIST_NAME_MAX + 1], unsigned count, unsigned i) {
+    for (;;) {
+        unsigned largest = i, l = 2 * i + 1, r = l + 1;
+        if (l < count && dfs_list_compare(heap[l], heap[largest]) > 0)
+            largest = l;
+        if (r < count && dfs_list_compare(heap[r], heap[largest]) > 0)
+            largest = r;
+        if (largest == i)
+            return;
+        char tmp[DFS_LIST_NAME_MAX + 1];
+        memcpy(tmp, heap[i], sizeof(tmp));
+        memcpy(heap[i], heap[largest], sizeof(tmp));
+        memcpy(heap[largest], tmp, sizeof(tmp));
+        i = largest;
+    }
+}
+
+static inline int dfs_list_compare_entries(const void *a, const void *b) {
+    return dfs_list_compare(a, b);
+}
+
+// Encode into w (initialised here; free w->buf) the first DFS_LIST_BATCH
+// regular files in path ending in ext (any name if ext is NULL) that come
+// after the name after in listing order. Returns 1 if more names follow the
+// batch, 0 if not, or -1 if the directory cannot be read.
+static inline int dfs_list_scan(const char *path, const char *ext, const char *after,
+                                struct dfs_list_writer *w) {
+    if (dfs_list_writer_init(w) < 0)
+        return -1;
+    DIR *dir = opendir(path);
+    char (*heap)[DFS_LIST_NAME_MAX + 1] = malloc(DFS_LIST_BATCH * sizeof(*heap));
+    if (!dir || !heap) {
+        if (dir)
+            closedir(dir);
+        free(heap);
+        return -1;
+    }
+
+    unsigned count = 0;
+    int more = 0;
+    size_t ext_len = ext ? strlen(ext) : 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (entry->d_type != DT_REG || len <= ext_len || strcmp(entry->d_name + len - ext_len, ext ? ext : "") != 0)
+            continue;
+        if (after && *after && dfs_list_compare(entry->d_name, after) <= 0)
+            continue;
+        if (count < DFS_LIST_BATCH) {
+            // Sift the new name up into place
+            unsigned i = count++;
+            memcpy(heap[i], entry->d_name, len + 1);
+            while (i > 0 && dfs_list_compare(heap[(i - 1) / 2], heap[i]) < 0) {
+                char tmp[DFS_LIST_NAME_MAX + 1];
+                memcpy(tmp, heap[i], sizeof(tmp));
+                memcpy(heap[i], heap[(i - 1) / 2], sizeof(tmp));
+                memcpy(heap[(i - 1) / 2], tmp, sizeof(tmp));
+                i = (i - 1) / 2;
+            }
+        } else {
+            more = 1;
+            if (dfs_list_compare(entry->d_name, heap[0]) < 0) {
+                memcpy(heap[0], entry->d_name, len + 1);
+                dfs_list_sift_down(heap, count, 0);
+            }
+        }
+    }
+    closedir(dir);
+
+    qsort(heap, count, sizeof(*heap), dfs_list_compare_entries);
+    for (unsigned i = 0; i < count; i++)
+        dfs_list_put(w, heap[i]);
+    free(heap);
+    return more;
+}
+
+// Send the batch in w as one chunk of a chunked reply. It is held back with
+// MSG_MORE until the next one, or the end of the payload, fills the segment.
+static inline int dfs_list_send_batch(int sock, const struct dfs_list_writer *w) {
+    unsigned char head[8];
+    dfs_put64(head, w->len);
+    return send_all_flags(sock, head, sizeof(head), MSG_MORE) < 0 ||
+           send_all_flags(sock, w->buf, w->len, MSG_MORE) < 0 ? -1 : 0;
+}
+
+#endif /* DFS_LIST_H */
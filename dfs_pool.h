@@ -0,0 +1,155 @@
+#ifndef DFS_POOL_H
+#define DFS_POOL_H
+
+/*
+ * Bounded worker pool for the storage servers.
+ *
+ * pool_run() waits in epoll for new connections and for requests on
+ * connections that are already open, and hands each ready socket to
+ * pool_submit(), which queues it for one of a fixed number of worker
+ * threads.  The queue has a fixed capacity: when every worker is busy and
+ * the queue is full, pool_submit() blocks, so the loop stops accepting and
+ * new clients wait in the kernel listen backlog instead of piling up in
+ * memory.
+ *
+ * A worker serves one request and then parks the connection back in epoll,
+ * so S1's long-lived pooled connections only occupy a thread while a
+ * request is actually running.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define POOL_DEFAULT_QUEUE 256
+#define POOL_MAX_EVENTS 64
+
+// Serves one request; returns 1 to keep the connection open for the next one,
+// or POOL_DETACHED if the handler has kept the socket for itself
+typedef int (*pool_handler)(int client_sock);
+
+#define POOL_DETACHED 2
+
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int *queue;          /* Ring buffer of accepted sockets */
+    int capacity;
+    int head, count;
+    pool_handler handler;
+    int epfd;            /* Listener plus idle connections */
+};
+
+// Wait for the next request on an open connection
+static void pool_park(struct worker_pool *pool, int sock) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.fd = sock };
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_MOD, sock, &ev) < 0 &&
+        (errno != ENOENT || epoll_ctl(pool->epfd, EPOLL_CTL_ADD, sock, &ev) < 0)) {
+        perror("epoll_ctl failed");
+        close(sock);
+    }
+}
+
+static void *pool_worker(void *arg) {
+    struct worker_pool *pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        int client_sock = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        int keep = pool->handler(client_sock);
+        if (keep == POOL_DETACHED)
+            epoll_ctl(pool->epfd, EPOLL_CTL_DEL, client_sock, NULL);
+        else if (keep)
+            pool_park(pool, client_sock);
+        else
+            close(client_sock);  // Also drops it from epoll
+    }
+    return NULL;
+}
+
+// Start `threads` workers that run handler() on each submitted socket.
+static int pool_start(struct worker_pool *pool, int threads, int queue_size, pool_handler handler) {
+    pool->queue = malloc(sizeof(int) * queue_size);
+    pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!pool->queue || pool->epfd < 0)
+        return -1;
+    pool->capacity = queue_size;
+    pool->head = 0;
+    pool->count = 0;
+    pool->handler = handler;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, pool_worker, pool) != 0) {
+            perror("Worker thread creation failed");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+// Queue a connection for the workers, waiting while the queue is full
+static void pool_submit(struct worker_pool *pool, int client_sock) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->capacity)
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    pool->queue[(pool->head + pool->count) % pool->capacity] = client_sock;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Accept connections and dispatch ready requests to the workers; never returns
+static void pool_run(struct worker_pool *pool, int server_sock) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = server_sock };
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+
+    struct epoll_event events[POOL_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(pool->epfd, events, POOL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait failed");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int sock = events[i].data.fd;
+            if (sock == server_sock) {
+                sock = accept(server_sock, NULL, NULL);
+                if (sock < 0) {
+                    perror("Accept failed");
+                    continue;
+                }
+            }
+            // New connection, or a parked one with a request (or EOF) waiting
+            pool_submit(pool, sock);
+        }
+    }
+}
+
+// Default worker count: two per core, since requests mostly wait on disk or network
+static int pool_default_threads(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 2 ? (int)cores * 2 : 4;
+}
+
+#endif /* DFS_POOL_H */
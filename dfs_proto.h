@@ -0,0 +1,375 @@
+#ifndef DFS_PROTO_H
+#define DFS_PROTO_H
+
+/*
+ * Wire protocol shared by the client, S1 and the storage servers.
+ *
+ * Every request and every reply starts with the same 24-byte header, all
+ * fields in network byte order:
+ *
+ *   offset  size  field
+ *        0     2  magic        "DF"
+ *        2     1  version      DFS_PROTO_VERSION
+ *        3     1  opcode       DFS_OP_*
+ *        4     2  flags        DFS_FLAG_*
+ *        6     2  name_len     bytes of the first name (path, filename, file type)
+ *        8     2  aux_len      bytes of the second name (upload destination, byte range)
+ *       10     2  status       replies: DFS_OK or a DFS_E* code
+ *       12     4  request_id   chosen by the sender, echoed in the reply
+ *       16     8  payload_len  bytes of payload after the names
+ *
+ * The header is followed by the name bytes (not NUL terminated), the aux
+ * bytes, then payload_len bytes of payload.  Replies carry no names.  A
+ * request with its names is sent with a single writev.
+ *
+ * A reply whose size is not known when it starts (a tar archive built as it
+ * is sent) has DFS_FLAG_CHUNKED set and payload_len 0.  Its payload follows
+ * as chunks, each an 8-byte length and then that many bytes, and ends with
+ * a chunk of length 0.  A sender that fails partway closes the connection,
+ * so a missing end marker means the payload is incomplete.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "dfs_io.h"
+
+#define DFS_PROTO_MAGIC 0x4446  /* "DF" */
+#define DFS_PROTO_VERSION 1
+#define DFS_HEADER_SIZE 24
+#define DFS_NAME_MAX 1024       /* Longest name or aux field accepted */
+#define DFS_SYNC_MAX 4096       /* Longest TARFETCH sync point accepted */
+
+// Opcodes
+#define DFS_OP_UPLOAD    1  /* name: filename, aux: destination dir, payload: file data */
+#define DFS_OP_DOWNLOAD  2  /* name: path, aux: optional byte range; reply payload: file data */
+#define DFS_OP_REMOVE    3  /* name: path */
+#define DFS_OP_TARFETCH  4  /* name: file type or "all", aux: optional directory, payload: optional sync point
+                               (dfs_journal.h) for only what changed; reply payload: tar archive */
+#define DFS_OP_LISTFILES 5  /* name: directory, aux: cursor from the last batch; reply payload: a batch of
+                               names (dfs_list.h), or from S1 one batch per chunk */
+#define DFS_OP_PING      6  /* Health check for pooled backend connections */
+#define DFS_OP_STAT      7  /* name: path; reply payload: size and mtime, 8 bytes each */
+
+// Resumable uploads: the payload of each request starts with an upload
+// descriptor (struct dfs_upload), and every reply carries the committed
+// offset, 8 bytes: how much of the file, from the start, the server has.
+#define DFS_OP_UPLOAD_PART   8   /* name: filename, aux: destination dir, payload: descriptor + data at offset */
+#define DFS_OP_UPLOAD_QUERY  9   /* name, aux as above, payload: descriptor */
+#define DFS_OP_UPLOAD_COMMIT 10  /* name, aux as above, payload: descriptor; moves the finished file into place */
+
+#define DFS_OP_WATCH 11  /* S1 to a storage server; reply: a chunked payload that does not end, one chunk
+                            per change to the store (dfs_watch.h) */
+#define DFS_OP_STATS 12  /* Reply payload: S1's counters, one "name value" line each */
+#define DFS_OP_FIND  13  /* name: directory, aux: query (dfs_find.h); reply: chunks of matches */
+#define DFS_OP_REBALANCE 14  /* name: "", "start", "pause", "resume" or "rate", aux: KB/s for "rate";
+                                reply payload: the rebalancer's progress, one "name value" line each */
+
+// Flags
+#define DFS_FLAG_REPLY   0x0001
+#define DFS_FLAG_CHUNKED 0x0002  /* Payload is sent as length-prefixed chunks */
+#define DFS_FLAG_GZIP    0x0004  /* TARFETCH: compress the archive; its chunks are gzip members */
+#define DFS_FLAG_PARTIAL 0x0008  /* LISTFILES reply: a storage server did not answer in time */
+#define DFS_FLAG_MORE    0x0010  /* LISTFILES reply: another batch follows this one */
+#define DFS_FLAG_SYNC    0x0020  /* UPLOAD, UPLOAD_COMMIT: have the file on disk (fsync) before replying */
+#define DFS_FLAG_MOVED   0x0040  /* REMOVE: a copy of a file kept on another node, not a deletion to journal */
+
+// Reply status codes (REMOVE keeps its original 0/1/2 meanings)
+#define DFS_OK       0
+#define DFS_ENOENT   1  /* File or directory not found */
+#define DFS_EIO      2  /* Could not read, write or remove */
+#define DFS_EINVAL   3  /* Unsupported file type or malformed request */
+#define DFS_EUNAVAIL 4  /* Storage server unreachable */
+
+struct dfs_header {
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t name_len;
+    uint16_t aux_len;
+    int16_t status;
+    uint32_t request_id;
+    uint64_t payload_len;
+};
+
+static inline void dfs_put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void dfs_put32(unsigned char *p, uint32_t v) {
+    dfs_put16(p, v >> 16);
+    dfs_put16(p + 2, v);
+}
+
+static inline void dfs_put64(unsigned char *p, uint64_t v) {
+    dfs_put32(p, v >> 32);
+    dfs_put32(p + 4, v);
+}
+
+static inline uint16_t dfs_get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t dfs_get32(const unsigned char *p) {
+    return (uint32_t)dfs_get16(p) << 16 | dfs_get16(p + 2);
+}
+
+static inline uint64_t dfs_get64(const unsigned char *p) {
+    return (uint64_t)dfs_get32(p) << 32 | dfs_get32(p + 4);
+}
+
+static inline void dfs_encode_header(const struct dfs_header *h, unsigned char *buf) {
+    dfs_put16(buf, DFS_PROTO_MAGIC);
+    buf[2] = DFS_PROTO_VERSION;
+    buf[3] = h->opcode;
+    dfs_put16(buf + 4, h->flags);
+    dfs_put16(buf + 6, h->name_len);
+    dfs_put16(buf + 8, h->aux_len);
+    dfs_put16(buf + 10, (uint16_t)h->status);
+    dfs_put32(buf + 12, h->request_id);
+    dfs_put64(buf + 16, h->payload_len);
+}
+
+// Returns 0, or -1 if the bytes are not a header this version understands
+static inline int dfs_decode_header(const unsigned char *buf, struct dfs_header *h) {
+    if (dfs_get16(buf) != DFS_PROTO_MAGIC || buf[2] != DFS_PROTO_VERSION)
+        return -1;
+    h->opcode = buf[3];
+    h->flags = dfs_get16(buf + 4);
+    h->name_len = dfs_get16(buf + 6);
+    h->aux_len = dfs_get16(buf + 8);
+    h->status = (int16_t)dfs_get16(buf + 10);
+    h->request_id = dfs_get32(buf + 12);
+    h->payload_len = dfs_get64(buf + 16);
+    if (h->name_len > DFS_NAME_MAX || h->aux_len > DFS_NAME_MAX)
+        return -1;
+    return 0;
+}
+
+// Upload descriptor at the start of UPLOAD_PART/QUERY/COMMIT payloads.
+// The client picks the id; it names the server's staging file, so the same
+// id picks up where an earlier, interrupted upload left off.
+#define DFS_UPLOAD_DESC_SIZE 24
+
+struct dfs_upload {
+    uint64_t id;
+    uint64_t offset;  /* Where the data in this part goes */
+    uint64_t total;   /* Size of the complete file */
+};
+
+static inline void dfs_encode_upload(const struct dfs_upload *up, unsigned char *buf) {
+    dfs_put64(buf, up->id);
+    dfs_put64(buf + 8, up->offset);
+    dfs_put64(buf + 16, up->total);
+}
+
+static inline void dfs_decode_upload(const unsigned char *buf, struct dfs_upload *up) {
+    up->id = dfs_get64(buf);
+    up->offset = dfs_get64(buf + 8);
+    up->total = dfs_get64(buf + 16);
+}
+
+// Which requests carry a payload; anything else with one is malformed
+static inline int dfs_op_has_payload(int opcode) {
+    return opcode == DFS_OP_UPLOAD || opcode == DFS_OP_UPLOAD_PART ||
+           opcode == DFS_OP_UPLOAD_QUERY || opcode == DFS_OP_UPLOAD_COMMIT || opcode == DFS_OP_TARFETCH;
+}
+
+static inline uint32_t dfs_next_request_id(void) {
+    static uint32_t next_id = 0;
+    return __sync_add_and_fetch(&next_id, 1);
+}
+
+static inline const char *dfs_op_name(int opcode) {
+    switch (opcode) {
+    case DFS_OP_UPLOAD: return "UPLOAD";
+    case DFS_OP_DOWNLOAD: return "DOWNLOAD";
+    case DFS_OP_REMOVE: return "REMOVE";
+    case DFS_OP_TARFETCH: return "TARFETCH";
+    case DFS_OP_LISTFILES: return "LISTFILES";
+    case DFS_OP_PING: return "PING";
+    case DFS_OP_STAT: return "STAT";
+    case DFS_OP_UPLOAD_PART: return "UPLOAD_PART";
+    case DFS_OP_UPLOAD_QUERY: return "UPLOAD_QUERY";
+    case DFS_OP_UPLOAD_COMMIT: return "UPLOAD_COMMIT";
+    case DFS_OP_WATCH: return "WATCH";
+    case DFS_OP_STATS: return "STATS";
+    case DFS_OP_FIND: return "FIND";
+    case DFS_OP_REBALANCE: return "REBALANCE";
+    default: return "UNKNOWN";
+    }
+}
+
+// Send a request header and its names in one writev, together with the
+// first head_len bytes of its payload_len bytes of payload (an upload
+// descriptor, say); the caller sends the rest of the payload afterwards.
+// flags are request flags such as DFS_FLAG_GZIP.
+static inline int dfs_send_request_flags(int sock, int opcode, int flags, uint32_t request_id, const char *name,
+                                         const char *aux, const void *head, size_t head_len, uint64_t payload_len) {
+    size_t name_len = name ? strlen(name) : 0;
+    size_t aux_len = aux ? strlen(aux) : 0;
+    if (name_len > DFS_NAME_MAX || aux_len > DFS_NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    struct dfs_header h = {
+        .opcode = opcode,
+        .flags = flags,
+        .name_len = name_len,
+        .aux_len = aux_len,
+        .request_id = request_id,
+        .payload_len = payload_len
+    };
+    unsigned char buf[DFS_HEADER_SIZE];
+    dfs_encode_header(&h, buf);
+
+    struct iovec iov[4] = {
+        { buf, sizeof(buf) },
+        { (void *)name, name_len },
+        { (void *)aux, aux_len },
+        { (void *)head, head_len }
+    };
+    return writev_all(sock, iov, 4);
+}
+
+static inline int dfs_send_request_head(int sock, int opcode, uint32_t request_id, const char *name, const char *aux,
+                                        const void *head, size_t head_len, uint64_t payload_len) {
+    return dfs_send_request_flags(sock, opcode, 0, request_id, name, aux, head, head_len, payload_len);
+}
+
+// Send a request header and its names in one writev. If payload is not
+// NULL the first payload_len bytes of it go out in the same call;
+// otherwise the caller sends the payload itself afterwards.
+static inline int dfs_send_request(int sock, int opcode, uint32_t request_id, const char *name, const char *aux,
+                                   const void *payload, uint64_t payload_len) {
+    return dfs_send_request_head(sock, opcode, request_id, name, aux, payload, payload ? payload_len : 0,
+                                 payload_len);
+}
+
+// Send the reply to req with extra flags (such as DFS_FLAG_PARTIAL).
+// payload works as in dfs_send_request.
+static inline int dfs_send_reply_flags(int sock, const struct dfs_header *req, int status, int flags,
+                                       const void *payload, uint64_t payload_len) {
+    struct dfs_header h = {
+        .opcode = req->opcode,
+        .flags = DFS_FLAG_REPLY | flags,
+        .status = status,
+        .request_id = req->request_id,
+        .payload_len = payload_len
+    };
+    unsigned char buf[DFS_HEADER_SIZE];
+    dfs_encode_header(&h, buf);
+
+    struct iovec iov[2] = {
+        { buf, sizeof(buf) },
+        { (void *)payload, payload ? payload_len : 0 }
+    };
+    return writev_all(sock, iov, 2);
+}
+
+// Send the reply to req. payload works as in dfs_send_request.
+static inline int dfs_send_reply(int sock, const struct dfs_header *req, int status,
+                                 const void *payload, uint64_t payload_len) {
+    return dfs_send_reply_flags(sock, req, status, 0, payload, payload_len);
+}
+
+// Reply with a status and no payload
+static inline int dfs_send_status(int sock, const struct dfs_header *req, int status) {
+    return dfs_send_reply(sock, req, status, NULL, 0);
+}
+
+// Start a chunked reply to req; the chunks follow. flags are added to the
+// reply's own (DFS_FLAG_GZIP for a compressed archive). The header is held
+// back with MSG_MORE to leave with the first chunk.
+static inline int dfs_send_chunked_head(int sock, const struct dfs_header *req, int status, int flags) {
+    struct dfs_header h = {
+        .opcode = req->opcode,
+        .flags = DFS_FLAG_REPLY | DFS_FLAG_CHUNKED | flags,
+        .status = status,
+        .request_id = req->request_id
+    };
+    unsigned char buf[DFS_HEADER_SIZE];
+    dfs_encode_header(&h, buf);
+    return send_all_flags(sock, buf, sizeof(buf), MSG_MORE);
+}
+
+// End a chunked payload
+static inline int dfs_send_chunk_end(int sock) {
+    unsigned char len[8] = { 0 };
+    return send_all(sock, len, sizeof(len));
+}
+
+// Read the length of the next chunk (0 at the end of the payload).
+// Returns 0, or -1 if the connection broke.
+static inline int dfs_recv_chunk_head(int sock, uint64_t *len) {
+    unsigned char buf[8];
+    if (recv_all(sock, buf, sizeof(buf)) < 0)
+        return -1;
+    *len = dfs_get64(buf);
+    return 0;
+}
+
+static inline int dfs_recv_header(int sock, struct dfs_header *h) {
+    unsigned char buf[DFS_HEADER_SIZE];
+    if (recv_all(sock, buf, sizeof(buf)) < 0)
+        return -1;
+    if (dfs_decode_header(buf, h) < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Read the next request and its names (NUL terminated into name and aux,
+// each at least DFS_NAME_MAX + 1 bytes). Returns 0, or -1 on EOF or error.
+static inline int dfs_recv_request(int sock, struct dfs_header *h, char *name, char *aux) {
+    if (dfs_recv_header(sock, h) < 0 ||
+        recv_all(sock, name, h->name_len) < 0 ||
+        recv_all(sock, aux, h->aux_len) < 0)
+        return -1;
+    name[h->name_len] = '\0';
+    aux[h->aux_len] = '\0';
+    return 0;
+}
+
+// Read the reply to a request we sent; anything else means the stream is out of sync
+static inline int dfs_recv_reply(int sock, int opcode, uint32_t request_id, struct dfs_header *h) {
+    if (dfs_recv_header(sock, h) < 0)
+        return -1;
+    if (!(h->flags & DFS_FLAG_REPLY) || h->opcode != opcode || h->request_id != request_id) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Read and throw away a payload we are not going to use, so the next
+// message can be read. Returns 0, or -1 if the connection broke.
+static inline int dfs_skip_payload(int sock, uint64_t len) {
+    char buffer[4096];
+    while (len > 0) {
+        ssize_t n = recv_some(sock, buffer, len < sizeof(buffer) ? len : sizeof(buffer));
+        if (n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read an entire reply payload into a new buffer (NUL terminated for convenience)
+static inline char *dfs_recv_payload(int sock, uint64_t len) {
+    char *buf = malloc(len + 1);
+    if (!buf)
+        return NULL;
+    if (recv_all(sock, buf, len) < 0) {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+#endif /* DFS_PROTO_H */
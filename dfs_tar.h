@@ -0,0 +1,433 @@
+#ifndef DFS_TAR_H
+#define DFS_TAR_H
+
+/*
+ * Tar archives written straight to a socket, shared by S1 and the storage
+ * servers.
+ *
+ * The directory is walked as the archive goes out: each regular file gets
+ * a ustar header (preceded by a pax extended header when its name or size
+ * does not fit ustar's fields) and its contents follow with sendfile().
+ * Nothing is staged on disk and the archive size is never needed, because
+ * the reply uses chunked framing (DFS_FLAG_CHUNKED): one chunk per file,
+ * then the two zero blocks that end a tar archive, then the end marker.
+ * The first bytes leave as soon as the first file is found, however large
+ * the store.  Because each chunk is a complete entry, S1 can merge the
+ * archives of several servers into one by passing on their entry chunks and
+ * ending the result with a trailer of its own.  When the client asks for a
+ * compressed archive, S1 feeds the merged entries through dfs_gzip.h
+ * instead, and its chunks are gzip members rather than entries.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_file.h"
+#include "dfs_journal.h"
+#include "dfs_gzip.h"
+
+#define DFS_TAR_BLOCK 512
+#define DFS_TAR_PATH_MAX 4096            /* Longest archive member name */
+#define DFS_TAR_USTAR_SIZE_MAX 077777777777ULL  /* Largest size in the 12-byte field */
+
+// Archive being written to a socket
+struct dfs_tar {
+    int sock;
+    const char *ext;         // Only files ending in this are archived (NULL for all)
+    const char *since;       // Sync point of an incremental archive (NULL for everything)
+    struct dfs_gzip *gz;     // Compress entries into this instead of sending them (NULL)
+    char path[DFS_TAR_PATH_MAX];  // Directory being walked; shared by every level
+    size_t skip;             // Archive names start this far into path
+    uint64_t bytes;          // Archive bytes sent so far
+    unsigned files;
+};
+
+static inline void dfs_tar_octal(char *field, size_t size, uint64_t value) {
+    snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+}
+
+// Fill in a ustar header block; name must already fit (see dfs_tar_split).
+// The name and prefix fields are not NUL-terminated when full.
+static inline void dfs_tar_block(unsigned char *block, const char *prefix, const char *name,
+                                 const struct stat *st, uint64_t size, char type) {
+    memset(block, 0, DFS_TAR_BLOCK);
+    char *h = (char *)block;
+    memcpy(h, name, strnlen(name, 100));
+    dfs_tar_octal(h + 100, 8, st->st_mode & 07777);
+    dfs_tar_octal(h + 108, 8, st->st_uid & 07777777);
+    dfs_tar_octal(h + 116, 8, st->st_gid & 07777777);
+    dfs_tar_octal(h + 124, 12, size <= DFS_TAR_USTAR_SIZE_MAX ? size : 0);
+    dfs_tar_octal(h + 136, 12, st->st_mtime > 0 ? (uint64_t)st->st_mtime & DFS_TAR_USTAR_SIZE_MAX : 0);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memcpy(h + 345, prefix, strnlen(prefix, 155));
+
+    // The checksum is computed with its own field read as spaces
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < DFS_TAR_BLOCK; i++)
+        sum += block[i];
+    snprintf(h + 148, 8, "%06o", sum);
+}
+
+// Split name into ustar's prefix and name fields. Returns 0, or -1 if it
+// cannot be split so that both fit.
+static inline int dfs_tar_split(const char *name, char *prefix, const char **rest) {
+    size_t len = strlen(name);
+    *prefix = '\0';
+    *rest = name;
+    if (len <= 100)
+        return 0;
+    for (const char *slash = strchr(name, '/'); slash; slash = strchr(slash + 1, '/')) {
+        size_t head = slash - name;
+        if (head <= 155 && len - head - 1 <= 100 && len - head - 1 > 0) {
+            memcpy(prefix, name, head);
+            prefix[head] = '\0';
+            *rest = slash + 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Append a pax record ("<len> key=value\n", len counting itself) to buf
+static inline size_t dfs_tar_pax_record(char *buf, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;  // ' ', '=', '\n'
+    size_t len = body + 1;
+    while (snprintf(NULL, 0, "%zu", len) + body != len)
+        len++;
+    return sprintf(buf, "%zu %s=%s\n", len, key, value);
+}
+
+// Send one entry as a chunk: its header block(s), contents and padding.
+// The contents come from fd, or from data if fd is -1.
+static inline int dfs_tar_entry(struct dfs_tar *tar, const char *name, int fd, const void *data,
+                                const struct stat *st) {
+    uint64_t size = st->st_size;
+    char prefix[156];
+    const char *short_name;
+    char pax[DFS_TAR_PATH_MAX + 128];
+    size_t pax_len = 0;
+    if (dfs_tar_split(name, prefix, &short_name) < 0) {
+        pax_len += dfs_tar_pax_record(pax + pax_len, "path", name);
+        prefix[0] = '\0';
+        short_name = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    }
+    if (size > DFS_TAR_USTAR_SIZE_MAX) {
+        char digits[24];
+        snprintf(digits, sizeof(digits), "%llu", (unsigned long long)size);
+        pax_len += dfs_tar_pax_record(pax + pax_len, "size", digits);
+    }
+
+    // The chunk length, any pax header and the file's header go out together
+    size_t pax_blocks = pax_len ? 1 + (pax_len + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK : 0;
+    size_t head_len = 8 + (pax_blocks + 1) * DFS_TAR_BLOCK;
+    unsigned char head[8 + (2 + (sizeof(pax) + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK) * DFS_TAR_BLOCK];
+    unsigned char *block = head + 8;
+    if (pax_len) {
+        char pax_name[101];
+        snprintf(pax_name, sizeof(pax_name), "PaxHeaders/%.88s", short_name);
+        dfs_tar_block(block, "", pax_name, st, pax_len, 'x');
+        memset(block + DFS_TAR_BLOCK, 0, (pax_blocks - 1) * DFS_TAR_BLOCK);
+        memcpy(block + DFS_TAR_BLOCK, pax, pax_len);
+        block += pax_blocks * DFS_TAR_BLOCK;
+    }
+    dfs_tar_block(block, prefix, short_name, st, size, '0');
+
+    uint64_t padding = (DFS_TAR_BLOCK - size % DFS_TAR_BLOCK) % DFS_TAR_BLOCK;
+    uint64_t chunk = head_len - 8 + size + padding;
+    dfs_put64(head, chunk);
+
+    static const char zeros[DFS_TAR_BLOCK];
+    if (tar->gz) {
+        if (dfs_gzip_write(tar->gz, head + 8, head_len - 8) < 0 ||
+            (fd >= 0 ? dfs_gzip_read_file(tar->gz, fd, 0, size) : dfs_gzip_write(tar->gz, data, size)) < 0 ||
+            dfs_gzip_write(tar->gz, zeros, padding) < 0)
+            return -1;
+    } else if (send_all_flags(tar->sock, head, head_len, size > 0 ? MSG_MORE : 0) < 0 ||
+               (fd >= 0 ? dfs_sendfile_all(tar->sock, fd, 0, size) : send_all(tar->sock, data, size)) < 0 ||
+               send_all(tar->sock, zeros, padding) < 0) {
+        return -1;
+    }
+    tar->bytes += chunk;
+    tar->files++;
+    return 0;
+}
+
+// Send one file as a chunk
+static inline int dfs_tar_file(struct dfs_tar *tar, const char *name, int fd, const struct stat *st) {
+    return dfs_tar_entry(tar, name, fd, NULL, st);
+}
+
+// Send len bytes of data as a file of its own, named name
+static inline int dfs_tar_data(struct dfs_tar *tar, const char *name, const void *data, size_t len) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_uid = getuid();
+    st.st_gid = getgid();
+    st.st_size = len;
+    st.st_mtime = time(NULL);
+    return dfs_tar_entry(tar, name, -1, data, &st);
+}
+
+// Does a file name end in ext?
+static inline int dfs_tar_wanted(const char *name, const char *ext) {
+    size_t len = strlen(name), ext_len = ext ? strlen(ext) : 0;
+    return len > ext_len && strcmp(name + len - ext_len, ext ? ext : "") == 0;
+}
+
+// Send an entry for every wanted file under tar->path. Files that vanish
+// or can't be read are left out. Returns 0, or -1 if the connection broke.
+static inline int dfs_tar_walk(struct dfs_tar *tar) {
+    DIR *dir = opendir(tar->path);
+    if (!dir)
+        return 0;
+
+    size_t len = strlen(tar->path);
+    int rc = 0;
+    struct dirent *entry;
+    while (rc == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (len + 1 + strlen(entry->d_name) >= sizeof(tar->path)) {
+            fprintf(stderr, "Name too long for tar, skipped: %s/%s\n", tar->path, entry->d_name);
+            continue;
+        }
+        snprintf(tar->path + len, sizeof(tar->path) - len, "/%s", entry->d_name);
+
+        struct stat st;
+        if (lstat(tar->path, &st) < 0) {
+            // Removed while we were walking
+        } else if (S_ISDIR(st.st_mode)) {
+            rc = dfs_tar_walk(tar);
+        } else if (S_ISREG(st.st_mode) && dfs_tar_wanted(entry->d_name, tar->ext)) {
+            int fd = open(tar->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+                rc = dfs_tar_file(tar, tar->path + tar->skip, fd, &st);
+            if (fd >= 0)
+                close(fd);
+        }
+        tar->path[len] = '\0';
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Send the files under tar->path that were stored since tar->since (see
+// dfs_journal.h), then the list of those removed and the new cursor.
+// Returns 0, or -1 if the connection broke.
+static inline int dfs_tar_changes(struct dfs_tar *tar) {
+    char journal[1100];
+    snprintf(journal, sizeof(journal), "%s/%s", dfs_journal_root, DFS_JOURNAL_NAME);
+
+    // Read the journal from the sync point up to its current end
+    unsigned char *buf = NULL;
+    uint64_t id = 0, since, start, end = 0;
+    int fd = open(journal, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        id = st.st_ino;
+        end = st.st_size;
+    }
+    dfs_journal_start(tar->since, id, &since, &start);
+    if (start > end)
+        start = end;
+    size_t got = 0;
+    if (fd >= 0 && (buf = malloc(end - start + 1)) != NULL) {
+        while (got < end - start) {
+            ssize_t n = pread(fd, buf + got, end - start - got, start + got);
+            if (n <= 0)
+                break;
+            got += n;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    // Keep the records under the directory for the file type, newest last
+    const char *dir = strlen(tar->path) >= tar->skip ? tar->path + tar->skip : "";
+    const char *ext = tar->ext ? tar->ext : "";
+    size_t dir_len = strlen(dir), ext_len = strlen(ext);
+    struct dfs_change *changes = NULL;
+    size_t count = 0, capacity = 0, pos = 0;
+    while (pos + DFS_JOURNAL_HEADER <= got) {
+        uint16_t len = dfs_get16(buf + pos + 10);
+        if (pos + DFS_JOURNAL_HEADER + len > got)
+            break;  // Still being written; the next sync picks it up
+        const char *path = (const char *)buf + pos + DFS_JOURNAL_HEADER;
+        int wanted = dfs_get64(buf + pos) >= since &&
+                     (dir_len == 0 || (len > dir_len && memcmp(path, dir, dir_len) == 0 && path[dir_len] == '/')) &&
+                     len > ext_len && memcmp(path + len - ext_len, ext, ext_len) == 0;
+        if (wanted && count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            struct dfs_change *grown = realloc(changes, capacity * sizeof(*changes));
+            if (!grown)
+                break;
+            changes = grown;
+        }
+        if (wanted) {
+            changes[count].path = path;
+            changes[count].len = len;
+            changes[count].order = count;
+            count++;
+        }
+        pos += DFS_JOURNAL_HEADER + len;
+    }
+    end = start + pos;
+    if (count > 0)
+        qsort(changes, count, sizeof(*changes), dfs_compare_changes);
+
+    // Whatever is there now goes in the archive, whatever is gone on the list
+    char *deleted = NULL, full_path[DFS_TAR_PATH_MAX];
+    size_t deleted_len = 0;
+    unsigned sent = tar->files;
+    int rc = 0;
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        if (i + 1 < count && changes[i + 1].len == changes[i].len &&
+            memcmp(changes[i + 1].path, changes[i].path, changes[i].len) == 0)
+            continue;  // A later record for the same path follows
+
+        snprintf(full_path, sizeof(full_path), "%.*s/%.*s", (int)tar->skip - 1, tar->path, changes[i].len,
+                 changes[i].path);
+        int file = open(full_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (file >= 0 && fstat(file, &st) == 0 && S_ISREG(st.st_mode)) {
+            rc = dfs_tar_file(tar, full_path + tar->skip, file, &st);
+        } else {
+            char *grown = realloc(deleted, deleted_len + changes[i].len + 2);
+            if (grown) {
+                deleted = grown;
+                memcpy(deleted + deleted_len, changes[i].path, changes[i].len);
+                deleted_len += changes[i].len;
+                deleted[deleted_len++] = '\n';
+            }
+        }
+        if (file >= 0)
+            close(file);
+    }
+    sent = tar->files - sent;
+
+    // Then the list of removed files and where the next sync starts
+    char name[64], cursor[96];
+    int cursor_len = snprintf(cursor, sizeof(cursor), "%s %llu %llu\n", dfs_journal_store,
+                              (unsigned long long)id, (unsigned long long)end);
+    if (rc == 0 && deleted_len > 0) {
+        snprintf(name, sizeof(name), ".dfs/%s.deleted", dfs_journal_store);
+        rc = dfs_tar_data(tar, name, deleted, deleted_len);
+    }
+    if (rc == 0) {
+        snprintf(name, sizeof(name), ".dfs/%s.cursor", dfs_journal_store);
+        rc = dfs_tar_data(tar, name, cursor, cursor_len);
+    }
+    printf("Incremental tar of %s: %zu journal record(s) matched, %u file(s) sent, up to offset %llu\n",
+           dfs_journal_store, count, sent, (unsigned long long)end);
+    free(deleted);
+    free(changes);
+    free(buf);
+    return rc;
+}
+
+// Send the entries of an archive: every wanted file, or for an incremental
+// archive the changes. Returns 0, or -1 if the connection broke.
+static inline int dfs_tar_send_files(struct dfs_tar *tar) {
+    return tar->since ? dfs_tar_changes(tar) : dfs_tar_walk(tar);
+}
+
+// Start an archive of the files under root/subdir (subdir may be NULL or
+// empty) that end in ext (all files if ext is NULL), named relative to root.
+// If since is not NULL the archive holds only what changed after that sync
+// point. Returns NULL if the directory cannot be opened (for a full archive).
+static inline struct dfs_tar *dfs_tar_open(int sock, const char *root, const char *subdir, const char *ext,
+                                           const char *since) {
+    struct dfs_tar *tar = malloc(sizeof(*tar));
+    if (!tar)
+        return NULL;
+    tar->sock = sock;
+    tar->ext = ext;
+    tar->since = since;
+    tar->gz = NULL;
+    tar->bytes = 0;
+    tar->files = 0;
+    tar->skip = strlen(root) + 1;
+    int len = snprintf(tar->path, sizeof(tar->path), "%s%s%s", root, subdir && *subdir ? "/" : "",
+                       subdir ? subdir : "");
+    while (len > 1 && tar->path[len - 1] == '/')
+        tar->path[--len] = '\0';
+
+    // Files removed with their directory still belong in an incremental archive
+    DIR *dir = len < (int)sizeof(tar->path) ? opendir(since ? root : tar->path) : NULL;
+    if (!dir) {
+        free(tar);
+        return NULL;
+    }
+    closedir(dir);
+    return tar;
+}
+
+// Send the two zero blocks that end an archive, then the end marker
+static inline int dfs_tar_end(int sock) {
+    unsigned char trailer[8 + 2 * DFS_TAR_BLOCK] = { 0 };
+    dfs_put64(trailer, 2 * DFS_TAR_BLOCK);
+    if (send_all(sock, trailer, sizeof(trailer)) < 0)
+        return -1;
+    return dfs_send_chunk_end(sock);
+}
+
+// Compressed form of dfs_tar_end: the zero blocks go through gz, which is
+// then flushed and the payload ended
+static inline int dfs_tar_end_gzip(struct dfs_gzip *gz) {
+    static const unsigned char trailer[2 * DFS_TAR_BLOCK];
+    if (dfs_gzip_write(gz, trailer, sizeof(trailer)) < 0)
+        return -1;
+    return dfs_gzip_finish(gz);
+}
+
+// Is this the start of the end-of-archive trailer rather than an entry?
+// Every chunk of a tar reply holds whole entries, so this only needs to
+// look at the first block of a chunk.
+static inline int dfs_tar_is_trailer(const unsigned char *block) {
+    for (int i = 0; i < DFS_TAR_BLOCK; i++) {
+        if (block[i])
+            return 0;
+    }
+    return 1;
+}
+
+// Reply to req with a tar archive of the files under root/subdir ending in
+// ext, or of what changed there since a sync point (see dfs_tar_open).
+// Returns 1 if sent, 0 if the directory could not be opened (an error
+// status was sent instead), or -1 if the connection broke mid-archive and
+// must be dropped.
+static inline int dfs_send_tar(int sock, const struct dfs_header *req, const char *root, const char *subdir,
+                               const char *ext, const char *since) {
+    struct dfs_tar *tar = dfs_tar_open(sock, root, subdir, ext, since);
+    if (!tar) {
+        perror("Error opening directory for tar");
+        return dfs_send_status(sock, req, DFS_ENOENT) == 0 ? 0 : -1;
+    }
+
+    int rc = dfs_send_chunked_head(sock, req, DFS_OK, 0);
+    if (rc == 0)
+        rc = dfs_tar_send_files(tar);
+    if (rc == 0)
+        rc = dfs_tar_end(sock);
+    if (rc < 0)
+        perror("Error sending tar archive");
+    else
+        printf("Sent %star archive of %u file(s) under %s (%llu bytes)\n", since ? "incremental " : "",
+               tar->files, tar->path, (unsigned long long)(tar->bytes + 2 * DFS_TAR_BLOCK));
+    free(tar);
+    return rc < 0 ? -1 : 1;
+}
+
+#endif /* DFS_TAR_H */
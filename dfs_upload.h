@@ -0,0 +1,379 @@
+#ifndef DFS_UPLOAD_H
+#define DFS_UPLOAD_H
+
+/*
+ * Resumable uploads, shared by S1 (for .c files) and the storage servers.
+ *
+ * A file arrives as parts (DFS_OP_UPLOAD_PART), each written with pwrite()
+ * at its own offset into a staging file next to the target that is
+ * preallocated to the full size:
+ *
+ *   dir/.name.<id>.upload   the data received so far
+ *   dir/.name.<id>.ranges   one 16-byte (offset, length) record per stretch of data
+ *
+ * Parts can come in any order and over several connections at once.  The
+ * committed offset is where the data received contiguously from byte 0
+ * ends; a client whose connection dropped asks for it (DFS_OP_UPLOAD_QUERY)
+ * and sends only what comes after.  Bytes of a part that was cut off are
+ * kept too.  DFS_OP_UPLOAD_COMMIT renames the staging file over the target
+ * once every byte is there, so nobody ever sees a half-written file.
+ *
+ *   dir/.name.done          the id of the upload last committed to name
+ *
+ * A client that missed the reply to its commit sends it again; by then the
+ * staging files are gone, and the marker, which also holds the inode the
+ * commit produced, tells whether the file there is this upload's.  The
+ * marker goes when the file is removed or replaced by a plain upload.
+ *
+ * Nothing else cleans up after a client that gives up on an upload, so
+ * every server sweeps its store from a thread of its own: staging files
+ * and markers untouched for DFS_UPLOAD_STALE_S are removed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_file.h"
+#include "dfs_journal.h"
+
+#define DFS_UPLOAD_RECORD_SIZE 16
+#define DFS_UPLOAD_STALE_S (24 * 3600)  /* Age at which staging files and markers are swept away */
+#define DFS_UPLOAD_SWEEP_S 3600         /* How often a store is swept */
+
+// Names of the staging files for an upload to path
+static inline void dfs_upload_paths(const char *path, uint64_t id, char *data_path, char *ranges_path, size_t size) {
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+    snprintf(data_path, size, "%.*s.%s.%016llx.upload", dir_len, path, path + dir_len, (unsigned long long)id);
+    snprintf(ranges_path, size, "%.*s.%s.%016llx.ranges", dir_len, path, path + dir_len, (unsigned long long)id);
+}
+
+// Name of the marker left by the last upload committed to path
+static inline void dfs_upload_done_path(const char *path, char *done_path, size_t size) {
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+    snprintf(done_path, size, "%.*s.%s.done", dir_len, path, path + dir_len);
+}
+
+// Drop the marker of the upload last committed to path, once the file
+// there is removed or replaced by a plain upload
+static inline void dfs_upload_forget(const char *path) {
+    char done_path[1100];
+    dfs_upload_done_path(path, done_path, sizeof(done_path));
+    unlink(done_path);
+}
+
+// Whether name is that of a staging file or a marker
+static inline int dfs_upload_is_staging(const char *name) {
+    static const char *suffixes[] = { ".upload", ".ranges", ".done" };
+    size_t len = strlen(name);
+    for (size_t i = 0; name[0] == '.' && i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t n = strlen(suffixes[i]);
+        if (len > n + 1 && strcmp(name + len - n, suffixes[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Remove the staging files and markers under dir that nothing has touched
+// for DFS_UPLOAD_STALE_S before now. Returns how many were removed.
+static inline int dfs_upload_sweep(const char *dir, time_t now) {
+    DIR *d = opendir(dir);
+    if (!d)
+        return 0;
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char path[4096];
+        struct stat st;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (size_t)snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= sizeof(path) ||
+            lstat(path, &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            removed += dfs_upload_sweep(path, now);
+        else if (S_ISREG(st.st_mode) && dfs_upload_is_staging(entry->d_name) &&
+                 now - st.st_mtime >= DFS_UPLOAD_STALE_S && unlink(path) == 0)
+            removed++;
+    }
+    closedir(d);
+    return removed;
+}
+
+static inline void *dfs_upload_sweeper(void *root) {
+    for (;;) {
+        int removed = dfs_upload_sweep(root, time(NULL));
+        if (removed > 0)
+            printf("Removed %d abandoned upload file(s) from %s\n", removed, (const char *)root);
+        sleep(DFS_UPLOAD_SWEEP_S);
+    }
+    return NULL;
+}
+
+// Sweep the store at root now and every DFS_UPLOAD_SWEEP_S, from a thread
+// of its own
+static inline void dfs_upload_sweep_start(const char *root) {
+    pthread_t thread;
+    char *copy = strdup(root);
+    if (!copy || pthread_create(&thread, NULL, dfs_upload_sweeper, copy) != 0) {
+        perror("Could not start sweeping abandoned uploads");
+        free(copy);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static inline int dfs_compare_ranges(const void *a, const void *b) {
+    uint64_t x = ((const uint64_t *)a)[0], y = ((const uint64_t *)b)[0];
+    return (x > y) - (x < y);
+}
+
+// Where the data received contiguously from byte 0 ends, according to the
+// ranges log (0 if there is none yet)
+static inline uint64_t dfs_upload_committed(const char *ranges_path) {
+    int fd = open(ranges_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    size_t count = fstat(fd, &st) == 0 ? st.st_size / DFS_UPLOAD_RECORD_SIZE : 0;
+    unsigned char *raw = malloc(count * DFS_UPLOAD_RECORD_SIZE + 1);
+    uint64_t (*ranges)[2] = malloc(count * sizeof(*ranges) + 1);
+    size_t got = 0;
+    while (raw && got < count * DFS_UPLOAD_RECORD_SIZE) {
+        ssize_t n = pread(fd, raw + got, count * DFS_UPLOAD_RECORD_SIZE - got, got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    if (!raw || !ranges) {
+        free(raw);
+        free(ranges);
+        return 0;
+    }
+
+    count = got / DFS_UPLOAD_RECORD_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        ranges[i][0] = dfs_get64(raw + i * DFS_UPLOAD_RECORD_SIZE);
+        ranges[i][1] = dfs_get64(raw + i * DFS_UPLOAD_RECORD_SIZE + 8);
+    }
+    qsort(ranges, count, sizeof(*ranges), dfs_compare_ranges);
+
+    uint64_t end = 0;
+    for (size_t i = 0; i < count && ranges[i][0] <= end; i++) {
+        if (ranges[i][0] + ranges[i][1] > end)
+            end = ranges[i][0] + ranges[i][1];
+    }
+    free(raw);
+    free(ranges);
+    return end;
+}
+
+// Add a stretch of received data to the ranges log. Each record goes out
+// in a single O_APPEND write, so parts finishing at the same time don't
+// interleave. Returns 0, or -1 on error.
+static inline int dfs_upload_record(const char *ranges_path, uint64_t offset, uint64_t len) {
+    if (len == 0)
+        return 0;
+    int fd = open(ranges_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    unsigned char record[DFS_UPLOAD_RECORD_SIZE];
+    dfs_put64(record, offset);
+    dfs_put64(record + 8, len);
+    int rc = write_all(fd, record, sizeof(record));
+    if (close(fd) != 0)
+        rc = -1;
+    return rc;
+}
+
+// Open the staging file for an upload of total bytes, creating it at full
+// size if this is the first part. Returns the descriptor, or -1 (errno is
+// EINVAL if a staging file of another size is already there).
+static inline int dfs_upload_open(const char *data_path, uint64_t total) {
+    int fd = open(data_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        goto fail;
+    if ((uint64_t)st.st_size == total)
+        return fd;
+    if (st.st_size == 0) {
+        // Reserve the whole file so parts can land anywhere in it
+        if (posix_fallocate(fd, 0, total) != 0 && ftruncate(fd, total) < 0)
+            goto fail;
+        return fd;
+    }
+    errno = EINVAL;
+fail:
+    if (fd >= 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return -1;
+}
+
+// Receive the len data bytes of a part into the staging file.
+// Returns DFS_OK, DFS_EINVAL or DFS_EIO (the data is still consumed), or -1
+// if the connection broke; whatever did arrive is kept and counted.
+static inline int dfs_upload_part(int sock, const struct dfs_upload *up, uint64_t len,
+                                  const char *data_path, const char *ranges_path) {
+    int status = DFS_OK, fd = -1;
+    if (up->offset > up->total || len > up->total - up->offset) {
+        status = DFS_EINVAL;
+    } else if ((fd = dfs_upload_open(data_path, up->total)) < 0) {
+        status = errno == EINVAL ? DFS_EINVAL : DFS_EIO;
+        perror("Error opening upload staging file");
+    }
+
+    char buffer[DFS_CHUNK_SIZE];
+    uint64_t done = 0, written = 0;
+    while (done < len) {
+        ssize_t n = recv_some(sock, buffer, len - done < sizeof(buffer) ? len - done : sizeof(buffer));
+        if (n <= 0)
+            break;
+        // After a write error keep reading, so the stream stays in sync
+        if (status == DFS_OK) {
+            if (pwrite_all(fd, buffer, n, up->offset + done) < 0) {
+                perror("Error writing upload staging file");
+                status = DFS_EIO;
+            } else {
+                written += n;
+            }
+        }
+        done += n;
+    }
+
+    if (fd >= 0) {
+        if (close(fd) != 0)
+            status = DFS_EIO;
+        if (dfs_upload_record(ranges_path, up->offset, written) < 0) {
+            perror("Error recording upload progress");
+            status = DFS_EIO;
+        }
+    }
+    return done < len ? -1 : status;
+}
+
+// Replace the ranges log of a committed upload with the marker saying
+// that the file now at path is the upload's
+static inline void dfs_upload_mark(const char *path, const struct dfs_upload *up, const char *ranges_path) {
+    char done_path[1100];
+    unsigned char mark[16];
+    struct stat st;
+    dfs_upload_done_path(path, done_path, sizeof(done_path));
+    int fd = stat(path, &st) == 0 ? open(ranges_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : -1;
+    dfs_put64(mark, up->id);
+    dfs_put64(mark + 8, fd >= 0 ? (uint64_t)st.st_ino : 0);
+    int rc = fd >= 0 ? write_all(fd, mark, sizeof(mark)) : -1;
+    if (fd >= 0 && close(fd) != 0)
+        rc = -1;
+    if (rc < 0 || rename(ranges_path, done_path) != 0)
+        unlink(ranges_path);
+}
+
+// Whether the file at path is what this upload committed
+static inline int dfs_upload_was_committed(const char *path, const struct dfs_upload *up) {
+    char done_path[1100];
+    unsigned char mark[16];
+    struct stat st;
+    dfs_upload_done_path(path, done_path, sizeof(done_path));
+    int fd = open(done_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int same = pread(fd, mark, sizeof(mark), 0) == (ssize_t)sizeof(mark) && stat(path, &st) == 0 &&
+               dfs_get64(mark) == up->id && dfs_get64(mark + 8) == (uint64_t)st.st_ino &&
+               (uint64_t)st.st_size == up->total;
+    close(fd);
+    return same;
+}
+
+// Move a finished upload into place, first syncing it to disk if sync is
+// set. Returns DFS_OK, DFS_EINVAL if parts are still missing, or DFS_EIO.
+static inline int dfs_upload_commit(const char *path, const struct dfs_upload *up, uint64_t committed,
+                                    const char *data_path, const char *ranges_path, int sync) {
+    struct stat st;
+    if (stat(data_path, &st) < 0 && dfs_upload_was_committed(path, up))
+        return DFS_OK;  // Already committed; the client just missed our reply
+
+    if (committed < up->total)
+        return DFS_EINVAL;
+    if (up->total == 0) {
+        int fd = dfs_upload_open(data_path, 0);  // No parts were needed
+        if (fd >= 0)
+            close(fd);
+    }
+    int fd = sync ? open(data_path, O_RDWR | O_CLOEXEC) : -1;
+    if (sync && (fd < 0 || fsync(fd) != 0)) {
+        perror("Error syncing upload");
+        if (fd >= 0)
+            close(fd);
+        return DFS_EIO;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (rename(data_path, path) != 0 || (sync && dfs_sync_dir(path) < 0)) {
+        perror("Error committing upload");
+        return DFS_EIO;
+    }
+    dfs_upload_mark(path, up, ranges_path);
+    dfs_journal_note(path, '+');
+    dfs_index_note(path);
+    printf("Committed upload of %llu bytes to %s\n", (unsigned long long)up->total, path);
+    return DFS_OK;
+}
+
+// Reply to an upload request with its status and the committed offset
+static inline int dfs_send_committed(int sock, const struct dfs_header *req, int status, uint64_t committed) {
+    unsigned char reply[8];
+    dfs_put64(reply, committed);
+    return dfs_send_reply(sock, req, status, reply, sizeof(reply));
+}
+
+// Serve an UPLOAD_PART, UPLOAD_QUERY or UPLOAD_COMMIT request for the file
+// at path. Every reply carries the committed offset. Returns 1 if the
+// connection can be reused, 0 if it broke.
+static inline int dfs_serve_upload(int sock, const struct dfs_header *req, const char *path) {
+    unsigned char desc[DFS_UPLOAD_DESC_SIZE];
+    if (req->payload_len < sizeof(desc))
+        return dfs_skip_payload(sock, req->payload_len) == 0 && dfs_send_committed(sock, req, DFS_EINVAL, 0) == 0;
+    if (recv_all(sock, desc, sizeof(desc)) < 0)
+        return 0;
+
+    struct dfs_upload up;
+    dfs_decode_upload(desc, &up);
+    uint64_t len = req->payload_len - sizeof(desc);
+
+    char data_path[1100], ranges_path[1100];
+    dfs_upload_paths(path, up.id, data_path, ranges_path, sizeof(data_path));
+
+    int status = DFS_OK;
+    if (req->opcode == DFS_OP_UPLOAD_PART)
+        status = dfs_upload_part(sock, &up, len, data_path, ranges_path);
+    else if (dfs_skip_payload(sock, len) < 0)
+        status = -1;
+    if (status < 0)
+        return 0;
+
+    uint64_t committed = dfs_upload_committed(ranges_path);
+    if (req->opcode == DFS_OP_UPLOAD_COMMIT && status == DFS_OK) {
+        status = dfs_upload_commit(path, &up, committed, data_path, ranges_path, req->flags & DFS_FLAG_SYNC);
+        if (status == DFS_OK)
+            committed = up.total;
+    }
+
+    return dfs_send_committed(sock, req, status, committed) == 0;
+}
+
+#endif /* DFS_UPLOAD_H */
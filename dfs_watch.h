@@ -0,0 +1,104 @@
+#ifndef DFS_WATCH_H
+#define DFS_WATCH_H
+
+/*
+ * Change notifications from a storage server to S1, for S1's listing cache.
+ *
+ * S1 sends WATCH on a connection of its own.  A server whose store is
+ * indexed (dfs_index.h) answers with a chunked reply that never ends: one
+ * chunk per change, '+' and the path of the entry that changed, relative to
+ * the store, or just '*' when anything may have changed, which is also the
+ * first chunk.  Without an index there is nothing to follow, and the
+ * server answers DFS_EUNAVAIL instead.
+ *
+ * Notifications are sent without waiting.  A subscriber that cannot take
+ * one at once is dropped, and S1, finding the connection closed, forgets
+ * what it has cached and asks again.  The same happens to every subscriber
+ * when the server stops indexing.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_index.h"
+#include "dfs_pool.h"
+
+#define DFS_WATCH_MAX 8  /* Subscribers at once (one per S1 instance) */
+
+static struct {
+    pthread_mutex_t lock;
+    int socks[DFS_WATCH_MAX];
+    int count;
+} dfs_watch = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Send one notification to every subscriber, dropping any that would block
+static inline void dfs_watch_send(char kind, const char *path) {
+    unsigned char msg[8 + 1 + DFS_NAME_MAX];
+    size_t len = path ? strlen(path) : 0;
+    if (len > DFS_NAME_MAX)
+        len = DFS_NAME_MAX;
+    dfs_put64(msg, 1 + len);
+    msg[8] = kind;
+    if (len)
+        memcpy(msg + 9, path, len);
+
+    pthread_mutex_lock(&dfs_watch.lock);
+    for (int i = 0; i < dfs_watch.count; ) {
+        if (send(dfs_watch.socks[i], msg, 9 + len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)(9 + len)) {
+            i++;
+            continue;
+        }
+        fprintf(stderr, "Dropping a change subscriber that is not keeping up\n");
+        close(dfs_watch.socks[i]);
+        dfs_watch.socks[i] = dfs_watch.socks[--dfs_watch.count];
+    }
+    pthread_mutex_unlock(&dfs_watch.lock);
+}
+
+// dfs_index_changed for a server with subscribers
+static inline void dfs_watch_changed(const char *path) {
+    if (path) {
+        dfs_watch_send('+', path);
+        return;
+    }
+    if (dfs_index.top) {
+        dfs_watch_send('*', NULL);
+        return;
+    }
+
+    // No index any more: nothing left to follow
+    pthread_mutex_lock(&dfs_watch.lock);
+    while (dfs_watch.count > 0)
+        close(dfs_watch.socks[--dfs_watch.count]);
+    pthread_mutex_unlock(&dfs_watch.lock);
+}
+
+// Serve a WATCH request: keep the connection for notifications from now on.
+// Returns POOL_DETACHED once the socket is a subscriber's, 1 if the request
+// was refused, or 0 if the connection broke.
+static inline int dfs_watch_serve(int sock, const struct dfs_header *req) {
+    // Holding the index still, no change falls between '*' and the next one
+    pthread_rwlock_rdlock(&dfs_index.lock);
+    pthread_mutex_lock(&dfs_watch.lock);
+    int rc;
+    if (!dfs_index.top || dfs_watch.count == DFS_WATCH_MAX) {
+        rc = dfs_send_status(sock, req, DFS_EUNAVAIL) == 0;
+    } else {
+        unsigned char first[9] = { 0 };
+        dfs_put64(first, 1);
+        first[8] = '*';
+        rc = dfs_send_chunked_head(sock, req, DFS_OK, 0) == 0 && send_all(sock, first, sizeof(first)) == 0 ? POOL_DETACHED : 0;
+        if (rc == POOL_DETACHED)
+            dfs_watch.socks[dfs_watch.count++] = sock;
+    }
+    pthread_mutex_unlock(&dfs_watch.lock);
+    pthread_rwlock_unlock(&dfs_index.lock);
+    return rc;
+}
+
+#endif /* DFS_WATCH_H */
@@ -1,25 +1,45 @@
+#define _GNU_SOURCE  /* accept4, MAP_STACK */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <dirent.h>    /* For DIR, struct dirent, opendir(), readdir(), closedir() */
 #include <sys/types.h> /* For additional type definitions */
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_file.h"
+#include "dfs_upload.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_find.h"
+#include "dfs_catalog.h"
+#include "dfs_cluster.h"
 
 #define PORT 3030
 #define BUFFER_SIZE 4096
-#define S2_PORT 3032
-#define S3_PORT 3034
-#define S4_PORT 3036
-#define MAX_FILES 1000  /* Maximum number of files to process */
+#define LIST_DEADLINE_MS 2000  /* How long each storage server has to answer a listing */
+#define LISTEN_BACKLOG SOMAXCONN
 
-// Function prototypes
-void send_c_tar(int client_sock);
-int stream_tar_from_server(int client_sock, const char *filetype, int server_port);
+void resolve_path(const char *input_path, char *resolved_path, size_t resolved_size);
+int remove_from_node(const struct dfs_node *node, const char *path, int flags);
+static void rebalance_repair(void);
 
 // Function to create directories recursively
 void create_directories(const char *path) {
@@ -38,65 +58,646 @@ void create_directories(const char *path) {
     mkdir(tmp, 0777); // Create the final directory
 }
 
-// Function to save data locally to a specified path
-void save_locally(const char *filename, const char *data, int size, const char *dest_path) {
-    const char *home = getenv("HOME");
-    char full_path[1024];
-
-    // Resolve destination path
-    if (dest_path[0] == '~')
-        snprintf(full_path, sizeof(full_path), "%s%s", home, dest_path + 1);
-    else
-        snprintf(full_path, sizeof(full_path), "%s/S1/%s", home, dest_path);
+// Work out where an upload of filename to dest_path is stored locally,
+// creating the directories on the way.
+void local_upload_path(const char *filename, const char *dest_path, char *file_path, size_t size) {
+    resolve_path(dest_path, file_path, size);  // As downloads resolve it
+    create_directories(file_path); // Create necessary directories
 
-    create_directories(full_path); // Create necessary directories
+    size_t len = strlen(file_path);
+    snprintf(file_path + len, size - len, "/%s", filename);
+}
 
+// Function to save an uploaded file locally to a specified path, writing it as it arrives.
+// Returns DFS_OK, DFS_EIO, or -1 if the client connection broke.
+int save_locally(int client_sock, const char *filename, uint64_t size, const char *dest_path) {
     char file_path[1024];
-    snprintf(file_path, sizeof(file_path), "%s/%s", full_path, filename);
-
-    // Open file for writing
-    FILE *fp = fopen(file_path, "wb");
-    if (fp) {
-        fwrite(data, 1, size, fp); // Write data to file
-        fclose(fp);
+    local_upload_path(filename, dest_path, file_path, sizeof(file_path));
+
+    // Write the file data to disk as it arrives
+    int status = dfs_recv_file(client_sock, file_path, size);
+    if (status == DFS_OK) {
+        dfs_journal_note(file_path, '+');
+        dfs_index_note(file_path);
+        dfs_upload_forget(file_path);  // A plain upload leaves no upload to commit again
         printf("Stored .c file at %s\n", file_path);
-    } else {
-        perror("Error writing .c file"); // Error handling for file write
     }
+    return status;
 }
 
-// Function to forward file data to a specified server
-void forward_to_server(const char *filename, const char *data, int size, const char *dest_path, int server_port, const char *server_name) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket to server failed");
-        return;
+/* ===== PLACEMENT ===== */
+
+static int replica_count = 1;  /* Copies of each file the cluster map places (-R) */
+static int write_quorum;       /* Copies on disk before an upload is acknowledged (-W) */
+
+// The name of node id, for log messages
+static const char *node_name(int id) {
+    const struct dfs_node *n = dfs_cluster_node(id);
+    return id == DFS_CLUSTER_LOCAL ? "S1" : n ? n->name : "an unknown node";
+}
+
+// The names of the count nodes in nodes, for log messages
+static const char *node_names(const int *nodes, int count, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < count && len < size; i++)
+        len += snprintf(buf + len, size - len, "%s%s", i ? ", " : "", node_name(nodes[i]));
+    return buf;
+}
+
+// Where a new file at path (relative to the stores) is stored: S1 keeps .c
+// files, and the cluster map places the rest (dfs_cluster.h), on
+// replica_count nodes where it has that many for the type. This is the
+// one placement policy: everything else finds a file through the catalog,
+// and falls back on this only for a file the catalog does not have.
+// Fills nodes (DFS_CATALOG_COPIES at most) with the nodes' ids, the first
+// in placement order first, and returns how many there are, 0 for a type
+// no node stores.
+static int place_file(const char *path, int *nodes) {
+    const char *ext = strrchr(path, '.');
+    if (ext && strcmp(ext, ".c") == 0) {
+        nodes[0] = DFS_CLUSTER_LOCAL;
+        return 1;
+    }
+    struct dfs_node *best[DFS_CATALOG_COPIES];
+    int count = dfs_cluster_place_n(path, best, replica_count);
+    for (int i = 0; i < count; i++)
+        nodes[i] = best[i]->id;
+    return count;
+}
+
+// The path of a file or directory relative to the stores, with empty and
+// "." components dropped: "~S1/a//b.c", "~/S1/a/b.c", "$HOME/S1/a/b.c" and
+// "a/./b.c" are all "a/b.c". Returns -1 for a path outside the stores.
+static int store_relative(const char *path, char *rel, size_t size) {
+    char prefix[1024];
+    snprintf(prefix, sizeof(prefix), "%s/S1", getenv("HOME"));
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(path, "~/S1", 4) == 0 && (path[4] == '/' || path[4] == '\0'))
+        path += 4;
+    else if (strncmp(path, "~S1", 3) == 0 && (path[3] == '/' || path[3] == '\0'))
+        path += 3;
+    else if (strncmp(path, prefix, prefix_len) == 0 && (path[prefix_len] == '/' || path[prefix_len] == '\0'))
+        path += prefix_len;
+    else if (path[0] == '/' || path[0] == '~')
+        return -1;
+
+    size_t len = 0;
+    while (*path) {
+        size_t n = strcspn(path, "/");
+        if (n == 2 && strncmp(path, "..", 2) == 0)
+            return -1;
+        if (n > 0 && !(n == 1 && path[0] == '.')) {
+            if (len + (len > 0) + n >= size)
+                return -1;
+            if (len > 0)
+                rel[len++] = '/';
+            memcpy(rel + len, path, n);
+            len += n;
+        }
+        path += n + (path[n] == '/');
+    }
+    rel[len] = '\0';
+    return 0;
+}
+
+// Where the file at path is: the nodes in the map the catalog has copies
+// on, or else the ones the placement policy would have put it on. Fills
+// nodes as place_file() does and returns how many there are (0 if no node
+// would have it). key receives its catalog key, "" if it cannot have one;
+// version its version in the catalog, 0 if the catalog does not have it.
+static int locate_file(const char *path, char *key, size_t size, uint64_t *version, int *nodes) {
+    struct dfs_catalog_info info;
+    *version = 0;
+    if (store_relative(path, key, size) < 0) {
+        key[0] = '\0';
+        return place_file(path, nodes);
     }
+    int count = 0;
+    if (dfs_catalog_lookup(key, &info)) {
+        for (int i = 0; i < info.copies; i++) {
+            if (info.nodes[i] == DFS_CLUSTER_LOCAL || dfs_cluster_node(info.nodes[i]))
+                nodes[count++] = info.nodes[i];
+        }
+    }
+    if (count > 0) {
+        *version = info.version;
+        return count;
+    }
+    return place_file(key, nodes);
+}
 
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(server_port);
-    serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+// CRC-32 and size of the file at path. Returns -1 if it cannot be read.
+static int file_crc32(const char *path, uint32_t *crc, uint64_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    char buffer[DFS_CHUNK_SIZE];
+    ssize_t n;
+    *crc = crc32(0, NULL, 0);
+    *size = 0;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        *crc = crc32(*crc, (const unsigned char *)buffer, n);
+        *size += n;
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
 
-    // Connect to the server
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection to server failed");
+// The catalog key of filename uploaded to dest_path. Returns -1 if it
+// would be outside the stores.
+static int upload_key(const char *filename, const char *dest_path, char *key, size_t size) {
+    char joined[2 * DFS_NAME_MAX + 2];
+    snprintf(joined, sizeof(joined), "%s/%s", dest_path, filename);
+    return store_relative(joined, key, size);
+}
+
+// Record in the catalog that the file at key was stored on the count nodes
+// in nodes: size bytes with CRC-32 *crc, or no known CRC if crc is NULL.
+// S1's own files are read back for both. Returns the file's new version,
+// or 0 if it was not recorded.
+static int64_t catalog_stored(const char *key, const int *nodes, int count, uint64_t size, const uint32_t *crc) {
+    uint32_t sum = crc ? *crc : 0;
+    int has_checksum = crc != NULL;
+    if (nodes[0] == DFS_CLUSTER_LOCAL) {
+        char file_path[2048];
+        snprintf(file_path, sizeof(file_path), "%s/S1/%s", getenv("HOME"), key);
+        if (file_crc32(file_path, &sum, &size) < 0)
+            return 0;
+        has_checksum = 1;
+    }
+    int64_t version = dfs_catalog_put(key, nodes, count, size, sum, has_checksum);
+    char names[256];
+    if (version > 0)
+        printf("Catalogued %s on %s (version %lld)\n", key, node_names(nodes, count, names, sizeof(names)),
+               (long long)version);
+    return version > 0 ? version : 0;
+}
+
+// DFS_FLAG_MOVED if the catalog still has the file at key, so that removing
+// one of its copies is no deletion; 0 if it does not
+static int catalog_moved_flag(const char *key) {
+    struct dfs_catalog_info info;
+    return dfs_catalog_lookup(key, &info) ? DFS_FLAG_MOVED : 0;
+}
+
+// Remove the copies that old, the catalog entry of key before it was
+// stored again, had on nodes other than the count in keep: the ones the
+// cluster map no longer places it on
+static void remove_old_copies(const char *key, const struct dfs_catalog_info *old, const int *keep, int count) {
+    for (int i = 0; i < old->copies; i++) {
+        const struct dfs_node *stale = dfs_cluster_node(old->nodes[i]);
+        int kept = 0;
+        for (int k = 0; k < count; k++)
+            kept |= keep[k] == old->nodes[i];
+        if (!kept && stale && remove_from_node(stale, key, DFS_FLAG_MOVED) == DFS_OK)
+            printf("Removed the old copy of %s from %s\n", key, stale->name);
+    }
+}
+
+/* ===== BACKEND CONNECTION POOL ===== */
+
+/*
+ * Connections to S2/S3/S4 are kept open and reused instead of doing a full
+ * connect/close per operation.  Every exchange with a backend is framed (the
+ * response size or count is known up front, and UPLOAD is acknowledged), so
+ * a connection whose exchange completed can go back to the pool.  Any error
+ * or partially read response closes the connection instead.
+ *
+ * Pools are per process: per client in fork mode, per worker in epoll mode.
+ */
+#define POOL_MAX_IDLE 8      /* Idle connections kept per backend */
+#define POOL_PING_AFTER 10   /* Seconds idle before a connection is re-checked with PING */
+
+struct pooled_conn {
+    int sock;
+    time_t last_used;
+};
+
+struct backend_pool {
+    int count;
+    struct pooled_conn idle[POOL_MAX_IDLE];
+};
+
+static struct backend_pool backend_pools[DFS_CLUSTER_MAX];  /* In the cluster map's order */
+
+static void fiber_forget(int fd);
+
+static struct backend_pool *find_backend_pool(const struct dfs_node *node) {
+    return &backend_pools[node - dfs_cluster.nodes];
+}
+
+// An idle connection must have nothing to read; after a long idle spell
+// the backend must also answer a PING
+static int backend_is_healthy(const struct pooled_conn *pc) {
+    char byte;
+    ssize_t n = recv(pc->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n >= 0)
+        return 0;  // Closed by the backend, or stray bytes left in the stream
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return 0;
+    if (time(NULL) - pc->last_used < POOL_PING_AFTER)
+        return 1;
+
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    return dfs_send_request(pc->sock, DFS_OP_PING, id, NULL, NULL, NULL, 0) == 0 &&
+           dfs_recv_reply(pc->sock, DFS_OP_PING, id, &reply) == 0 && reply.status == DFS_OK;
+}
+
+// Get a connection to a backend, reusing an idle one when possible
+int backend_acquire(const struct dfs_node *node) {
+    struct backend_pool *pool = find_backend_pool(node);
+    while (pool->count > 0) {
+        struct pooled_conn pc = pool->idle[--pool->count];  // Most recently used first
+        if (backend_is_healthy(&pc))
+            return pc.sock;
+        close(pc.sock);
+    }
+    return connect_to_addr(&node->addr);
+}
+
+// Return a connection whose last exchange completed cleanly
+void backend_release(const struct dfs_node *node, int sock) {
+    struct backend_pool *pool = find_backend_pool(node);
+    fiber_forget(sock);
+    if (pool->count == POOL_MAX_IDLE) {
         close(sock);
         return;
     }
+    pool->idle[pool->count].sock = sock;
+    pool->idle[pool->count].last_used = time(NULL);
+    pool->count++;
+}
+
+/* ===== REPLICATION ===== */
+
+/*
+ * Each file of a type the cluster map places is stored on replica_count
+ * nodes (s1 -R), the first ones in its placement order.  An upload goes to
+ * all of them at once: every chunk from the client is passed on to each
+ * node still taking part, and a node that breaks off is dropped.  With more
+ * than one copy the nodes sync the file to disk before they answer
+ * (DFS_FLAG_SYNC), and the client has its reply as soon as write_quorum of
+ * them have stored it (s1 -W, a majority by default), with the file in the
+ * catalog on those nodes.  The connections of the nodes still storing it
+ * go to the rebalancer (SCM_RIGHTS over a socket pair), which gives each up
+ * to REPLICA_LAG_MS and catalogues the copy once it is stored, so a slow
+ * node never holds up the client's next request.  A node that does not
+ * make it is left out, and the rebalancer copies the file to it later.
+ *
+ * An upload that misses its quorum is refused, and the catalog keeps the
+ * file as it was, on the nodes the upload did not write to: an old copy it
+ * may have overwritten is dropped and made again by the rebalancer.  The
+ * copies the upload made are handed to the rebalancer to remove.  Only if
+ * it left no old copy is the new file catalogued as it is.
+ *
+ * Reads go to the copies in turn, and fall back on the next copy when a
+ * node cannot be reached or does not have the file; a copy found missing
+ * is dropped from the catalog, for the rebalancer to replace.  Removals go
+ * to every copy.
+ */
+#define REPLICA_LAG_MS 10000  /* How long the copies after the quorum have to be stored */
+
+// A copy of an upload handed to the rebalancer, with the socket of the
+// node still storing it, or without one for a copy to remove
+struct replica_handoff {
+    int node;
+    int opcode;                  /* The request the node is to answer */
+    uint32_t id;
+    int64_t version;             /* Catalogue the copy under this version; -1: remove it, 0: neither */
+    char key[DFS_NAME_MAX + 1];
+};
+
+static int replica_handoff_sock[2] = { -1, -1 };  /* [0] the rebalancer's end, [1] everyone else's */
+
+// One node's part in an upload
+struct replica {
+    const struct dfs_node *node;
+    int sock;                    /* -1 once it has answered or been given up on */
+    uint32_t id;
+    int answered;
+    int status;                  /* Its answer, DFS_EUNAVAIL without one */
+    uint64_t committed;          /* The committed offset in its answer, for a resumable upload */
+};
+
+// Read the answer of a node whose socket is readable. Returns -1 if the
+// connection broke.
+static int replica_read(struct replica *r, int opcode) {
+    struct dfs_header reply;
+    unsigned char offset[8];
+    if (dfs_recv_reply(r->sock, opcode, r->id, &reply) < 0 ||
+        (reply.payload_len == sizeof(offset) ? recv_all(r->sock, offset, sizeof(offset))
+                                             : dfs_skip_payload(r->sock, reply.payload_len)) < 0) {
+        fprintf(stderr, "Forwarding to %s failed: %s\n", r->node->name, strerror(errno));
+        close(r->sock);
+        r->sock = -1;
+        return -1;
+    }
+    r->answered = 1;
+    r->status = reply.status;
+    if (reply.payload_len == sizeof(offset))
+        r->committed = dfs_get64(offset);
+    backend_release(r->node, r->sock);
+    r->sock = -1;
+    printf("Forwarded file to %s (status %d)\n", r->node->name, reply.status);
+    return 0;
+}
+
+// Wait for the answers of the nodes in rep until want of them have stored
+// the file or none is left to answer; the ones still to answer keep their
+// sockets. Returns how many nodes have answered DFS_OK.
+static int replica_collect(struct replica *rep, int count, int opcode, int want) {
+    int ok = 0, pending = 0;
+    for (int i = 0; i < count; i++) {
+        ok += rep[i].answered && rep[i].status == DFS_OK;
+        pending += rep[i].sock >= 0;
+    }
+    if (pending == 0 || ok >= want)
+        return ok;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN };
+    int broken = epfd < 0;
+    for (int i = 0; i < count && !broken; i++) {
+        ev.data.u32 = i;
+        if (rep[i].sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, rep[i].sock, &ev) < 0)
+            broken = 1;
+    }
+    if (broken)
+        perror("Error waiting for the copies of an upload");
+
+    while (!broken && pending > 0 && ok < want) {
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n == 0 && dfs_wait(epfd, POLLIN) < 0))
+            break;
+        for (int e = 0; e < n; e++) {
+            struct replica *r = &rep[events[e].data.u32];
+            if (r->sock < 0)
+                continue;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, r->sock, NULL);
+            if (replica_read(r, opcode) == 0 && r->status == DFS_OK)
+                ok++;
+            pending--;
+        }
+    }
+    if (epfd >= 0)
+        close(epfd);
+    return ok;
+}
+
+// The ids of the nodes in rep that have stored the file, into stored;
+// returns how many there are. *committed (if not NULL) gets the least
+// committed offset of those, or of every node that answered if none did.
+static int replica_stored(const struct replica *rep, int count, int *stored, uint64_t *committed) {
+    int n = 0, answered = 0;
+    uint64_t least_ok = UINT64_MAX, least = UINT64_MAX;
+    for (int i = 0; i < count; i++) {
+        if (!rep[i].answered)
+            continue;
+        answered++;
+        if (rep[i].committed < least)
+            least = rep[i].committed;
+        if (rep[i].status != DFS_OK)
+            continue;
+        stored[n++] = rep[i].node->id;
+        if (rep[i].committed < least_ok)
+            least_ok = rep[i].committed;
+    }
+    if (committed)
+        *committed = n ? least_ok : answered ? least : 0;
+    return n;
+}
+
+// Hand the copy of the file at key on node to the rebalancer: with sock, a
+// copy still being stored, to wait for; with sock -1, a copy to remove.
+// Returns -1 if there is no rebalancer to take it.
+static int replica_hand_off(const char *key, int node, int sock, int opcode, uint32_t id, int64_t version) {
+    struct replica_handoff h = { .node = node, .opcode = opcode, .id = id, .version = version };
+    snprintf(h.key, sizeof(h.key), "%s", key);
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (sock >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &sock, sizeof(int));
+    }
+    if (replica_handoff_sock[1] < 0 ||
+        sendmsg(replica_handoff_sock[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)sizeof(h))
+        return -1;
+    return 0;
+}
+
+// Hand the nodes in rep still storing the file at key to the rebalancer,
+// their copies to be catalogued under version (see struct
+// replica_handoff). Returns how many it took; the rest are given up on.
+static int replica_hand_off_late(struct replica *rep, int count, int opcode, const char *key, int64_t version) {
+    int taken = 0;
+    for (int i = 0; i < count; i++) {
+        struct replica *r = &rep[i];
+        if (r->sock < 0)
+            continue;
+        if (replica_hand_off(key, r->node->id, r->sock, opcode, r->id, version) == 0)
+            taken++;
+        else
+            printf("Gave up on the copy of %s on %s\n", key, r->node->name);
+        fiber_forget(r->sock);  // The rebalancer has the connection now
+        close(r->sock);
+        r->sock = -1;
+    }
+    return taken;
+}
+
+// Remove the copy of the file at key on node that an upload made though
+// it failed, through the rebalancer if there is one
+static void replica_discard(const char *key, int node) {
+    const struct dfs_node *n = dfs_cluster_node(node);
+    if (replica_hand_off(key, node, -1, 0, 0, -1) < 0 && n)
+        remove_from_node(n, key, catalog_moved_flag(key));
+}
+
+// Add node to the nodes that have the file at key, if that is still the
+// version an upload stored there. Returns the file's new version, or 0.
+static int64_t catalog_late_copy(const char *key, int64_t version, int node) {
+    struct dfs_catalog_info now;
+    int nodes[DFS_CATALOG_COPIES];
+    if (!dfs_catalog_lookup(key, &now) || now.version != (uint64_t)version || dfs_catalog_has(&now, node) ||
+        now.copies == DFS_CATALOG_COPIES)
+        return 0;
+    memcpy(nodes, now.nodes, now.copies * sizeof(nodes[0]));
+    nodes[now.copies] = node;
+    int64_t next = dfs_catalog_move(key, &now, nodes, now.copies + 1);
+    char names[256];
+    if (next > 0)
+        printf("Catalogued %s on %s\n", key, node_names(nodes, now.copies + 1, names, sizeof(names)));
+    return next > 0 ? next : 0;
+}
+
+// Stream an upload (or an upload part, query or commit) from the client to
+// the count nodes in rep at once, passing each chunk on to every node as
+// soon as it arrives, so only one chunk is held in memory; then wait until
+// quorum of them have stored it, or none is left to answer. Nodes that have
+// not answered by then keep their connections, for the rebalancer.
+// Returns DFS_OK if quorum nodes stored it, otherwise the first status a
+// node answered with (DFS_EUNAVAIL if none answered), or -1 if the client
+// connection broke. If crc is not NULL it receives the CRC-32 of the data
+// relayed.
+int forward_to_replicas(int client_sock, const struct dfs_header *req, const char *filename, const char *dest_path,
+                        struct replica *rep, int count, int quorum, uint32_t *crc) {
+    uint64_t size = req->payload_len;
+
+    // Storage servers take the destination as ~/S1/<path>, however S1 was given it
+    char rel[DFS_NAME_MAX + 1], dest[DFS_NAME_MAX + 1];
+    if (store_relative(dest_path, rel, sizeof(rel)) == 0 && strlen(rel) + 5 < sizeof(dest)) {
+        snprintf(dest, sizeof(dest), "~/S1/%s", rel);
+        dest_path = dest;
+    }
+
+    // Copies beyond the first are only worth having once they are on disk
+    int flags = replica_count > 1 && req->opcode != DFS_OP_UPLOAD_PART && req->opcode != DFS_OP_UPLOAD_QUERY
+                    ? DFS_FLAG_SYNC
+                    : 0;
+    for (int i = 0; i < count; i++) {
+        struct replica *r = &rep[i];
+        r->sock = backend_acquire(r->node);
+        r->id = dfs_next_request_id();
+        r->answered = 0;
+        r->status = DFS_EUNAVAIL;
+        r->committed = 0;
+        if (r->sock >= 0 &&
+            dfs_send_request_flags(r->sock, req->opcode, flags, r->id, filename, dest_path, NULL, 0, size) < 0) {
+            close(r->sock);
+            r->sock = -1;
+        }
+        if (r->sock < 0)
+            fprintf(stderr, "Connection to %s failed: %s\n", r->node->name, strerror(errno));
+    }
+
+    char buffer[DFS_CHUNK_SIZE];
+    uint64_t remaining = size;
+    if (crc)
+        *crc = crc32(0, NULL, 0);
+    while (remaining > 0) {
+        ssize_t n = recv_some(client_sock, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+        if (n <= 0) {
+            printf("Upload data receive failed\n");
+            for (int i = 0; i < count; i++) {
+                if (rep[i].sock >= 0)
+                    close(rep[i].sock);  // The servers discard the partial file
+                rep[i].sock = -1;
+            }
+            return -1;
+        }
+        remaining -= n;
+        if (crc)
+            *crc = crc32(*crc, (const unsigned char *)buffer, n);
+
+        // If a server goes away, keep reading so the client connection stays in sync
+        for (int i = 0; i < count; i++) {
+            if (rep[i].sock >= 0 && send_all(rep[i].sock, buffer, n) < 0) {
+                fprintf(stderr, "Forwarding to %s failed: %s\n", rep[i].node->name, strerror(errno));
+                close(rep[i].sock);
+                rep[i].sock = -1;
+            }
+        }
+    }
+
+    // Wait for the servers' acknowledgements
+    if (replica_collect(rep, count, req->opcode, quorum) >= quorum)
+        return DFS_OK;
+    for (int i = 0; i < count; i++) {
+        if (rep[i].answered && rep[i].status != DFS_OK)
+            return rep[i].status;
+    }
+    return DFS_EUNAVAIL;
+}
+
+// An upload of the file at key, size bytes with CRC-32 *crc (no known CRC
+// if crc is NULL), missed its quorum; old is the catalog entry it had, or
+// NULL. The catalog keeps the old copies on the nodes in rep that left the
+// file alone, and the copies the upload made are removed, unless no old
+// copy is left: then the file is catalogued as it is now. Returns the
+// version the nodes still storing it are to catalogue their copies under,
+// or -1 if they are to be removed.
+static int64_t replica_failed(const char *key, const struct dfs_catalog_info *old, const struct replica *rep,
+                              int count, uint64_t size, const uint32_t *crc) {
+    int stored[DFS_CATALOG_COPIES], n = replica_stored(rep, count, stored, NULL);
+    int keep[DFS_CATALOG_COPIES], kept = 0;
+    for (int i = 0; old && i < old->copies; i++) {
+        int touched = 0;
+        for (int k = 0; k < count; k++)
+            touched |= rep[k].node->id == old->nodes[i] && ((rep[k].answered && rep[k].status == DFS_OK) || rep[k].sock >= 0);
+        if (!touched)
+            keep[kept++] = old->nodes[i];
+    }
+    if (old && kept == 0 && n > 0) {
+        printf("No old copy of %s is left; keeping the %d new one(s)\n", key, n);
+        int64_t version = catalog_stored(key, stored, n, size, crc);
+        return version > 0 ? version : -1;
+    }
 
-    // Step 1: Send "UPLOAD" command
-    char cmd[10] = "UPLOAD";
-    send(sock, cmd, sizeof(cmd), 0);  // Notify server it's an upload
+    char names[256];
+    if (old && kept > 0 && kept < old->copies && dfs_catalog_move(key, old, keep, kept) > 0) {
+        printf("Catalogued %s on %s, the copies the failed upload left alone\n", key,
+               node_names(keep, kept, names, sizeof(names)));
+        rebalance_repair();
+    }
+    for (int i = 0; i < n; i++)
+        replica_discard(key, stored[i]);
+    return -1;
+}
 
-    // Step 2: Send filename, path, size, and data
-    send(sock, filename, 256, 0);
-    send(sock, dest_path, 256, 0);
-    send(sock, &size, sizeof(int), 0);
-    send(sock, data, size, 0);
+// Store an upload, or an upload part, query or commit, of the file at key
+// on the count nodes in nodes, and send the client its reply: the status,
+// with the committed offset for a resumable upload (the least of the nodes
+// that have it). A whole upload or a commit that makes its quorum goes in
+// the catalog on the nodes that stored it, and the copies the file had on
+// other nodes are removed. The nodes still storing it when the client has
+// its reply are the rebalancer's to wait for. Returns -1 if the client
+// connection broke.
+static int store_replicas(int client_sock, const struct dfs_header *req, const char *filename, const char *dest_path,
+                          const char *key, const int *nodes, int count) {
+    struct replica rep[DFS_CATALOG_COPIES];
+    for (int i = 0; i < count; i++)
+        rep[i] = (struct replica){ .node = dfs_cluster_node(nodes[i]), .sock = -1 };
+    int quorum = write_quorum < count ? write_quorum : count;
+    int whole = req->opcode == DFS_OP_UPLOAD;
+    int storing = whole || req->opcode == DFS_OP_UPLOAD_COMMIT;
+    struct dfs_catalog_info old;
+    int had = storing && dfs_catalog_lookup(key, &old);
+
+    uint32_t crc;
+    int status = forward_to_replicas(client_sock, req, filename, dest_path, rep, count, quorum, whole ? &crc : NULL);
+    if (status < 0)
+        return -1;
 
-    printf("Forwarded file to %s\n", server_name);
-    close(sock); // Close the socket after sending
+    // The parts of a resumable upload went by in no particular order, so there is no CRC to record
+    int stored[DFS_CATALOG_COPIES];
+    uint64_t committed;
+    int n = replica_stored(rep, count, stored, &committed);
+    uint64_t size = whole ? req->payload_len : committed;
+    int64_t version = 0;
+    if (storing && status == DFS_OK)
+        version = catalog_stored(key, stored, n, size, whole ? &crc : NULL);
+    else if (storing)
+        version = replica_failed(key, had ? &old : NULL, rep, count, size, whole ? &crc : NULL);
+    int rc = whole ? dfs_send_status(client_sock, req, status) : dfs_send_committed(client_sock, req, status, committed);
+
+    // No waiting for the nodes still writing: the rebalancer catalogues their copies
+    int late = replica_hand_off_late(rep, count, req->opcode, key, storing ? version : 0);
+    if (version > 0 && n + late < count)
+        rebalance_repair();  // For the copies that are missing
+    if (status == DFS_OK && version > 0 && had)
+        remove_old_copies(key, &old, nodes, count);
+    return rc < 0 ? -1 : 0;
 }
 
 // Function to resolve file path, handling ~ expansion
@@ -111,6 +712,9 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
     else if (strncmp(input_path, "~S1/", 4) == 0) {
         snprintf(resolved_path, resolved_size, "%s/S1/%s", home, input_path + 4);
     }
+    else if (strcmp(input_path, "~S1") == 0) {
+        snprintf(resolved_path, resolved_size, "%s/S1", home);
+    }
     // Handle absolute path
     else if (input_path[0] == '/') {
         strncpy(resolved_path, input_path, resolved_size);
@@ -146,720 +750,3193 @@ void extract_path_components(const char *s1_path, char *server_path, size_t max_
     }
 }
 
-// Get file from another server (S2/S3/S4)
-int get_file_from_server(int client_sock, const char *path, int server_port) {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        int error_code = -1;
-        send(client_sock, &error_code, sizeof(int), 0);
-        perror("Socket creation failed");
+/* ===== BACKEND RELAY ===== */
+
+/*
+ * Download and tar payloads from S2/S3/S4 are moved to the client with
+ * splice(): backend socket -> pipe -> client socket, so the data never
+ * enters user space.  If the kernel refuses to splice these descriptors the
+ * relay falls back to copying through a large buffer.  With -C S1 always
+ * uses the copy path, which makes it easy to compare the two.
+ *
+ * Every relay logs its throughput and the CPU time it used per GB; time
+ * spent waiting for either socket does not count as CPU.
+ */
+#define RELAY_PIPE_SIZE (1024 * 1024)   /* Requested pipe capacity */
+#define RELAY_COPY_SIZE (256 * 1024)    /* Buffer for the copy fallback */
+#define RELAY_PIPE_CACHE 8
+
+struct relay_stats {
+    unsigned long long bytes;
+    double seconds;      /* Wall clock */
+    double cpu;          /* Thread CPU time, excluding waits */
+    double cpu_mark;
+    int copying;         /* splice did not work; copy the rest */
+};
+
+static int relay_use_splice = 1;
+static int relay_pipes[RELAY_PIPE_CACHE][2];
+static int relay_pipe_count;
+static struct relay_stats relay_totals;
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// dfs_wait that keeps waiting time out of the relay's CPU figure
+static int relay_wait(struct relay_stats *st, int fd, short events) {
+    st->cpu += clock_seconds(CLOCK_THREAD_CPUTIME_ID) - st->cpu_mark;
+    int rc = dfs_wait(fd, events);
+    st->cpu_mark = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    return rc;
+}
+
+// Get an empty pipe, reusing one from an earlier relay when possible
+static int relay_pipe_get(int p[2]) {
+    if (relay_pipe_count > 0) {
+        relay_pipe_count--;
+        p[0] = relay_pipes[relay_pipe_count][0];
+        p[1] = relay_pipes[relay_pipe_count][1];
         return 0;
     }
-    
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(server_port);
-    serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    // Attempt to connect to the server
-    if (connect(server_sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        int error_code = -1;
-        send(client_sock, &error_code, sizeof(int), 0);
-        close(server_sock);
+    if (pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+    fcntl(p[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);  // Best effort; the default is 64 KB
+    return 0;
+}
+
+// Keep a pipe for the next relay; only empty pipes may be put back
+static void relay_pipe_put(int p[2], int empty) {
+    if (empty && relay_pipe_count < RELAY_PIPE_CACHE) {
+        relay_pipes[relay_pipe_count][0] = p[0];
+        relay_pipes[relay_pipe_count][1] = p[1];
+        relay_pipe_count++;
+        return;
+    }
+    close(p[0]);
+    close(p[1]);
+}
+
+// Move len bytes with splice. Returns bytes moved, or -1 with errno set if
+// splice is not supported and nothing has been moved yet.
+static long long relay_splice(int from, int to, unsigned long long len, struct relay_stats *st) {
+    int p[2];
+    if (relay_pipe_get(p) < 0)
+        return -1;
+
+    unsigned long long moved = 0;
+    size_t in_pipe = 0;
+    int failed = 0;
+    while ((moved < len || in_pipe > 0) && !failed) {
+        // Fill the pipe from the backend
+        if (moved + in_pipe < len) {
+            unsigned long long want = len - moved - in_pipe;
+            ssize_t n = splice(from, NULL, p[1], NULL, want < RELAY_PIPE_SIZE ? want : RELAY_PIPE_SIZE,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (n > 0) {
+                in_pipe += n;
+            } else if (n == 0) {
+                failed = 1;  // Backend closed early
+                break;
+            } else if (errno == EINVAL || errno == ENOSYS) {
+                if (moved == 0 && in_pipe == 0) {
+                    relay_pipe_put(p, 1);
+                    errno = EINVAL;
+                    return -1;  // Caller falls back to copying
+                }
+                failed = 1;
+                break;
+            } else if (errno == EAGAIN && in_pipe == 0) {
+                if (relay_wait(st, from, POLLIN) < 0)
+                    failed = 1;
+                continue;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                perror("Error receiving data from server");
+                failed = 1;
+                break;
+            }
+        }
+
+        // Drain the pipe into the client
+        while (in_pipe > 0) {
+            ssize_t n = splice(p[0], NULL, to, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                in_pipe -= n;
+                moved += n;
+            } else if (n < 0 && errno == EAGAIN) {
+                if (relay_wait(st, to, POLLOUT) < 0) {
+                    failed = 1;
+                    break;
+                }
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                perror("Error sending data to client");
+                failed = 1;
+                break;
+            }
+        }
+    }
+
+    relay_pipe_put(p, in_pipe == 0);
+    return moved;
+}
+
+// Move len bytes by copying through a large user-space buffer
+static long long relay_copy(int from, int to, unsigned long long len, struct relay_stats *st) {
+    char *buffer = malloc(RELAY_COPY_SIZE);
+    if (!buffer)
+        return 0;
+
+    unsigned long long moved = 0;
+    while (moved < len) {
+        unsigned long long want = len - moved;
+        ssize_t n = recv(from, buffer, want < RELAY_COPY_SIZE ? want : RELAY_COPY_SIZE, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (relay_wait(st, from, POLLIN) < 0)
+                break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("Error receiving data from server");
+            break;
+        }
+        if (send_all(to, buffer, n) < 0) {
+            perror("Error sending data to client");
+            break;
+        }
+        moved += n;
+    }
+    free(buffer);
+    return moved;
+}
+
+// Move len bytes with splice, or by copying once splice turns out not to
+// work for these descriptors. Returns bytes moved.
+static long long relay_move(int from, int to, unsigned long long len, struct relay_stats *st) {
+    long long moved = -1;
+    if (relay_use_splice && !st->copying)
+        moved = relay_splice(from, to, len, st);
+    if (moved < 0) {
+        st->copying = 1;
+        moved = relay_copy(from, to, len, st);
+    }
+    st->bytes += moved;
+    return moved;
+}
+
+static void relay_start(struct relay_stats *st) {
+    memset(st, 0, sizeof(*st));
+    st->seconds = clock_seconds(CLOCK_MONOTONIC);
+    st->cpu_mark = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// Add a finished relay to the process totals and log both
+static void relay_finish(struct relay_stats *st) {
+    st->cpu += clock_seconds(CLOCK_THREAD_CPUTIME_ID) - st->cpu_mark;
+    st->seconds = clock_seconds(CLOCK_MONOTONIC) - st->seconds;
+
+    relay_totals.bytes += st->bytes;
+    relay_totals.seconds += st->seconds;
+    relay_totals.cpu += st->cpu;
+
+    double gb = st->bytes / 1e9, total_gb = relay_totals.bytes / 1e9;
+    printf("Relayed %llu bytes by %s: %.1f MB/s, %.3f CPU s/GB (process total %.3f GB, %.3f CPU s/GB)\n",
+           st->bytes, st->copying ? "copy" : "splice", st->seconds > 0 ? st->bytes / st->seconds / 1e6 : 0.0,
+           gb > 0 ? st->cpu / gb : 0.0, total_gb, total_gb > 0 ? relay_totals.cpu / total_gb : 0.0);
+}
+
+// Relay len bytes of a backend reply payload to the client.
+// Returns 0 once everything has been moved, -1 if either side failed.
+int relay_payload(int server_sock, int client_sock, unsigned long long len) {
+    struct relay_stats st;
+    relay_start(&st);
+    long long moved = relay_move(server_sock, client_sock, len, &st);
+    relay_finish(&st);
+    return (unsigned long long)moved == len ? 0 : -1;
+}
+
+// Relay a chunked backend payload to the client one chunk at a time, up to
+// and including its end marker. Returns 0 once everything has been moved,
+// -1 if either side failed.
+int relay_chunked(int server_sock, int client_sock) {
+    struct relay_stats st;
+    relay_start(&st);
+    int rc = 0;
+    for (;;) {
+        uint64_t len;
+        unsigned char head[8];
+        if (dfs_recv_chunk_head(server_sock, &len) < 0) {
+            perror("Error receiving data from server");
+            rc = -1;
+            break;
+        }
+        dfs_put64(head, len);
+        if (send_all_flags(client_sock, head, sizeof(head), len > 0 ? MSG_MORE : 0) < 0) {
+            perror("Error sending data to client");
+            rc = -1;
+            break;
+        }
+        if (len == 0)
+            break;
+        if ((unsigned long long)relay_move(server_sock, client_sock, len, &st) != len) {
+            rc = -1;
+            break;
+        }
+    }
+    relay_finish(&st);
+    return rc;
+}
+
+// Get file from a storage node, leaving the status it answered with in *status.
+// Unless final is set, a node that cannot be reached or does not have the
+// file is not reported to the client, so that another copy can be tried.
+// Returns 1 if the file was relayed, 0 on an error reply, -1 if the client connection is unusable.
+int get_file_from_server(int client_sock, const struct dfs_header *req, const char *path, const char *range,
+                         const struct dfs_node *node, int final, int *status) {
+    *status = DFS_EUNAVAIL;
+    int server_sock = backend_acquire(node);
+    if (server_sock < 0) {
+        if (final)
+            dfs_send_status(client_sock, req, DFS_EUNAVAIL);
         perror("Connection to server failed");
         return 0;
     }
     
-    // Send "DOWNLOAD" command to the server
-    char cmd[10] = "DOWNLOAD";
-    send(server_sock, cmd, sizeof(cmd), 0);
-    
     // Extract path components after S1 prefix
-    char server_path[512];
+    char server_path[DFS_NAME_MAX + 1];
     resolve_path(path, server_path, sizeof(server_path));
     
-    char relative_path[512];
+    char relative_path[DFS_NAME_MAX + 1];
     extract_path_components(server_path, relative_path, sizeof(relative_path));
     
-    // Send the path to the server
-    send(server_sock, relative_path, sizeof(relative_path), 0);
-    
-    // Get file size from the server
-    int file_size = 0;
-    recv(server_sock, &file_size, sizeof(int), 0);
+    // Send the DOWNLOAD (with its byte range, if any) or STAT request to
+    // the server, then get the size of what it will send
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    if (dfs_send_request(server_sock, req->opcode, id, relative_path, range, NULL, 0) < 0 ||
+        dfs_recv_reply(server_sock, req->opcode, id, &reply) < 0) {
+        close(server_sock);
+        if (final)
+            dfs_send_status(client_sock, req, DFS_EUNAVAIL);
+        return 0;
+    }
+    *status = reply.status;
     
-    if (file_size <= 0) {
+    if (reply.status != DFS_OK) {
         // Forward the error to client
-        send(client_sock, &file_size, sizeof(int), 0);
-        close(server_sock);
+        if (final || reply.status != DFS_ENOENT)
+            dfs_send_status(client_sock, req, reply.status);
+        backend_release(node, server_sock);
         return 0;
     }
     
     // Send file size to client
-    send(client_sock, &file_size, sizeof(int), 0);
-    
-    // Relay data from server to client
-    char buffer[BUFFER_SIZE];
-    int bytes_read = 0;
-    int total_read = 0;
-    
-    while (total_read < file_size) {
-        bytes_read = recv(server_sock, buffer, 
-                          (file_size - total_read < BUFFER_SIZE) ? (file_size - total_read) : BUFFER_SIZE, 0);
-        if (bytes_read <= 0) {
-            perror("Error receiving data from server");
-            break;
-        }
-        send(client_sock, buffer, bytes_read, 0);
-        total_read += bytes_read;
+    if (dfs_send_reply(client_sock, req, DFS_OK, NULL, reply.payload_len) < 0) {
+        close(server_sock);
+        return -1;
     }
     
-    close(server_sock);
+    // Relay data from server to client; only a fully relayed response
+    // leaves either connection in a reusable state
+    if (relay_payload(server_sock, client_sock, reply.payload_len) < 0) {
+        close(server_sock);
+        return -1;
+    }
+    backend_release(node, server_sock);
     return 1;
 }
 
-// Function to handle file download requests
-int handle_download(int client_sock, const char *path) {
-    char *ext = strrchr(path, '.');
-    char resolved_path[1024];
+// Drop the count nodes in lost, found not to have their copies of the
+// file at key, from its catalog entry if it is still at version, so that
+// the rebalancer replaces the copies
+static void catalog_lost(const char *key, uint64_t version, const int *lost, int count) {
+    struct dfs_catalog_info now;
+    if (!dfs_catalog_lookup(key, &now) || now.version != version)
+        return;
+    int kept[DFS_CATALOG_COPIES], n = 0;
+    for (int i = 0; i < now.copies; i++) {
+        int gone = 0;
+        for (int k = 0; k < count; k++)
+            gone |= lost[k] == now.nodes[i];
+        if (!gone)
+            kept[n++] = now.nodes[i];
+    }
+    char names[256];
+    if (n > 0 && dfs_catalog_move(key, &now, kept, n) > 0) {
+        printf("The copy of %s on %s is missing\n", key, node_names(lost, count, names, sizeof(names)));
+        rebalance_repair();
+    }
+}
+
+// Function to handle file download and STAT requests. range is the optional
+// byte range from the request's aux field (see dfs_parse_range), "" for the whole file.
+// The file is fetched from one of the nodes the catalog has copies on, a
+// different one first each time, without asking the others unless it has to.
+int handle_download(int client_sock, const struct dfs_header *req, const char *path, const char *range) {
+    static unsigned read_turn;
+    char resolved_path[1024], key[DFS_NAME_MAX + 1];
+    uint64_t version;
+    int nodes[DFS_CATALOG_COPIES];
+    int count = locate_file(path, key, sizeof(key), &version, nodes);
     
     // Check file extension
-    if (!ext || (strcmp(ext, ".c") != 0 && 
-                strcmp(ext, ".pdf") != 0 && 
-                strcmp(ext, ".txt") != 0 && 
-                strcmp(ext, ".zip") != 0)) {
-        int error_code = -1;
-        send(client_sock, &error_code, sizeof(int), 0);
+    if (!count) {
+        dfs_send_status(client_sock, req, DFS_EINVAL);
         return 0;
- }
+    }
     
-    // For .c files, resolve path and check locally
-    if (strcmp(ext, ".c") == 0) {
+    // For files S1 holds, resolve path and check locally
+    if (nodes[0] == DFS_CLUSTER_LOCAL) {
         resolve_path(path, resolved_path, sizeof(resolved_path));
         
         printf("Looking for .c file at: %s\n", resolved_path);
         
-        // Open the file
-        FILE *fp = fopen(resolved_path, "rb");
-        if (!fp) {
-            perror("File open error");
-            int error_code = -1;
-            send(client_sock, &error_code, sizeof(int), 0);
-            return 0;
-        }
-        
-        // Get file size
-        fseek(fp, 0, SEEK_END);
-        int file_size = ftell(fp);
-        rewind(fp);
-        
-        // Send file size
-        send(client_sock, &file_size, sizeof(int), 0);
-        
-        // Read and send file data
-        char *buffer = malloc(file_size);
-        fread(buffer, 1, file_size, fp);
-        send(client_sock, buffer, file_size, 0);
-        
-        free(buffer);
-        fclose(fp);
-        printf("Sent .c file to client: %s\n", resolved_path);
-        return 1;
+        // STAT only wants the size and modification time
+        int sent = req->opcode == DFS_OP_STAT ? dfs_send_stat(client_sock, req, resolved_path)
+                                              : dfs_send_file(client_sock, req, resolved_path, range);
+        if (sent > 0 && req->opcode == DFS_OP_DOWNLOAD)
+            printf("Sent .c file to client: %s\n", resolved_path);
+        // Removed behind S1's back: only the disk can say so, the index may lag behind it
+        if (sent == 0 && version && access(resolved_path, F_OK) != 0 && errno == ENOENT)
+            dfs_catalog_forget(key, version);
+        return sent;
+    }
+
+    // Otherwise get it from a storage server that has it, trying the next on failure
+    int status, rc = 0, lost[DFS_CATALOG_COPIES], missing = 0;
+    int first = (getpid() + read_turn++) % count;
+    for (int i = 0; i < count; i++) {
+        int node = nodes[(first + i) % count];
+        printf("Retrieving %s file from %s: %s\n", strrchr(path, '.'), node_name(node), path);
+        rc = get_file_from_server(client_sock, req, path, range, dfs_cluster_node(node), i == count - 1, &status);
+        if (rc == 0 && status == DFS_ENOENT)
+            lost[missing++] = node;
+        if (rc != 0 || (status != DFS_ENOENT && status != DFS_EUNAVAIL))
+            break;
     }
-    // For .pdf files, get from S2
-    else if (strcmp(ext, ".pdf") == 0) {
-        printf("Retrieving .pdf file from S2: %s\n", path);
-        return get_file_from_server(client_sock, path, S2_PORT);
+    if (version && missing == count)
+        dfs_catalog_forget(key, version);
+    else if (version && missing > 0)
+        catalog_lost(key, version, lost, missing);
+    return rc;
+}
+
+/* ===== START OF REMOVE FUNCTIONALITY ===== */
+
+// Remove the file at path (relative to the stores) from a storage node;
+// flags is DFS_FLAG_MOVED for a copy of a file kept on other nodes.
+// Returns the node's status (DFS_EUNAVAIL if it could not be reached).
+int remove_from_node(const struct dfs_node *node, const char *path, int flags) {
+    int server_sock = backend_acquire(node);
+    if (server_sock < 0) {
+        fprintf(stderr, "Connection to %s failed: %s\n", node->name, strerror(errno));
+        return DFS_EUNAVAIL;
     }
-    // For .txt files, get from S3
-    else if (strcmp(ext, ".txt") == 0) {
-        printf("Retrieving .txt file from S3: %s\n", path);
-        return get_file_from_server(client_sock, path, S3_PORT);
+
+    // Send the REMOVE request, then get the status code
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    if (dfs_send_request_flags(server_sock, DFS_OP_REMOVE, flags, id, path, NULL, NULL, 0, 0) < 0 ||
+        dfs_recv_reply(server_sock, DFS_OP_REMOVE, id, &reply) < 0) {
+        close(server_sock);
+        return DFS_EUNAVAIL;
     }
-    // For .zip files, get from S4
-    else if (strcmp(ext, ".zip") == 0) {
-        printf("Retrieving .zip file from S4: %s\n", path);
-        return get_file_from_server(client_sock, path, S4_PORT);
+    backend_release(node, server_sock);
+    return reply.status;
+}
+
+// Forward a remove request to every storage node in nodes (count of them)
+// and send the client the status: DFS_OK if each node with a copy removed
+// it, DFS_EUNAVAIL if a node could not be reached, or the error of one that
+// failed. *removed gets the number of copies removed.
+// Returns the status.
+int forward_remove(int client_sock, const struct dfs_header *req, const char *path, const int *nodes, int count,
+                   int *removed) {
+    // Extract path components after S1 prefix
+    char server_path[DFS_NAME_MAX + 1];
+    resolve_path(path, server_path, sizeof(server_path));
+
+    char relative_path[DFS_NAME_MAX + 1];
+    extract_path_components(server_path, relative_path, sizeof(relative_path));
+
+    int status = DFS_ENOENT, failed = DFS_OK;
+    *removed = 0;
+    for (int i = 0; i < count; i++) {
+        const struct dfs_node *node = dfs_cluster_node(nodes[i]);
+        int rc = remove_from_node(node, relative_path, 0);
+        printf("%s file removal request forwarded to %s. Status: %d\n", strrchr(path, '.'), node->name, rc);
+        if (rc == DFS_OK)
+            (*removed)++;
+        else if (rc != DFS_ENOENT && failed != DFS_EUNAVAIL)
+            failed = rc;
     }
+    if (failed != DFS_OK)
+        status = failed;
+    else if (*removed > 0)
+        status = DFS_OK;
+
+    // Forward status code to client
+    dfs_send_status(client_sock, req, status);
+    return status;
+}
+
+// Remove a file S1 holds and send the client the status
+int remove_locally(int client_sock, const struct dfs_header *req, const char *path) {
+    char resolved_path[1024];
+    int status_code = 0;  // 0: Success, 1: File not found, 2: Permission denied
+
+    resolve_path(path, resolved_path, sizeof(resolved_path));
     
-    return 0;
+    printf("Attempting to remove .c file: %s\n", resolved_path);
+    
+    // Try to access the file first
+    if (!dfs_index_exists(resolved_path)) {
+        status_code = 1;  // File not found
+        dfs_send_status(client_sock, req, status_code);
+        return status_code;
+    }
+
+    // Try to remove the file
+    if (remove(resolved_path) != 0) {
+        status_code = 2;  // Permission denied or other error
+        dfs_send_status(client_sock, req, status_code);
+        perror("Error removing .c file");
+        return status_code;
+    }
+
+    // File successfully removed
+    dfs_journal_note(resolved_path, '-');
+    dfs_index_note(resolved_path);
+    dfs_upload_forget(resolved_path);
+    dfs_send_status(client_sock, req, status_code);
+    printf("Successfully removed .c file: %s\n", resolved_path);
+    return status_code;
 }
 
-/* ===== START OF REMOVE FUNCTIONALITY ===== */
+// Function to remove file from S1, S2, S3 or S4 (local or remote), wherever
+// the catalog has copies of it
+int handle_remove(int client_sock, const struct dfs_header *req, const char *path) {
+    char key[DFS_NAME_MAX + 1];
+    uint64_t version;
+    int nodes[DFS_CATALOG_COPIES];
+    int count = locate_file(path, key, sizeof(key), &version, nodes);
+
+    // Check file extension
+    if (!count) {
+        dfs_send_status(client_sock, req, DFS_ENOENT);  // File not found/supported
+        return 0;
+    }
+
+    int status, removed = 0;
+    if (nodes[0] == DFS_CLUSTER_LOCAL)
+        status = remove_locally(client_sock, req, path);
+    else
+        status = forward_remove(client_sock, req, path, nodes, count, &removed);
+
+    // Gone either way. A copy on a node that could not be reached stays
+    // behind; removing the file again once the node is back removes it.
+    if ((status == DFS_OK || status == DFS_ENOENT || removed > 0) && key[0])
+        dfs_catalog_remove(key);
+    return status == DFS_OK;
+}
+
+/* ===== END OF REMOVE FUNCTIONALITY ===== */
+
+/* ===== TAR FETCH ===== */
+
+/*
+ * TARFETCH builds one archive out of S1's own .c files and the stores of
+ * S2/S3/S4.  The name is a file type, or "all" for every type, and aux can
+ * limit the archive to one directory under ~S1.  The request goes to every
+ * storage server involved before anything else is done, so they all walk
+ * their stores at the same time; S1 then sends its own entries and passes
+ * on each server's entries as they become ready, ending the merged archive
+ * with a single trailer.  With DFS_FLAG_GZIP the merged stream is compressed
+ * on its way out by tar_gzip_threads threads (dfs_gzip.h); the storage
+ * servers still send plain entries, so the merge works the same.  When
+ * files have copies on several nodes (s1 -R), only the first entry for each
+ * name is passed on, and the copies that come after it are skipped.
+ */
+static int tar_gzip_threads;  /* 0: compress on the request's own thread */
+
+struct tar_source {
+    const char *type;
+    const struct dfs_node *node;  /* NULL for S1's own files */
+    const char *server_name;
+    int sock;
+    uint32_t id;
+};
+
+#define TAR_SOURCES_MAX (1 + DFS_CLUSTER_MAX)
+#define TAR_HEAD_MAX ((2 + (DFS_TAR_PATH_MAX + 128 + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK) * DFS_TAR_BLOCK)
+
+// The names already passed on by a merge of several nodes' replies, so
+// that a file on several nodes (its copies, or the old and new one of a
+// move) is passed on once: an open-addressing hash set
+struct name_set {
+    char **names;
+    size_t cap, count;
+};
+
+// Add the name of len bytes to set. Returns 1 if it was there already, 0
+// if not (or if it could not be added).
+static int name_set_add(struct name_set *set, const char *name, size_t len) {
+    if ((set->count + 1) * 10 > set->cap * 7) {
+        size_t cap = set->cap ? 2 * set->cap : 1024;
+        char **names = calloc(cap, sizeof(*names));
+        if (!names)
+            return 0;
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->names[i])
+                continue;
+            size_t j = dfs_catalog_hash(set->names[i], strlen(set->names[i])) & (cap - 1);
+            while (names[j])
+                j = (j + 1) & (cap - 1);
+            names[j] = set->names[i];
+        }
+        free(set->names);
+        set->names = names;
+        set->cap = cap;
+    }
+    size_t mask = set->cap - 1;
+    for (size_t i = dfs_catalog_hash(name, len) & mask;; i = (i + 1) & mask) {
+        if (!set->names[i]) {
+            if ((set->names[i] = strndup(name, len)) != NULL)
+                set->count++;
+            return 0;
+        }
+        if (strncmp(set->names[i], name, len) == 0 && set->names[i][len] == '\0')
+            return 1;
+    }
+}
+
+static void name_set_free(struct name_set *set) {
+    for (size_t i = 0; i < set->cap; i++)
+        free(set->names[i]);
+    free(set->names);
+}
+
+// The stores holding files of filetype ("all" for every type), S1's own
+// first: one source per node. Returns how many there are.
+static int tar_sources(struct tar_source *src, const char *filetype) {
+    int all = strcmp(filetype, "all") == 0, count = 0;
+    if (all || strcmp(filetype, ".c") == 0)
+        src[count++] = (struct tar_source){ ".c", NULL, "S1", -1, 0 };
+    for (int i = 0; i < dfs_cluster.count; i++) {
+        const struct dfs_node *n = &dfs_cluster.nodes[i];
+        if (all || strcmp(filetype, n->type) == 0)
+            src[count++] = (struct tar_source){ n->type, n, n->name, -1, 0 };
+    }
+    return count;
+}
+
+// Whether a file can be in the replies of two of the count sources in src:
+// nodes of one type, which hold the copies of a file (s1 -R) or, while the
+// rebalancer moves it, the old and the new one
+static int tar_sources_overlap(const struct tar_source *src, int count) {
+    for (int i = 0; i < count; i++)
+        for (int k = i + 1; k < count; k++)
+            if (strcmp(src[i].type, src[k].type) == 0)
+                return 1;
+    return 0;
+}
+
+// Work out which directory under each store's root a client path such as
+// ~S1/project names ("" for the whole store)
+static void tar_directory(const char *path, char *dir, size_t size) {
+    dir[0] = '\0';
+    if (!*path || strcmp(path, "~S1") == 0 || strcmp(path, "~S1/") == 0 ||
+        strcmp(path, "~/S1") == 0 || strcmp(path, "~/S1/") == 0)
+        return;
+    char resolved[DFS_NAME_MAX + 1];
+    resolve_path(path, resolved, sizeof(resolved));
+    extract_path_components(resolved, dir, size);
+}
+
+// The name of the tar entry whose first block, of a chunk of len bytes, is
+// at block: the path in its pax header if it has one, or else its ustar
+// name. The rest of a pax header and the ustar header after it are read
+// in after the first block, and *have grows by their size. Returns the
+// length of the name put in name (size bytes), or -1 if the connection broke.
+static int tar_entry_name(int sock, unsigned char *block, size_t *have, uint64_t len, char *name, size_t size) {
+    const char *pax = NULL, *h = (const char *)block;
+    uint64_t pax_len = block[156] == 'x' ? strtoull(h + 124, NULL, 8) : 0;
+    size_t pax_bytes = (pax_len + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK * DFS_TAR_BLOCK;
+    if (pax_len > 0 && DFS_TAR_BLOCK + pax_bytes + DFS_TAR_BLOCK <= TAR_HEAD_MAX &&
+        DFS_TAR_BLOCK + pax_bytes + DFS_TAR_BLOCK <= len) {
+        if (recv_all(sock, block + DFS_TAR_BLOCK, pax_bytes + DFS_TAR_BLOCK) < 0)
+            return -1;
+        *have += pax_bytes + DFS_TAR_BLOCK;
+        pax = h + DFS_TAR_BLOCK;
+        h = pax + pax_bytes;  // The ustar header
+    }
+
+    // Pax records are "<len> key=value\n"
+    for (const char *p = pax, *end = pax + pax_len; p && p < end;) {
+        char *key;
+        unsigned long rec = strtoul(p, &key, 10);
+        if (rec == 0 || rec > (unsigned long)(end - p) || *key != ' ')
+            break;
+        if (strncmp(key + 1, "path=", 5) == 0) {
+            int n = (int)(p + rec - 1 - (key + 6));
+            return snprintf(name, size, "%.*s", n, key + 6) < (int)size ? n : (int)size - 1;
+        }
+        p += rec;
+    }
+    int n = h[345] ? snprintf(name, size, "%.155s/%.100s", h + 345, h) : snprintf(name, size, "%.100s", h);
+    return n < (int)size ? n : (int)size - 1;
+}
+
+// Pass on the entries of the storage servers' archives as they become
+// ready, one whole entry at a time, dropping their trailers; with gz they
+// are compressed instead of relayed. With seen, an entry whose name is in
+// it already is dropped too. A server whose archive is complete goes back
+// to the pool and its sock is set to -1.
+// Returns 0, or -1 if a connection broke mid-entry.
+static int tar_merge(int client_sock, struct dfs_gzip *gz, struct tar_source *src, int count,
+                     struct name_set *seen, struct relay_stats *st, unsigned *entries) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return -1;
+    int active = 0;
+    for (int i = 0; i < count; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+        if (src[i].sock >= 0 && src[i].node) {
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, src[i].sock, &ev) < 0) {
+                close(epfd);
+                return -1;
+            }
+            active++;
+        }
+    }
+
+    int rc = 0;
+    while (active > 0 && rc == 0) {
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n == 0 && relay_wait(st, epfd, POLLIN) < 0)) {
+            rc = -1;
+            break;
+        }
+
+        for (int e = 0; e < n && rc == 0; e++) {
+            struct tar_source *s = &src[events[e].data.u32];
+            uint64_t len;
+            unsigned char head[8 + TAR_HEAD_MAX];
+            size_t have = DFS_TAR_BLOCK;
+            char name[DFS_TAR_PATH_MAX];
+            int name_len = 0;
+            if (dfs_recv_chunk_head(s->sock, &len) < 0) {
+                fprintf(stderr, "%s broke off its tar archive\n", s->server_name);
+                rc = -1;
+            } else if (len == 0) {
+                // End of this server's archive
+                epoll_ctl(epfd, EPOLL_CTL_DEL, s->sock, NULL);
+                backend_release(s->node, s->sock);
+                s->sock = -1;
+                active--;
+            } else if (len < DFS_TAR_BLOCK || recv_all(s->sock, head + 8, DFS_TAR_BLOCK) < 0) {
+                rc = -1;
+            } else if (dfs_tar_is_trailer(head + 8)) {
+                rc = dfs_skip_payload(s->sock, len - DFS_TAR_BLOCK);
+            } else if (seen && (name_len = tar_entry_name(s->sock, head + 8, &have, len, name, sizeof(name))) < 0) {
+                rc = -1;
+            } else if (seen && name_set_add(seen, name, name_len)) {
+                rc = dfs_skip_payload(s->sock, len - have);  // Another copy of a file already sent
+            } else if (gz) {
+                if (dfs_gzip_write(gz, head + 8, have) < 0 || dfs_gzip_recv(gz, s->sock, len - have) < 0)
+                    rc = -1;
+                st->bytes += len;
+                (*entries)++;
+            } else {
+                // The entry's header goes out with its length, the rest is relayed
+                dfs_put64(head, len);
+                if (send_all_flags(client_sock, head, 8 + have, MSG_MORE) < 0 ||
+                    (unsigned long long)relay_move(s->sock, client_sock, len - have, st) != len - have)
+                    rc = -1;
+                st->bytes += have;
+                (*entries)++;
+            }
+        }
+    }
+    close(epfd);
+    return rc;
+}
+
+// Log how well a compressed archive did: wall-clock and per-CPU-second
+// throughput, so the threaded and single-threaded paths can be compared
+static void tar_gzip_report(const struct dfs_gzip *gz, double seconds) {
+    double mb = gz->in_bytes / 1e6, cpu = gz->cpu_ns / 1e9;
+    printf("Compressed %.1f MB of tar to %.1f MB (%.1f%%) on %d worker thread(s): %.1f MB/s, %.3f CPU s "
+           "(%.1f MB per CPU s)\n",
+           mb, gz->out_bytes / 1e6, gz->in_bytes ? 100.0 * gz->out_bytes / gz->in_bytes : 0.0, gz->threads,
+           seconds > 0 ? mb / seconds : 0.0, cpu, cpu > 0 ? mb / cpu : 0.0);
+}
+
+// Handle a TARFETCH request: filetype is ".c", ".pdf", ".txt", ".zip" or
+// "all", and path (may be empty) limits the archive to one directory. A
+// sync point in the request, passed on to every store, makes it an
+// incremental archive (see dfs_journal.h).
+// Returns -1 if the client connection broke mid-archive.
+int handle_tarfetch(int client_sock, const struct dfs_header *req, const char *filetype, const char *path) {
+    char *since;
+    int got = dfs_recv_sync_point(client_sock, req, &since);
+    if (got != 0)
+        return got < 0 || dfs_send_status(client_sock, req, DFS_EINVAL) < 0 ? -1 : 0;
+    uint64_t since_len = since ? req->payload_len : 0;
+
+    struct tar_source src[TAR_SOURCES_MAX];
+    struct name_set seen = { 0 };
+    int count = tar_sources(src, filetype);
+    if (count == 0) {
+        // Invalid file type
+        free(since);
+        return dfs_send_status(client_sock, req, DFS_EINVAL) == 0 ? 0 : -1;
+    }
+
+    char dir[DFS_NAME_MAX + 1];
+    tar_directory(path, dir, sizeof(dir));
+
+    // Ask every storage server first, so they all start on their archives now
+    int status = DFS_OK;
+    for (int i = 0; i < count; i++) {
+        if (!src[i].node)
+            continue;
+        printf("Requesting %s tar from %s\n", src[i].type, src[i].server_name);
+        src[i].sock = backend_acquire(src[i].node);
+        src[i].id = dfs_next_request_id();
+        if (src[i].sock >= 0 &&
+            dfs_send_request(src[i].sock, DFS_OP_TARFETCH, src[i].id, src[i].type, dir, since, since_len) < 0) {
+            close(src[i].sock);
+            src[i].sock = -1;
+        }
+        if (src[i].sock < 0) {
+            fprintf(stderr, "Connection to %s failed: %s\n", src[i].server_name, strerror(errno));
+            status = DFS_EUNAVAIL;
+        }
+    }
+
+    // Their replies start right away; a store without the directory has nothing to add
+    int sources = 0;
+    for (int i = 0; i < count; i++) {
+        if (src[i].sock < 0)
+            continue;
+        struct dfs_header reply;
+        if (dfs_recv_reply(src[i].sock, DFS_OP_TARFETCH, src[i].id, &reply) < 0) {
+            close(src[i].sock);
+            src[i].sock = -1;
+            status = DFS_EUNAVAIL;
+        } else if (reply.status != DFS_OK || !(reply.flags & DFS_FLAG_CHUNKED)) {
+            if (reply.status != DFS_ENOENT && status == DFS_OK)
+                status = reply.status != DFS_OK ? reply.status : DFS_EIO;
+            if (reply.flags & DFS_FLAG_CHUNKED || reply.payload_len)
+                close(src[i].sock);
+            else
+                backend_release(src[i].node, src[i].sock);
+            src[i].sock = -1;
+        } else {
+            sources++;
+        }
+    }
+
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    struct dfs_tar *local = !src[0].node ? dfs_tar_open(client_sock, root, dir, ".c", since) : NULL;
+    if (local)
+        sources++;
+    if (status == DFS_OK && sources == 0)
+        status = DFS_ENOENT;
+
+    // A compressed archive gets its compression threads before anything is sent
+    struct dfs_gzip *gz = NULL;
+    double started = clock_seconds(CLOCK_MONOTONIC);
+    if (status == DFS_OK && (req->flags & DFS_FLAG_GZIP) &&
+        (gz = dfs_gzip_open(client_sock, tar_gzip_threads)) == NULL)
+        status = DFS_EIO;
+
+    int rc = 0;
+    if (status != DFS_OK) {
+        printf("Could not build the %s tar archive (status %d)\n", filetype, status);
+        rc = dfs_send_status(client_sock, req, status);
+    } else {
+        // Our own entries first, then the servers' as they arrive
+        struct relay_stats st;
+        unsigned entries = 0;
+        rc = dfs_send_chunked_head(client_sock, req, DFS_OK, gz ? DFS_FLAG_GZIP : 0);
+        if (rc == 0 && local) {
+            local->gz = gz;
+            rc = dfs_tar_send_files(local);
+            entries += local->files;
+        }
+        if (rc == 0 && sources > (local != NULL)) {
+            relay_start(&st);
+            st.copying = gz != NULL;  // Compressed entries are read into memory
+            rc = tar_merge(client_sock, gz, src, count, tar_sources_overlap(src, count) ? &seen : NULL, &st, &entries);
+            relay_finish(&st);
+        }
+        if (rc == 0)
+            rc = gz ? dfs_tar_end_gzip(gz) : dfs_tar_end(client_sock);
+        if (rc == 0 && gz)
+            tar_gzip_report(gz, clock_seconds(CLOCK_MONOTONIC) - started);
+        if (rc == 0)
+            printf("Sent %s%s tar archive of %u file(s) to client\n", since ? "incremental " : "", filetype,
+                   entries);
+    }
+
+    // Anything still open was cut off mid-archive
+    for (int i = 0; i < count; i++) {
+        if (src[i].node && src[i].sock >= 0)
+            close(src[i].sock);
+    }
+    free(local);
+    free(since);
+    name_set_free(&seen);
+    dfs_gzip_free(gz);
+    return rc < 0 ? -1 : 0;
+}
+
+/* ===== FIND ===== */
+
+/*
+ * FIND searches every store at once (dfs_find.h).  As with TARFETCH, the
+ * request goes to every storage node before S1 searches its own store, so they
+ * all search at the same time; S1 sends its own matches first and then
+ * passes on each server's chunks of matches as they arrive.  A server that
+ * cannot be reached is left out and the reply is marked partial.  As in a
+ * merged archive, a file with copies on several nodes is passed on once.
+ */
+
+// Drop the matches in the chunk at buf, of len bytes, whose paths are in
+// seen already, adding the others. Returns the length of what is left.
+static uint64_t find_drop_seen(struct name_set *seen, unsigned char *buf, uint64_t len) {
+    uint64_t kept = 0;
+    for (uint64_t off = 0; off + DFS_FIND_RECORD_HEAD <= len;) {
+        size_t path_len = buf[off] << 8 | buf[off + 1], rec = DFS_FIND_RECORD_HEAD + path_len;
+        if (off + rec > len)
+            break;
+        if (!name_set_add(seen, (const char *)buf + off + DFS_FIND_RECORD_HEAD, path_len)) {
+            memmove(buf + kept, buf + off, rec);
+            kept += rec;
+        }
+        off += rec;
+    }
+    return kept;
+}
+
+// Pass on the storage servers' chunks of matches as they arrive, counting
+// the matches; with seen, only those whose paths are not in it yet. A
+// server whose reply is complete goes back to the pool; one whose reply
+// breaks off is dropped. Returns 0, or -1 if the client's connection broke.
+static int find_merge(int client_sock, struct tar_source *src, int count, struct name_set *seen,
+                      unsigned long long *matches) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    unsigned char *chunk = malloc(8 + DFS_FIND_BATCH_BYTES);
+    if (epfd < 0 || !chunk) {
+        if (epfd >= 0)
+            close(epfd);
+        free(chunk);
+        return -1;
+    }
+    int active = 0;
+    for (int i = 0; i < count; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+        if (src[i].sock >= 0 && src[i].node && epoll_ctl(epfd, EPOLL_CTL_ADD, src[i].sock, &ev) == 0)
+            active++;
+    }
+
+    int rc = 0;
+    while (active > 0 && rc == 0) {
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n == 0 && dfs_wait(epfd, POLLIN) < 0)) {
+            rc = -1;
+            break;
+        }
+
+        for (int e = 0; e < n && rc == 0; e++) {
+            struct tar_source *s = &src[events[e].data.u32];
+            uint64_t len = 0;
+            int got = dfs_recv_chunk_head(s->sock, &len);
+            if (got == 0 && len == 0) {
+                // End of this server's matches
+                epoll_ctl(epfd, EPOLL_CTL_DEL, s->sock, NULL);
+                backend_release(s->node, s->sock);
+                s->sock = -1;
+                active--;
+                continue;
+            }
+            if (got < 0 || len > DFS_FIND_BATCH_BYTES || recv_all(s->sock, chunk + 8, len) < 0) {
+                fprintf(stderr, "%s broke off its search results\n", s->server_name);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, s->sock, NULL);
+                close(s->sock);
+                s->sock = -1;
+                active--;
+                continue;
+            }
+            if (seen && (len = find_drop_seen(seen, chunk + 8, len)) == 0)
+                continue;  // Nothing but copies; an empty chunk would end the reply
+            for (uint64_t off = 0; off + DFS_FIND_RECORD_HEAD <= len; (*matches)++)
+                off += DFS_FIND_RECORD_HEAD + (chunk[8 + off] << 8 | chunk[8 + off + 1]);
+            dfs_put64(chunk, len);
+            rc = send_all_flags(client_sock, chunk, 8 + len, MSG_MORE);
+        }
+    }
+    close(epfd);
+    free(chunk);
+    return rc;
+}
+
+// Handle a FIND request: search the directory path (empty for everything)
+// of every store with the query in the aux field.
+// Returns -1 if the client connection broke mid-reply.
+int handle_find(int client_sock, const struct dfs_header *req, const char *path, const char *query) {
+    struct dfs_find_query q;
+    char dir[DFS_NAME_MAX + 1];
+    tar_directory(path, dir, sizeof(dir));
+    if (dfs_find_parse(query, &q) < 0 || !dfs_find_subdir_ok(dir)) {
+        printf("Invalid search: '%s' under '%s'\n", query, path);
+        return dfs_send_status(client_sock, req, DFS_EINVAL) == 0 ? 0 : -1;
+    }
+
+    // Ask every storage server first, so they all search at the same time
+    struct tar_source src[1 + DFS_CLUSTER_MAX];
+    int count = 1 + dfs_cluster.count, missing = 0;
+    src[0] = (struct tar_source){ ".c", NULL, "S1", -1, 0 };
+    for (int i = 1; i < count; i++) {
+        const struct dfs_node *n = &dfs_cluster.nodes[i - 1];
+        src[i] = (struct tar_source){ n->type, n, n->name, -1, 0 };
+        src[i].sock = backend_acquire(src[i].node);
+        src[i].id = dfs_next_request_id();
+        if (src[i].sock >= 0 && dfs_send_request(src[i].sock, DFS_OP_FIND, src[i].id, dir, query, NULL, 0) < 0) {
+            close(src[i].sock);
+            src[i].sock = -1;
+        }
+        if (src[i].sock < 0) {
+            fprintf(stderr, "Connection to %s failed: %s\n", src[i].server_name, strerror(errno));
+            missing++;
+        }
+    }
+
+    // A store without the directory has nothing to add
+    char root[1024], local_dir[1024 + DFS_NAME_MAX + 2];
+    struct stat st;
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    snprintf(local_dir, sizeof(local_dir), "%s/%s", root, dir);
+    int sources = stat(local_dir, &st) == 0 && S_ISDIR(st.st_mode);
+    for (int i = 0; i < count; i++) {
+        if (!src[i].node || src[i].sock < 0)
+            continue;
+        struct dfs_header reply;
+        if (dfs_recv_reply(src[i].sock, DFS_OP_FIND, src[i].id, &reply) < 0) {
+            close(src[i].sock);
+            src[i].sock = -1;
+            missing++;
+        } else if (reply.status != DFS_OK || !(reply.flags & DFS_FLAG_CHUNKED)) {
+            if (reply.status != DFS_ENOENT)
+                missing++;
+            if (reply.flags & DFS_FLAG_CHUNKED || reply.payload_len)
+                close(src[i].sock);
+            else
+                backend_release(src[i].node, src[i].sock);
+            src[i].sock = -1;
+        } else {
+            sources++;
+        }
+    }
+
+    unsigned long long matches = 0;
+    struct name_set seen = { 0 };
+    int rc;
+    if (sources == 0) {
+        printf("Nothing to search under '%s'\n", path);
+        rc = dfs_send_status(client_sock, req, missing ? DFS_EUNAVAIL : DFS_ENOENT);
+    } else {
+        // Our own matches first, then the servers' as they arrive
+        rc = dfs_send_chunked_head(client_sock, req, DFS_OK, missing ? DFS_FLAG_PARTIAL : 0);
+        long long local = rc == 0 ? dfs_find_send_matches(client_sock, root, dir, ".c", &q) : -1;
+        struct name_set *dedup = tar_sources_overlap(src, count) ? &seen : NULL;
+        rc = local < 0 ? -1 : find_merge(client_sock, src, count, dedup, &matches);
+        if (rc == 0)
+            rc = dfs_send_chunk_end(client_sock);
+        if (rc == 0)
+            printf("Sent %llu match(es) for '%s' under '%s'%s\n", matches + local, query, path,
+                   missing ? " (partial)" : "");
+    }
+    dfs_find_free(&q);
+    name_set_free(&seen);
+
+    // Anything still open was cut off mid-reply
+    for (int i = 0; i < count; i++) {
+        if (src[i].node && src[i].sock >= 0)
+            close(src[i].sock);
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Listings ask every storage node at once.  The LISTFILES requests all go out
+ * before S1 reads its own directory, and the replies are read in pieces as
+ * they arrive, from a private epoll set that also holds a timerfd for the
+ * deadlines.  Each server has list_deadline_ms from the moment its request
+ * went out; one that has not answered completely by then is dropped (its
+ * connection is closed, since the reply may still come), and the listing
+ * goes to the client with DFS_FLAG_PARTIAL set.
+ *
+ * Every source, S1's own directory included, is read one sorted batch at a
+ * time (dfs_list.h).  The batches are merged by listing order into batches
+ * of the same form, which go to the client as the chunks of one reply, and
+ * a source whose batch runs out is asked for its next one, after the last
+ * name it sent.  So a directory of any size is listed holding at most one
+ * batch per source.
+ */
+static int list_deadline_ms = LIST_DEADLINE_MS;
+
+struct list_source {
+    const char *ext;
+    const struct dfs_node *node; /* NULL for S1's own directory */
+    const char *server_name;
+    int sock;                    /* -1 once finished or given up on */
+    uint32_t id;
+    double deadline;             /* CLOCK_MONOTONIC seconds */
+    unsigned char head[DFS_HEADER_SIZE];
+    size_t head_got;
+    uint64_t len, got;           /* Payload length and how much has arrived */
+    unsigned char *batch;        /* The batch of names being read */
+    int complete;                /* The batch has arrived */
+    int more;                    /* Another batch follows it */
+    struct dfs_list_reader reader;
+    const char *next;            /* The next name to merge, NULL when done */
+};
+
+// Send the LISTFILES request for dir_path to every server in src, asking
+// each for the batch after the last name it sent
+static void list_request(struct list_source *src, int count, const char *dir_path) {
+    char server_path[DFS_NAME_MAX + 1];
+    extract_path_components(dir_path, server_path, sizeof(server_path));
+    for (int i = 0; i < count; i++) {
+        const char *cursor = src[i].reader.name;
+        free(src[i].batch);
+        src[i].batch = NULL;
+        src[i].head_got = 0;
+        src[i].len = src[i].got = 0;
+        src[i].complete = src[i].more = 0;
+        src[i].sock = backend_acquire(src[i].node);
+        src[i].id = dfs_next_request_id();
+        src[i].deadline = clock_seconds(CLOCK_MONOTONIC) + list_deadline_ms / 1000.0;
+        if (src[i].sock >= 0 &&
+            dfs_send_request(src[i].sock, DFS_OP_LISTFILES, src[i].id, server_path, *cursor ? cursor : NULL,
+                             NULL, 0) < 0) {
+            close(src[i].sock);
+            src[i].sock = -1;
+        }
+        if (src[i].sock < 0)
+            fprintf(stderr, "Connection to %s failed: %s\n", src[i].server_name, strerror(errno));
+    }
+}
+
+// Take in whatever part of a server's reply has arrived, without waiting.
+// Returns 1 once the reply is complete, 0 if more is to come, or -1 if the
+// connection broke or the reply makes no sense.
+static int list_read(struct list_source *s) {
+    for (;;) {
+        void *to;
+        size_t want;
+        if (s->head_got < DFS_HEADER_SIZE) {
+            to = s->head + s->head_got;
+            want = DFS_HEADER_SIZE - s->head_got;
+        } else if (s->got < s->len) {
+            to = s->batch + s->got;
+            want = s->len - s->got;
+        } else {
+            s->complete = 1;
+            return 1;
+        }
+
+        ssize_t n = recv(s->sock, to, want, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+        if (n <= 0)
+            return -1;
+        if (s->head_got < DFS_HEADER_SIZE) {
+            s->head_got += n;
+            struct dfs_header reply;
+            if (s->head_got < DFS_HEADER_SIZE)
+                continue;
+            if (dfs_decode_header(s->head, &reply) < 0 || !(reply.flags & DFS_FLAG_REPLY) ||
+                reply.opcode != DFS_OP_LISTFILES || reply.request_id != s->id)
+                return -1;
+            // A server without the directory simply has nothing to add
+            s->len = reply.status == DFS_OK ? reply.payload_len : 0;
+            s->more = reply.status == DFS_OK && (reply.flags & DFS_FLAG_MORE);
+            if ((reply.status != DFS_OK && reply.payload_len) || s->len > DFS_LIST_BATCH_BYTES)
+                return -1;
+            if ((s->batch = malloc(s->len + 1)) == NULL)
+                return -1;
+        } else {
+            s->got += n;
+        }
+    }
+}
+
+// Arm timer for the earliest deadline of the servers still being waited for
+static void list_arm(int timer, const struct list_source *src, int count) {
+    double next = 0;
+    for (int i = 0; i < count; i++) {
+        if (src[i].sock >= 0 && (next == 0 || src[i].deadline < next))
+            next = src[i].deadline;
+    }
+    struct itimerspec when = { { 0, 0 }, { (time_t)next, (long)((next - (time_t)next) * 1e9) } };
+    if (next > 0 && when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
+        when.it_value.tv_nsec = 1;
+    timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+// Collect the replies to list_request, each until its server's deadline.
+// Returns how many servers are missing from the listing.
+static int list_collect(struct list_source *src, int count) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = count };
+    if (epfd < 0 || timer < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, timer, &ev) < 0) {
+        perror("Error waiting for listings");
+        for (int i = 0; i < count; i++) {
+            if (src[i].sock >= 0)
+                close(src[i].sock);
+            src[i].sock = -1;
+        }
+    }
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        ev.data.u32 = i;
+        if (src[i].sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, src[i].sock, &ev) == 0) {
+            pending++;
+        } else if (src[i].sock >= 0) {
+            close(src[i].sock);
+            src[i].sock = -1;
+        }
+    }
+    list_arm(timer, src, count);
+
+    while (pending > 0) {
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n == 0 && dfs_wait(epfd, POLLIN) < 0))
+            break;
+
+        double now = clock_seconds(CLOCK_MONOTONIC);
+        for (int e = 0; e < n; e++) {
+            struct list_source *s = &src[events[e].data.u32];
+            if (events[e].data.u32 == (uint32_t)count) {
+                // A deadline passed: give up on every server that is out of time
+                uint64_t expirations;
+                if (read(timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    perror("Error reading listing timer");
+                for (int i = 0; i < count; i++) {
+                    if (src[i].sock >= 0 && src[i].deadline <= now) {
+                        printf("%s did not answer the listing within %d ms\n", src[i].server_name,
+                               list_deadline_ms);
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, src[i].sock, NULL);
+                        close(src[i].sock);
+                        src[i].sock = -1;
+                        pending--;
+                    }
+                }
+                list_arm(timer, src, count);
+                continue;
+            }
+            if (s->sock < 0)
+                continue;
+
+            int rc = list_read(s);
+            if (rc == 0)
+                continue;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s->sock, NULL);
+            if (rc > 0) {
+                backend_release(s->node, s->sock);
+            } else {
+                fprintf(stderr, "%s broke off its listing\n", s->server_name);
+                close(s->sock);
+            }
+            s->sock = -1;
+            pending--;
+        }
+    }
+
+    int missing = 0;
+    for (int i = 0; i < count; i++) {
+        if (src[i].sock >= 0)
+            close(src[i].sock);  // Only if waiting itself failed
+        src[i].sock = -1;
+        missing += !src[i].complete;
+    }
+    if (timer >= 0)
+        close(timer);
+    if (epfd >= 0)
+        close(epfd);
+    return missing;
+}
+
+// Read S1's own batch after the last name taken from it
+static int list_scan_local(struct list_source *s, const char *resolved_path) {
+    struct dfs_list_writer w;
+    free(s->batch);
+    s->more = dfs_index_scan(resolved_path, s->ext, s->reader.name, &w);
+    s->batch = w.buf;
+    s->len = w.len;
+    s->complete = s->more >= 0;
+    s->more = s->more > 0;
+    return s->complete ? 0 : -1;
+}
+
+// Start merging the batch that has arrived for s. Returns -1 if it is corrupt.
+static int list_start(struct list_source *s) {
+    if (!s->complete) {
+        s->next = NULL;
+        return 0;
+    }
+    dfs_list_reader_init(&s->reader, s->batch, s->len);
+    s->next = dfs_list_next(&s->reader);
+    return s->reader.bad ? -1 : 0;
+}
+
+// Move s on to its next name, fetching its next batch when this one runs out.
+// Returns -1 if the batch could not be had, in which case the listing cannot
+// go on.
+static int list_advance(struct list_source *s, const char *resolved_path, const char *dir_path) {
+    s->next = dfs_list_next(&s->reader);
+    if (s->next || s->reader.bad)
+        return s->reader.bad ? -1 : 0;
+    if (!s->more)
+        return 0;
+
+    // The reader still holds the last name, which is where the next batch starts
+    if (!s->node) {
+        if (list_scan_local(s, resolved_path) < 0)
+            return -1;
+    } else {
+        list_request(s, 1, dir_path);
+        if (list_collect(s, 1) > 0)
+            return -1;
+    }
+    return list_start(s);
+}
+
+/*
+ * Listing cache.  Each S1 process keeps the listings it sent recently, as
+ * the bytes of the reply, and answers a repeated dispfnames from memory.
+ * Whether a cached listing is still current is decided by a table that all
+ * S1 processes share (it is mapped before the first fork): each directory
+ * hashes to a bucket holding
+ *
+ *   active   uploads and removes under way in it
+ *   gen      changes made through S1 << 32 | changes notified from outside
+ *
+ * and a listing is current while its bucket is as it was when the listing
+ * was fetched.  An upload or remove marks its directory active from before
+ * it starts until after the client has its reply, so a client always sees
+ * its own change.  Changes made behind S1's back come from a watcher
+ * process that follows S1's store through an index and every storage node
+ * through WATCH (dfs_watch.h); nothing is served from the cache unless all
+ * of them are being followed.  With -r ms, a listing whose directory has only
+ * had outside changes is still served up to ms after it was fetched, and
+ * fetched again once the client has it.
+ */
+#define LIST_CACHE_SLOTS 64
+#define LIST_CACHE_ENTRY_MAX (256 * 1024)  /* Larger listings are not cached */
+#define LIST_BUCKETS 4096
+#define LIST_FOLLOWED_ALL (1 + dfs_cluster.count)  /* S1's store and every storage node */
+#define LIST_OWN_CHANGE (1ULL << 32)
+#define LIST_WATCH_WAIT_MS 2000            /* How long a notification may take to arrive whole */
+#define LIST_WATCH_RESTART_MS 1000         /* Least time between starts of the watcher */
+
+struct list_bucket {
+    _Atomic uint32_t active;
+    _Atomic uint64_t gen;
+};
+
+static struct list_shared {
+    struct list_bucket buckets[LIST_BUCKETS];
+    _Atomic int followed;        /* Sources whose changes reach the watcher */
+    _Atomic uint64_t hits, stale_hits, misses, stored, changes, notifications, stale_ms_total, stale_ms_max;
+} *list_shared;
+
+struct list_entry {
+    char key[DFS_NAME_MAX + 1];  /* "" for a free slot */
+    uint64_t gen;
+    double fetched, used;        /* CLOCK_MONOTONIC seconds */
+    unsigned char *body;         /* The chunks of the reply, end included */
+    size_t len;
+    int refreshing;
+};
+
+static struct list_entry list_cache[LIST_CACHE_SLOTS];
+static int list_cache_on = 1;
+static int list_stale_ms = 0;
+
+// The key of the directory at resolved_path (an absolute S1 path): the path
+// relative to S1's store, "" for the store itself. Returns -1 for a path
+// that is not cached (outside the store, or not in one form only).
+static int list_key(const char *resolved_path, char *key, size_t size) {
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    size_t root_len = strlen(root), len = 0;
+    if (strncmp(resolved_path, root, root_len) != 0 || (resolved_path[root_len] && resolved_path[root_len] != '/'))
+        return -1;
+    for (const char *p = resolved_path + root_len; *p; ) {
+        while (*p == '/')
+            p++;
+        size_t n = strcspn(p, "/");
+        if (n == 0)
+            break;
+        if (p[0] == '~' || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.') || len + n + 2 > size)
+            return -1;
+        if (len)
+            key[len++] = '/';
+        memcpy(key + len, p, n);
+        len += n;
+        p += n;
+    }
+    key[len] = '\0';
+    return 0;
+}
+
+static struct list_bucket *list_bucket(const char *key) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++)
+        h = (h ^ *p) * 1099511628211ULL;
+    return &list_shared->buckets[h % LIST_BUCKETS];
+}
+
+// Count a change to the directory key, or to every directory if key is NULL
+static void list_bump(const char *key, uint64_t change) {
+    if (key) {
+        atomic_fetch_add(&list_bucket(key)->gen, change);
+        return;
+    }
+    for (int i = 0; i < LIST_BUCKETS; i++)
+        atomic_fetch_add(&list_shared->buckets[i].gen, change);
+}
+
+// Bracket an upload or remove in the directory key (NULL: any directory)
+static void list_change_begin(const char *key) {
+    atomic_fetch_add(&list_shared->changes, 1);
+    if (key) {
+        atomic_fetch_add(&list_bucket(key)->active, 1);
+    } else {
+        for (int i = 0; i < LIST_BUCKETS; i++)
+            atomic_fetch_add(&list_shared->buckets[i].active, 1);
+    }
+    list_bump(key, LIST_OWN_CHANGE);
+}
+
+static void list_change_end(const char *key) {
+    list_bump(key, LIST_OWN_CHANGE);
+    if (key) {
+        atomic_fetch_sub(&list_bucket(key)->active, 1);
+    } else {
+        for (int i = 0; i < LIST_BUCKETS; i++)
+            atomic_fetch_sub(&list_shared->buckets[i].active, 1);
+    }
+}
+
+// Note an outside change to the entry at path, relative to a store (NULL:
+// anything); the listing of the directory it is in is no longer current
+static void list_notify(const char *path) {
+    atomic_fetch_add(&list_shared->notifications, 1);
+    if (!path) {
+        list_bump(NULL, 1);
+        return;
+    }
+    char key[DFS_NAME_MAX + 1];
+    snprintf(key, sizeof(key), "%s", path);
+    list_bump(key, 1);  // The entry itself, in case it was a directory
+    char *slash = strrchr(key, '/');
+    if (slash)
+        *slash = '\0';
+    else
+        key[0] = '\0';
+    list_bump(key, 1);
+}
+
+static struct list_entry *list_cache_find(const char *key) {
+    for (int i = 0; i < LIST_CACHE_SLOTS; i++) {
+        if (list_cache[i].body && strcmp(list_cache[i].key, key) == 0)
+            return &list_cache[i];
+    }
+    return NULL;
+}
+
+static void list_cache_drop(const char *key) {
+    struct list_entry *e = list_cache_find(key);
+    if (e) {
+        free(e->body);
+        memset(e, 0, sizeof(*e));
+    }
+}
+
+// Keep body (taken over) as the listing of key, in place of its old one or
+// of the listing used longest ago
+static void list_cache_store(const char *key, uint64_t gen, double fetched, unsigned char *body, size_t len) {
+    struct list_entry *e = list_cache_find(key);
+    for (int i = 0; !e && i < LIST_CACHE_SLOTS; i++) {
+        if (!list_cache[i].body)
+            e = &list_cache[i];
+    }
+    for (int i = 0; !e && i < LIST_CACHE_SLOTS; i++) {
+        if (i == 0 || list_cache[i].used < e->used)
+            e = &list_cache[i];
+    }
+    free(e->body);
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    e->gen = gen;
+    e->fetched = e->used = fetched;
+    e->body = body;
+    e->len = len;
+    e->refreshing = 0;
+    atomic_fetch_add(&list_shared->stored, 1);
+}
+
+enum { LIST_MISS, LIST_FRESH, LIST_STALE };
+
+// Whether the cached listing e of a directory in bucket b can be served
+static int list_cache_state(const struct list_entry *e, struct list_bucket *b, double now) {
+    if (atomic_load(&list_shared->followed) < LIST_FOLLOWED_ALL || atomic_load(&b->active) != 0)
+        return LIST_MISS;
+    uint64_t gen = atomic_load(&b->gen);
+    if (gen == e->gen)
+        return LIST_FRESH;
+    if (list_stale_ms > 0 && gen / LIST_OWN_CHANGE == e->gen / LIST_OWN_CHANGE &&
+        (now - e->fetched) * 1000 <= list_stale_ms)
+        return LIST_STALE;
+    return LIST_MISS;
+}
+
+// A copy of the reply being sent, for the cache
+struct list_copy {
+    unsigned char *buf;
+    size_t len, cap;
+    int dropped;                 /* Too large, or out of memory */
+};
+
+static void list_copy_add(struct list_copy *copy, const void *data, size_t len) {
+    if (copy->dropped)
+        return;
+    if (copy->len + len > copy->cap) {
+        size_t cap = copy->cap ? 2 * copy->cap : 4096;
+        while (cap < copy->len + len)
+            cap *= 2;
+        unsigned char *buf = copy->len + len <= LIST_CACHE_ENTRY_MAX ? realloc(copy->buf, cap) : NULL;
+        if (!buf) {
+            free(copy->buf);
+            copy->buf = NULL;
+            copy->dropped = 1;
+            return;
+        }
+        copy->buf = buf;
+        copy->cap = cap;
+    }
+    memcpy(copy->buf + copy->len, data, len);
+    copy->len += len;
+}
+
+// Send the batch in w to the client (if there is one) and add it to copy
+static int list_send_batch(int client_sock, const struct dfs_list_writer *w, struct list_copy *copy) {
+    unsigned char head[8];
+    dfs_put64(head, w->len);
+    list_copy_add(copy, head, sizeof(head));
+    list_copy_add(copy, w->buf, w->len);
+    return client_sock < 0 ? 0 : dfs_list_send_batch(client_sock, w);
+}
+
+// Fetch the listing of dir_path from every store and send it to the client,
+// keeping a copy of the reply in copy. With client_sock -1 the listing is
+// only copied. Returns 1 if it was sent (*missing counts the stores that
+// did not answer), 0 if an error status was sent instead, or -1 if the
+// listing broke off after it had started going to the client.
+static int list_fetch(int client_sock, const struct dfs_header *req, const char *dir_path,
+                      const char *resolved_path, struct list_copy *copy, int *missing) {
+    // Check if the directory exists
+    DIR *dir = opendir(resolved_path);
+    if (!dir) {
+        perror("Directory open error");
+        if (client_sock >= 0)
+            dfs_send_status(client_sock, req, DFS_ENOENT);
+        return 0;
+    }
+    closedir(dir);
+
+    // Ask every storage node now, so they list their directories while we read ours
+    struct list_source src[1 + DFS_CLUSTER_MAX];
+    int sources = 1 + dfs_cluster.count;
+    memset(src, 0, sources * sizeof(src[0]));
+    src[0].ext = ".c";
+    src[0].server_name = "S1";
+    for (int i = 1; i < sources; i++) {
+        src[i].node = &dfs_cluster.nodes[i - 1];
+        src[i].ext = src[i].node->type;
+        src[i].server_name = src[i].node->name;
+    }
+    list_request(src + 1, sources - 1, dir_path);
+    
+    // Get the first local .c files, then the files of the storage nodes
+    // that answer in time
+    struct dfs_list_writer w;
+    int failed = dfs_list_writer_init(&w) < 0;
+    *missing = 0;
+    if (list_scan_local(&src[0], resolved_path) < 0)
+        (*missing)++;
+    *missing += list_collect(src + 1, sources - 1);
+    for (int i = 0; i < sources; i++)
+        failed |= list_start(&src[i]) < 0;
+    if (failed) {
+        for (int i = 0; i < sources; i++)
+            free(src[i].batch);
+        free(w.buf);
+        if (client_sock >= 0)
+            dfs_send_status(client_sock, req, DFS_EIO);
+        return 0;
+    }
+    
+    // Merge the names in the specified order: .c, .pdf, .txt, .zip, a batch
+    // per chunk, marked if a server is missing from the listing
+    int rc = client_sock < 0 ? 0 : dfs_send_chunked_head(client_sock, req, DFS_OK, *missing ? DFS_FLAG_PARTIAL : 0);
+    uint64_t total_files = 0;
+    while (rc == 0) {
+        struct list_source *first = NULL;
+        for (int i = 0; i < sources; i++) {
+            if (src[i].next && (!first || dfs_list_compare(src[i].next, first->next) < 0))
+                first = &src[i];
+        }
+        if (w.count > 0 && (!first || w.count == DFS_LIST_BATCH)) {
+            rc = list_send_batch(client_sock, &w, copy);
+            dfs_list_writer_reset(&w);
+        }
+        if (!first)
+            break;
+        dfs_list_put(&w, first->next);
+        total_files++;
+
+        // A file being moved between nodes is on both for a moment: list it once
+        for (int i = 0; i < sources && rc == 0; i++) {
+            if (&src[i] != first && src[i].next && dfs_list_compare(src[i].next, first->next) == 0 &&
+                list_advance(&src[i], resolved_path, dir_path) < 0) {
+                fprintf(stderr, "Listing of %s broke off at %s\n", src[i].server_name, src[i].reader.name);
+                rc = -1;
+            }
+        }
+        if (rc == 0 && list_advance(first, resolved_path, dir_path) < 0) {
+            fprintf(stderr, "Listing of %s broke off at %s\n", first->server_name, first->reader.name);
+            rc = -1;
+        }
+    }
+    unsigned char end[8] = { 0 };
+    list_copy_add(copy, end, sizeof(end));
+    if (rc == 0 && client_sock >= 0)
+        rc = dfs_send_chunk_end(client_sock);
+    
+    for (int i = 0; i < sources; i++)
+        free(src[i].batch);
+    free(w.buf);
+    if (rc < 0)
+        return -1;
+    printf("%s %llu filenames %s directory '%s'%s\n", client_sock < 0 ? "Fetched" : "Sent",
+           (unsigned long long)total_files, client_sock < 0 ? "of" : "to client for", dir_path,
+           *missing ? " (partial)" : "");
+    return 1;
+}
+
+// Fetch the listing of dir_path for the client (or for the cache alone, with
+// client_sock -1), and cache it under key (unless NULL) if it is complete
+// and nothing changed the directory meanwhile. Returns as list_fetch.
+static int list_fill(int client_sock, const struct dfs_header *req, const char *dir_path,
+                     const char *resolved_path, const char *key) {
+    struct list_bucket *b = key ? list_bucket(key) : NULL;
+    int cacheable = b && atomic_load(&list_shared->followed) == LIST_FOLLOWED_ALL && atomic_load(&b->active) == 0;
+    uint64_t gen = b ? atomic_load(&b->gen) : 0;
+    double fetched = clock_seconds(CLOCK_MONOTONIC);
+
+    struct list_copy copy = { NULL, 0, 0, !cacheable };
+    int missing;
+    int rc = list_fetch(client_sock, req, dir_path, resolved_path, &copy, &missing);
+    if (rc == 1 && !missing && !copy.dropped) {
+        list_cache_store(key, gen, fetched, copy.buf, copy.len);
+        return rc;
+    }
+    free(copy.buf);
+    if (key)
+        list_cache_drop(key);
+    return rc;
+}
+
+// Function to handle the dispfnames command
+// Returns -1 if the listing broke off after it had started going to the client.
+int handle_dispfnames(int client_sock, const struct dfs_header *req, const char *dir_path) {
+    char resolved_path[1024], key[DFS_NAME_MAX + 1];
+    resolve_path(dir_path, resolved_path, sizeof(resolved_path));
+    int cacheable = list_shared && list_cache_on && list_key(resolved_path, key, sizeof(key)) == 0;
+    if (!cacheable)
+        return list_fetch(client_sock, req, dir_path, resolved_path, &(struct list_copy){ .dropped = 1 },
+                          &(int){ 0 });
+
+    // A listing that is still current, or recent enough, goes out from memory
+    double now = clock_seconds(CLOCK_MONOTONIC);
+    struct list_entry *e = list_cache_find(key);
+    int state = e ? list_cache_state(e, list_bucket(key), now) : LIST_MISS;
+    if (state == LIST_MISS) {
+        atomic_fetch_add(&list_shared->misses, 1);
+        return list_fill(client_sock, req, dir_path, resolved_path, key);
+    }
+    // Send a copy: in epoll mode the entry may be replaced while this waits
+    e->used = now;
+    unsigned char *body = malloc(e->len);
+    size_t len = e->len;
+    if (!body) {
+        atomic_fetch_add(&list_shared->misses, 1);
+        return list_fill(client_sock, req, dir_path, resolved_path, key);
+    }
+    memcpy(body, e->body, len);
+    uint64_t age_ms = (now - e->fetched) * 1000;
+    int refresh = state == LIST_STALE && !e->refreshing;  // Unless someone is fetching it already
+    if (refresh)
+        e->refreshing = 1;
+
+    int rc = dfs_send_chunked_head(client_sock, req, DFS_OK, 0) < 0 || send_all(client_sock, body, len) < 0 ? -1 : 1;
+    free(body);
+    if (state == LIST_FRESH) {
+        atomic_fetch_add(&list_shared->hits, 1);
+        printf("Sent cached listing of '%s'\n", dir_path);
+        return rc;
+    }
+
+    uint64_t max = atomic_load(&list_shared->stale_ms_max);
+    atomic_fetch_add(&list_shared->stale_hits, 1);
+    atomic_fetch_add(&list_shared->stale_ms_total, age_ms);
+    while (age_ms > max && !atomic_compare_exchange_weak(&list_shared->stale_ms_max, &max, age_ms))
+        ;
+    printf("Sent cached listing of '%s' (%llu ms old)%s\n", dir_path, (unsigned long long)age_ms,
+           refresh ? ", refreshing it" : "");
+    if (refresh)
+        list_fill(-1, req, dir_path, resolved_path, key);
+    return rc;
+}
+
+// Reply to STATS with the listing cache's and the catalog's counters
+int handle_stats(int client_sock, const struct dfs_header *req) {
+    char text[2048];
+    int len = 0;
+    if (list_shared) {
+        uint64_t hits = atomic_load(&list_shared->hits), stale = atomic_load(&list_shared->stale_hits);
+        uint64_t misses = atomic_load(&list_shared->misses);
+        uint64_t served = hits + stale + misses;
+        len = snprintf(text, sizeof(text),
+                       "list_cache_hits %llu\n"
+                       "list_cache_stale_hits %llu\n"
+                       "list_cache_misses %llu\n"
+                       "list_cache_hit_ratio %.3f\n"
+                       "list_cache_stored %llu\n"
+                       "list_cache_stale_ms_avg %.1f\n"
+                       "list_cache_stale_ms_max %llu\n"
+                       "list_changes %llu\n"
+                       "list_notifications %llu\n"
+                       "list_sources_followed %d/%d\n",
+                       (unsigned long long)hits, (unsigned long long)stale, (unsigned long long)misses,
+                       served ? (double)(hits + stale) / served : 0.0,
+                       (unsigned long long)atomic_load(&list_shared->stored),
+                       stale ? (double)atomic_load(&list_shared->stale_ms_total) / stale : 0.0,
+                       (unsigned long long)atomic_load(&list_shared->stale_ms_max),
+                       (unsigned long long)atomic_load(&list_shared->changes),
+                       (unsigned long long)atomic_load(&list_shared->notifications),
+                       atomic_load(&list_shared->followed), LIST_FOLLOWED_ALL);
+    }
+    len += dfs_catalog_stats(text + len, sizeof(text) - len);
+    return dfs_send_reply(client_sock, req, DFS_OK, text, len);
+}
+
+// The directory whose listing a request changes, for the listing cache:
+// 1 with its key in key, 0 if the request changes no listing, or -1 if it
+// might change any of them
+static int list_change_key(const struct dfs_header *req, const char *name, const char *aux, char *key,
+                           size_t size) {
+    char resolved_path[1024];
+    if (req->opcode == DFS_OP_UPLOAD || req->opcode == DFS_OP_UPLOAD_COMMIT) {
+        resolve_path(aux, resolved_path, sizeof(resolved_path));
+        return list_key(resolved_path, key, size) == 0 ? 1 : -1;
+    }
+    if (req->opcode == DFS_OP_REMOVE) {
+        resolve_path(name, resolved_path, sizeof(resolved_path));
+        char *slash = strrchr(resolved_path, '/');
+        if (slash)
+            *slash = '\0';
+        return list_key(resolved_path, key, size) == 0 ? 1 : -1;
+    }
+    return 0;
+}
+
+/* ===== CHANGE WATCHER ===== */
+
+// dfs_wait for the watcher: a notification that has started arriving must
+// arrive whole in good time
+static int list_watch_wait(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int n;
+    while ((n = poll(&pfd, 1, LIST_WATCH_WAIT_MS)) < 0 && errno == EINTR)
+        ;
+    return n > 0 ? 0 : -1;
+}
+
+// Start following the changes to a storage node's store. Returns the
+// connection, or -1.
+static int list_watch_connect(const struct dfs_node *node) {
+    int sock = connect_to_addr(&node->addr);
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    if (sock >= 0 && dfs_send_request(sock, DFS_OP_WATCH, id, "", NULL, NULL, 0) == 0 &&
+        dfs_recv_reply(sock, DFS_OP_WATCH, id, &reply) == 0 && reply.status == DFS_OK &&
+        (reply.flags & DFS_FLAG_CHUNKED))
+        return sock;
+    if (sock >= 0)
+        close(sock);
+    return -1;
+}
+
+// Follow S1's own store and every storage node for changes that did not go
+// through S1, and note them for the listing cache. Runs in a process of
+// its own and never returns.
+static void list_watch_run(void) {
+    dfs_wait = list_watch_wait;
+    dfs_io_nonblock = 1;
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    dfs_index_changed = list_notify;
+    atomic_store(&list_shared->followed, dfs_index_open(root) == 0);
+
+    struct {
+        const struct dfs_node *node;
+        const char *name;
+        int sock;
+        time_t retry;
+    } servers[DFS_CLUSTER_MAX];
+    int count = dfs_cluster.count;
+    for (int i = 0; i < count; i++) {
+        servers[i].node = &dfs_cluster.nodes[i];
+        servers[i].name = dfs_cluster.nodes[i].name;
+        servers[i].sock = -1;
+        servers[i].retry = 0;
+    }
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1 failed; listings will not be cached");
+        exit(1);
+    }
+
+    for (;;) {
+        // (Re)connect to any server not being followed, at most once a second
+        time_t now = time(NULL);
+        for (int i = 0; i < count; i++) {
+            if (servers[i].sock >= 0 || now < servers[i].retry)
+                continue;
+            servers[i].retry = now + 1;
+            servers[i].sock = list_watch_connect(servers[i].node);
+            struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+            if (servers[i].sock >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, servers[i].sock, &ev) == 0) {
+                atomic_fetch_add(&list_shared->followed, 1);
+                printf("Following changes on %s\n", servers[i].name);
+            } else if (servers[i].sock >= 0) {
+                close(servers[i].sock);
+                servers[i].sock = -1;
+            }
+        }
+
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, 1000);
+        for (int e = 0; e < n; e++) {
+            int i = events[e].data.u32;
+            uint64_t len;
+            char change[DFS_NAME_MAX + 2];
+            if (dfs_recv_chunk_head(servers[i].sock, &len) == 0 && len > 0 && len < sizeof(change) &&
+                recv_all(servers[i].sock, change, len) == 0) {
+                change[len] = '\0';
+                list_notify(change[0] == '+' ? change + 1 : NULL);
+                continue;
+            }
+
+            // Whatever changed from now on goes unseen, so nothing cached can be trusted
+            printf("Lost track of changes on %s\n", servers[i].name);
+            atomic_fetch_sub(&list_shared->followed, 1);
+            list_notify(NULL);
+            close(servers[i].sock);  // Also drops it from epoll
+            servers[i].sock = -1;
+        }
+    }
+}
+
+static pid_t list_watch_pid = -1;
+static volatile sig_atomic_t list_watch_down;  /* 1: exited, 2: cache dropped, to be restarted */
+static double list_watch_started;               /* CLOCK_MONOTONIC seconds */
+
+// Start the watcher process; server_sock is the listener, which it closes
+static void list_watch_start(int server_sock) {
+    list_watch_started = clock_seconds(CLOCK_MONOTONIC);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Go down with S1, or nothing would notice the connections left open
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+            exit(0);
+        close(server_sock);
+        signal(SIGCHLD, SIG_DFL);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        list_watch_run();
+    }
+    if (pid < 0)
+        perror("Fork failed; listings will not be cached until the watcher starts");
+    list_watch_pid = pid;
+    list_watch_down = pid < 0 ? 2 : 0;
+}
+
+// Called by S1's main process for each child that exits, also from its
+// SIGCHLD handler, so it only notes whether that was the watcher
+static int list_watch_exited(pid_t pid) {
+    if (!list_shared || pid != list_watch_pid)
+        return 0;
+    list_watch_down = 1;
+    return 1;
+}
+
+// Restart the watcher if it has exited, no sooner than LIST_WATCH_RESTART_MS
+// after it last started; nothing cached can be trusted until a new one
+// follows every store. Returns the ms until the restart is due, or -1 if
+// none is pending.
+static int list_watch_restart(int server_sock) {
+    if (!list_watch_down)
+        return -1;
+    if (list_watch_down == 1) {
+        atomic_store(&list_shared->followed, 0);
+        list_notify(NULL);
+        list_watch_down = 2;
+    }
+    double wait = list_watch_started + LIST_WATCH_RESTART_MS / 1000.0 - clock_seconds(CLOCK_MONOTONIC);
+    if (wait > 0)
+        return (int)(wait * 1000) + 1;
+    list_watch_start(server_sock);
+    return list_watch_down ? LIST_WATCH_RESTART_MS : -1;
+}
+
+// Set up the listing cache shared by every S1 process and start the watcher
+// that keeps it current. Must run before the first fork.
+static void list_cache_start(int server_sock) {
+    if (!list_cache_on)
+        return;
+    list_shared = mmap(NULL, sizeof(*list_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (list_shared == MAP_FAILED) {
+        perror("mmap failed; listings will not be cached");
+        list_shared = NULL;
+        return;
+    }
+    list_watch_start(server_sock);
+}
+
+/* ===== REBALANCER ===== */
+
+/*
+ * When the cluster map changes, the placement policy puts some catalogued
+ * files on other nodes than the ones that hold them: those of a node that
+ * was added take a share of its type's files, and a node being drained
+ * (weight 0) gives all of its files up.  With several copies of each file
+ * (s1 -R), a copy can also be missing: one a node did not store in time
+ * for an upload, or one a read found gone.  A rebalancer process puts them
+ * right, one file at a time, while S1 serves clients as usual.
+ *
+ * A pass goes through the catalog for the files whose nodes are not the
+ * ones place_file() gives now, and streams each to every such node without
+ * a copy from a node with one: a DOWNLOAD from the one relayed straight
+ * into an UPLOAD to the other, paced to at most -m KB/s.  Until the copies
+ * are complete, reads go to the old nodes, as the catalog still says.  Then
+ * the catalog entry changes over to the new nodes in one record, if the
+ * file has not changed in the meantime, and the copies on other nodes are
+ * removed a moment later, once reads already on their way to them have got
+ * there.  A file that could not be copied to every node it belongs on
+ * keeps its old copies too, until a later pass.
+ *
+ * An upload or removal of a file that is being moved stops the move and
+ * waits for it to end: the file under way is marked in a table shared by
+ * every S1 process, which also counts the uploads and removals under way by
+ * hash of their path, and the rebalancer does not start on a file any of
+ * them may be writing.  A file skipped for that reason, or that could not
+ * be moved, is tried again by a later pass: one runs REBALANCE_RETRY_S
+ * after a pass that left files behind, and REBALANCE_REPAIR_S after an
+ * upload or read that left a file short of copies.
+ *
+ * The rebalancer's progress (files and bytes moved, what is left, the file
+ * under way) is reported by the REBALANCE command, which also starts a pass
+ * at once, pauses and resumes the rebalancer, and changes its rate.
+ */
+#define REBALANCE_RATE_KB 10240   /* Default pace for moving files, KB/s */
+#define REBALANCE_WRITERS 1024    /* Buckets of uploads and removes under way */
+#define REBALANCE_RETRY_S 30      /* How soon a pass that left files behind is run again */
+#define REBALANCE_REPAIR_S 5      /* How soon after the last pass files short of copies get a pass */
+#define REBALANCE_RESTART_MS 1000 /* Least time between starts of the rebalancer */
+#define REBALANCE_GRACE_MS 1000   /* How long an old copy stays after its file has moved */
+#define REBALANCE_PENDING 1024    /* Old copies waiting to be removed */
+#define REBALANCE_WAIT_MS 10000   /* How long a node may keep the rebalancer waiting */
+#define REBALANCE_LATE 256        /* Copies of uploads the rebalancer waits for at once */
+
+enum { REBALANCE_IDLE, REBALANCE_SCANNING, REBALANCE_MOVING, REBALANCE_PAUSED };
+
+static struct rebalance_shared {
+    _Atomic uint32_t moving;     /* Hash of the file being moved, 0 for none */
+    _Atomic int stop;            /* Stop moving it: a client is writing it */
+    _Atomic uint32_t writing[REBALANCE_WRITERS];
+    _Atomic int requested, repair, paused, state, rate_kb;
+    _Atomic uint64_t passes, files_total, files_moved, files_failed, files_skipped, stranded;
+    _Atomic uint64_t bytes_total, bytes_moved, bytes_left, current_size, current_done;
+    char current[DFS_NAME_MAX + 1];  /* The file being moved, for the report */
+} *rebalance_shared;
+
+static int rebalance_rate_kb = REBALANCE_RATE_KB;
+static int rebalance_finishing;  /* The new node has the whole file; its reply must be waited for */
+
+// The hash the writing table and moving go by; never 0
+static uint32_t rebalance_hash(const char *key) {
+    return dfs_catalog_hash(key, strlen(key)) | 1;
+}
+
+// Bracket an upload or removal of the file at key, a catalog key. A move
+// of the file that is under way is stopped, and waited for to end.
+static void rebalance_hold(const char *key) {
+    uint32_t h = rebalance_hash(key);
+    atomic_fetch_add(&rebalance_shared->writing[h % REBALANCE_WRITERS], 1);
+    if (atomic_load(&rebalance_shared->moving) != h)
+        return;
+
+    atomic_store(&rebalance_shared->stop, 1);
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec every = { { 0, 10000000 }, { 0, 10000000 } };  /* 10 ms */
+    if (timer >= 0)
+        timerfd_settime(timer, 0, &every, NULL);
+    while (atomic_load(&rebalance_shared->moving) == h) {
+        uint64_t ticks;
+        if (timer < 0 || dfs_wait(timer, POLLIN) < 0 || read(timer, &ticks, sizeof(ticks)) < 0)
+            usleep(10000);
+    }
+    if (timer >= 0) {
+        fiber_forget(timer);
+        close(timer);
+    }
+}
+
+static void rebalance_release(const char *key) {
+    atomic_fetch_sub(&rebalance_shared->writing[rebalance_hash(key) % REBALANCE_WRITERS], 1);
+}
+
+// Whether the move under way is to stop: a client is writing the file, or
+// the rebalancer has been paused
+static int rebalance_stopping(void) {
+    return atomic_load(&rebalance_shared->stop) || atomic_load(&rebalance_shared->paused);
+}
+
+// dfs_wait for the rebalancer: give up on a node that keeps it waiting, and
+// on the file under way if a client is writing it or the rebalancer is paused
+static int rebalance_wait(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    for (int waited = 0; waited < REBALANCE_WAIT_MS; waited += 100) {
+        if (!rebalance_finishing && rebalance_stopping())
+            return -1;
+        int n = poll(&pfd, 1, 100);
+        if (n > 0)
+            return 0;
+        if (n < 0 && errno != EINTR)
+            return -1;
+    }
+    return -1;
+}
+
+// Mark key as the file being moved, unless a client may be writing it.
+// Returns -1 if it is to be left for now.
+static int rebalance_claim(const char *key) {
+    uint32_t h = rebalance_hash(key);
+    atomic_store(&rebalance_shared->stop, 0);
+    snprintf(rebalance_shared->current, sizeof(rebalance_shared->current), "%s", key);
+    atomic_store(&rebalance_shared->moving, h);
+    if (atomic_load(&rebalance_shared->writing[h % REBALANCE_WRITERS]) == 0)
+        return 0;
+    atomic_store(&rebalance_shared->moving, 0);
+    return -1;
+}
+
+// Sleep as long as it takes for sent bytes since started (CLOCK_MONOTONIC
+// seconds) to keep to the rate, or until the move is to stop
+static void rebalance_pace(double started, uint64_t sent) {
+    int rate_kb = atomic_load(&rebalance_shared->rate_kb);
+    if (rate_kb <= 0)
+        return;
+    double ahead = started + sent / (rate_kb * 1024.0) - clock_seconds(CLOCK_MONOTONIC);
+    while (ahead > 0 && !rebalance_stopping()) {
+        double nap = ahead < 0.05 ? ahead : 0.05;
+        usleep((useconds_t)(nap * 1e6));
+        ahead -= nap;
+    }
+}
+
+// Have the rebalancer run a pass soon, for a file short of copies
+static void rebalance_repair(void) {
+    if (rebalance_shared)
+        atomic_store(&rebalance_shared->repair, 1);
+}
+
+// Stream the file at key from one node to another: DOWNLOAD from the one,
+// relayed chunk by chunk into an UPLOAD to the other. Returns DFS_OK once
+// the new node has stored the whole file, with its size and CRC-32 in
+// *size and *crc, or the status that stopped it (DFS_EUNAVAIL for a node
+// that broke off or a move that was stopped).
+static int rebalance_copy(const char *key, const struct dfs_node *from, const struct dfs_node *to, uint64_t *size,
+                          uint32_t *crc) {
+    int src = backend_acquire(from);
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    if (src < 0 || dfs_send_request(src, DFS_OP_DOWNLOAD, id, key, NULL, NULL, 0) < 0 ||
+        dfs_recv_reply(src, DFS_OP_DOWNLOAD, id, &reply) < 0) {
+        if (src >= 0)
+            close(src);
+        return DFS_EUNAVAIL;
+    }
+    if (reply.status != DFS_OK) {
+        backend_release(from, src);
+        return reply.status;
+    }
+    *size = reply.payload_len;
+
+    // Stored as "~/S1/<dir>", as forward_to_replicas() sends it, and as
+    // surely on disk as an upload's copies
+    char dest[DFS_NAME_MAX + 8];
+    const char *slash = strrchr(key, '/');
+    snprintf(dest, sizeof(dest), "~/S1/%.*s", slash ? (int)(slash - key) : 0, key);
+    // Files go one after another, so the last bit of each must not wait on a delayed ACK
+    int dst = backend_acquire(to), one = 1;
+    if (dst >= 0)
+        setsockopt(dst, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    uint32_t up_id = dfs_next_request_id();
+    if (dst >= 0 && dfs_send_request_flags(dst, DFS_OP_UPLOAD, replica_count > 1 ? DFS_FLAG_SYNC : 0, up_id,
+                                           slash ? slash + 1 : key, dest, NULL, 0, *size) < 0) {
+        close(dst);
+        dst = -1;
+    }
+
+    char buffer[DFS_CHUNK_SIZE];
+    uint64_t remaining = *size;
+    double started = clock_seconds(CLOCK_MONOTONIC);
+    *crc = crc32(0, NULL, 0);
+    while (dst >= 0 && remaining > 0) {
+        size_t want = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        ssize_t n = rebalance_stopping() ? -1 : recv_some(src, buffer, want);
+        if (n <= 0 || send_all(dst, buffer, n) < 0) {
+            close(dst);  // The new node discards the partial file
+            dst = -1;
+            break;
+        }
+        remaining -= n;
+        *crc = crc32(*crc, (const unsigned char *)buffer, n);
+        atomic_fetch_add(&rebalance_shared->bytes_moved, n);
+        atomic_fetch_sub(&rebalance_shared->bytes_left, n);
+        atomic_fetch_add(&rebalance_shared->current_done, n);
+        rebalance_pace(started, *size - remaining);
+    }
+    if (dst < 0) {
+        close(src);
+        return DFS_EUNAVAIL;
+    }
+    backend_release(from, src);
+
+    // Past this point the new node stores the file, so the move is not stopped
+    rebalance_finishing = 1;
+    int rc = dfs_recv_reply(dst, DFS_OP_UPLOAD, up_id, &reply) < 0 || dfs_skip_payload(dst, reply.payload_len) < 0;
+    rebalance_finishing = 0;
+    if (rc) {
+        close(dst);
+        return DFS_EUNAVAIL;
+    }
+    backend_release(to, dst);
+    return reply.status;
+}
+
+// A file to move, found by a pass
+struct rebalance_move {
+    char *key;
+    struct dfs_catalog_info info;  /* As the pass found it */
+    uint64_t bytes;                /* Its size for each copy it needs */
+};
+
+struct rebalance_plan {
+    struct rebalance_move *moves;
+    size_t count, cap;
+    uint64_t bytes, stranded;
+};
+
+// dfs_catalog_each callback: note the file if it is not on the nodes it belongs on
+static void rebalance_plan_file(const char *key, const struct dfs_catalog_info *info, void *arg) {
+    struct rebalance_plan *plan = arg;
+    int want[DFS_CATALOG_COPIES], count = place_file(key, want), sources = 0, missing = 0;
+    if (dfs_catalog_has(info, DFS_CLUSTER_LOCAL))
+        return;
+    for (int i = 0; i < info->copies; i++)
+        sources += dfs_cluster_node(info->nodes[i]) != NULL;
+    for (int i = 0; i < count; i++)
+        missing += !dfs_catalog_has(info, want[i]);
+    if (missing == 0 && info->copies == count)
+        return;
+    if (count == 0 || want[0] == DFS_CLUSTER_LOCAL || sources == 0) {
+        plan->stranded++;  // On nodes no longer in the map, or of a type no node takes
+        return;
+    }
+    if (plan->count == plan->cap) {
+        size_t cap = plan->cap ? 2 * plan->cap : 256;
+        struct rebalance_move *moves = realloc(plan->moves, cap * sizeof(*moves));
+        if (!moves)
+            return;
+        plan->moves = moves;
+        plan->cap = cap;
+    }
+    char *copy = strdup(key);
+    if (!copy)
+        return;
+    plan->moves[plan->count++] = (struct rebalance_move){ copy, *info, missing * info->size };
+    plan->bytes += missing * info->size;
+}
+
+// Old copies of moved files, removed once REBALANCE_GRACE_MS have passed:
+// a ring, oldest first
+static struct rebalance_old_copy {
+    char key[DFS_NAME_MAX + 1];
+    int node;
+    double due;
+} rebalance_pending[REBALANCE_PENDING];
+static int rebalance_pending_first, rebalance_pending_count;
+
+// Remove the old copies that are due, or all of them (once due) if all is
+// set; at least one if the ring is full
+static void rebalance_reap(int all) {
+    while (rebalance_pending_count > 0) {
+        struct rebalance_old_copy *p = &rebalance_pending[rebalance_pending_first];
+        double wait = p->due - clock_seconds(CLOCK_MONOTONIC);
+        if (wait > 0 && !all && rebalance_pending_count < REBALANCE_PENDING)
+            return;
+        if (wait > 0)
+            usleep((useconds_t)(wait * 1e6));
+        // A copy the catalog lists again, stored there since, stays
+        const struct dfs_node *n = dfs_cluster_node(p->node);
+        struct dfs_catalog_info now;
+        int found = dfs_catalog_lookup(p->key, &now), listed = found && dfs_catalog_has(&now, p->node);
+        int status = n && !listed ? remove_from_node(n, p->key, found ? DFS_FLAG_MOVED : 0) : DFS_OK;
+        if (status != DFS_OK && status != DFS_ENOENT)
+            printf("Could not remove the old copy of %s from %s (status %d)\n", p->key, n->name, status);
+        rebalance_pending_first = (rebalance_pending_first + 1) % REBALANCE_PENDING;
+        rebalance_pending_count--;
+    }
+}
+
+// Note the old copy of key on node, to be removed once reads on their way
+// to it have got there
+static void rebalance_defer_remove(const char *key, int node) {
+    rebalance_reap(0);
+    int i = (rebalance_pending_first + rebalance_pending_count++) % REBALANCE_PENDING;
+    snprintf(rebalance_pending[i].key, sizeof(rebalance_pending[i].key), "%s", key);
+    rebalance_pending[i].node = node;
+    rebalance_pending[i].due = clock_seconds(CLOCK_MONOTONIC) + REBALANCE_GRACE_MS / 1000.0;
+}
+
+// The copies of uploads whose nodes were still storing them when the
+// client had its reply, handed over by the S1 processes (see REPLICATION)
+static struct rebalance_late_copy {
+    struct replica_handoff h;
+    int sock;
+    double due;                  /* CLOCK_MONOTONIC seconds */
+} rebalance_late[REBALANCE_LATE];
+static int rebalance_late_count;
+
+// Take the copies handed over, then wait up to ms for their nodes and
+// catalogue (or remove) each copy that has been stored; the rest are given
+// up on REPLICA_LAG_MS after they came, and left to a later pass
+static void rebalance_take_copies(int ms) {
+    struct pollfd pfd[1 + REBALANCE_LATE];
+    int n = 0;
+    if (replica_handoff_sock[0] >= 0)
+        pfd[n++] = (struct pollfd){ .fd = replica_handoff_sock[0], .events = POLLIN };
+    for (int i = 0; i < rebalance_late_count; i++)
+        pfd[n++] = (struct pollfd){ .fd = rebalance_late[i].sock, .events = POLLIN };
+    if (n > 0)
+        poll(pfd, n, ms);
+    else if (ms > 0)
+        usleep(ms * 1000);
+
+    for (;;) {
+        struct replica_handoff h;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { &h, sizeof(h) };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                              .msg_controllen = sizeof(control) };
+        if (replica_handoff_sock[0] < 0 ||
+            recvmsg(replica_handoff_sock[0], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(h))
+            break;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        int sock = -1;
+        if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            memcpy(&sock, CMSG_DATA(cm), sizeof(int));
+        if (sock < 0) {
+            rebalance_defer_remove(h.key, h.node);
+        } else if (rebalance_late_count == REBALANCE_LATE || !dfs_cluster_node(h.node)) {
+            close(sock);
+            rebalance_repair();
+        } else {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+            double due = clock_seconds(CLOCK_MONOTONIC) + REPLICA_LAG_MS / 1000.0;
+            rebalance_late[rebalance_late_count++] = (struct rebalance_late_copy){ h, sock, due };
+        }
+    }
+
+    for (int i = 0; i < rebalance_late_count;) {
+        struct rebalance_late_copy *l = &rebalance_late[i];
+        struct pollfd ready = { .fd = l->sock, .events = POLLIN };
+        struct replica r = { .node = dfs_cluster_node(l->h.node), .sock = l->sock, .id = l->h.id };
+        if (poll(&ready, 1, 0) > 0) {
+            rebalance_finishing = 1;  // Its answer is read even while paused
+            replica_read(&r, l->h.opcode);
+            rebalance_finishing = 0;
+            if (r.answered && r.status == DFS_OK && l->h.version < 0) {
+                rebalance_defer_remove(l->h.key, l->h.node);
+            } else if (r.answered && r.status == DFS_OK && l->h.version > 0) {
+                int64_t next = catalog_late_copy(l->h.key, l->h.version, l->h.node);
+                for (int k = 0; k < rebalance_late_count && next > 0; k++)  // Others of that upload
+                    if (rebalance_late[k].h.version == l->h.version && strcmp(rebalance_late[k].h.key, l->h.key) == 0)
+                        rebalance_late[k].h.version = next;
+                if (next == 0)
+                    rebalance_repair();
+            } else if (l->h.version > 0) {
+                rebalance_repair();
+            }
+        } else if (clock_seconds(CLOCK_MONOTONIC) >= l->due) {
+            printf("%s did not store %s within %d ms\n", r.node->name, l->h.key, REPLICA_LAG_MS);
+            close(l->sock);
+            if (l->h.version > 0)
+                rebalance_repair();
+        } else {
+            i++;
+            continue;
+        }
+        rebalance_late[i] = rebalance_late[--rebalance_late_count];
+    }
+    rebalance_reap(0);
+    fflush(stdout);
+}
 
-// Function to remove file from S1, S2, or S3 (local or remote)
-int handle_remove(int client_sock, const char *path) {
-    char *ext = strrchr(path, '.');
-    char resolved_path[1024];
-    int status_code = 0;  // 0: Success, 1: File not found, 2: Permission denied
+// Copy the file m is about to node to from any node with a copy. Returns
+// DFS_OK, DFS_ENOENT if no copy was found, or another status if it could
+// not be copied.
+static int rebalance_copy_to(const struct rebalance_move *m, const struct dfs_node *to) {
+    int status = DFS_EUNAVAIL, sources = 0, lost = 0;
+    for (int i = 0; i < m->info.copies && status != DFS_OK && !rebalance_stopping(); i++) {
+        const struct dfs_node *from = dfs_cluster_node(m->info.nodes[i]);
+        if (!from)
+            continue;
+        uint64_t size = 0;
+        uint32_t crc;
+        sources++;
+        status = rebalance_copy(m->key, from, to, &size, &crc);
+        if (status == DFS_OK && m->info.has_checksum && (size != m->info.size || crc != m->info.checksum)) {
+            printf("Rebalancer: %s on %s does not match its CRC\n", m->key, from->name);
+            remove_from_node(to, m->key, DFS_FLAG_MOVED);
+            status = DFS_EIO;
+        } else if (status == DFS_OK) {
+            printf("Copied %s from %s to %s (%llu bytes)\n", m->key, from->name, to->name, (unsigned long long)size);
+        } else if (status == DFS_ENOENT) {
+            printf("Rebalancer: %s is missing from %s\n", m->key, from->name);
+            lost++;
+        } else if (!rebalance_stopping()) {
+            printf("Rebalancer: could not copy %s from %s to %s (status %d)\n", m->key, from->name, to->name,
+                   status);
+        }
+    }
+    return sources > 0 && lost == sources ? DFS_ENOENT : status;
+}
 
-    // Check file extension
-    if (!ext || (strcmp(ext, ".c") != 0 && 
-                strcmp(ext, ".pdf") != 0 && 
-                strcmp(ext, ".txt") != 0 && 
-                strcmp(ext, ".zip") != 0)) {
-        status_code = 1;  // File not found/supported
-        send(client_sock, &status_code, sizeof(int), 0);
+// Put one file on the nodes it belongs on, as the pass found it. Returns 1
+// if it is there, 0 if it is to be tried again later, -1 if it failed.
+static int rebalance_file(const struct rebalance_move *m) {
+    struct dfs_catalog_info now;
+    if (!dfs_catalog_lookup(m->key, &now) || now.version != m->info.version)
+        return 0;  // Stored again or removed since the pass began, wherever it belongs now
+    if (rebalance_claim(m->key) < 0)
         return 0;
+
+    // Copy it to each node it belongs on that has no copy yet
+    int want[DFS_CATALOG_COPIES], count = place_file(m->key, want);
+    int next[DFS_CATALOG_COPIES], n = 0, copied[DFS_CATALOG_COPIES], made = 0, status = DFS_OK;
+    atomic_store(&rebalance_shared->current_size, m->bytes);
+    atomic_store(&rebalance_shared->current_done, 0);
+    for (int i = 0; i < count && status != DFS_ENOENT && !rebalance_stopping(); i++) {
+        if (dfs_catalog_has(&m->info, want[i])) {
+            next[n++] = want[i];
+            continue;
+        }
+        status = rebalance_copy_to(m, dfs_cluster_node(want[i]));
+        if (status == DFS_OK)
+            next[n++] = copied[made++] = want[i];
     }
 
-    // For .c files, resolve path and remove locally
-    if (strcmp(ext, ".c") == 0) {
-        resolve_path(path, resolved_path, sizeof(resolved_path));
-        
-        printf("Attempting to remove .c file: %s\n", resolved_path);
-        
-        // Try to access the file first
-        if (access(resolved_path, F_OK) != 0) {
-            status_code = 1;  // File not found
-            send(client_sock, &status_code, sizeof(int), 0);
-            return 0;
+    // Until it is on every node it belongs on, it keeps the copies it had
+    int complete = n == count, rc = 0;
+    for (int i = 0; i < m->info.copies && !complete && n < DFS_CATALOG_COPIES; i++) {
+        if (dfs_cluster_node(m->info.nodes[i])) {
+            int listed = 0;
+            for (int k = 0; k < n; k++)
+                listed |= next[k] == m->info.nodes[i];
+            if (!listed)
+                next[n++] = m->info.nodes[i];
+        }
+    }
+    char names[256];
+    if (status == DFS_ENOENT) {
+        printf("Rebalancer: %s is missing from every node\n", m->key);
+        dfs_catalog_forget(m->key, m->info.version);
+        rc = -1;
+    } else if (!complete && made == 0) {
+        rc = rebalance_stopping() ? 0 : -1;
+    } else if (dfs_catalog_move(m->key, &m->info, next, n) > 0) {
+        printf("%s is on %s\n", m->key, node_names(next, n, names, sizeof(names)));
+        rc = complete ? 1 : rebalance_stopping() ? 0 : -1;
+    } else {
+        // Not the file the catalog has any more
+        for (int i = 0; i < made; i++) {
+            if (!dfs_catalog_lookup(m->key, &now) || !dfs_catalog_has(&now, copied[i]))
+                remove_from_node(dfs_cluster_node(copied[i]), m->key, catalog_moved_flag(m->key));
         }
+        complete = 0;
+    }
+    atomic_store(&rebalance_shared->moving, 0);
+
+    // The copies it no longer needs
+    for (int i = 0; i < m->info.copies && complete; i++) {
+        int kept = 0;
+        for (int k = 0; k < n; k++)
+            kept |= next[k] == m->info.nodes[i];
+        if (!kept && dfs_cluster_node(m->info.nodes[i]))
+            rebalance_defer_remove(m->key, m->info.nodes[i]);
+    }
+    return rc;
+}
 
-        // Try to remove the file
-        if (remove(resolved_path) != 0) {
-            status_code = 2;  // Permission denied or other error
-            send(client_sock, &status_code, sizeof(int), 0);
-            perror("Error removing .c file");
-            return 0;
+// One pass over the catalog. Returns the number of files left behind.
+static uint64_t rebalance_pass(void) {
+    struct rebalance_shared *rs = rebalance_shared;
+    struct rebalance_plan plan = { 0 };
+    atomic_store(&rs->state, REBALANCE_SCANNING);
+    dfs_catalog_each(rebalance_plan_file, &plan);
+
+    atomic_fetch_add(&rs->passes, 1);
+    atomic_store(&rs->files_total, plan.count);
+    atomic_store(&rs->bytes_total, plan.bytes);
+    atomic_store(&rs->bytes_left, plan.bytes);
+    atomic_store(&rs->stranded, plan.stranded);
+    atomic_store(&rs->files_moved, 0);
+    atomic_store(&rs->files_failed, 0);
+    atomic_store(&rs->files_skipped, 0);
+    atomic_store(&rs->bytes_moved, 0);
+    if (plan.count > 0)
+        printf("Rebalancer: %zu file(s), %llu bytes, to move\n", plan.count, (unsigned long long)plan.bytes);
+    if (plan.stranded > 0)
+        printf("Rebalancer: %llu file(s) on nodes no longer in the map, or of types no node takes\n",
+               (unsigned long long)plan.stranded);
+
+    for (size_t i = 0; i < plan.count; i++) {
+        while (atomic_load(&rs->paused)) {
+            atomic_store(&rs->state, REBALANCE_PAUSED);
+            rebalance_take_copies(200);
         }
+        atomic_store(&rs->state, REBALANCE_MOVING);
+        rebalance_take_copies(0);
+        int rc = rebalance_file(&plan.moves[i]);
+        uint64_t done = atomic_exchange(&rs->current_done, 0), size = plan.moves[i].bytes;
+        if (done < size)  // Whatever was not sent is no longer to do
+            atomic_fetch_sub(&rs->bytes_left, size - done);
+        else
+            atomic_fetch_add(&rs->bytes_left, done - size);
+        atomic_fetch_add(rc == 1 ? &rs->files_moved : rc == 0 ? &rs->files_skipped : &rs->files_failed, 1);
+        rs->current[0] = '\0';
+        free(plan.moves[i].key);
+    }
+    free(plan.moves);
+    rebalance_reap(1);
+    atomic_store(&rs->bytes_left, 0);
+    atomic_store(&rs->state, REBALANCE_IDLE);
+
+    uint64_t left = atomic_load(&rs->files_failed) + atomic_load(&rs->files_skipped);
+    if (plan.count > 0)
+        printf("Rebalancer: moved %llu of %zu file(s) (%llu bytes), %llu left for later\n",
+               (unsigned long long)atomic_load(&rs->files_moved), plan.count,
+               (unsigned long long)atomic_load(&rs->bytes_moved), (unsigned long long)left);
+    fflush(stdout);
+    return left;
+}
 
-        // File successfully removed
-        status_code = 0;
-        send(client_sock, &status_code, sizeof(int), 0);
-        printf("Successfully removed .c file: %s\n", resolved_path);
-        return 1;
+// Run passes: one at startup, then whenever one is asked for, every
+// REBALANCE_RETRY_S while files are left behind, and when files are short
+// of copies. Runs in a process of its
+// own and never returns.
+static void rebalance_run(void) {
+    dfs_wait = rebalance_wait;
+    dfs_io_nonblock = 1;
+    atomic_store(&rebalance_shared->moving, 0);
+    for (;;) {
+        atomic_store(&rebalance_shared->requested, 0);
+        atomic_store(&rebalance_shared->repair, 0);
+        time_t retry = rebalance_pass() > 0 ? time(NULL) + REBALANCE_RETRY_S : 0;
+        time_t repair = time(NULL) + REBALANCE_REPAIR_S;
+        while (!atomic_load(&rebalance_shared->requested) && (!retry || time(NULL) < retry) &&
+               !(atomic_load(&rebalance_shared->repair) && time(NULL) >= repair))
+            rebalance_take_copies(200);
+    }
+}
+
+static pid_t rebalance_pid = -1;
+static volatile sig_atomic_t rebalance_down;  /* Exited, to be restarted */
+static double rebalance_started;               /* CLOCK_MONOTONIC seconds */
+
+// Start the rebalancer process; server_sock is the listener, which it closes
+static void rebalance_start(int server_sock) {
+    rebalance_started = clock_seconds(CLOCK_MONOTONIC);
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+            exit(0);
+        close(server_sock);
+        signal(SIGCHLD, SIG_DFL);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        rebalance_run();
     }
+    if (pid < 0)
+        perror("Fork failed; files will not be rebalanced until the rebalancer starts");
+    rebalance_pid = pid;
+    rebalance_down = pid < 0;
+}
 
-    // For .pdf files, forward remove request to S2
-    else if (strcmp(ext, ".pdf") == 0) {
-        // Create socket to S2
-        int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_sock < 0) {
-            status_code = 2;  // Error code for failure
-            send(client_sock, &status_code, sizeof(int), 0);
-            perror("Socket creation to S2 failed");
-            return 0;
-        }
+// Called by S1's main process for each child that exits, also from its
+// SIGCHLD handler, so it only notes whether that was the rebalancer
+static int rebalance_exited(pid_t pid) {
+    if (!rebalance_shared || pid != rebalance_pid)
+        return 0;
+    rebalance_down = 1;
+    return 1;
+}
 
-        struct sockaddr_in serv_addr;
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(S2_PORT);
-        serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+// Restart the rebalancer if it has exited, no sooner than
+// REBALANCE_RESTART_MS after it last started. Returns the ms until the
+// restart is due, or -1 if none is pending.
+static int rebalance_restart(int server_sock) {
+    if (!rebalance_down)
+        return -1;
+    double wait = rebalance_started + REBALANCE_RESTART_MS / 1000.0 - clock_seconds(CLOCK_MONOTONIC);
+    if (wait > 0)
+        return (int)(wait * 1000) + 1;
+    rebalance_start(server_sock);
+    return rebalance_down ? REBALANCE_RESTART_MS : -1;
+}
 
- if (connect(server_sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-            status_code = 2;  // Error code for failure
-            send(client_sock, &status_code, sizeof(int), 0);
-            close(server_sock);
-            perror("Connection to S2 failed");
-            return 0;
-        }
+// Set up the rebalancer's shared table and start it. Must run before the
+// first fork, and after the catalog is open.
+static void rebalance_init(int server_sock) {
+    if (!dfs_catalog.shared)
+        return;
+    rebalance_shared = mmap(NULL, sizeof(*rebalance_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rebalance_shared == MAP_FAILED) {
+        perror("mmap failed; files will not be rebalanced");
+        rebalance_shared = NULL;
+        return;
+    }
+    atomic_store(&rebalance_shared->rate_kb, rebalance_rate_kb);
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, replica_handoff_sock) < 0)
+        perror("socketpair failed; uploads will not wait for slow copies");
+    rebalance_start(server_sock);
+}
 
-        // Send "REMOVE" command to S2
-        char cmd[10] = "REMOVE";
-        send(server_sock, cmd, sizeof(cmd), 0);
+// Handle a REBALANCE request: carry out the action, if any, then report
+// the rebalancer's progress
+int handle_rebalance(int client_sock, const struct dfs_header *req, const char *action, const char *arg) {
+    struct rebalance_shared *rs = rebalance_shared;
+    if (!rs)
+        return dfs_send_status(client_sock, req, DFS_EUNAVAIL);
+    if (strcmp(action, "start") == 0) {
+        atomic_store(&rs->requested, 1);
+    } else if (strcmp(action, "pause") == 0 || strcmp(action, "resume") == 0) {
+        atomic_store(&rs->paused, action[0] == 'p');
+    } else if (strcmp(action, "rate") == 0 && *arg && atoi(arg) >= 0) {
+        atomic_store(&rs->rate_kb, atoi(arg));
+    } else if (*action && strcmp(action, "status") != 0) {
+        return dfs_send_status(client_sock, req, DFS_EINVAL);
+    }
 
-        // Extract path components after S1 prefix
-        char server_path[512];
-        resolve_path(path, server_path, sizeof(server_path));
+    static const char *states[] = { "idle", "scanning", "moving", "paused" };
+    int state = atomic_load(&rs->state);
+    if (atomic_load(&rs->paused) && state != REBALANCE_IDLE)
+        state = REBALANCE_PAUSED;
+    uint64_t total = atomic_load(&rs->files_total), moved = atomic_load(&rs->files_moved);
+    uint64_t failed = atomic_load(&rs->files_failed), skipped = atomic_load(&rs->files_skipped);
+    char text[2048 + DFS_NAME_MAX];
+    int len = snprintf(text, sizeof(text),
+                       "rebalance_state %s%s\n"
+                       "rebalance_rate_kb %d\n"
+                       "rebalance_passes %llu\n"
+                       "rebalance_files_total %llu\n"
+                       "rebalance_files_moved %llu\n"
+                       "rebalance_files_failed %llu\n"
+                       "rebalance_files_skipped %llu\n"
+                       "rebalance_files_remaining %llu\n"
+                       "rebalance_files_stranded %llu\n"
+                       "rebalance_bytes_total %llu\n"
+                       "rebalance_bytes_moved %llu\n"
+                       "rebalance_bytes_remaining %llu\n",
+                       states[state], atomic_load(&rs->paused) && state == REBALANCE_IDLE ? " (paused)" : "",
+                       atomic_load(&rs->rate_kb), (unsigned long long)atomic_load(&rs->passes),
+                       (unsigned long long)total, (unsigned long long)moved, (unsigned long long)failed,
+                       (unsigned long long)skipped,
+                       (unsigned long long)(state == REBALANCE_IDLE ? 0 : total - moved - failed - skipped),
+                       (unsigned long long)atomic_load(&rs->stranded), (unsigned long long)atomic_load(&rs->bytes_total),
+                       (unsigned long long)atomic_load(&rs->bytes_moved),
+                       (unsigned long long)atomic_load(&rs->bytes_left));
+    if (atomic_load(&rs->moving))
+        len += snprintf(text + len, sizeof(text) - len, "rebalance_current %.*s %llu/%llu\n", DFS_NAME_MAX,
+                        rs->current, (unsigned long long)atomic_load(&rs->current_done),
+                        (unsigned long long)atomic_load(&rs->current_size));
+    return dfs_send_reply(client_sock, req, DFS_OK, text, len);
+}
 
-        char relative_path[512];
-        extract_path_components(server_path, relative_path, sizeof(relative_path));
+// Handle a part, progress query or commit of a resumable upload: .c files
+// are staged here, other types by the servers that store them. A commit
+// puts the file in the catalog.
+// Returns -1 if the client connection broke.
+int handle_upload_session(int client_sock, const struct dfs_header *req, const char *filename, const char *dest_path) {
+    char key[DFS_NAME_MAX + 1];
+    int nodes[DFS_CATALOG_COPIES];
+    int count = upload_key(filename, dest_path, key, sizeof(key)) == 0 ? place_file(key, nodes) : 0;
+    if (count && nodes[0] == DFS_CLUSTER_LOCAL) {
+        char file_path[1024];
+        local_upload_path(filename, dest_path, file_path, sizeof(file_path));
+        if (!dfs_serve_upload(client_sock, req, file_path))
+            return -1;
+        if (req->opcode == DFS_OP_UPLOAD_COMMIT)
+            catalog_stored(key, nodes, 1, 0, NULL);
+        return 0;
+    }
+    if (count)
+        return store_replicas(client_sock, req, filename, dest_path, key, nodes, count);
 
-        // Send the path to the server
-        send(server_sock, relative_path, sizeof(relative_path), 0);
+    if (dfs_skip_payload(client_sock, req->payload_len) < 0)
+        return -1;
+    dfs_send_committed(client_sock, req, DFS_EINVAL, 0);
+    return 0;
+}
 
-        // Get status code from S2
-        recv(server_sock, &status_code, sizeof(int), 0);
-        close(server_sock);
+// Execute one client request whose header and names have already been read.
+// Returns 1 to keep the connection open, 0 to close it.
+static int dispatch_command(int client_sock, const struct dfs_header *req, const char *name, const char *aux) {
+    // Only uploads carry a request payload
+    if (req->payload_len != 0 && !dfs_op_has_payload(req->opcode)) {
+        printf("Unexpected payload for %s request\n", dfs_op_name(req->opcode));
+        dfs_send_status(client_sock, req, DFS_EINVAL);
+        return 0;
+    }
 
-        // Forward status code to client
-        send(client_sock, &status_code, sizeof(int), 0);
-        printf("PDF file removal request forwarded to S2. Status: %d\n", status_code);
-        return 1;
+    if (req->opcode == DFS_OP_DOWNLOAD) {
+        if (*aux)
+            printf("Download request received for: %s (bytes %s)\n", name, aux);
+        else
+            printf("Download request received for: %s\n", name);
+        if (handle_download(client_sock, req, name, aux) < 0)
+            return 0;  // Response cut short; the client cannot resync
     }
 
-    // For .txt files, forward remove request to S3
-    else if (strcmp(ext, ".txt") == 0) {
-        // Create socket to S3
-        int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_sock < 0) {
-            status_code = 2;  // Error code for failure
-            send(client_sock, &status_code, sizeof(int), 0);
-            perror("Socket creation to S3 failed");
+    else if (req->opcode == DFS_OP_STAT) {
+        printf("Stat request received for: %s\n", name);
+        if (handle_download(client_sock, req, name, "") < 0)
             return 0;
-        }
+    }
 
-        struct sockaddr_in serv_addr;
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(S3_PORT);
-        serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    else if (req->opcode == DFS_OP_REMOVE) {
+        printf("Remove request received for: %s\n", name);
+        handle_remove(client_sock, req, name);
+    }
 
-        if (connect(server_sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-            status_code = 2;  // Error code for failure
-            send(client_sock, &status_code, sizeof(int), 0);
-            close(server_sock);
-            perror("Connection to S3 failed");
+    else if (req->opcode == DFS_OP_TARFETCH) {
+        if (*aux)
+            printf("Tar request received for: %s files under %s\n", name, aux);
+        else
+            printf("Tar request received for: %s files\n", name);
+        if (handle_tarfetch(client_sock, req, name, aux) < 0)
             return 0;
-        }
+    }
 
-        // Send "REMOVE" command to S3
-        char cmd[10] = "REMOVE";
-        send(server_sock, cmd, sizeof(cmd), 0);
+    else if (req->opcode == DFS_OP_LISTFILES) {
+        printf("Directory listing request received for: %s\n", name);
+        if (handle_dispfnames(client_sock, req, name) < 0)
+            return 0;  // Listing cut short
+    }
 
-        // Extract path components after S1 prefix
-        char server_path[512];
-        resolve_path(path, server_path, sizeof(server_path));
+    else if (req->opcode == DFS_OP_UPLOAD_PART || req->opcode == DFS_OP_UPLOAD_QUERY ||
+             req->opcode == DFS_OP_UPLOAD_COMMIT) {
+        printf("%s request received for: %s (%llu bytes) to %s\n", dfs_op_name(req->opcode), name,
+               (unsigned long long)req->payload_len, aux);
+        if (handle_upload_session(client_sock, req, name, aux) < 0)
+            return 0;  // Client connection broke mid-part
+    }
 
-        char relative_path[512];
-        extract_path_components(server_path, relative_path, sizeof(relative_path));
+    else if (req->opcode == DFS_OP_PING) {
+        dfs_send_status(client_sock, req, DFS_OK);
+    }
 
-        // Send the path to the server
-        send(server_sock, relative_path, sizeof(relative_path), 0);
+    else if (req->opcode == DFS_OP_FIND) {
+        printf("Search request received for: %s under '%s'\n", aux, name);
+        if (handle_find(client_sock, req, name, aux) < 0)
+            return 0;  // Results cut short
+    }
 
-        // Get status code from S3
-        recv(server_sock, &status_code, sizeof(int), 0);
-        close(server_sock);
+    else if (req->opcode == DFS_OP_STATS) {
+        handle_stats(client_sock, req);
+    }
 
-        // Forward status code to client
-        send(client_sock, &status_code, sizeof(int), 0);
-        printf("TXT file removal request forwarded to S3. Status: %d\n", status_code);
-        return 1;
+    else if (req->opcode == DFS_OP_REBALANCE) {
+        printf("Rebalance request received: %s\n", *name ? name : "status");
+        handle_rebalance(client_sock, req, name, aux);
     }
 
-    // For .zip files, forward remove request to S4
-    else if (strcmp(ext, ".zip") == 0) {
-        // Create socket to S4
-        int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_sock < 0) {
-            status_code = 2;  // Error code for failure
-            send(client_sock, &status_code, sizeof(int), 0);
-            perror("Socket creation to S4 failed");
-            return 0;
+    else if (req->opcode == DFS_OP_UPLOAD) {
+        printf("UPLOAD command recognized\n");
+
+        const char *filename = name, *dest_path = aux;
+        uint64_t file_size = req->payload_len;
+
+        printf("Upload request received for: %s (%llu bytes) to %s\n", filename,
+               (unsigned long long)file_size, dest_path);
+
+        // The file data is stored or relayed as it arrives, never buffered whole
+        int status;
+        char key[DFS_NAME_MAX + 1];
+        int nodes[DFS_CATALOG_COPIES], count = 0;
+        if (upload_key(filename, dest_path, key, sizeof(key)) < 0)
+            printf("Invalid destination: %s\n", dest_path);
+        else if ((count = place_file(key, nodes)) == 0)
+            printf("Unsupported file type: %s\n", filename);
+        if (count && nodes[0] == DFS_CLUSTER_LOCAL) {
+            status = save_locally(client_sock, filename, file_size, dest_path);
+        } else if (count) {
+            // Relayed to every node that gets a copy, which replies to the client
+            return store_replicas(client_sock, req, filename, dest_path, key, nodes, count) == 0;
+        } else {
+            status = dfs_skip_payload(client_sock, file_size) == 0 ? DFS_EINVAL : -1;
         }
 
-        struct sockaddr_in serv_addr;
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(S4_PORT);
-        serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        if (status < 0)
+            return 0;  // Client connection broke mid-upload
+        if (status == DFS_OK)
+            catalog_stored(key, nodes, 1, file_size, NULL);
+        dfs_send_status(client_sock, req, status);
+    } else {
+        printf("Unknown command: %d\n", req->opcode);
+        dfs_send_status(client_sock, req, DFS_EINVAL);
+    }
+    return 1;
+}
 
-        if (connect(server_sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-            status_code = 2;  // Error code for failure
-            send(client_sock, &status_code, sizeof(int), 0);
-            close(server_sock);
-            perror("Connection to S4 failed");
-            return 0;
-        }
+// The catalog key of the file an upload or removal writes, for the
+// rebalancer. Returns -1 if the request writes no file.
+static int rebalance_key(const struct dfs_header *req, const char *name, const char *aux, char *key, size_t size) {
+    if (req->opcode == DFS_OP_UPLOAD || req->opcode == DFS_OP_UPLOAD_COMMIT)
+        return upload_key(name, aux, key, size);
+    if (req->opcode == DFS_OP_REMOVE)
+        return store_relative(name, key, size);
+    return -1;
+}
 
-        // Send "REMOVE" command to S4
-        char cmd[10] = "REMOVE";
-        send(server_sock, cmd, sizeof(cmd), 0);
+// process_command with the listing it changes, if any, held out of the
+// listing cache until the client has the reply, and the file it writes, if
+// any, out of the rebalancer's hands
+int process_command(int client_sock, const struct dfs_header *req, const char *name, const char *aux) {
+    char key[DFS_NAME_MAX + 1], file_key[DFS_NAME_MAX + 1];
+    int changes = list_shared ? list_change_key(req, name, aux, key, sizeof(key)) : 0;
+    int held = rebalance_shared && rebalance_key(req, name, aux, file_key, sizeof(file_key)) == 0;
+    if (changes)
+        list_change_begin(changes > 0 ? key : NULL);
+    if (held)
+        rebalance_hold(file_key);
+    int keep_open = dispatch_command(client_sock, req, name, aux);
+    if (held)
+        rebalance_release(file_key);
+    if (changes)
+        list_change_end(changes > 0 ? key : NULL);
+    return keep_open;
+}
 
-        // Extract path components after S1 prefix
-        char server_path[512];
-        resolve_path(path, server_path, sizeof(server_path));
+// Main function to handle client requests (fork mode)
+void prcclient(int client_sock) {
+    while (1) {
+        struct dfs_header req;
+        char name[DFS_NAME_MAX + 1], aux[DFS_NAME_MAX + 1];
 
-        char relative_path[512];
-        extract_path_components(server_path, relative_path, sizeof(relative_path));
+        if (dfs_recv_request(client_sock, &req, name, aux) < 0) {
+            if (errno == EPROTO)
+                printf("Protocol mismatch, closing connection\n");
+            break;  // Client disconnected
+        }
 
-        // Send the path to the server
-        send(server_sock, relative_path, sizeof(relative_path), 0);
+        if (!process_command(client_sock, &req, name, aux))
+            break;
+    }
 
-        // Get status code from S4
-        recv(server_sock , &status_code, sizeof(int), 0);
-        close(server_sock);
+    close(client_sock);
+    exit(0); // Child exits after client disconnects
+}
 
-        // Forward status code to client
-        send(client_sock, &status_code, sizeof(int), 0);
-        printf("ZIP file removal request forwarded to S4. Status: %d\n", status_code);
-        return 1;
+/* ===== EPOLL WORKER MODE ===== */
+
+/*
+ * With -e, S1 pre-forks one worker per core instead of forking per client.
+ * Each worker runs an epoll loop over the shared listening socket and all of
+ * its clients, with every socket non-blocking.  A connection cycles through
+ *
+ *   CONN_READ_HEADER -> CONN_READ_NAMES -> CONN_RUNNING -> CONN_READ_HEADER ...
+ *
+ * The loop assembles request headers itself, so an idle connection costs only
+ * its struct conn; the names buffer exists only while a request is in flight.  Once a request is complete, the command runs on a fiber
+ * (a small private stack) through the same handlers fork mode uses.  When a
+ * handler would block on a socket, dfs_wait parks the fiber and the loop
+ * resumes it once epoll reports the socket ready.  A fiber and its stack only
+ * exist while a command is running.
+ */
+#define MAX_EVENTS 256
+#define FIBER_STACK_SIZE (256 * 1024)  /* The largest frames hold 64 KB copy buffers */
+#define FIBER_STACK_CACHE 16
+#define FIBER_GUARD_SIZE 4096
+
+enum conn_state { CONN_READ_HEADER, CONN_READ_NAMES, CONN_RUNNING };
+
+struct fiber {
+    ucontext_t ctx;      /* Lives at the low end of its own stack mapping */
+};
+
+struct conn {
+    int sock;
+    enum conn_state state;
+    int have, need;      /* Header bytes read so far / expected for this state */
+    int keep_open;       /* Result of the last command */
+    int finished;        /* Fiber has returned from process_command */
+    int closed;
+    struct fiber *fiber;
+    struct conn *next_closed;
+    struct dfs_header req;
+    unsigned char raw[DFS_HEADER_SIZE];
+    char *names;         /* name, NUL, aux, NUL */
+};
+
+static int worker_epfd = -1;
+static ucontext_t worker_ctx;
+static struct conn *current_conn;     /* Conn whose fiber is running */
+static struct conn *closed_conns;     /* Freed after each epoll batch */
+static struct fiber *fiber_cache[FIBER_STACK_CACHE];
+static int fiber_cache_count;
+static int listen_tag;                /* epoll data.ptr for the listener */
+
+// dfs_wait for epoll workers: park the running fiber until fd is ready
+static int fiber_wait(int fd, short events) {
+    struct conn *c = current_conn;
+    if (!c)
+        return dfs_poll_wait(fd, events);
+
+    struct epoll_event ev = {
+        .events = EPOLLONESHOT | ((events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0) |
+                  ((events & POLLOUT) ? EPOLLOUT : 0),
+        .data.ptr = c
+    };
+    if (epoll_ctl(worker_epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(worker_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
     }
+    swapcontext(&c->fiber->ctx, &worker_ctx);
+    return 0;
+}
 
-    return 0; // Return 0 if no valid file type was found
+// Drop a socket the running fiber waited on from the worker's epoll set,
+// before it is parked in the backend pool (no-op in fork mode)
+static void fiber_forget(int fd) {
+    if (worker_epfd >= 0)
+        epoll_ctl(worker_epfd, EPOLL_CTL_DEL, fd, NULL);
 }
 
-/* ===== END OF REMOVE FUNCTIONALITY ===== */
+static struct fiber *fiber_alloc(void) {
+    if (fiber_cache_count > 0)
+        return fiber_cache[--fiber_cache_count];
 
-// Modified handle_tarfetch to stream directly to client
-void handle_tarfetch(int client_sock, const char *filetype) {
-    if (strcmp(filetype, ".c") == 0) {
-        printf("Creating .c tar file for client\n");
-        send_c_tar(client_sock);
-    } 
-    else if (strcmp(filetype, ".pdf") == 0) {
-        printf("Forwarding PDF tar request to S2\n");
-        if (stream_tar_from_server(client_sock, filetype, S2_PORT) != 0) {
-            int error = -1;
-            send(client_sock, &error, sizeof(int), 0);
-        }
-    }
-    else if (strcmp(filetype, ".txt") == 0) {
-        printf("Forwarding TXT tar request to S3\n");
-        if (stream_tar_from_server(client_sock, filetype, S3_PORT) != 0) {
-            int error = -1;
-            send(client_sock, &error, sizeof(int), 0);
-        }
-    }
-    else {
-        // Invalid file type
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-    }
+    char *map = mmap(NULL, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    mprotect(map, FIBER_GUARD_SIZE, PROT_NONE);  // Catch stack overflows
+    return (struct fiber *)(map + FIBER_GUARD_SIZE);
 }
 
-// Function to create a tar file for .c files (local to S1) and send to client
-void send_c_tar(int client_sock) {
-    const char *home = getenv("HOME");
-    char command[1024];
-    char tar_name[] = "cfiles.tar";  // Name client will receive
-    
-    // Create tar file in /tmp directory to avoid permission issues
-    char tmp_tar_path[1024];
-    snprintf(tmp_tar_path, sizeof(tmp_tar_path), "/tmp/cfiles_%d.tar", getpid());
-    
-    // Create the tar file
-    snprintf(command, sizeof(command), "tar -cf %s -C %s/S1 .", tmp_tar_path, home);
-    int result = system(command);
-    
-    if (result != 0) {
-        printf("Error creating .c tar file\n");
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        return;
-    }
-    
-    // Open the tar file
-    FILE *fp = fopen(tmp_tar_path, "rb");
-    if (!fp) {
-        perror("Error opening tar file");
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        remove(tmp_tar_path); // Clean up temporary file
+static void fiber_free(struct fiber *f) {
+    if (fiber_cache_count < FIBER_STACK_CACHE) {
+        fiber_cache[fiber_cache_count++] = f;
         return;
     }
-    
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    int file_size = ftell(fp);
-    rewind(fp);
-    
-    // Send file size to client
-    send(client_sock, &file_size, sizeof(int), 0);
-    
-    // Send file data
-    char buffer[BUFFER_SIZE];
-    while (!feof(fp)) {
-        size_t read = fread(buffer, 1, BUFFER_SIZE, fp);
-        if (read > 0) {
-            send(client_sock, buffer, read, 0);
-        }
-    }
-    
-    fclose(fp);
-    remove(tmp_tar_path); // Clean up temporary file
-    printf("Sent .c tar file to client (%d bytes)\n", file_size);
+    munmap((char *)f - FIBER_GUARD_SIZE, FIBER_STACK_SIZE);
 }
 
-// Modified request_tar_from_server to stream directly to client
-int stream_tar_from_server(int client_sock, const char *filetype, int server_port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
-        return -1;
-    }
+static void fiber_main(void) {
+    struct conn *c = current_conn;
+    c->keep_open = process_command(c->sock, &c->req, c->names, c->names + c->req.name_len + 1);
+    c->finished = 1;
+    // Returning switches to uc_link, i.e. back into the event loop
+}
 
-    struct sockaddr_in serv_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(server_port),
-        .sin_addr.s_addr = inet_addr("127.0.0.1")
-    };
+static void conn_close(struct conn *c) {
+    close(c->sock);
+    free(c->names);
+    c->names = NULL;
+    c->closed = 1;
+    c->next_closed = closed_conns;
+    closed_conns = c;
+}
 
-    // Attempt to connect to the server
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection to server failed");
-        close(sock);
-        return -1;
-    }
+static void conn_wait_header(struct conn *c) {
+    c->state = CONN_READ_HEADER;
+    c->have = 0;
+    c->need = sizeof(c->raw);
+    free(c->names);
+    c->names = NULL;
+}
 
-    // Send TARFETCH command
-    char cmd[10] = "TARFETCH";
-    send(sock, cmd, sizeof(cmd), 0);
-    send(sock, filetype, strlen(filetype)+1, 0);
+// Switch into the conn's fiber. Returns -1 if the connection should be closed.
+static int conn_resume(struct conn *c) {
+    current_conn = c;
+    swapcontext(&worker_ctx, &c->fiber->ctx);
+    current_conn = NULL;
+    if (!c->finished)
+        return 0;  // Parked in fiber_wait
+
+    fiber_free(c->fiber);
+    c->fiber = NULL;
+    if (!c->keep_open)
+        return -1;
 
-    // Receive file size
-    int file_size;
-    if (recv(sock, &file_size, sizeof(int), 0) <= 0) {
-        close(sock);
-        perror("Failed to receive file size");
- return -1;
-    }
+    // Back to reading headers; anything the client already pipelined is
+    // reported straight away because the socket is level-triggered again
+    conn_wait_header(c);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+    epoll_ctl(worker_epfd, EPOLL_CTL_MOD, c->sock, &ev);
+    return 0;
+}
 
-    if (file_size <= 0) {
-        close(sock);
-        perror("Received invalid file size");
+// Start running the command whose header was just read
+static int conn_run(struct conn *c) {
+    c->fiber = fiber_alloc();
+    if (!c->fiber) {
+        perror("Fiber stack allocation failed");
         return -1;
     }
 
-    // Forward file size to client
-    send(client_sock, &file_size, sizeof(int), 0);
+    char *stack = (char *)(c->fiber + 1);
+    getcontext(&c->fiber->ctx);
+    c->fiber->ctx.uc_stack.ss_sp = stack;
+    c->fiber->ctx.uc_stack.ss_size = FIBER_STACK_SIZE - FIBER_GUARD_SIZE - sizeof(struct fiber);
+    c->fiber->ctx.uc_link = &worker_ctx;
+    makecontext(&c->fiber->ctx, fiber_main, 0);
 
-    // Stream data from server to client
-    char buffer[BUFFER_SIZE];
-    int remaining = file_size;
-    while (remaining > 0) {
-        int to_read = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
-        int received = recv(sock, buffer, to_read, 0);
-        if (received <= 0) {
-            perror("Error receiving data from server");
-            break;
-        }
-        
-        // Forward to client
-        int sent = send(client_sock, buffer, received, 0);
-        if (sent <= 0) {
-            perror("Error sending data to client");
-            break;
-        }
-        
-        remaining -= received;
-    }
+    c->state = CONN_RUNNING;
+    c->finished = 0;
 
-    close(sock);
-    return (remaining == 0) ? 0 : -1;
+    // The command owns the socket now; stop level-triggered read events
+    struct epoll_event ev = { .events = EPOLLONESHOT, .data.ptr = c };
+    epoll_ctl(worker_epfd, EPOLL_CTL_MOD, c->sock, &ev);
+    return conn_resume(c);
 }
 
-// Function to get filenames from S2, S3, or S4
-int get_filenames_from_server(const char *dir_path, char filenames[][256], int *count, int max_files, int server_port, const char *ext) {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket connection to server failed");
-        return 0;
-    }
-    
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(server_port);
-    serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    // Attempt to connect to the server
-    if (connect(server_sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection to server failed");
-        close(server_sock);
-        return 0;
-    }
-    
-    // Send "LISTFILES" command
-    char cmd[10] = "LISTFILES";
-    send(server_sock, cmd, sizeof(cmd), 0);
-    
-    // Extract path components after S1 prefix
-    char server_path[512];
-    extract_path_components(dir_path, server_path, sizeof(server_path));
-    
-    // Send the path to the server
-    send(server_sock, server_path, sizeof(server_path), 0);
-    
-    // Receive file count
-    int file_count = 0;
-    recv(server_sock, &file_count, sizeof(int), 0);
-    
-    if (file_count <= 0) {
-        close(server_sock);
-        return 0;
-    }
-    
-    // Receive filenames
-    for (int i = 0; i < file_count && *count < max_files; i++) {
-        char filename[256];
-        recv(server_sock, filename, sizeof(filename), 0);
-        
-        // Check if the file has the specified extension
-        char *file_ext = strrchr(filename, '.');
-        if (file_ext && strcmp(file_ext, ext) == 0) {
-            strcpy(filenames[*count], filename);
-            (*count)++;
+// Read whatever header bytes have arrived. Returns -1 if the connection should be closed.
+static int conn_read_header(struct conn *c) {
+    for (;;) {
+        char *dst = (c->state == CONN_READ_HEADER) ? (char *)c->raw : c->names;
+        ssize_t n = recv(c->sock, dst + c->have, c->need - c->have, 0);
+        if (n == 0)
+            return -1;  // Client disconnected
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
         }
-    }
-    
-    close(server_sock);
-    return 1;
-}
-
-// Compare function for qsort to sort filenames alphabetically
-int compare_filenames(const void *a, const void *b) {
-    return strcmp((const char *)a, (const char *)b);
-}
-
-// Function to handle the dispfnames command
-int handle_dispfnames(int client_sock, const char *dir_path) {
-    char resolved_path[1024];
-    resolve_path(dir_path, resolved_path, sizeof(resolved_path));
-    
-    // Check if the directory exists
-    DIR *dir = opendir(resolved_path);
-    if (!dir) {
-        perror("Directory open error");
-        int error_code = -1;
-        send(client_sock, &error_code, sizeof(int), 0);
-        return 0;
-    }
-    closedir(dir);
-    
-    // Arrays to store filenames by type
-    char c_files[MAX_FILES][256];
-    char pdf_files[MAX_FILES][256];
-    char txt_files[MAX_FILES][256];
-    char zip_files[MAX_FILES][256];
-    int c_count = 0, pdf_count = 0, txt_count = 0, zip_count = 0;
-    
-    // Get local .c files
-    dir = opendir(resolved_path);
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && c_count < MAX_FILES) {
-        if (entry->d_type == DT_REG) {  // Regular file
-            char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".c") == 0) {
-                strcpy(c_files[c_count], entry->d_name);
-                c_count++;
+        c->have += n;
+        if (c->have < c->need)
+            continue;
+
+        if (c->state == CONN_READ_HEADER) {
+            if (dfs_decode_header(c->raw, &c->req) < 0) {
+                printf("Protocol mismatch, closing connection\n");
+                return -1;
             }
+            // Names are read into one buffer; NULs are added once both arrive
+            c->names = malloc(c->req.name_len + c->req.aux_len + 2);
+            if (!c->names)
+                return -1;
+            c->state = CONN_READ_NAMES;
+            c->have = 0;
+            c->need = c->req.name_len + c->req.aux_len;
+        }
+        if (c->state == CONN_READ_NAMES && c->have == c->need) {
+            // Split "nameaux" into "name\0aux\0"
+            memmove(c->names + c->req.name_len + 1, c->names + c->req.name_len, c->req.aux_len);
+            c->names[c->req.name_len] = '\0';
+            c->names[c->req.name_len + 1 + c->req.aux_len] = '\0';
+            return conn_run(c);
         }
     }
-    closedir(dir);
-    
-    // Get . pdf files from S2
-    get_filenames_from_server(dir_path, pdf_files, &pdf_count, MAX_FILES, S2_PORT, ".pdf");
-    
-    // Get .txt files from S3
-    get_filenames_from_server(dir_path, txt_files, &txt_count, MAX_FILES, S3_PORT, ".txt");
-    
-    // Get .zip files from S4
-    get_filenames_from_server(dir_path, zip_files, &zip_count, MAX_FILES, S4_PORT, ".zip");
-    
-    // Sort each file type alphabetically
-    qsort(c_files, c_count, sizeof(c_files[0]), compare_filenames);
-    qsort(pdf_files, pdf_count, sizeof(pdf_files[0]), compare_filenames);
-    qsort(txt_files, txt_count, sizeof(txt_files[0]), compare_filenames);
-    qsort(zip_files, zip_count, sizeof(zip_files[0]), compare_filenames);
-    
-    // Calculate total file count
-    int total_files = c_count + pdf_count + txt_count + zip_count;
-       
-    // Send total file count to client
-    send(client_sock, &total_files, sizeof(int), 0);
-    
-    // Send filenames in specified order: .c, .pdf, .txt, .zip
-    for (int i = 0; i < c_count; i++) {
-        send(client_sock, c_files[i], sizeof(c_files[0]), 0);
-    }
-    
-    for (int i = 0; i < pdf_count; i++) {
-        send(client_sock, pdf_files[i], sizeof(pdf_files[0]), 0);
-    }
-    
-    for (int i = 0; i < txt_count; i++) {
-        send(client_sock, txt_files[i], sizeof(txt_files[0]), 0);
-    }
-    
-    for (int i = 0; i < zip_count; i++) {
-        send(client_sock, zip_files[i], sizeof(zip_files[0]), 0);
-    }
-    
-    printf("Sent %d filenames to client for directory '%s'\n", total_files, dir_path);
-    return 1;
 }
 
-// Main function to handle client requests
-void prcclient(int client_sock) {
-    while (1) {
-        char cmd[10] = {0};
-        int n = recv(client_sock, cmd, sizeof(cmd), 0);
-        if (n <= 0) {
-            close(client_sock);
-            break;  // Client disconnected
-        }
-
-        if (strcmp(cmd, "DOWNLOAD") == 0) {
-            char file_path[512] = {0};
-            recv(client_sock, file_path, sizeof(file_path), 0);
-            printf("Download request received for: %s\n", file_path);
-            handle_download(client_sock, file_path);
-        }
-
-        else if (strcmp(cmd, "REMOVE") == 0) {
-            char file_path[512] = {0};
-            recv(client_sock, file_path, sizeof(file_path), 0);
-            printf("Remove request received for: %s\n", file_path);
-            handle_remove(client_sock, file_path);
+static void accept_clients(int server_sock) {
+    for (;;) {
+        int client_sock = accept4(server_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Accept failed");
+            return;  // Drained, or another worker got there first
         }
 
-        else if (strcmp(cmd, "TARFETCH") == 0) {
-            char filetype[10] = {0};
-            recv(client_sock, filetype, sizeof(filetype), 0);
-            printf("Tar request received for: %s files\n", filetype);
-            handle_tarfetch(client_sock, filetype);
+        struct conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(client_sock);
+            continue;
         }
+        c->sock = client_sock;
+        conn_wait_header(c);
 
-        else if (strcmp(cmd, "LISTFILES") == 0) {
-            char dir_path[512] = {0};
-            recv(client_sock, dir_path, sizeof(dir_path), 0);
-            
-            printf("Directory listing request received for: %s\n", dir_path);
-            
-            // Handle list files request
-            handle_dispfnames(client_sock, dir_path);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        if (epoll_ctl(worker_epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("epoll_ctl failed");
             close(client_sock);
-            continue;            
+            free(c);
         }
+    }
+}
 
-        else if (strcmp(cmd, "UPLOAD") == 0) {
-            printf("UPLOAD command recognized\n");
+// Event loop of one epoll worker process
+static void run_worker(int server_sock) {
+    worker_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker_epfd < 0) {
+        perror("epoll_create1 failed");
+        exit(1);
+    }
+    dfs_wait = fiber_wait;
+    dfs_io_nonblock = 1;
+
+    // Each worker follows S1's store in an index of its own; a miss in it is
+    // checked on disk, since another worker may have just written the file
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    dfs_index_open(root);
+
+    // EPOLLEXCLUSIVE wakes one worker per new connection, not all of them
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_tag };
+    if (epoll_ctl(worker_epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
 
-            char filename[256] = {0}, dest_path[256] = {0};
-            int file_size = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(worker_epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            exit(1);
+        }
 
-            if (recv(client_sock, filename, sizeof(filename), 0) <= 0 ||
-                recv(client_sock, dest_path, sizeof(dest_path), 0) <= 0 ||
-                recv(client_sock, &file_size, sizeof(int), 0) <= 0) {
-                printf("Upload data receive failed\n");
-                break;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_tag) {
+                accept_clients(server_sock);
+                continue;
             }
 
-            printf("Upload request received for: %s (%d bytes) to %s\n", filename, file_size, dest_path);
+            struct conn *c = events[i].data.ptr;
+            if (c->closed)
+                continue;  // Closed earlier in this batch
+            int rc = (c->state == CONN_RUNNING) ? conn_resume(c) : conn_read_header(c);
+            if (rc < 0)
+                conn_close(c);
+        }
 
-            char *file_data = malloc(file_size);
-            int received = 0;
-            while (received < file_size) {
-                int r = recv(client_sock, file_data + received, file_size - received, 0);
-                if (r <= 0) break;
-                received += r;
-            }
+        while (closed_conns) {
+            struct conn *c = closed_conns;
+            closed_conns = c->next_closed;
+            free(c);
+        }
+    }
+}
 
-            char * ext = strrchr(filename, '.');
-            if (ext && strcmp(ext, ".c") == 0) {
-                save_locally(filename, file_data, file_size, dest_path);
-            } else if (ext && strcmp(ext, ".pdf") == 0) {
-                forward_to_server(filename, file_data, file_size, dest_path, S2_PORT, "Server2");
-            } else if (ext && strcmp(ext, ".txt") == 0) {
-                forward_to_server(filename, file_data, file_size, dest_path, S3_PORT, "Server3");
-            } else if (ext && strcmp(ext, ".zip") == 0) {
-                forward_to_server(filename, file_data, file_size, dest_path, S4_PORT, "Server4");
-            } else {
-                printf("Unsupported file type: %s\n", filename);
-            }
+// Start the epoll workers and restart any that die
+static void run_epoll_mode(int server_sock, int workers) {
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);
+    printf("S1 running %d epoll worker(s)\n", workers);
+    fflush(stdout);
 
-            free(file_data);
-        } else {
-            printf("Unknown command: %s\n", cmd);
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Fork failed");
+            exit(1);
         }
+        if (pid == 0)
+            run_worker(server_sock);
     }
 
-    close(client_sock);
-    exit(0); // Child exits after client disconnects
+    while (1) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (list_watch_exited(pid)) {
+            printf("Listing watcher %d exited (status %d), restarting\n", pid, status);
+            fflush(stdout);
+            for (int due; (due = list_watch_restart(server_sock)) >= 0; )
+                usleep(due * 1000);
+            continue;
+        }
+        if (rebalance_exited(pid)) {
+            printf("Rebalancer %d exited (status %d), restarting\n", pid, status);
+            fflush(stdout);
+            for (int due; (due = rebalance_restart(server_sock)) >= 0; )
+                usleep(due * 1000);
+            continue;
+        }
+        printf("Epoll worker %d exited (status %d), restarting\n", pid, status);
+        fflush(stdout);
+        if (fork() == 0)
+            run_worker(server_sock);
+    }
+}
+
+// Reap finished per-client children in fork mode, noting whether the
+// watcher or the rebalancer was one of them
+static void reap_children(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (!list_watch_exited(pid))
+            rebalance_exited(pid);
+    }
+    errno = saved_errno;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c cluster] [-R copies] [-W copies] [-m KB/s] [-e] [-w workers] [-C] [-z threads]\n"
+                    "          [-l ms] [-r ms | -N]\n", prog);
+    fprintf(stderr, "  -c cluster  read the storage nodes from this cluster map (default: S2, S3, S4)\n");
+    fprintf(stderr, "  -R copies   store each file on this many nodes, 1 to %d (default: 1)\n", DFS_CATALOG_COPIES);
+    fprintf(stderr, "  -W copies   answer an upload once this many of its copies are on disk, at most\n"
+                    "              -R (default: a majority)\n");
+    fprintf(stderr, "  -m KB/s     pace for moving files between nodes after the map changes, 0 for no\n"
+                    "              limit (default: %d)\n", REBALANCE_RATE_KB);
+    fprintf(stderr, "  -e          serve clients from epoll workers instead of fork per client\n");
+    fprintf(stderr, "  -w workers  number of epoll workers (default: one per core)\n");
+    fprintf(stderr, "  -C          relay backend downloads by copying instead of splice()\n");
+    fprintf(stderr, "  -z threads  threads compressing each gzip tar archive, 0 for none but the\n"
+                    "              request's own (default: one per core)\n");
+    fprintf(stderr, "  -l ms       how long each storage server has to answer a listing (default: %d)\n",
+            LIST_DEADLINE_MS);
+    fprintf(stderr, "  -r ms       serve a cached listing up to ms old while it is fetched again, when\n"
+                    "              only changes from outside S1 have been seen (default: 0, never)\n");
+    fprintf(stderr, "  -N          do not cache listings\n");
+    exit(1);
 }
 
 // Main function to set up the server
-int main() {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+int main(int argc, char *argv[]) {
+    int epoll_mode = 0;
+    const char *cluster_map = NULL;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt_char;
+    tar_gzip_threads = workers;
+    while ((opt_char = getopt(argc, argv, "c:R:W:m:ew:Cz:l:r:N")) != -1) {
+        if (opt_char == 'c')
+            cluster_map = optarg;
+        else if (opt_char == 'R' && atoi(optarg) >= 1 && atoi(optarg) <= DFS_CATALOG_COPIES)
+            replica_count = atoi(optarg);
+        else if (opt_char == 'W' && atoi(optarg) >= 1)
+            write_quorum = atoi(optarg);
+        else if (opt_char == 'm' && atoi(optarg) >= 0)
+            rebalance_rate_kb = atoi(optarg);
+        else if (opt_char == 'e')
+            epoll_mode = 1;
+        else if (opt_char == 'C')
+            relay_use_splice = 0;
+        else if (opt_char == 'w' && atoi(optarg) > 0)
+            workers = atoi(optarg);
+        else if (opt_char == 'z' && atoi(optarg) >= 0 && atoi(optarg) <= DFS_GZIP_THREADS_MAX)
+            tar_gzip_threads = atoi(optarg);
+        else if (opt_char == 'l' && atoi(optarg) > 0)
+            list_deadline_ms = atoi(optarg);
+        else if (opt_char == 'r' && atoi(optarg) >= 0)
+            list_stale_ms = atoi(optarg);
+        else if (opt_char == 'N')
+            list_cache_on = 0;
+        else
+            usage(argv[0]);
+    }
+    if (workers < 1)
+        workers = 1;
+    if (write_quorum == 0)
+        write_quorum = replica_count / 2 + 1;
+    if (write_quorum > replica_count)
+        usage(argv[0]);
+
+    // The storage nodes, known to every process forked from here
+    if (!cluster_map)
+        dfs_cluster_default();
+    else if (dfs_cluster_load(cluster_map) < 0)
+        exit(1);
+    for (int i = 0; i < dfs_cluster.count; i++) {
+        const struct dfs_node *n = &dfs_cluster.nodes[i];
+        printf("Node %d: %s at %s:%d, weight %g, type %s\n", n->id, n->name, n->host, n->port, n->weight,
+               n->type);
+    }
+    if (replica_count > 1)
+        printf("Storing %d copies of each file, %d on disk before an upload is answered\n", replica_count,
+               write_quorum);
+
+    // Each client holds a descriptor; allow as many as the hard limit permits
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_sock < 0) {
         perror("Socket error");
         exit(1);
@@ -882,14 +3959,55 @@ int main() {
     }
 
     // Start listening for incoming connections
-    if (listen(server_sock, 5) < 0) {
+    if (listen(server_sock, LISTEN_BACKLOG) < 0) {
         perror("Listen error");
         close(server_sock);
         exit(1);
     }
     printf("S1 server listening on port %d...\n", PORT);
 
+    // Record the .c files stored and removed, for incremental tar archives
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/S1", getenv("HOME"));
+    dfs_journal_open("S1", root);
+
+    // Clear away what uploads that clients gave up on left behind
+    dfs_upload_sweep_start(root);
+
+    // Keep track of what is stored where, shared by every process forked from here
+    dfs_catalog_open(root);
+
+    // Cache listings, following every store for changes
+    list_cache_start(server_sock);
+
+    // Move the files the cluster map now places elsewhere
+    rebalance_init(server_sock);
+
+    if (epoll_mode) {
+        run_epoll_mode(server_sock, workers);
+        return 0;
+    }
+
+    signal(SIGCHLD, reap_children);
+
+    // SIGCHLD is let in only while waiting for a client, so that a watcher
+    // or rebalancer reported gone is restarted from here, never from the
+    // handler
+    sigset_t chld, unblocked;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
     while (1) {
+        sigprocmask(SIG_BLOCK, &chld, &unblocked);
+        int due = list_watch_restart(server_sock), rebalance_due = rebalance_restart(server_sock);
+        if (rebalance_due >= 0 && (due < 0 || rebalance_due < due))
+            due = rebalance_due;
+        struct pollfd ready = { .fd = server_sock, .events = POLLIN };
+        struct timespec timeout = { due / 1000, due % 1000 * 1000000L };
+        int n = ppoll(&ready, 1, due >= 0 ? &timeout : NULL, &unblocked);
+        sigprocmask(SIG_SETMASK, &unblocked, NULL);
+        if (n <= 0)
+            continue;
+
         struct sockaddr_in client_addr;
         socklen_t addr_size = sizeof(client_addr);
         int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
@@ -905,6 +4023,7 @@ int main() {
             close(client_sock);
         } else if (pid == 0) {
             // Child process
+            signal(SIGCHLD, SIG_DFL);
             close(server_sock); // Child doesn't need the listener
             prcclient(client_sock); // Handle client requests
         } else {
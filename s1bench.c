@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "dfs_proto.h"
+
+/*
+ * Load generator for S1.  Opens many concurrent client connections, then
+ * keeps all of them busy with DOWNLOAD requests for one file and reports
+ * throughput, latency and how much memory the S1 processes use.  Run it once
+ * against "./s1" (fork per client) and once against "./s1 -e" (epoll workers)
+ * to compare the two models.
+ *
+ *   ./s1bench -c 5000 -n 50000 -f ~S1/bench/hello.c
+ */
+
+#define PORT 3030
+#define MAX_EVENTS 512
+
+enum bench_state { B_CONNECTING, B_SENDING, B_READ_HEADER, B_READ_BODY };
+
+struct bench_conn {
+    int sock;
+    enum bench_state state;
+    unsigned char request[DFS_HEADER_SIZE + DFS_NAME_MAX];
+    size_t request_len;
+    size_t sent;
+    unsigned char reply[DFS_HEADER_SIZE];
+    int reply_have;
+    long remaining;
+    double started;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Sum the memory of every running process named s1 (PSS counts shared pages fairly)
+static void s1_memory(int *procs, long *pss_kb, long *rss_kb) {
+    *procs = 0;
+    *pss_kb = 0;
+    *rss_kb = 0;
+    DIR *proc = opendir("/proc");
+    if (!proc)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+
+        char path[300], comm[64] = {0};
+        snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        if (!fgets(comm, sizeof(comm), fp))
+            comm[0] = '\0';
+        fclose(fp);
+        if (strcmp(comm, "s1\n") != 0)
+            continue;
+
+        (*procs)++;
+        snprintf(path, sizeof(path), "/proc/%s/smaps_rollup", entry->d_name);
+        fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        char line[256];
+        long kb;
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+                *pss_kb += kb;
+            else if (sscanf(line, "Rss: %ld kB", &kb) == 1)
+                *rss_kb += kb;
+        }
+        fclose(fp);
+    }
+    closedir(proc);
+}
+
+static void print_memory(const char *when) {
+    int procs;
+    long pss_kb, rss_kb;
+    s1_memory(&procs, &pss_kb, &rss_kb);
+    printf("S1 memory %s: %d process(es), PSS %.1f MB, RSS %.1f MB\n",
+           when, procs, pss_kb / 1024.0, rss_kb / 1024.0);
+}
+
+static int start_connect(struct bench_conn *c, int epfd, int port) {
+    c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->sock < 0)
+        return -1;  // Stays -1 and is skipped later
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1")
+    };
+    if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+    c->state = B_CONNECTING;
+
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev);
+}
+
+static void start_request(struct bench_conn *c, int epfd) {
+    c->state = B_SENDING;
+    c->sent = 0;
+    c->started = now_sec();
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+}
+
+int main(int argc, char *argv[]) {
+    int conns = 1000, requests = 10000, port = PORT;
+    const char *path = "~S1/bench/hello.c";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:f:p:")) != -1) {
+        switch (opt) {
+        case 'c': conns = atoi(optarg); break;
+        case 'n': requests = atoi(optarg); break;
+        case 'f': path = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-c connections] [-n requests] [-f path] [-p port]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (strlen(path) > DFS_NAME_MAX) {
+        fprintf(stderr, "Path too long\n");
+        return 1;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int epfd = epoll_create1(0);
+    struct bench_conn *all = calloc(conns, sizeof(*all));
+    double *latency = malloc(sizeof(double) * requests);
+    if (!all || !latency) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    print_memory("before");
+
+    // Phase 1: open every connection
+    double t0 = now_sec();
+    int connected = 0, failed = 0;
+    for (int i = 0; i < conns; i++) {
+        // A DOWNLOAD request is the header followed by the path
+        struct dfs_header h = { .opcode = DFS_OP_DOWNLOAD, .name_len = strlen(path), .request_id = i };
+        dfs_encode_header(&h, all[i].request);
+        memcpy(all[i].request + DFS_HEADER_SIZE, path, h.name_len);
+        all[i].request_len = DFS_HEADER_SIZE + h.name_len;
+        if (start_connect(&all[i], epfd, port) < 0)
+            failed++;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (connected + failed < conns) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 10000);
+        if (n <= 0)
+            break;
+        for (int i = 0; i < n; i++) {
+            struct bench_conn *c = events[i].data.ptr;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                failed++;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+                close(c->sock);
+                c->sock = -1;
+                continue;
+            }
+            connected++;
+            struct epoll_event ev = { .events = 0, .data.ptr = c };
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+        }
+    }
+    double t_connect = now_sec() - t0;
+    printf("Connected %d of %d clients in %.2f s (%d failed)\n", connected, conns, t_connect, failed);
+
+    sleep(1);  // Let S1 finish setting up per-connection state
+    print_memory("with all clients connected");
+
+    // Phase 2: keep every connection busy until the request budget is spent
+    int issued = 0, done = 0, errors = 0;
+    long long bytes = 0;
+    t0 = now_sec();
+    for (int i = 0; i < conns && issued < requests; i++) {
+        if (all[i].sock < 0 || all[i].state != B_CONNECTING)
+            continue;
+        start_request(&all[i], epfd);
+        issued++;
+    }
+
+    char buffer[65536];
+    while (done + errors < issued) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 10000);
+        if (n <= 0) {
+            printf("Timed out with %d request(s) outstanding\n", issued - done - errors);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct bench_conn *c = events[i].data.ptr;
+            int finished = 0, failed_req = 0;
+
+            if (c->state == B_SENDING) {
+                ssize_t w = send(c->sock, c->request + c->sent, c->request_len - c->sent, MSG_NOSIGNAL);
+                if (w < 0 && errno != EAGAIN) {
+                    failed_req = 1;
+                } else if (w > 0 && (c->sent += w) == c->request_len) {
+                    c->state = B_READ_HEADER;
+                    c->reply_have = 0;
+                    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+                }
+            } else if (c->state == B_READ_HEADER) {
+                ssize_t r = recv(c->sock, c->reply + c->reply_have, sizeof(c->reply) - c->reply_have, 0);
+                if (r <= 0 && !(r < 0 && errno == EAGAIN)) {
+                    failed_req = 1;
+                } else if (r > 0 && (c->reply_have += r) == sizeof(c->reply)) {
+                    struct dfs_header h;
+                    if (dfs_decode_header(c->reply, &h) < 0 || h.status != DFS_OK) {
+                        failed_req = 1;
+                    } else {
+                        c->remaining = h.payload_len;
+                        c->state = B_READ_BODY;
+                        finished = (c->remaining == 0);
+                    }
+                }
+            } else if (c->state == B_READ_BODY) {
+                size_t want = c->remaining < (long)sizeof(buffer) ? (size_t)c->remaining : sizeof(buffer);
+                ssize_t r = recv(c->sock, buffer, want, 0);
+                if (r <= 0 && !(r < 0 && errno == EAGAIN)) {
+                    failed_req = 1;
+                } else if (r > 0) {
+                    c->remaining -= r;
+                    bytes += r;
+                    finished = (c->remaining == 0);
+                }
+            }
+
+            if (failed_req) {
+                errors++;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+                close(c->sock);
+                c->sock = -1;
+            } else if (finished) {
+                latency[done++] = now_sec() - c->started;
+                if (issued < requests) {
+                    start_request(c, epfd);
+                    issued++;
+                }
+            }
+        }
+    }
+    double elapsed = now_sec() - t0;
+
+    print_memory("after load");
+
+    if (done > 0) {
+        qsort(latency, done, sizeof(double), compare_double);
+        printf("Requests: %d ok, %d failed in %.2f s\n", done, errors, elapsed);
+        printf("Throughput: %.0f req/s, %.1f MB/s\n", done / elapsed, bytes / elapsed / (1024 * 1024));
+        printf("Latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               latency[done / 2] * 1000, latency[(int)(done * 0.99)] * 1000, latency[done - 1] * 1000);
+    } else {
+        printf("No requests completed (%d failed)\n", errors);
+    }
+
+    for (int i = 0; i < conns; i++) {
+        if (all[i].sock >= 0)
+            close(all[i].sock);
+    }
+    free(all);
+    free(latency);
+    return 0;
+}
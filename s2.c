@@ -10,8 +10,22 @@
 #include <dirent.h>    /* For DIR, struct dirent, opendir(), readdir(), closedir() */
 #include <sys/types.h> /* For additional type definitions */
 
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_file.h"
+#include "dfs_upload.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_pool.h"
+#include "dfs_watch.h"
+#include "dfs_find.h"
+
 #define PORT 3032  // S2 port
 #define BUFFER_SIZE 4096
+#define DEFAULT_BACKLOG 128
+
+static int server_port = PORT;
+static const char *store_name = "S2";  /* Files live in ~/<store_name> */
 
 void create_directories(const char *path) {
     char tmp[1024];
@@ -28,78 +42,71 @@ void create_directories(const char *path) {
     mkdir(tmp, 0777);
 }
 
-void save_file(const char *filename, const char *data, int size, const char *dest_path) {
+// Work out where an upload of filename to dest_path goes under ~/S2,
+// creating the directories on the way.
+void upload_path(const char *filename, const char *dest_path, char *file_path, size_t size) {
     const char *home = getenv("HOME");
     char full_path[1024];
 
     // Handle "~/S1/..." case
     if (strncmp(dest_path, "~/S1/", 5) == 0) {
-        snprintf(full_path, sizeof(full_path), "%s/S2/%s", home, dest_path + 5);
+        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home, store_name, dest_path + 5);
     }
     // Handle generic "~/" case
     else if (strncmp(dest_path, "~/", 2) == 0) {
-        snprintf(full_path, sizeof(full_path), "%s/S2/%s", home, dest_path + 2);
+        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home, store_name, dest_path + 2);
     }
     // Handle absolute or other paths
     else {
-        snprintf(full_path, sizeof(full_path), "%s/S2/%s", home, dest_path);
+        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home, store_name, dest_path);
     }
 
     // Create directories if needed
     create_directories(full_path);
 
     // Final file path
+    snprintf(file_path, size, "%s/%s", full_path, filename);
+}
+
+// Store an upload from S1 under ~/S2, writing it to disk as it arrives (and syncing it
+// there before returning, if sync is set).
+// Returns DFS_OK or DFS_EIO, or -1 if the connection broke.
+int save_file(int client_sock, const char *filename, uint64_t size, const char *dest_path, int sync) {
     char file_path[1024];
-    snprintf(file_path, sizeof(file_path), "%s/%s", full_path, filename);
+    upload_path(filename, dest_path, file_path, sizeof(file_path));
 
     // Write file
-    FILE *fp = fopen(file_path, "wb");
-    if (fp) {
-        fwrite(data, 1, size, fp);
-        fclose(fp);
+    int status = dfs_recv_payload_file(client_sock, file_path, size, 0, sync, NULL);
+    if (status == DFS_OK) {
+        dfs_journal_note(file_path, '+');
+        dfs_index_note(file_path);
+        dfs_upload_forget(file_path);  // A plain upload leaves no upload to commit again
         printf("Stored PDF file at %s\n", file_path);
-    } else {
-        perror("Error writing PDF file");
     }
+    return status;
 }
 
 
-// Function to handle file download requests
-int handle_download(int client_sock, const char *path) {
+// Function to handle file download and STAT requests.
+// Returns 1 if sent, 0 if not found, -1 if the connection broke mid-response.
+int handle_download(int client_sock, const struct dfs_header *req, const char *path, const char *range) {
     const char *home = getenv("HOME");
     char resolved_path[1024];
     
     // Create path with S2 directory
-    snprintf(resolved_path, sizeof(resolved_path), "%s/S2/%s", home, path);
+    snprintf(resolved_path, sizeof(resolved_path), "%s/%s/%s", home, store_name, path);
     
     printf("Looking for PDF file at: %s\n", resolved_path);
     
-    // Open the file
-    FILE *fp = fopen(resolved_path, "rb");
-    if (!fp) {
-        perror("File open error");
-        int error_code = -1;
-        send(client_sock, &error_code, sizeof(int), 0);
-        return 0;
-    }
-    
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    int file_size = ftell(fp);
-    rewind(fp);
-    
-    // Send file size
-    send(client_sock, &file_size, sizeof(int), 0);
-    
-    // Read and send file data
-    char *buffer = malloc(file_size);
-    fread(buffer, 1, file_size, fp);
-    send(client_sock, buffer, file_size, 0);
-    
-    free(buffer);
-    fclose(fp);
-    printf("Sent PDF file to S1: %s\n", resolved_path);
-    return 1;
+    // STAT only wants the size and modification time
+    if (req->opcode == DFS_OP_STAT)
+        return dfs_send_stat(client_sock, req, resolved_path);
+
+    // Stream the file straight from the page cache
+    int sent = dfs_send_file(client_sock, req, resolved_path, range);
+    if (sent > 0)
+        printf("Sent PDF file to S1: %s\n", resolved_path);
+    return sent;
 }
 
 // Function to resolve file path
@@ -112,7 +119,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     if (strncmp(input_path, "~/", 2) == 0) {
 
-        snprintf(resolved_path, resolved_size, "%s/S2/%s", home, input_path + 2);
+        snprintf(resolved_path, resolved_size, "%s/%s/%s", home, store_name, input_path + 2);
 
     }
 
@@ -120,7 +127,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     else if (input_path[0] == '/') {
 
-        snprintf(resolved_path, resolved_size, "%s/S2%s", home, input_path);
+        snprintf(resolved_path, resolved_size, "%s/%s%s", home, store_name, input_path);
 
     }
 
@@ -128,7 +135,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     else {
 
-        snprintf(resolved_path, resolved_size, "%s/S2/%s", home, input_path);
+        snprintf(resolved_path, resolved_size, "%s/%s/%s", home, store_name, input_path);
 
     }
 
@@ -136,7 +143,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
 // Handle file removal request
 
-int handle_remove(int client_sock, const char *path) {
+int handle_remove(int client_sock, const struct dfs_header *req, const char *path) {
 
     char resolved_path[1024];
 
@@ -148,11 +155,11 @@ int handle_remove(int client_sock, const char *path) {
 
     // Check if file exists
 
-    if (access(resolved_path, F_OK) != 0) {
+    if (!dfs_index_exists(resolved_path)) {
 
         status_code = 1;  // File not found
 
-        send(client_sock, &status_code, sizeof(int), 0);
+        dfs_send_status(client_sock, req, status_code);
 
         return 0;
 
@@ -164,7 +171,7 @@ int handle_remove(int client_sock, const char *path) {
 
         status_code = 2;  // Permission denied or other error
 
-        send(client_sock, &status_code, sizeof(int), 0);
+        dfs_send_status(client_sock, req, status_code);
 
         return 0;
 
@@ -174,7 +181,12 @@ int handle_remove(int client_sock, const char *path) {
 
     status_code = 0;
 
-    send(client_sock, &status_code, sizeof(int), 0);
+    if (!(req->flags & DFS_FLAG_MOVED))  // Still on another node: no deletion
+        dfs_journal_note(resolved_path, '-');
+    dfs_index_note(resolved_path);
+    dfs_upload_forget(resolved_path);
+
+    dfs_send_status(client_sock, req, status_code);
 
     printf("Successfully removed PDF file: %s\n", resolved_path);
 
@@ -183,120 +195,29 @@ int handle_remove(int client_sock, const char *path) {
 }
 
 
-// Function to create a tar file of all PDF files in S2 directory
-int create_pdf_tar(const char *tar_path) {
-    const char *home = getenv("HOME");
-    char command[2048];  // Increased buffer size for safety
-    
-    // Create the tar file with full path
-    snprintf(command, sizeof(command), 
-             "cd %s/S2 && tar -cf %s $(find . -type f -name '*.pdf' 2>/dev/null)", 
-             home, tar_path);
-    
-    int ret = system(command);
-    if (ret != 0) {
-        printf("tar command failed with status %d\n", ret);
-        return -1;
-    }
-    
-    // Verify the tar file was created
-    if (access(tar_path, F_OK) != 0) {
-        printf("Tar file was not created: %s\n", tar_path);
-        return -1;
-    }
-    
-    return 0;
-}
-
-// Function to handle TARFETCH requests from S1
-void handle_tarfetch(int client_sock) {
-    // Create unique temp file name using PID
-    char tar_path[1024];
-    snprintf(tar_path, sizeof(tar_path), "/tmp/pdf_temp_%d.tar", getpid());
-    
-    // Create the tar file
-    if (create_pdf_tar(tar_path) != 0) {
-        printf("Error creating PDF tar file\n");
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        return;
-    }
-    
-    // Open the tar file
-    FILE *fp = fopen(tar_path, "rb");
-    if (!fp) {
-        perror("Error opening tar file");
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        remove(tar_path);  // Clean up failed file
-        return;
-    }
-    
-    // Get file size
-    if (fseek(fp, 0, SEEK_END) != 0) {
-        perror("Error seeking tar file");
-        fclose(fp);
-        remove(tar_path);
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        return;
-    }
-    
-    long file_size = ftell(fp);
-    if (file_size < 0) {
-        perror("Error getting tar file size");
-        fclose(fp);
-        remove(tar_path);
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        return;
-    }
-    rewind(fp);
-    
-    // Send file size to S1
-    if (send(client_sock, &file_size, sizeof(int), 0) <= 0) {
-        perror("Error sending file size");
-        fclose(fp);
-        remove(tar_path);
-        return;
-    }
-    
-    // Send file data
-    char buffer[BUFFER_SIZE];
-    size_t total_sent = 0;
-    while (!feof(fp)) {
-        size_t read = fread(buffer, 1, BUFFER_SIZE, fp);
-        if (read > 0) {
-            ssize_t sent = send(client_sock, buffer, read, 0);
-            if (sent <= 0) {
-                perror("Error sending file data");
-                break;
-            }
-            total_sent += sent;
-        }
-        if (ferror(fp)) {
-            perror("Error reading tar file");
-            break;
-        }
-    }
-    
-    fclose(fp);
-    remove(tar_path); // Clean up temporary file
-    
-    if (total_sent == file_size) {
-        printf("Successfully sent PDF tar file to S1 (%ld bytes)\n", file_size);
-    } else {
-        printf("Warning: Only sent %zu of %ld bytes\n", total_sent, file_size);
-    }
+// Function to handle TARFETCH requests from S1: stream an archive of all
+// PDF files under dir_path (the whole of S2 directory if it is empty),
+// built as it is sent, or with a sync point in the request only those
+// stored or removed since (see dfs_journal.h).
+// Returns 1 if the connection can be reused, 0 if the response was cut short.
+int handle_tarfetch(int client_sock, const struct dfs_header *req, const char *dir_path) {
+    char *since;
+    int rc = dfs_recv_sync_point(client_sock, req, &since);
+    if (rc != 0)
+        return rc > 0 && dfs_send_status(client_sock, req, DFS_EINVAL) == 0;
+
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+    rc = dfs_send_tar(client_sock, req, root, dir_path, ".pdf", since) >= 0;
+    free(since);
+    return rc;
 }
 
 // Function to handle LISTFILES request for .pdf files
-void handle_list_files(int client_sock, const char *dir_path) {
+void handle_list_files(int client_sock, const struct dfs_header *req, const char *dir_path, const char *cursor) {
     char resolved_path[1024];
     const char *home = getenv("HOME");
     
-    printf("DEBUG: Received path from S1: '%s'\n", dir_path);
-    
     // Convert ~/S1 to ~/S2 or ~/S1/folder to ~/S2/folder
     char adjusted_path[512] = {0};
     
@@ -321,63 +242,166 @@ void handle_list_files(int client_sock, const char *dir_path) {
         snprintf(adjusted_path, sizeof(adjusted_path), "%s", dir_path);
     }
     
-    printf("DEBUG: Adjusted path: '%s'\n", adjusted_path);
-    
     // Resolve the full path for S2
     if (strlen(adjusted_path) > 0) {
-        snprintf(resolved_path, sizeof(resolved_path), "%s/S2/%s", home, adjusted_path);
+        snprintf(resolved_path, sizeof(resolved_path), "%s/%s/%s", home, store_name, adjusted_path);
     } else {
-        snprintf(resolved_path, sizeof(resolved_path), "%s/S2", home);
+        snprintf(resolved_path, sizeof(resolved_path), "%s/%s", home, store_name);
     }
     
-    printf("DEBUG: Looking for PDF files in: '%s'\n", resolved_path);
-    
-    //printf("DEBUG: Looking for PDF files in: '%s'\n", resolved_path);
-    
-    // Check if the directory exists
-    DIR *dir = opendir(resolved_path);
-    if (!dir) {
-        // Directory not found, send 0 file count
-        int file_count = 0;
-        perror("DEBUG: Directory open error");
-        printf("DEBUG: Failed to open directory '%s'\n", resolved_path);
-        send(client_sock, &file_count, sizeof(int), 0);
+    // Send the next batch of names after the cursor; S1 asks again while
+    // the reply says there are more
+    int count = dfs_send_listing(client_sock, req, resolved_path, ".pdf", cursor);
+    if (count < 0) {
+        printf("Failed to list directory '%s'\n", resolved_path);
         return;
     }
     
-    // Count and collect .pdf files
-    struct dirent *entry;
-    char filenames[1000][256];  // Up to 1000 files
-    int file_count = 0;
-    
-    while ((entry = readdir(dir)) != NULL && file_count < 1000) {
-        if (entry->d_type == DT_REG) {  // Regular file
-            char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".pdf") == 0) {
-                strcpy(filenames[file_count], entry->d_name);
-                printf("DEBUG: Found PDF file: %s\n", entry->d_name);
-                file_count++;
-            }
+    printf("%s: Sent %d .pdf filenames to S1 for directory '%s'\n", store_name, count, dir_path);
+}
+
+
+// Serve one request from S1; runs on a pool worker thread.
+// Returns 1 to keep the connection open for S1's next request.
+int handle_request(int client_sock) {
+    struct dfs_header req;
+    char name[DFS_NAME_MAX + 1], aux[DFS_NAME_MAX + 1];
+    if (dfs_recv_request(client_sock, &req, name, aux) < 0)
+        return 0;  // S1 closed the connection
+
+    // Only uploads carry a request payload
+    if (req.payload_len != 0 && !dfs_op_has_payload(req.opcode)) {
+        dfs_send_status(client_sock, &req, DFS_EINVAL);
+        return 0;
+    }
+
+    // Health check from S1's connection pool
+    if (req.opcode == DFS_OP_PING)
+        return dfs_send_status(client_sock, &req, DFS_OK) == 0;
+
+    // Check if this is a download request
+    if (req.opcode == DFS_OP_DOWNLOAD) {
+        if (*aux)
+            printf("Download request received from S1 for: %s (bytes %s)\n", name, aux);
+        else
+            printf("Download request received from S1 for: %s\n", name);
+        // Handle download request
+        return handle_download(client_sock, &req, name, aux) >= 0;
+    }
+
+    // Size and modification time of a file, served by the download path
+    if (req.opcode == DFS_OP_STAT) {
+        printf("Stat request received from S1 for: %s\n", name);
+        return handle_download(client_sock, &req, name, aux) >= 0;
+    }
+
+    // Parts, progress queries and commits of resumable uploads
+    if (req.opcode == DFS_OP_UPLOAD_PART || req.opcode == DFS_OP_UPLOAD_QUERY ||
+        req.opcode == DFS_OP_UPLOAD_COMMIT) {
+        char file_path[1024];
+        upload_path(name, aux, file_path, sizeof(file_path));
+        return dfs_serve_upload(client_sock, &req, file_path);
+    }
+
+    // Check if this is a remove request
+    if (req.opcode == DFS_OP_REMOVE) {
+        printf("Remove request received for: %s\n", name);
+        // Handle remove request
+        handle_remove(client_sock, &req, name);
+        return 1;
+    }
+
+    // Check if this is a download tar request
+    if (req.opcode == DFS_OP_TARFETCH) {
+        if (strcmp(name, ".pdf") == 0) {
+            if (*aux)
+                printf("Tar request received for PDF files under %s\n", aux);
+            else
+                printf("Tar request received for PDF files\n");
+            return handle_tarfetch(client_sock, &req, aux);
         }
+
+        // Only PDF files are supported on S2
+        printf("Unsupported file type for tar request: %s\n", name);
+        return dfs_skip_payload(client_sock, req.payload_len) == 0 &&
+               dfs_send_status(client_sock, &req, DFS_EINVAL) == 0;
     }
-    closedir(dir);
-    
-    printf("DEBUG: Total PDF files found: %d\n", file_count);
-    
-    // Send file count
-    send(client_sock, &file_count, sizeof(int), 0);
-    
-    // Send each filename
-    for (int i = 0; i < file_count; i++) {
-        send(client_sock, filenames[i], sizeof(filenames[0]), 0);
-        printf("DEBUG: Sent filename: %s\n", filenames[i]);
+
+    // S1 follows changes to the store for its listing cache
+    if (req.opcode == DFS_OP_WATCH) {
+        printf("Change notifications requested\n");
+        return dfs_watch_serve(client_sock, &req);
     }
-    
-    printf("S2: Sent %d .pdf filenames to S1 for directory '%s'\n", file_count, dir_path);
+
+    // S1 searches every store at once; this one holds the .pdf files
+    if (req.opcode == DFS_OP_FIND) {
+        printf("Search request received for: %s under '%s'\n", aux, name);
+        char root[1024];
+        snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+        return dfs_send_find(client_sock, &req, root, name, ".pdf", aux) >= 0;
+    }
+
+    // Check if this is a list files request
+    if (req.opcode == DFS_OP_LISTFILES) {
+        printf("Directory listing request received for: %s\n", name);
+
+        // Handle list files request
+        handle_list_files(client_sock, &req, name, aux);
+        return 1;
+    }
+
+    // Upload functionality
+    if (req.opcode == DFS_OP_UPLOAD) {
+        const char *filename = name, *dest_path = aux;
+
+        printf("Upload request received for: %s (%llu bytes) to %s\n", filename,
+               (unsigned long long)req.payload_len, dest_path);
+
+        // The data is written to disk as it arrives, never buffered whole
+        int status = save_file(client_sock, filename, req.payload_len, dest_path, req.flags & DFS_FLAG_SYNC);
+        if (status < 0) {
+            printf("Upload data receive failed\n");
+            return 0;
+        }
+
+        // Acknowledge so S1 knows the exchange is complete
+        return dfs_send_status(client_sock, &req, status) == 0;
+    }
+
+    printf("Unknown command: %d\n", req.opcode);
+    return dfs_send_status(client_sock, &req, DFS_EINVAL) == 0;
 }
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-n store] [-t threads] [-b backlog] [-q queue]\n", prog);
+    fprintf(stderr, "  -p port     port to listen on (default: %d)\n", PORT);
+    fprintf(stderr, "  -n store    store name; files live in ~/store (default: S2)\n");
+    fprintf(stderr, "  -t threads  worker threads serving requests (default: two per core)\n");
+    fprintf(stderr, "  -b backlog  listen backlog (default: %d)\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -q queue    accepted connections waiting for a worker (default: %d)\n", POOL_DEFAULT_QUEUE);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = pool_default_threads();
+    int backlog = DEFAULT_BACKLOG;
+    int queue_size = POOL_DEFAULT_QUEUE;
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "p:n:t:b:q:")) != -1) {
+        if (opt_char == 'p' && atoi(optarg) > 0)
+            server_port = atoi(optarg);
+        else if (opt_char == 'n' && *optarg && !strchr(optarg, '/'))
+            store_name = optarg;
+        else if (opt_char == 't' && atoi(optarg) > 0)
+            threads = atoi(optarg);
+        else if (opt_char == 'b' && atoi(optarg) > 0)
+            backlog = atoi(optarg);
+        else if (opt_char == 'q' && atoi(optarg) > 0)
+            queue_size = atoi(optarg);
+        else
+            usage(argv[0]);
+    }
 
-int main() {
     int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) {
         perror("Socket error");
@@ -386,7 +410,7 @@ int main() {
 
     struct sockaddr_in server_addr = {
         .sin_family = AF_INET,
-        .sin_port = htons(PORT),
+        .sin_port = htons(server_port),
         .sin_addr.s_addr = INADDR_ANY
     };
 
@@ -394,102 +418,25 @@ int main() {
     setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
-    listen(server_sock, 5);
-    printf("S2 server listening on port %d...\n", PORT);
-
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_size = sizeof(client_addr);
-        int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
-
-        char cmd[10] = {0};
-        recv(client_sock, cmd, sizeof(cmd), 0);
-        
-        // Check if this is a download request
-        if (strcmp(cmd, "DOWNLOAD") == 0) {
-            char file_path[512] = {0};
-            recv(client_sock, file_path, sizeof(file_path), 0);
-            printf("Download request received from S1 for: %s\n", file_path);
-            // Handle download request
-            handle_download(client_sock, file_path);
-            close(client_sock);
-            continue;
-        }
-
-        // Check if this is a remove request
-
-        if (strcmp(cmd, "REMOVE") == 0) {
-            char file_path[512] = {0};
-            recv(client_sock, file_path, sizeof(file_path), 0);
-            printf("Remove request received for: %s\n", file_path);
-            // Handle remove request
-            handle_remove(client_sock, file_path);
-            close(client_sock);
-            continue;
-        }
+    listen(server_sock, backlog);
+    printf("%s server listening on port %d (%d worker threads, backlog %d)...\n", store_name, server_port, threads, backlog);
 
-        if (strcmp(cmd, "TARFETCH") == 0) {
-            char filetype[10] = {0};
-            recv(client_sock, filetype, sizeof(filetype), 0);
-            
-            if (strcmp(filetype, ".pdf") == 0) {
-                printf("Tar request received for PDF files\n");
-                handle_tarfetch(client_sock);
-            } else {
-                // Only PDF files are supported on S2
-                printf("Unsupported file type for tar request: %s\n", filetype);
-                int error = -1;
-                send(client_sock, &error, sizeof(int), 0);
-            }
-            
-            close(client_sock);
-            continue;
-        }
-
-        // Check if this is a list files request
-        else if (strcmp(cmd, "LISTFILES") == 0) {
-            char dir_path[512];
-            recv(client_sock, dir_path, sizeof(dir_path), 0);
-            
-            printf("Directory listing request received for: %s\n", dir_path);
-            
-            // Handle list files request
-            handle_list_files(client_sock, dir_path);
-            close(client_sock);
-            continue;
-        }
+    // Record what is stored and removed, for incremental tar archives
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+    dfs_journal_open(store_name, root);
 
-    // Upload Functionality        
-    if (strcmp(cmd, "UPLOAD") == 0) {
-        char filename[256] = {0}, dest_path[256] = {0};
-        int file_size = 0;
+    // Clear away what uploads that clients gave up on left behind
+    dfs_upload_sweep_start(root);
 
-        recv(client_sock, filename, sizeof(filename), 0);
-        recv(client_sock, dest_path, sizeof(dest_path), 0);
-        recv(client_sock, &file_size, sizeof(int), 0);
-
-        printf("Upload request received for: %s (%d bytes) to %s\n", filename, file_size, dest_path);
-
-        char *file_data = malloc(file_size);
-        if (!file_data) {
-            perror("Memory allocation failed");
-            close(client_sock);
-            continue;
-        }
+    // Answer listings and existence checks from memory, and tell S1 what changes
+    dfs_index_changed = dfs_watch_changed;
+    dfs_index_open(root);
 
-        int received = 0;
-        while (received < file_size) {
-            int r = recv(client_sock, file_data + received, file_size - received, 0);
-            if (r <= 0) break;
-            received += r;
-        }
-
-        save_file(filename, file_data, file_size, dest_path);
-        free(file_data);
-        close(client_sock);
-        continue;
-    }
-    }
+    struct worker_pool pool;
+    if (pool_start(&pool, threads, queue_size, handle_request) != 0)
+        exit(1);
 
+    pool_run(&pool, server_sock);
     return 0;
-}
\ No newline at end of file
+}
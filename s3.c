@@ -9,10 +9,26 @@
 #include <dirent.h>    /* For DIR, struct dirent, opendir(), readdir(), closedir() */
 #include <sys/types.h> /* For additional type definitions */
 
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_file.h"
+#include "dfs_upload.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_pool.h"
+#include "dfs_watch.h"
+#include "dfs_find.h"
+
 #define PORT 3034
 #define BUFFER_SIZE 4096
+#define DEFAULT_BACKLOG 128
+
+static int server_port = PORT;
+static const char *store_name = "S3";  /* Files live in ~/<store_name> */
 
-void save_file(const char *filename, char *file_data, int file_size, const char *dest_path) {
+// Work out where an upload of filename to dest_path goes under ~/S3,
+// creating the directory. Returns 0, or -1 if the file type isn't ours.
+int upload_path(const char *filename, const char *dest_path, char *file_path, size_t size) {
     char *ext = strrchr(filename, '.');
     if (!ext) ext = "";
 
@@ -20,28 +36,38 @@ void save_file(const char *filename, char *file_data, int file_size, const char
     char full_path[1024];
 
     if (strcmp(ext, ".txt") == 0) {
-        snprintf(full_path, sizeof(full_path), "%s/S3/%s", home, dest_path + 5);
+        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home, store_name, dest_path + 5);
 
         // Create the directory
         char command[1024];
         snprintf(command, sizeof(command), "mkdir -p \"%s\"", full_path);
         system(command);
 
-        // Save the file
-        char file_path[1024];
-        snprintf(file_path, sizeof(file_path), "%s/%s", full_path, filename);
+        snprintf(file_path, size, "%s/%s", full_path, filename);
+        return 0;
+    }
 
-        FILE *fp = fopen(file_path, "wb");
-        if (fp) {
-            fwrite(file_data, 1, file_size, fp);
-            fclose(fp);
-            printf("Stored .txt file at %s\n", file_path);
-        } else {
-            perror("Error writing file");
-        }
-    } else {
-        printf("Invalid file format for Server 3\n");
+    printf("Invalid file format for Server 3\n");
+    return -1;
+}
+
+// Store an upload from S1, writing it to disk as it arrives (and syncing it
+// there before returning, if sync is set).
+// Returns DFS_OK, DFS_EIO or DFS_EINVAL, or -1 if the connection broke.
+int save_file(int client_sock, const char *filename, uint64_t file_size, const char *dest_path, int sync) {
+    // Save the file
+    char file_path[1024];
+    if (upload_path(filename, dest_path, file_path, sizeof(file_path)) < 0)
+        return dfs_skip_payload(client_sock, file_size) == 0 ? DFS_EINVAL : -1;
+
+    int status = dfs_recv_payload_file(client_sock, file_path, file_size, 0, sync, NULL);
+    if (status == DFS_OK) {
+        dfs_journal_note(file_path, '+');
+        dfs_index_note(file_path);
+        dfs_upload_forget(file_path);  // A plain upload leaves no upload to commit again
+        printf("Stored .txt file at %s\n", file_path);
     }
+    return status;
 }
 
 
@@ -73,42 +99,26 @@ void create_directories(const char *path) {
 
 }
 
-// Function to handle file download requests
-int handle_download(int client_sock, const char *path) {
+// Function to handle file download and STAT requests.
+// Returns 1 if sent, 0 if not found, -1 if the connection broke mid-response.
+int handle_download(int client_sock, const struct dfs_header *req, const char *path, const char *range) {
     const char *home = getenv("HOME");
     char resolved_path[1024];
     
     // Create path with S3 directory
-    snprintf(resolved_path, sizeof(resolved_path), "%s/S3/%s", home, path);
+    snprintf(resolved_path, sizeof(resolved_path), "%s/%s/%s", home, store_name, path);
     
     printf("Looking for TXT file at: %s\n", resolved_path);
     
-    // Open the file
-    FILE *fp = fopen(resolved_path, "rb");
-    if (!fp) {
-        perror("File open error");
-        int error_code = -1;
-        send(client_sock, &error_code, sizeof(int), 0);
-        return 0;
-    }
-    
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    int file_size = ftell(fp);
-    rewind(fp);
-    
-    // Send file size
-    send(client_sock, &file_size, sizeof(int), 0);
-    
-    // Read and send file data
-    char *buffer = malloc(file_size);
-    fread(buffer, 1, file_size, fp);
-    send(client_sock, buffer, file_size, 0);
-    
-    free(buffer);
-    fclose(fp);
-    printf("Sent TXT file to S1: %s\n", resolved_path);
-    return 1;
+    // STAT only wants the size and modification time
+    if (req->opcode == DFS_OP_STAT)
+        return dfs_send_stat(client_sock, req, resolved_path);
+
+    // Stream the file straight from the page cache
+    int sent = dfs_send_file(client_sock, req, resolved_path, range);
+    if (sent > 0)
+        printf("Sent TXT file to S1: %s\n", resolved_path);
+    return sent;
 }
 
 
@@ -122,7 +132,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     if (strncmp(input_path, "~/", 2) == 0) {
 
-        snprintf(resolved_path, resolved_size, "%s/S3/%s", home, input_path + 2);
+        snprintf(resolved_path, resolved_size, "%s/%s/%s", home, store_name, input_path + 2);
 
     }
 
@@ -130,7 +140,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     else if (input_path[0] == '/') {
 
-        snprintf(resolved_path, resolved_size, "%s/S3%s", home, input_path);
+        snprintf(resolved_path, resolved_size, "%s/%s%s", home, store_name, input_path);
 
     }
 
@@ -138,7 +148,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     else {
 
-        snprintf(resolved_path, resolved_size, "%s/S3/%s", home, input_path);
+        snprintf(resolved_path, resolved_size, "%s/%s/%s", home, store_name, input_path);
 
     }
 
@@ -146,7 +156,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
 // Handle file removal request
 
-int handle_remove(int client_sock, const char *path) {
+int handle_remove(int client_sock, const struct dfs_header *req, const char *path) {
 
     char resolved_path[1024];
 
@@ -162,11 +172,11 @@ int handle_remove(int client_sock, const char *path) {
 
     // Check if file exists
 
-    if (access(resolved_path, F_OK) != 0) {
+    if (!dfs_index_exists(resolved_path)) {
 
         status_code = 1;  // File not found
 
-        send(client_sock, &status_code, sizeof(int), 0);
+        dfs_send_status(client_sock, req, status_code);
 
         return 0;
 
@@ -178,7 +188,7 @@ int handle_remove(int client_sock, const char *path) {
 
         status_code = 2;  // Permission denied or other error
 
-        send(client_sock, &status_code, sizeof(int), 0);
+        dfs_send_status(client_sock, req, status_code);
 
         return 0;
 
@@ -188,7 +198,12 @@ int handle_remove(int client_sock, const char *path) {
 
     status_code = 0;
 
-    send(client_sock, &status_code, sizeof(int), 0);
+    if (!(req->flags & DFS_FLAG_MOVED))  // Still on another node: no deletion
+        dfs_journal_note(resolved_path, '-');
+    dfs_index_note(resolved_path);
+    dfs_upload_forget(resolved_path);
+
+    dfs_send_status(client_sock, req, status_code);
 
     printf("Successfully removed TXT file: %s\n", resolved_path);
 
@@ -197,115 +212,26 @@ int handle_remove(int client_sock, const char *path) {
 }
 
 
-// Function to create a tar file of all .txt files in S3 directory
-int create_txt_tar(const char *tar_path) {
-    const char *home = getenv("HOME");
-    char command[2048];  // Increased buffer size for safety
-    
-    // Create the tar file with full path
-    snprintf(command, sizeof(command), 
-             "cd %s/S3 && tar -cf %s $(find . -type f -name '*.txt' 2>/dev/null)", 
-             home, tar_path);
-    
-    int ret = system(command);
-    if (ret != 0) {
-        printf("tar command failed with status %d\n", ret);
-        return -1;
-    }
-    
-    // Verify the tar file was created
-    if (access(tar_path, F_OK) != 0) {
-        printf("Tar file was not created: %s\n", tar_path);
-        return -1;
-    }
-    
-    return 0;
-}
-
-// Function to handle TARFETCH requests from S1
-void handle_tarfetch(int client_sock) {
-    // Create unique temp file name using PID
-    char tar_path[1024];
-    snprintf(tar_path, sizeof(tar_path), "/tmp/txt_temp_%d.tar", getpid());
-    
-    // Create the tar file
-    if (create_txt_tar(tar_path) != 0) {
-        printf("Error creating .txt tar file\n");
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        return;
-    }
-    
-    // Open the tar file
-    FILE *fp = fopen(tar_path, "rb");
-    if (!fp) {
-        perror("Error opening tar file");
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        remove(tar_path);  // Clean up failed file
-        return;
-    }
-    
-    // Get file size
-    if (fseek(fp, 0, SEEK_END) != 0) {
-        perror("Error seeking tar file");
-        fclose(fp);
-        remove(tar_path);
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        return;
-    }
-    
-    long file_size = ftell(fp);
-    if (file_size < 0) {
-        perror("Error getting tar file size");
-        fclose(fp);
-        remove(tar_path);
-        int error = -1;
-        send(client_sock, &error, sizeof(int), 0);
-        return;
-    }
-    rewind(fp);
-    
-    // Send file size to S1
-    if (send(client_sock, &file_size, sizeof(int), 0) <= 0) {
-        perror("Error sending file size");
-        fclose(fp);
-        remove(tar_path);
-        return;
-    }
-    
-    // Send file data
-    char buffer[BUFFER_SIZE];
-    size_t total_sent = 0;
-    while (!feof(fp)) {
-        size_t read = fread(buffer, 1, BUFFER_SIZE, fp);
-        if (read > 0) {
-            ssize_t sent = send(client_sock, buffer, read, 0);
-            if (sent <= 0) {
-                perror("Error sending file data");
-                break;
-            }
-            total_sent += sent;
-        }
-        if (ferror(fp)) {
-            perror("Error reading tar file");
-            break;
-        }
-    }
-    
-    fclose(fp);
-    remove(tar_path); // Clean up temporary file
-    
-    if (total_sent == file_size) {
-        printf("Successfully sent .txt tar file to S1 (%ld bytes)\n", file_size);
-    } else {
-        printf("Warning: Only sent %zu of %ld bytes\n", total_sent, file_size);
-    }
+// Function to handle TARFETCH requests from S1: stream an archive of all
+// .txt files under dir_path (the whole of S3 directory if it is empty),
+// built as it is sent, or with a sync point in the request only those
+// stored or removed since (see dfs_journal.h).
+// Returns 1 if the connection can be reused, 0 if the response was cut short.
+int handle_tarfetch(int client_sock, const struct dfs_header *req, const char *dir_path) {
+    char *since;
+    int rc = dfs_recv_sync_point(client_sock, req, &since);
+    if (rc != 0)
+        return rc > 0 && dfs_send_status(client_sock, req, DFS_EINVAL) == 0;
+
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+    rc = dfs_send_tar(client_sock, req, root, dir_path, ".txt", since) >= 0;
+    free(since);
+    return rc;
 }
 
 // Function to handle LISTFILES request for .txt files
-void handle_list_files(int client_sock, const char *dir_path) {
+void handle_list_files(int client_sock, const struct dfs_header *req, const char *dir_path, const char *cursor) {
     char resolved_path[1024];
     const char *home = getenv("HOME");
     
@@ -339,189 +265,210 @@ void handle_list_files(int client_sock, const char *dir_path) {
     
     // Resolve the full path for S3
     if (strlen(adjusted_path) > 0) {
-        snprintf(resolved_path, sizeof(resolved_path), "%s/S3/%s", home, adjusted_path);
+        snprintf(resolved_path, sizeof(resolved_path), "%s/%s/%s", home, store_name, adjusted_path);
     } else {
-        snprintf(resolved_path, sizeof(resolved_path), "%s/S3", home);
+        snprintf(resolved_path, sizeof(resolved_path), "%s/%s", home, store_name);
     }
     
     printf("Looking for TXT files in: '%s'\n", resolved_path);
     
     
-    // Check if the directory exists
-    DIR *dir = opendir(resolved_path);
-    if (!dir) {
-        // Directory not found, send 0 file count
-        int file_count = 0;
-        perror("Directory open error");
-        printf("Failed to open directory '%s'\n", resolved_path);
-        send(client_sock, &file_count, sizeof(int), 0);
+    // Send the next batch of names after the cursor; S1 asks again while
+    // the reply says there are more
+    int count = dfs_send_listing(client_sock, req, resolved_path, ".txt", cursor);
+    if (count < 0) {
+        printf("Failed to list directory '%s'\n", resolved_path);
         return;
     }
     
-    // Count and collect .txt files
-    struct dirent *entry;
-    char filenames[1000][256];  // Up to 1000 files
-    int file_count = 0;
-    
-    while ((entry = readdir(dir)) != NULL && file_count < 1000) {
-        if (entry->d_type == DT_REG) {  // Regular file
-            char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".txt") == 0) {
-                strcpy(filenames[file_count], entry->d_name);
-                printf("Found TXT file: %s\n", entry->d_name);
-                file_count++;
-            }
-        }
-    }
-    closedir(dir);
-    
-    printf("Total TXT files found: %d\n", file_count);
-    
-    // Send file count
-    send(client_sock, &file_count, sizeof(int), 0);
-    
-    // Send each filename
-    for (int i = 0; i < file_count; i++) {
-        send(client_sock, filenames[i], sizeof(filenames[0]), 0);
-        printf("Sent filename: %s\n", filenames[i]);
-    }
-    
-    printf("S3: Sent %d .txt filenames to S1 for directory '%s'\n", file_count, dir_path);
+    printf("%s: Sent %d .txt filenames to S1 for directory '%s'\n", store_name, count, dir_path);
 }
 
 
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_size;
+// Serve one request from S1; runs on a pool worker thread.
+// Returns 1 to keep the connection open for S1's next request.
+int handle_request(int client_sock) {
+    struct dfs_header req;
+    char name[DFS_NAME_MAX + 1], aux[DFS_NAME_MAX + 1];
+    if (dfs_recv_request(client_sock, &req, name, aux) < 0)
+        return 0;  // S1 closed the connection
 
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket error");
-        exit(1);
+    // Only uploads carry a request payload
+    if (req.payload_len != 0 && !dfs_op_has_payload(req.opcode)) {
+        dfs_send_status(client_sock, &req, DFS_EINVAL);
+        return 0;
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    // Health check from S1's connection pool
+    if (req.opcode == DFS_OP_PING)
+        return dfs_send_status(client_sock, &req, DFS_OK) == 0;
+
+    // Check if this is a download request
+    if (req.opcode == DFS_OP_DOWNLOAD) {
+        if (*aux)
+            printf("Download request received from S1 for: %s (bytes %s)\n", name, aux);
+        else
+            printf("Download request received from S1 for: %s\n", name);
+        // Handle download request
+        return handle_download(client_sock, &req, name, aux) >= 0;
+    }
 
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind error");
-        exit(1);
+    // Size and modification time of a file, served by the download path
+    if (req.opcode == DFS_OP_STAT) {
+        printf("Stat request received from S1 for: %s\n", name);
+        return handle_download(client_sock, &req, name, aux) >= 0;
     }
 
-    listen(server_sock, 5);
-    printf("S3 server is listening on port %d...\n", PORT);
-
-    while (1) {
-        addr_size = sizeof(client_addr);
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
-
-        //download starts 
-        char cmd[10] = {0};
-        recv(client_sock, cmd, sizeof(cmd), 0);
-        
-        // Check if this is a download request
-        if (strcmp(cmd, "DOWNLOAD") == 0) {
-            char file_path[512] = {0};
-            recv(client_sock, file_path, sizeof(file_path), 0);
-            
-            printf("Download request received from S1 for: %s\n", file_path);
-            
-            // Handle download request
-            handle_download(client_sock, file_path);
-            close(client_sock);
-            continue;
+    // Parts, progress queries and commits of resumable uploads
+    if (req.opcode == DFS_OP_UPLOAD_PART || req.opcode == DFS_OP_UPLOAD_QUERY ||
+        req.opcode == DFS_OP_UPLOAD_COMMIT) {
+        char file_path[1024];
+        if (upload_path(name, aux, file_path, sizeof(file_path)) < 0)
+            return dfs_skip_payload(client_sock, req.payload_len) == 0 &&
+                   dfs_send_committed(client_sock, &req, DFS_EINVAL, 0) == 0;
+        return dfs_serve_upload(client_sock, &req, file_path);
+    }
+
+    // Check if this is a remove request
+    if (req.opcode == DFS_OP_REMOVE) {
+        printf("Remove request received for: %s\n", name);
+        // Handle remove request
+        handle_remove(client_sock, &req, name);
+        return 1;
+    }
+
+    // Check if this is a download tar request
+    if (req.opcode == DFS_OP_TARFETCH) {
+        if (strcmp(name, ".txt") == 0) {
+            if (*aux)
+                printf("Tar request received for TXT files under %s\n", aux);
+            else
+                printf("Tar request received for TXT files\n");
+            return handle_tarfetch(client_sock, &req, aux);
         }
 
-        // Check if this is a remove request
+        // Only TXT files are supported on S3
+        printf("Unsupported file type for tar request: %s\n", name);
+        return dfs_skip_payload(client_sock, req.payload_len) == 0 &&
+               dfs_send_status(client_sock, &req, DFS_EINVAL) == 0;
+    }
 
-        if (strcmp(cmd, "REMOVE") == 0) {
+    // S1 follows changes to the store for its listing cache
+    if (req.opcode == DFS_OP_WATCH) {
+        printf("Change notifications requested\n");
+        return dfs_watch_serve(client_sock, &req);
+    }
 
-            char file_path[512] = {0};
+    // S1 searches every store at once; this one holds the .txt files
+    if (req.opcode == DFS_OP_FIND) {
+        printf("Search request received for: %s under '%s'\n", aux, name);
+        char root[1024];
+        snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+        return dfs_send_find(client_sock, &req, root, name, ".txt", aux) >= 0;
+    }
 
-            recv(client_sock, file_path, sizeof(file_path), 0);
+    // Check if this is a list files request
+    if (req.opcode == DFS_OP_LISTFILES) {
+        printf("Directory listing request received for: %s\n", name);
 
-            
+        // Handle list files request
+        handle_list_files(client_sock, &req, name, aux);
+        return 1;
+    }
 
-            printf("Remove request received for: %s\n", file_path);
+    // Upload functionality
+    if (req.opcode == DFS_OP_UPLOAD) {
+        const char *filename = name, *dest_path = aux;
 
-            
+        printf("Upload request received for: %s (%llu bytes) to %s\n", filename,
+               (unsigned long long)req.payload_len, dest_path);
 
-            // Handle remove request
+        // The data is written to disk as it arrives, never buffered whole
+        int status = save_file(client_sock, filename, req.payload_len, dest_path, req.flags & DFS_FLAG_SYNC);
+        if (status < 0) {
+            printf("Upload data receive failed\n");
+            return 0;
+        }
 
-            handle_remove(client_sock, file_path);
+        // Acknowledge so S1 knows the exchange is complete
+        return dfs_send_status(client_sock, &req, status) == 0;
+    }
 
-            close(client_sock);
+    printf("Unknown command: %d\n", req.opcode);
+    return dfs_send_status(client_sock, &req, DFS_EINVAL) == 0;
+}
 
-            continue;
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-n store] [-t threads] [-b backlog] [-q queue]\n", prog);
+    fprintf(stderr, "  -p port     port to listen on (default: %d)\n", PORT);
+    fprintf(stderr, "  -n store    store name; files live in ~/store (default: S3)\n");
+    fprintf(stderr, "  -t threads  worker threads serving requests (default: two per core)\n");
+    fprintf(stderr, "  -b backlog  listen backlog (default: %d)\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -q queue    accepted connections waiting for a worker (default: %d)\n", POOL_DEFAULT_QUEUE);
+    exit(1);
+}
 
-        }
+int main(int argc, char *argv[]) {
+    int server_sock;
+    struct sockaddr_in server_addr;
+    int threads = pool_default_threads();
+    int backlog = DEFAULT_BACKLOG;
+    int queue_size = POOL_DEFAULT_QUEUE;
+    int opt_char;
+
+    while ((opt_char = getopt(argc, argv, "p:n:t:b:q:")) != -1) {
+        if (opt_char == 'p' && atoi(optarg) > 0)
+            server_port = atoi(optarg);
+        else if (opt_char == 'n' && *optarg && !strchr(optarg, '/'))
+            store_name = optarg;
+        else if (opt_char == 't' && atoi(optarg) > 0)
+            threads = atoi(optarg);
+        else if (opt_char == 'b' && atoi(optarg) > 0)
+            backlog = atoi(optarg);
+        else if (opt_char == 'q' && atoi(optarg) > 0)
+            queue_size = atoi(optarg);
+        else
+            usage(argv[0]);
+    }
 
-        // Check if this is a download tar request
-        if (strcmp(cmd, "TARFETCH") == 0) {
-            char filetype[10] = {0};
-            recv(client_sock, filetype, sizeof(filetype), 0);
-            
-            if (strcmp(filetype, ".txt") == 0) {
-                printf("Tar request received for TXT files\n");
-                handle_tarfetch(client_sock);
-            } else {
-                // Only TXT files are supported on S3
-                printf("Unsupported file type for tar request: %s\n", filetype);
-                int error = -1;
-                send(client_sock, &error, sizeof(int), 0);
-            }
-            
-            close(client_sock);
-            continue;
-        }
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("Socket error");
+        exit(1);
+    }
 
-        // Check if this is a list files request
-        else if (strcmp(cmd, "LISTFILES") == 0) {
-            char dir_path[512];
-            recv(client_sock, dir_path, sizeof(dir_path), 0);
-            
-            printf("Directory listing request received for: %s\n", dir_path);
-            
-            // Handle list files request
-            handle_list_files(client_sock, dir_path);
-            close(client_sock);
-            continue;
-        }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
 
-        // Upload functionality
-        if (strcmp(cmd, "UPLOAD") == 0) {
-            char filename[256] = {0}, dest_path[256] = {0};
-            int file_size = 0;
-    
-            recv(client_sock, filename, sizeof(filename), 0);
-            recv(client_sock, dest_path, sizeof(dest_path), 0);
-            recv(client_sock, &file_size, sizeof(int), 0);
-    
-            printf("Upload request received for: %s (%d bytes) to %s\n", filename, file_size, dest_path);
-    
-            char *file_data = malloc(file_size);
-            if (!file_data) {
-                perror("Memory allocation failed");
-                close(client_sock);
-                continue;
-            }
-    
-            int received = 0;
-            while (received < file_size) {
-                int r = recv(client_sock, file_data + received, file_size - received, 0);
-                if (r <= 0) break;
-                received += r;
-            }
-    
-            save_file(filename, file_data, file_size, dest_path);
-            free(file_data);
-            close(client_sock);
-            continue;
-        }
-        
+    // Allow a quick restart while old pooled connections sit in TIME_WAIT
+    int opt = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind error");
+        exit(1);
     }
 
+    listen(server_sock, backlog);
+    printf("%s server is listening on port %d (%d worker threads, backlog %d)...\n", store_name, server_port, threads, backlog);
+
+    // Record what is stored and removed, for incremental tar archives
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+    dfs_journal_open(store_name, root);
+
+    // Clear away what uploads that clients gave up on left behind
+    dfs_upload_sweep_start(root);
+
+    // Answer listings and existence checks from memory, and tell S1 what changes
+    dfs_index_changed = dfs_watch_changed;
+    dfs_index_open(root);
+
+    struct worker_pool pool;
+    if (pool_start(&pool, threads, queue_size, handle_request) != 0)
+        exit(1);
+
+    pool_run(&pool, server_sock);
     return 0;
-}
\ No newline at end of file
+}
@@ -10,10 +10,26 @@
 #include <dirent.h>    /* For DIR, struct dirent, opendir(), readdir(), closedir() */
 #include <sys/types.h> /* For additional type definitions */
 
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_file.h"
+#include "dfs_upload.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_pool.h"
+#include "dfs_watch.h"
+#include "dfs_find.h"
+
 #define PORT 3036
 #define BUFFER_SIZE 4096
+#define DEFAULT_BACKLOG 128
+
+static int server_port = PORT;
+static const char *store_name = "S4";  /* Files live in ~/<store_name> */
 
-void save_file(const char *filename, char *file_data, int file_size, const char *dest_path) {
+// Work out where an upload of filename to dest_path goes under ~/S4,
+// creating the directory. Returns 0, or -1 if the file type isn't ours.
+int upload_path(const char *filename, const char *dest_path, char *file_path, size_t size) {
     char *ext = strrchr(filename, '.');
     if (!ext) ext = "";
 
@@ -21,28 +37,38 @@ void save_file(const char *filename, char *file_data, int file_size, const char
     char full_path[1024];
 
     if (strcmp(ext, ".zip") == 0) {
-        snprintf(full_path, sizeof(full_path), "%s/S4/%s", home, dest_path + 5);
+        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home, store_name, dest_path + 5);
 
         // Create the directory
         char command[1024];
         snprintf(command, sizeof(command), "mkdir -p \"%s\"", full_path);
         system(command);
 
-        // Save the file
-        char file_path[1024];
-        snprintf(file_path, sizeof(file_path), "%s/%s", full_path, filename);
+        snprintf(file_path, size, "%s/%s", full_path, filename);
+        return 0;
+    }
 
-        FILE *fp = fopen(file_path, "wb");
-        if (fp) {
-            fwrite(file_data, 1, file_size, fp);
-            fclose(fp);
-            printf("Stored .zip file at %s\n", file_path);
-        } else {
-            perror("Error writing file");
-        }
-    } else {
-        printf("Invalid file format for Server 3\n");
+    printf("Invalid file format for Server 3\n");
+    return -1;
+}
+
+// Store an upload from S1, writing it to disk as it arrives (and syncing it
+// there before returning, if sync is set).
+// Returns DFS_OK, DFS_EIO or DFS_EINVAL, or -1 if the connection broke.
+int save_file(int client_sock, const char *filename, uint64_t file_size, const char *dest_path, int sync) {
+    // Save the file
+    char file_path[1024];
+    if (upload_path(filename, dest_path, file_path, sizeof(file_path)) < 0)
+        return dfs_skip_payload(client_sock, file_size) == 0 ? DFS_EINVAL : -1;
+
+    int status = dfs_recv_payload_file(client_sock, file_path, file_size, 0, sync, NULL);
+    if (status == DFS_OK) {
+        dfs_journal_note(file_path, '+');
+        dfs_index_note(file_path);
+        dfs_upload_forget(file_path);  // A plain upload leaves no upload to commit again
+        printf("Stored .zip file at %s\n", file_path);
     }
+    return status;
 }
 
 void create_directories(const char *path) {
@@ -73,9 +99,9 @@ void create_directories(const char *path) {
 
 }
 
-// Function to handle file download requests
+// Function to handle file download and STAT requests
 
-int handle_download(int client_sock, const char *path) {
+int handle_download(int client_sock, const struct dfs_header *req, const char *path, const char *range) {
 
     const char *home = getenv("HOME");
 
@@ -85,7 +111,7 @@ int handle_download(int client_sock, const char *path) {
 
     // Create path with S4 directory
 
-    snprintf(resolved_path, sizeof(resolved_path), "%s/S4/%s", home, path);
+    snprintf(resolved_path, sizeof(resolved_path), "%s/%s/%s", home, store_name, path);
 
     
 
@@ -93,57 +119,15 @@ int handle_download(int client_sock, const char *path) {
 
     
 
-    // Open the file
-
-    FILE *fp = fopen(resolved_path, "rb");
-
-    if (!fp) {
-
-        perror("File open error");
-
-        int error_code = -1;
-
-        send(client_sock, &error_code, sizeof(int), 0);
-
-        return 0;
-
-    }
-
-    
-
-    // Get file size
-
-    fseek(fp, 0, SEEK_END);
-
-    int file_size = ftell(fp);
-
-    rewind(fp);
-
-    
-
-    // Send file size
-
-    send(client_sock, &file_size, sizeof(int), 0);
-
-    
-
-    // Read and send file data
-
-    char *buffer = malloc(file_size);
-
-    fread(buffer, 1, file_size, fp);
-
-    send(client_sock, buffer, file_size, 0);
-
-    
-
-    free(buffer);
-
-    fclose(fp);
+    // STAT only wants the size and modification time
+    if (req->opcode == DFS_OP_STAT)
+        return dfs_send_stat(client_sock, req, resolved_path);
 
-    printf("Sent ZIP file to S1: %s\n", resolved_path);
-
-    return 1;
+    // Stream the file straight from the page cache
+    int sent = dfs_send_file(client_sock, req, resolved_path, range);
+    if (sent > 0)
+        printf("Sent ZIP file to S1: %s\n", resolved_path);
+    return sent;
 
 }
 
@@ -158,7 +142,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     if (strncmp(input_path, "~/", 2) == 0) {
 
-        snprintf(resolved_path, resolved_size, "%s/S4/%s", home, input_path + 2);
+        snprintf(resolved_path, resolved_size, "%s/%s/%s", home, store_name, input_path + 2);
 
     }
 
@@ -166,7 +150,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     else if (input_path[0] == '/') {
 
-        snprintf(resolved_path, resolved_size, "%s/S4%s", home, input_path);
+        snprintf(resolved_path, resolved_size, "%s/%s%s", home, store_name, input_path);
 
     }
 
@@ -174,7 +158,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
     else {
 
-        snprintf(resolved_path, resolved_size, "%s/S4/%s", home, input_path);
+        snprintf(resolved_path, resolved_size, "%s/%s/%s", home, store_name, input_path);
 
     }
 
@@ -182,7 +166,7 @@ void resolve_path(const char *input_path, char *resolved_path, size_t resolved_s
 
 // Handle file removal request
 
-int handle_remove(int client_sock, const char *path) {
+int handle_remove(int client_sock, const struct dfs_header *req, const char *path) {
 
     char resolved_path[1024];
 
@@ -194,11 +178,11 @@ int handle_remove(int client_sock, const char *path) {
 
     // Check if file exists
 
-    if (access(resolved_path, F_OK) != 0) {
+    if (!dfs_index_exists(resolved_path)) {
 
         status_code = 1;  // File not found
 
-        send(client_sock, &status_code, sizeof(int), 0);
+        dfs_send_status(client_sock, req, status_code);
 
         return 0;
 
@@ -210,7 +194,7 @@ int handle_remove(int client_sock, const char *path) {
 
         status_code = 2;  // Permission denied or other error
 
-        send(client_sock, &status_code, sizeof(int), 0);
+        dfs_send_status(client_sock, req, status_code);
 
         return 0;
 
@@ -220,7 +204,12 @@ int handle_remove(int client_sock, const char *path) {
 
     status_code = 0;
 
-    send(client_sock, &status_code, sizeof(int), 0);
+    if (!(req->flags & DFS_FLAG_MOVED))  // Still on another node: no deletion
+        dfs_journal_note(resolved_path, '-');
+    dfs_index_note(resolved_path);
+    dfs_upload_forget(resolved_path);
+
+    dfs_send_status(client_sock, req, status_code);
 
     printf("Successfully removed ZIP file: %s\n", resolved_path);
 
@@ -228,8 +217,26 @@ int handle_remove(int client_sock, const char *path) {
 
 }
 
+// Function to handle TARFETCH requests from S1: stream an archive of all
+// .zip files under dir_path (the whole of S4 directory if it is empty),
+// built as it is sent, or with a sync point in the request only those
+// stored or removed since (see dfs_journal.h).
+// Returns 1 if the connection can be reused, 0 if the response was cut short.
+int handle_tarfetch(int client_sock, const struct dfs_header *req, const char *dir_path) {
+    char *since;
+    int rc = dfs_recv_sync_point(client_sock, req, &since);
+    if (rc != 0)
+        return rc > 0 && dfs_send_status(client_sock, req, DFS_EINVAL) == 0;
+
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+    rc = dfs_send_tar(client_sock, req, root, dir_path, ".zip", since) >= 0;
+    free(since);
+    return rc;
+}
+
 // Function to handle LISTFILES request for .zip files
-void handle_list_files(int client_sock, const char *dir_path) {
+void handle_list_files(int client_sock, const struct dfs_header *req, const char *dir_path, const char *cursor) {
     char resolved_path[1024];
     const char *home = getenv("HOME");
     
@@ -263,181 +270,210 @@ void handle_list_files(int client_sock, const char *dir_path) {
     
     // Resolve the full path for S4
     if (strlen(adjusted_path) > 0) {
-        snprintf(resolved_path, sizeof(resolved_path), "%s/S4/%s", home, adjusted_path);
+        snprintf(resolved_path, sizeof(resolved_path), "%s/%s/%s", home, store_name, adjusted_path);
     } else {
-        snprintf(resolved_path, sizeof(resolved_path), "%s/S4", home);
+        snprintf(resolved_path, sizeof(resolved_path), "%s/%s", home, store_name);
     }
     
     printf("Looking for ZIP files in: '%s'\n", resolved_path);
     
     
-    // Check if the directory exists
-    DIR *dir = opendir(resolved_path);
-    if (!dir) {
-        // Directory not found, send 0 file count
-        int file_count = 0;
-        perror("Directory open error");
-        printf("Failed to open directory '%s'\n", resolved_path);
-        send(client_sock, &file_count, sizeof(int), 0);
+    // Send the next batch of names after the cursor; S1 asks again while
+    // the reply says there are more
+    int count = dfs_send_listing(client_sock, req, resolved_path, ".zip", cursor);
+    if (count < 0) {
+        printf("Failed to list directory '%s'\n", resolved_path);
         return;
     }
     
-    // Count and collect .zip files
-    struct dirent *entry;
-    char filenames[1000][256];  // Up to 1000 files
-    int file_count = 0;
-    
-    while ((entry = readdir(dir)) != NULL && file_count < 1000) {
-        if (entry->d_type == DT_REG) {  // Regular file
-            char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".zip") == 0) {
-                strcpy(filenames[file_count], entry->d_name);
-                printf("Found ZIP file: %s\n", entry->d_name);
-                file_count++;
-            }
-        }
-    }
-    closedir(dir);
-    
-    printf("Total ZIP files found: %d\n", file_count);
-    
-    // Send file count
-    send(client_sock, &file_count, sizeof(int), 0);
-    
-    // Send each filename
-    for (int i = 0; i < file_count; i++) {
-        send(client_sock, filenames[i], sizeof(filenames[0]), 0);
-        printf("Sent filename: %s\n", filenames[i]);
-    }
-    
-    printf("S3: Sent %d .zip filenames to S1 for directory '%s'\n", file_count, dir_path);
+    printf("%s: Sent %d .zip filenames to S1 for directory '%s'\n", store_name, count, dir_path);
 }
 
 
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_size;
+// Serve one request from S1; runs on a pool worker thread.
+// Returns 1 to keep the connection open for S1's next request.
+int handle_request(int client_sock) {
+    struct dfs_header req;
+    char name[DFS_NAME_MAX + 1], aux[DFS_NAME_MAX + 1];
+    if (dfs_recv_request(client_sock, &req, name, aux) < 0)
+        return 0;  // S1 closed the connection
 
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket error");
-        exit(1);
+    // Only uploads carry a request payload
+    if (req.payload_len != 0 && !dfs_op_has_payload(req.opcode)) {
+        dfs_send_status(client_sock, &req, DFS_EINVAL);
+        return 0;
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind error");
-        exit(1);
+    // Health check from S1's connection pool
+    if (req.opcode == DFS_OP_PING)
+        return dfs_send_status(client_sock, &req, DFS_OK) == 0;
+
+    // Check if this is a download request
+    if (req.opcode == DFS_OP_DOWNLOAD) {
+        if (*aux)
+            printf("Download request received from S1 for: %s (bytes %s)\n", name, aux);
+        else
+            printf("Download request received from S1 for: %s\n", name);
+        // Handle download request
+        return handle_download(client_sock, &req, name, aux) >= 0;
     }
 
-    listen(server_sock, 5);
-    printf("S4 server is listening on port %d...\n", PORT);
-
-    while (1) {
-        addr_size = sizeof(client_addr);
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
-
-        //download starts here 
-        char cmd[10] = {0};
-
-        recv(client_sock, cmd, sizeof(cmd), 0);
-
-        
-
-        // Check if this is a download request
+    // Size and modification time of a file, served by the download path
+    if (req.opcode == DFS_OP_STAT) {
+        printf("Stat request received from S1 for: %s\n", name);
+        return handle_download(client_sock, &req, name, aux) >= 0;
+    }
 
-        if (strcmp(cmd, "DOWNLOAD") == 0) {
+    // Parts, progress queries and commits of resumable uploads
+    if (req.opcode == DFS_OP_UPLOAD_PART || req.opcode == DFS_OP_UPLOAD_QUERY ||
+        req.opcode == DFS_OP_UPLOAD_COMMIT) {
+        char file_path[1024];
+        if (upload_path(name, aux, file_path, sizeof(file_path)) < 0)
+            return dfs_skip_payload(client_sock, req.payload_len) == 0 &&
+                   dfs_send_committed(client_sock, &req, DFS_EINVAL, 0) == 0;
+        return dfs_serve_upload(client_sock, &req, file_path);
+    }
 
-            char file_path[512] = {0};
+    // Check if this is a remove request
+    if (req.opcode == DFS_OP_REMOVE) {
+        printf("Remove request received for: %s\n", name);
+        // Handle remove request
+        handle_remove(client_sock, &req, name);
+        return 1;
+    }
 
-            recv(client_sock, file_path, sizeof(file_path), 0);
+    // Check if this is a download tar request
+    if (req.opcode == DFS_OP_TARFETCH) {
+        if (strcmp(name, ".zip") == 0) {
+            if (*aux)
+                printf("Tar request received for ZIP files under %s\n", aux);
+            else
+                printf("Tar request received for ZIP files\n");
+            return handle_tarfetch(client_sock, &req, aux);
+        }
 
-            
+        // Only ZIP files are supported on S4
+        printf("Unsupported file type for tar request: %s\n", name);
+        return dfs_skip_payload(client_sock, req.payload_len) == 0 &&
+               dfs_send_status(client_sock, &req, DFS_EINVAL) == 0;
+    }
 
-            printf("Download request received from S1 for: %s\n", file_path);
+    // S1 follows changes to the store for its listing cache
+    if (req.opcode == DFS_OP_WATCH) {
+        printf("Change notifications requested\n");
+        return dfs_watch_serve(client_sock, &req);
+    }
 
-            
+    // S1 searches every store at once; this one holds the .zip files
+    if (req.opcode == DFS_OP_FIND) {
+        printf("Search request received for: %s under '%s'\n", aux, name);
+        char root[1024];
+        snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+        return dfs_send_find(client_sock, &req, root, name, ".zip", aux) >= 0;
+    }
 
-            // Handle download request
+    // Check if this is a list files request
+    if (req.opcode == DFS_OP_LISTFILES) {
+        printf("Directory listing request received for: %s\n", name);
 
-            handle_download(client_sock, file_path);
+        // Handle list files request
+        handle_list_files(client_sock, &req, name, aux);
+        return 1;
+    }
 
-            close(client_sock);
+    // Upload functionality
+    if (req.opcode == DFS_OP_UPLOAD) {
+        const char *filename = name, *dest_path = aux;
 
-            continue;
+        printf("Upload request received for: %s (%llu bytes) to %s\n", filename,
+               (unsigned long long)req.payload_len, dest_path);
 
+        // The data is written to disk as it arrives, never buffered whole
+        int status = save_file(client_sock, filename, req.payload_len, dest_path, req.flags & DFS_FLAG_SYNC);
+        if (status < 0) {
+            printf("Upload data receive failed\n");
+            return 0;
         }
 
-        // Check if this is a remove request
+        // Acknowledge so S1 knows the exchange is complete
+        return dfs_send_status(client_sock, &req, status) == 0;
+    }
 
-        if (strcmp(cmd, "REMOVE") == 0) {
+    printf("Unknown command: %d\n", req.opcode);
+    return dfs_send_status(client_sock, &req, DFS_EINVAL) == 0;
+}
 
-            char file_path[512] = {0};
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-n store] [-t threads] [-b backlog] [-q queue]\n", prog);
+    fprintf(stderr, "  -p port     port to listen on (default: %d)\n", PORT);
+    fprintf(stderr, "  -n store    store name; files live in ~/store (default: S4)\n");
+    fprintf(stderr, "  -t threads  worker threads serving requests (default: two per core)\n");
+    fprintf(stderr, "  -b backlog  listen backlog (default: %d)\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -q queue    accepted connections waiting for a worker (default: %d)\n", POOL_DEFAULT_QUEUE);
+    exit(1);
+}
 
-            recv(client_sock, file_path, sizeof(file_path), 0);            
+int main(int argc, char *argv[]) {
+    int server_sock;
+    struct sockaddr_in server_addr;
+    int threads = pool_default_threads();
+    int backlog = DEFAULT_BACKLOG;
+    int queue_size = POOL_DEFAULT_QUEUE;
+    int opt_char;
+
+    while ((opt_char = getopt(argc, argv, "p:n:t:b:q:")) != -1) {
+        if (opt_char == 'p' && atoi(optarg) > 0)
+            server_port = atoi(optarg);
+        else if (opt_char == 'n' && *optarg && !strchr(optarg, '/'))
+            store_name = optarg;
+        else if (opt_char == 't' && atoi(optarg) > 0)
+            threads = atoi(optarg);
+        else if (opt_char == 'b' && atoi(optarg) > 0)
+            backlog = atoi(optarg);
+        else if (opt_char == 'q' && atoi(optarg) > 0)
+            queue_size = atoi(optarg);
+        else
+            usage(argv[0]);
+    }
 
-            printf("Remove request received for: %s\n", file_path);
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("Socket error");
+        exit(1);
+    }
 
-            // Handle remove request
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
 
-            handle_remove(client_sock, file_path);
+    // Allow a quick restart while old pooled connections sit in TIME_WAIT
+    int opt = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-            close(client_sock);
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind error");
+        exit(1);
+    }
 
-            continue;
+    listen(server_sock, backlog);
+    printf("%s server is listening on port %d (%d worker threads, backlog %d)...\n", store_name, server_port, threads, backlog);
 
-        }
+    // Record what is stored and removed, for incremental tar archives
+    char root[1024];
+    snprintf(root, sizeof(root), "%s/%s", getenv("HOME"), store_name);
+    dfs_journal_open(store_name, root);
 
-        // Check if this is a list files request
-        else if (strcmp(cmd, "LISTFILES") == 0) {
-            char dir_path[512];
-            recv(client_sock, dir_path, sizeof(dir_path), 0);
-            
-            printf("Directory listing request received for: %s\n", dir_path);
-            
-            // Handle list files request
-            handle_list_files(client_sock, dir_path);
-            close(client_sock);
-            continue;
-        }
+    // Clear away what uploads that clients gave up on left behind
+    dfs_upload_sweep_start(root);
 
-        // If neither download nor remove, it's the original upload functionality
+    // Answer listings and existence checks from memory, and tell S1 what changes
+    dfs_index_changed = dfs_watch_changed;
+    dfs_index_open(root);
 
-        if (strcmp(cmd, "UPLOAD") == 0) {
-            char filename[256] = {0}, dest_path[256] = {0};
-            int file_size = 0;
-    
-            recv(client_sock, filename, sizeof(filename), 0);
-            recv(client_sock, dest_path, sizeof(dest_path), 0);
-            recv(client_sock, &file_size, sizeof(int), 0);
-    
-            printf("Upload request received for: %s (%d bytes) to %s\n", filename, file_size, dest_path);
-    
-            char *file_data = malloc(file_size);
-            if (!file_data) {
-                perror("Memory allocation failed");
-                close(client_sock);
-                continue;
-            }
-    
-            int received = 0;
-            while (received < file_size) {
-                int r = recv(client_sock, file_data + received, file_size - received, 0);
-                if (r <= 0) break;
-                received += r;
-            }
-    
-            save_file(filename, file_data, file_size, dest_path);
-            free(file_data);
-            close(client_sock);
-            continue;
-        }
-        
-    }
+    struct worker_pool pool;
+    if (pool_start(&pool, threads, queue_size, handle_request) != 0)
+        exit(1);
 
+    pool_run(&pool, server_sock);
     return 0;
-}
\ No newline at end of file
+}
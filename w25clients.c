@@ -6,10 +6,556 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "dfs_io.h"
+#include "dfs_proto.h"
+#include "dfs_file.h"
+#include "dfs_list.h"
+#include "dfs_find.h"
 
 #define PORT 3030          // Define the port number for the server
 #define BUFFER_SIZE 4096   // Define the buffer size for data transfer
 
+#define PARALLEL_STREAMS 4          // Default connections for pdownlf
+#define PARALLEL_MAX_STREAMS 16
+#define PARALLEL_MIN_RANGE (4 * 1024 * 1024)  // Smaller files use fewer streams
+#define PARALLEL_BUFFER_SIZE (256 * 1024)     // Receive buffer per stream
+
+#define UPLOAD_PART_SIZE (8 * 1024 * 1024)        // Bytes per resumable upload part
+#define UPLOAD_RESUMABLE_MIN (16 * 1024 * 1024)   // Larger uploads are sent as resumable parts
+#define UPLOAD_ATTEMPTS 5                         // Connections tried before giving up
+
+// One connection of a parallel download, fetching bytes [offset, offset + length)
+struct range_stream {
+    const char *path;
+    int fd;                  // Local file, shared by all streams
+    uint64_t offset;
+    uint64_t length;
+    uint64_t done;           // Bytes written so far (read by the progress display)
+    int failed;
+    int finished;            // Set by the stream's thread when it is done
+    pthread_t thread;
+};
+
+// Shared state of a striped upload: the file is cut into UPLOAD_PART_SIZE
+// parts, and each stream takes the next part nobody has sent yet
+struct striped_upload {
+    const char *filename;
+    const char *dest_path;
+    int fd;                  // Source file, shared by all streams
+    struct dfs_upload up;    // Upload id and total size
+    uint64_t next_part;      // Next part to hand out
+    uint64_t part_count;
+};
+
+// One connection of a striped upload
+struct part_stream {
+    struct striped_upload *job;
+    uint64_t sent;           // Bytes acknowledged so far (read by the progress display)
+    int failed;
+    int finished;            // Set by the stream's thread when it is done
+    pthread_t thread;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Name a resumable upload after what is uploaded where. Running the same
+// uploadf again after a failure gets the same id, so the server's staged
+// parts are reused; a modified source file gets a new one.
+static uint64_t upload_id(const struct stat *st, const char *filename, const char *dest_path) {
+    uint64_t fields[5] = { st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+    const unsigned char *p = (const unsigned char *)fields;
+    for (size_t i = 0; i < sizeof(fields); i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    for (const char *c = filename; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    hash = (hash ^ '/') * 1099511628211ULL;
+    for (const char *c = dest_path; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    return hash;
+}
+
+// Send one resumable upload request with len bytes of fd at up->offset as
+// its data, and read the committed offset from the reply. Returns the
+// reply status, or -1 if the connection failed.
+static int upload_request(int sock, int opcode, const char *filename, const char *dest_path,
+                          const struct dfs_upload *up, int fd, uint64_t len, uint64_t *committed) {
+    unsigned char desc[DFS_UPLOAD_DESC_SIZE], offset[8];
+    dfs_encode_upload(up, desc);
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    if (dfs_send_request_head(sock, opcode, id, filename, dest_path, desc, sizeof(desc), sizeof(desc) + len) < 0 ||
+        dfs_sendfile_all(sock, fd, up->offset, len) < 0 ||
+        dfs_recv_reply(sock, opcode, id, &reply) < 0)
+        return -1;
+    if (reply.payload_len == sizeof(offset)) {
+        if (recv_all(sock, offset, sizeof(offset)) < 0)
+            return -1;
+        *committed = dfs_get64(offset);
+    } else if (dfs_skip_payload(sock, reply.payload_len) < 0) {
+        return -1;
+    }
+    return reply.status;
+}
+
+// Upload a large file in parts that the server keeps until the COMMIT.
+// When the connection drops, reconnect, ask how much arrived and send only
+// the rest. Returns the server's status, or -1 if every attempt failed.
+static int resumable_upload(int fd, const struct stat *st, const char *filename, const char *dest_path) {
+    struct dfs_upload up = { .id = upload_id(st, filename, dest_path), .total = st->st_size };
+    for (int attempt = 1; attempt <= UPLOAD_ATTEMPTS; attempt++) {
+        if (attempt > 1) {
+            printf("Connection lost; retrying (attempt %d of %d)...\n", attempt, UPLOAD_ATTEMPTS);
+            sleep(1);
+        }
+        int sock = connect_to_server(PORT);
+        if (sock < 0)
+            continue;
+
+        uint64_t committed = 0;
+        int status = upload_request(sock, DFS_OP_UPLOAD_QUERY, filename, dest_path, &up, fd, 0, &committed);
+        if (status == DFS_OK && committed > 0)
+            printf("Resuming upload at byte %llu of %llu.\n", (unsigned long long)committed,
+                   (unsigned long long)up.total);
+        while (status == DFS_OK && committed < up.total) {
+            up.offset = committed;
+            uint64_t len = up.total - committed < UPLOAD_PART_SIZE ? up.total - committed : UPLOAD_PART_SIZE;
+            status = upload_request(sock, DFS_OP_UPLOAD_PART, filename, dest_path, &up, fd, len, &committed);
+        }
+        if (status == DFS_OK) {
+            up.offset = up.total;
+            status = upload_request(sock, DFS_OP_UPLOAD_COMMIT, filename, dest_path, &up, fd, 0, &committed);
+        }
+        close(sock);
+        if (status >= 0)
+            return status;
+    }
+    return -1;
+}
+
+// Send parts over one connection until there are none left
+static void *part_stream_main(void *arg) {
+    struct part_stream *ps = arg;
+    struct striped_upload *job = ps->job;
+    int sock = connect_to_server(PORT);
+    if (sock < 0) {
+        perror("Stream setup failed");
+        ps->failed = 1;
+    }
+
+    while (!ps->failed) {
+        uint64_t part = __atomic_fetch_add(&job->next_part, 1, __ATOMIC_RELAXED);
+        if (part >= job->part_count)
+            break;
+        struct dfs_upload up = job->up;
+        up.offset = part * UPLOAD_PART_SIZE;
+        uint64_t len = up.total - up.offset < UPLOAD_PART_SIZE ? up.total - up.offset : UPLOAD_PART_SIZE;
+        uint64_t committed;
+        if (upload_request(sock, DFS_OP_UPLOAD_PART, job->filename, job->dest_path, &up, job->fd, len,
+                           &committed) != DFS_OK) {
+            ps->failed = 1;  // The part is sent again on the next round
+            break;
+        }
+        __atomic_add_fetch(&ps->sent, len, __ATOMIC_RELAXED);
+    }
+
+    if (sock >= 0)
+        close(sock);
+    __atomic_store_n(&ps->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Print one progress line: bytes sent per stream and the aggregate rate.
+// base is what the server already had before this round started.
+static void print_upload_progress(struct part_stream *streams, int count, uint64_t base, uint64_t total,
+                                  double elapsed) {
+    uint64_t sent = 0;
+    printf("\r");
+    for (int i = 0; i < count; i++) {
+        uint64_t s = __atomic_load_n(&streams[i].sent, __ATOMIC_RELAXED);
+        sent += s;
+        printf("[%d:%5lluM] ", i + 1, (unsigned long long)(s >> 20));
+    }
+    printf("%3d%% %.1f MB/s ", total ? (int)((base + sent) * 100 / total) : 100,
+           elapsed > 0 ? sent / elapsed / 1e6 : 0.0);
+    fflush(stdout);
+}
+
+// Upload a file over several connections at once. Each stream takes parts
+// from a shared counter, so a slow connection simply sends fewer of them;
+// the server pwrite()s every part into a preallocated staging file, and the
+// COMMIT moves it into place once all parts are acknowledged. A round in
+// which a stream failed is followed by another that resends everything past
+// the committed offset. Returns the server's status, or -1 if every attempt
+// failed.
+static int striped_upload(int fd, const struct stat *st, const char *filename, const char *dest_path,
+                          int stream_count) {
+    struct striped_upload job = {
+        .filename = filename,
+        .dest_path = dest_path,
+        .fd = fd,
+        .up = { .id = upload_id(st, filename, dest_path), .total = st->st_size },
+        .part_count = ((uint64_t)st->st_size + UPLOAD_PART_SIZE - 1) / UPLOAD_PART_SIZE
+    };
+    if ((uint64_t)stream_count > job.part_count)
+        stream_count = job.part_count > 0 ? (int)job.part_count : 1;
+
+    double started = now_seconds();
+    for (int attempt = 1; attempt <= UPLOAD_ATTEMPTS; attempt++) {
+        if (attempt > 1) {
+            printf("Connection lost; retrying (attempt %d of %d)...\n", attempt, UPLOAD_ATTEMPTS);
+            sleep(1);
+        }
+        int sock = connect_to_server(PORT);
+        if (sock < 0)
+            continue;
+
+        // Parts wholly below the committed offset are already there
+        uint64_t committed = 0;
+        struct dfs_upload up = job.up;
+        int status = upload_request(sock, DFS_OP_UPLOAD_QUERY, filename, dest_path, &up, fd, 0, &committed);
+        if (status != DFS_OK) {
+            close(sock);
+            if (status > 0 && status != DFS_EUNAVAIL)  // A storage server may just be restarting
+                return status;
+            continue;
+        }
+        job.next_part = committed / UPLOAD_PART_SIZE;
+        uint64_t base = job.next_part * UPLOAD_PART_SIZE;
+        if (committed > 0)
+            printf("Resuming upload at byte %llu of %llu.\n", (unsigned long long)base,
+                   (unsigned long long)job.up.total);
+        printf("Sending %llu bytes over %d connection(s)...\n", (unsigned long long)(job.up.total - base),
+               stream_count);
+
+        struct part_stream streams[PARALLEL_MAX_STREAMS];
+        memset(streams, 0, sizeof(streams));
+        double round_started = now_seconds();
+        int running = 0, failed = 0;
+        for (int i = 0; i < stream_count; i++) {
+            streams[i].job = &job;
+            if (pthread_create(&streams[i].thread, NULL, part_stream_main, &streams[i]) != 0) {
+                failed = 1;
+                break;
+            }
+            running++;
+        }
+
+        // Show progress while the streams run, redrawing it four times a second
+        double last_shown = round_started;
+        for (;;) {
+            int finished = 1;
+            for (int i = 0; i < running; i++)
+                finished &= __atomic_load_n(&streams[i].finished, __ATOMIC_ACQUIRE);
+            if (finished)
+                break;
+            if (now_seconds() - last_shown >= 0.25) {
+                last_shown = now_seconds();
+                print_upload_progress(streams, running, base, job.up.total, last_shown - round_started);
+            }
+            usleep(20 * 1000);
+        }
+        for (int i = 0; i < running; i++) {
+            pthread_join(streams[i].thread, NULL);
+            failed |= streams[i].failed;
+        }
+        print_upload_progress(streams, running, base, job.up.total, now_seconds() - round_started);
+        printf("\n");
+
+        // Every part is acknowledged; move the file into place
+        if (!failed && running > 0) {
+            up.offset = up.total;
+            status = upload_request(sock, DFS_OP_UPLOAD_COMMIT, filename, dest_path, &up, fd, 0, &committed);
+            close(sock);
+            if (status >= 0) {
+                double elapsed = now_seconds() - started;
+                if (status == DFS_OK)
+                    printf("Sent %llu bytes in %.2f s (%.1f MB/s over %d connection(s)).\n",
+                           (unsigned long long)job.up.total, elapsed,
+                           elapsed > 0 ? job.up.total / elapsed / 1e6 : 0.0, stream_count);
+                return status;
+            }
+            continue;
+        }
+        close(sock);
+    }
+    return -1;
+}
+
+// Ask S1 for the size of a file. Returns 0, or -1 if it could not be found.
+static int stat_remote_file(const char *path, uint64_t *size) {
+    int sock = connect_to_server(PORT);
+    if (sock < 0) {
+        perror("Connect failed");
+        return -1;
+    }
+
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    unsigned char info[16];
+    int rc = -1;
+    if (dfs_send_request(sock, DFS_OP_STAT, id, path, NULL, NULL, 0) < 0 ||
+        dfs_recv_reply(sock, DFS_OP_STAT, id, &reply) < 0) {
+        printf("Error receiving file size.\n");
+    } else if (reply.status != DFS_OK || reply.payload_len != sizeof(info)) {
+        printf("File not found on server.\n");
+    } else if (recv_all(sock, info, sizeof(info)) == 0) {
+        *size = dfs_get64(info);
+        rc = 0;
+    }
+    close(sock);
+    return rc;
+}
+
+// Fetch one byte range over its own connection and write it in place
+static void *range_stream_main(void *arg) {
+    struct range_stream *rs = arg;
+    char *buffer = malloc(PARALLEL_BUFFER_SIZE);
+    int sock = connect_to_server(PORT);
+    if (!buffer || sock < 0) {
+        perror("Stream setup failed");
+        rs->failed = 1;
+        free(buffer);
+        if (sock >= 0)
+            close(sock);
+        __atomic_store_n(&rs->finished, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    char range[48];
+    snprintf(range, sizeof(range), "%llu:%llu", (unsigned long long)rs->offset,
+             (unsigned long long)rs->length);
+    uint32_t id = dfs_next_request_id();
+    struct dfs_header reply;
+    if (dfs_send_request(sock, DFS_OP_DOWNLOAD, id, rs->path, range, NULL, 0) < 0 ||
+        dfs_recv_reply(sock, DFS_OP_DOWNLOAD, id, &reply) < 0 ||
+        reply.status != DFS_OK || reply.payload_len != rs->length) {
+        rs->failed = 1;  // The file may have changed since we asked for its size
+    }
+
+    uint64_t done = 0;
+    while (!rs->failed && done < rs->length) {
+        uint64_t left = rs->length - done;
+        ssize_t n = recv_some(sock, buffer, left < PARALLEL_BUFFER_SIZE ? left : PARALLEL_BUFFER_SIZE);
+        if (n <= 0 || pwrite_all(rs->fd, buffer, n, rs->offset + done) < 0) {
+            rs->failed = 1;
+            break;
+        }
+        done += n;
+        __atomic_store_n(&rs->done, done, __ATOMIC_RELAXED);
+    }
+
+    free(buffer);
+    close(sock);
+    __atomic_store_n(&rs->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Print one progress line: per-stream percentages and the aggregate rate
+static void print_progress(struct range_stream *streams, int count, uint64_t total, double elapsed) {
+    uint64_t done = 0;
+    printf("\r");
+    for (int i = 0; i < count; i++) {
+        uint64_t d = __atomic_load_n(&streams[i].done, __ATOMIC_RELAXED);
+        done += d;
+        printf("[%d:%3d%%] ", i + 1, streams[i].length ? (int)(d * 100 / streams[i].length) : 100);
+    }
+    printf("%3d%% %.1f MB/s ", total ? (int)(done * 100 / total) : 100,
+           elapsed > 0 ? done / elapsed / 1e6 : 0.0);
+    fflush(stdout);
+}
+
+// Download a file over several connections at once: the file is split into
+// one byte range per stream, and every stream writes its range straight
+// into a preallocated local file with pwrite().
+static void parallel_download(const char *full_path, int stream_count) {
+    uint64_t size;
+    if (stat_remote_file(full_path, &size) < 0)
+        return;
+
+    // Don't bother splitting small files into tiny ranges
+    uint64_t max_streams = size / PARALLEL_MIN_RANGE;
+    if ((uint64_t)stream_count > max_streams)
+        stream_count = max_streams > 0 ? (int)max_streams : 1;
+
+    char *path_copy = strdup(full_path);
+    if (!path_copy) {
+        perror("Memory allocation error");
+        return;
+    }
+    char local_filename[256], tmp_filename[300];
+    snprintf(local_filename, sizeof(local_filename), "%s", basename(path_copy));
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.part%d", local_filename, getpid());
+    free(path_copy);
+
+    // Reserve the whole file up front so the ranges can land in any order
+    int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("Failed to create file");
+        return;
+    }
+    int err = size > 0 ? posix_fallocate(fd, 0, size) : 0;
+    if (err != 0 && ftruncate(fd, size) < 0) {
+        perror("Failed to preallocate file");
+        close(fd);
+        unlink(tmp_filename);
+        return;
+    }
+
+    printf("Receiving file of size %llu bytes over %d connection(s)...\n",
+           (unsigned long long)size, stream_count);
+
+    struct range_stream streams[PARALLEL_MAX_STREAMS];
+    memset(streams, 0, sizeof(streams));
+    uint64_t share = size / stream_count, offset = 0;
+    double started = now_seconds();
+    int running = 0;
+    for (int i = 0; i < stream_count; i++) {
+        streams[i].path = full_path;
+        streams[i].fd = fd;
+        streams[i].offset = offset;
+        streams[i].length = (i == stream_count - 1) ? size - offset : share;
+        offset += streams[i].length;
+        if (pthread_create(&streams[i].thread, NULL, range_stream_main, &streams[i]) != 0) {
+            streams[i].failed = 1;
+            break;
+        }
+        running++;
+    }
+
+    // Show progress while the streams run, redrawing it four times a second
+    double last_shown = started;
+    for (;;) {
+        int finished = 1;
+        for (int i = 0; i < running; i++)
+            finished &= __atomic_load_n(&streams[i].finished, __ATOMIC_ACQUIRE);
+        if (finished)
+            break;
+        if (now_seconds() - last_shown >= 0.25) {
+            last_shown = now_seconds();
+            print_progress(streams, stream_count, size, last_shown - started);
+        }
+        usleep(20 * 1000);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < stream_count; i++) {
+        if (i < running)
+            pthread_join(streams[i].thread, NULL);
+        failed |= streams[i].failed;
+    }
+    double elapsed = now_seconds() - started;
+    print_progress(streams, stream_count, size, elapsed);
+    printf("\n");
+
+    if (close(fd) != 0 || failed || rename(tmp_filename, local_filename) != 0) {
+        printf("Parallel download of '%s' failed.\n", full_path);
+        unlink(tmp_filename);
+        return;
+    }
+    printf("Downloaded '%s' to current directory (%llu bytes, %.1f MB/s over %d connection(s)).\n",
+           local_filename, (unsigned long long)size, elapsed > 0 ? size / elapsed / 1e6 : 0.0, stream_count);
+}
+
+// Collect the cursors (every .dfs/<store>.cursor: S1 .. S4, or the nodes of
+// a cluster map) that an earlier archive, unpacked in dir, ended with:
+// together they are where the next incremental archive starts. Returns the
+// length, or -1 if dir holds none of them.
+static int read_sync_point(const char *dir, char *buf, size_t size) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/.dfs", dir);
+    DIR *d = opendir(path);
+    if (!d)
+        return -1;
+    size_t len = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len <= 7 || strcmp(entry->d_name + name_len - 7, ".cursor") != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/.dfs/%s", dir, entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        if (len + 1 < size && fgets(buf + len, size - len, fp))
+            len += strcspn(buf + len, "\n");
+        if (len + 1 < size)
+            buf[len++] = '\n';
+        fclose(fp);
+    }
+    closedir(d);
+    buf[len < size ? len : size - 1] = '\0';
+    return len > 0 ? (int)len : -1;
+}
+
+// Parse "findf pattern [path] [-regex] [-size [+|-]N[k|M|G]] [-mtime [+|-]days]"
+// into q and path. -size +N is more than N bytes, -N less, N exactly;
+// -mtime +D is modified more than D days ago, -D less, D between D and D+1.
+static int parse_find(char *args, struct dfs_find_query *q, char *path, size_t path_size) {
+    memset(q, 0, sizeof(*q));
+    q->max_size = UINT64_MAX;
+    q->min_mtime = INT64_MIN;
+    q->max_mtime = INT64_MAX;
+    path[0] = '\0';
+    char *token = strtok(args, " ");
+    if (!token)
+        return -1;
+    snprintf(q->pattern, sizeof(q->pattern), "%s", token);
+
+    while ((token = strtok(NULL, " ")) != NULL) {
+        if (strcmp(token, "-regex") == 0) {
+            q->regex = 1;
+        } else if (strcmp(token, "-size") == 0 || strcmp(token, "-mtime") == 0) {
+            int is_size = token[1] == 's';
+            char *value = strtok(NULL, " "), *end;
+            if (!value)
+                return -1;
+            char sign = (*value == '+' || *value == '-') ? *value++ : 0;
+            unsigned long long n = strtoull(value, &end, 10);
+            if (end == value)
+                return -1;
+            if (is_size) {
+                const char *units = "kMG";
+                if (*end && strchr(units, *end))
+                    n <<= 10 * (strchr(units, *end++) - units + 1);
+                if (*end || (sign == '-' && n == 0))
+                    return -1;
+                if (sign == '+')
+                    q->min_size = n + 1;
+                else if (sign == '-')
+                    q->max_size = n - 1;
+                else
+                    q->min_size = q->max_size = n;
+            } else {
+                if (*end)
+                    return -1;
+                int64_t day_start = (int64_t)time(NULL) - (int64_t)n * 86400;
+                if (sign == '+')
+                    q->max_mtime = day_start - 1;
+                else if (sign == '-')
+                    q->min_mtime = day_start + 1;
+                else {
+                    q->min_mtime = day_start - 86400;
+                    q->max_mtime = day_start;
+                }
+            }
+        } else if (!path[0] && token[0] != '-') {
+            snprintf(path, path_size, "%s", token);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int main() {
     char command[1024], filename[256], dest_path[256];
 
@@ -33,73 +579,123 @@ int main() {
             }
         
             // Open the source file for reading
-            FILE *fp = fopen(src_path, "rb");
-            if (!fp) {
+            int fd = open(src_path, O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0) {
                 perror("File open failed");
+                if (fd >= 0)
+                    close(fd);
                 continue;
             }
         
-            // Get the size of the file
-            fseek(fp, 0, SEEK_END);
-            int file_size = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-        
-            // Allocate memory to hold the file data
-            char *file_data = malloc(file_size);
-            if (!file_data) {
-                perror("Memory allocation failed");
-                fclose(fp);
-                continue;
-            }
-        
-            // Read the file data into memory
-            fread(file_data, 1, file_size, fp);
-            fclose(fp);
+            // Get the size of the file (64 bits, so files over 4 GB work)
+            uint64_t file_size = st.st_size;
         
             // Extract the filename from the source path
             char *path_copy = strdup(src_path);
             char *filename = basename(path_copy);
         
-            // Create a socket for communication with the server
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            struct sockaddr_in server_addr;
-            server_addr.sin_family = AF_INET;
-            server_addr.sin_port = htons(PORT);
-            server_addr.sin_addr.s_addr = INADDR_ANY; // Connect to any available address
-        
+            // Large files go up in parts that survive a dropped connection
+            if (file_size >= UPLOAD_RESUMABLE_MIN) {
+                int status = resumable_upload(fd, &st, filename, dest_path);
+                if (status < 0)
+                    printf("Connection error while uploading file; run the same uploadf again to resume.\n");
+                else if (status != DFS_OK)
+                    printf("Upload of '%s' failed (status %d).\n", filename, status);
+                else
+                    printf("Uploaded '%s' (%llu bytes) to server path '%s'.\n", filename,
+                           (unsigned long long)file_size, dest_path);
+                close(fd);
+                free(path_copy);
+                continue;
+            }
+
             // Connect to the server
-            if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
                 perror("Connect failed");
-                free(file_data);
+                close(fd);
                 free(path_copy);
-                close(sock);
                 continue;
             }
         
-            // Send UPLOAD command and file details to the server
-            char cmd[10] = "UPLOAD";
-            send(sock, cmd, sizeof(cmd), 0);
-            send(sock, filename, 256, 0);
-            send(sock, dest_path, 256, 0);
-            send(sock, &file_size, sizeof(int), 0);
-            send(sock, file_data, file_size, 0);
-        
-            printf("Uploaded '%s' (%d bytes) to server path '%s'.\n", filename, file_size, dest_path);
+            // Send the UPLOAD request, stream the file data straight from the
+            // page cache, then wait for the server's status
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            if (dfs_send_request(sock, DFS_OP_UPLOAD, id, filename, dest_path, NULL, file_size) < 0 ||
+                dfs_sendfile_all(sock, fd, 0, file_size) < 0 ||
+                dfs_recv_reply(sock, DFS_OP_UPLOAD, id, &reply) < 0) {
+                printf("Connection error while uploading file.\n");
+            } else if (reply.status != DFS_OK) {
+                printf("Upload of '%s' failed (status %d).\n", filename, reply.status);
+            } else {
+                printf("Uploaded '%s' (%llu bytes) to server path '%s'.\n", filename,
+                       (unsigned long long)file_size, dest_path);
+            }
         
             // Clean up resources
-            free(file_data);
+            close(fd);
             free(path_copy);
             close(sock);
-        } 
+        }
+        // Check for parallel upload command
+        else if (strncmp(command, "puploadf", 8) == 0) {
+            char src_path[512], dest_path[512];
+            int stream_count = PARALLEL_STREAMS;
+            // Parse the source and destination paths and optional number of connections
+            if (sscanf(command, "puploadf %511s %511s %d", src_path, dest_path, &stream_count) < 2 ||
+                stream_count < 1 || stream_count > PARALLEL_MAX_STREAMS) {
+                printf("Invalid syntax. Use: puploadf source_path destination_path [connections (1-%d)]\n",
+                       PARALLEL_MAX_STREAMS);
+                continue;
+            }
+            if (!(strncmp(dest_path, "~/S1", 4) == 0 || strncmp(dest_path, "~S1", 3) == 0)) {
+                 printf("Invalid destination path. Use ~/S1 or ~S1\n");
+                 continue;
+            }
+
+            // Open the source file for reading
+            int fd = open(src_path, O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0) {
+                perror("File open failed");
+                if (fd >= 0)
+                    close(fd);
+                continue;
+            }
+
+            char *path_copy = strdup(src_path);
+            char *filename = basename(path_copy);
+            int status = striped_upload(fd, &st, filename, dest_path, stream_count);
+            if (status < 0)
+                printf("Connection error while uploading file; run the same puploadf again to resume.\n");
+            else if (status != DFS_OK)
+                printf("Upload of '%s' failed (status %d).\n", filename, status);
+            else
+                printf("Uploaded '%s' (%llu bytes) to server path '%s'.\n", filename,
+                       (unsigned long long)st.st_size, dest_path);
+            close(fd);
+            free(path_copy);
+        }
         // Check for download command
         else if (strncmp(command, "downlf", 6) == 0) {
             // Extract the full file path from the command
             char full_path[512];
             if (sscanf(command, "downlf %511[^\n]", full_path) != 1) {
-                printf("Invalid syntax. Use: downlf path_to_file\n");
+                printf("Invalid syntax. Use: downlf path_to_file [offset[:length] | -bytes]\n");
                 continue;
             }
 
+            // An optional last word selects a byte range: "offset:length",
+            // "offset" (to the end of the file) or "-N" (the last N bytes)
+            const char *range = NULL;
+            char *last_word = strrchr(full_path, ' ');
+            if (last_word && !strchr(last_word, '.')) {
+                *last_word = '\0';
+                range = last_word + 1;
+            }
+
             // Check if the file has a valid extension
             char *ext = strrchr(full_path, '.');
             if (!ext || (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && 
@@ -108,75 +704,42 @@ int main() {
                 continue;
             }
 
-            // Create a socket for communication with the server
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            struct sockaddr_in server_addr;
-            server_addr.sin_family = AF_INET;
-            server_addr.sin_port = htons(PORT);
-            server_addr.sin_addr.s_addr = INADDR_ANY; // Connect to any available address
-
             // Connect to the server
-            if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
                 perror("Connect failed");
-                close(sock);
                 continue;
             }
 
-            // Send DOWNLOAD command and the requested file path to the server
-            char cmd[10] = "DOWNLOAD";
-            send(sock, cmd, sizeof(cmd), 0);
-            send(sock, full_path, sizeof(full_path), 0);
-
-            // Receive the size of the file from the server
-            int file_size = 0;
-            int bytes_received = recv(sock, &file_size, sizeof(int), 0);
-            if (bytes_received <= 0) {
+            // Send the DOWNLOAD request for the file path to the server
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            if (dfs_send_request(sock, DFS_OP_DOWNLOAD, id, full_path, range, NULL, 0) < 0 ||
+                dfs_recv_reply(sock, DFS_OP_DOWNLOAD, id, &reply) < 0) {
                 printf("Error receiving file size.\n");
                 close(sock);
                 continue;
             }
 
             // Check if the file exists on the server
-            if (file_size < 0) {
-                printf("File not found on server.\n");
+            if (reply.status == DFS_EINVAL && range) {
+                printf("Invalid byte range '%s'.\n", range);
                 close(sock);
                 continue;
             }
-
-            printf("Receiving file of size %d bytes...\n", file_size);
-
-            // Allocate memory to receive the file data
-            char *file_data = malloc(file_size);
-            if (!file_data) {
-                perror("Failed to allocate memory");
+            if (reply.status != DFS_OK) {
+                printf("File not found on server.\n");
                 close(sock);
                 continue;
             }
+            uint64_t file_size = reply.payload_len;
 
-            // Receive the file data in chunks
-            int received = 0;
-            while (received < file_size) {
-                int r = recv(sock, file_data + received, file_size - received, 0);
-                if (r <= 0) {
-                    printf("Connection error while receiving data.\n");
-                    break;
-                }
-                received += r;
-            }
-
-            // Check if the entire file was received
-            if (received < file_size) {
-                printf("Warning: Only received %d of %d bytes\n", received, file_size);
-                free(file_data);
-                close(sock);
-                continue;
-            }
+            printf("Receiving file of size %llu bytes...\n", (unsigned long long)file_size);
 
             // Extract the filename from the full path
             char *path_copy = strdup(full_path);
             if (!path_copy) {
                 perror("Memory allocation error");
-                free(file_data);
                 close(sock);
                 continue;
             }
@@ -187,29 +750,44 @@ int main() {
             local_filename[sizeof(local_filename) - 1] = '\0';
             free(path_copy);
             
-            // Save the received data to a file in the current directory
-            FILE *fp = fopen(local_filename, "wb");
-            if (!fp) {
-                perror("Failed to create file");
-                free(file_data);
-                close(sock);
-                continue;
-            }
-
-            // Write the received data to the file
-            size_t written = fwrite(file_data, 1, file_size, fp);
-            if (written != file_size) {
-                printf("Warning: Only wrote %zu of %d bytes to file\n", written, file_size);
-            }
-            
-            fclose(fp);
-            printf("Downloaded '%s' to current directory (%d bytes).\n", local_filename, file_size);
+            // Write the file data to the current directory as it arrives
+            int status = dfs_recv_file(sock, local_filename, file_size);
+            if (status < 0)
+                printf("Connection error while receiving data.\n");
+            else if (status != DFS_OK)
+                printf("Failed to write '%s'.\n", local_filename);
+            else if (range)
+                printf("Downloaded bytes %s of the file to '%s' (%llu bytes).\n", range, local_filename,
+                       (unsigned long long)file_size);
+            else
+                printf("Downloaded '%s' to current directory (%llu bytes).\n", local_filename,
+                       (unsigned long long)file_size);
 
             // Clean up resources
-            free(file_data);
             close(sock);
 
         } 
+        // Check for parallel download command
+        else if (strncmp(command, "pdownlf", 7) == 0) {
+            // Extract the file path and optional number of connections
+            char full_path[512];
+            int stream_count = PARALLEL_STREAMS;
+            if (sscanf(command, "pdownlf %511s %d", full_path, &stream_count) < 1 ||
+                stream_count < 1 || stream_count > PARALLEL_MAX_STREAMS) {
+                printf("Invalid syntax. Use: pdownlf path_to_file [connections (1-%d)]\n", PARALLEL_MAX_STREAMS);
+                continue;
+            }
+
+            // Check if the file has a valid extension
+            char *ext = strrchr(full_path, '.');
+            if (!ext || (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && 
+                          strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0)) {
+                printf("Unsupported file type. Only .c, .pdf, .txt, and .zip files are supported.\n");
+                continue;
+            }
+
+            parallel_download(full_path, stream_count);
+        }
         // Check for remove command
         else if (strncmp(command, "removef", 7) == 0) {
             // Extract the file path from the command
@@ -229,28 +807,22 @@ int main() {
                 continue;
             }
 
-            // Create a socket for communication with the server
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            struct sockaddr_in server_addr;
-            server_addr.sin_family = AF_INET;
-            server_addr.sin_port = htons(PORT);
-            server_addr.sin_addr.s_addr = INADDR_ANY; // Connect to any available address
-
             // Connect to the server
-            if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
                 perror("Connect failed");
-                close(sock);
                 continue;
             }
 
-            // Send REMOVE command and the file path to the server
-            char cmd[10] = "REMOVE";
-            send(sock, cmd, sizeof(cmd), 0);
-            send(sock, full_path, sizeof(full_path), 0);
+            // Send the REMOVE request for the file path to the server
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            int status_code = -1;
 
             // Receive status code from the server
-            int status_code = 0;
-            recv(sock, &status_code, sizeof(int), 0);
+            if (dfs_send_request(sock, DFS_OP_REMOVE, id, full_path, NULL, NULL, 0) == 0 &&
+                dfs_recv_reply(sock, DFS_OP_REMOVE, id, &reply) == 0)
+                status_code = reply.status;
 
             // Check the status of the remove operation
             if (status_code == 0) {
@@ -267,82 +839,78 @@ int main() {
         } 
         // Check for download tar command
         else if (strncmp(command, "downltar", 8) == 0) {
-            char filetype[10];
-            // Parse the command to get the file type
-            if (sscanf(command, "downltar %9s", filetype) != 1) {
-                printf("Invalid syntax. Use: downltar .filetype (.c/.pdf/.txt)\n");
+            char filetype[10], dir_path[512] = "", mode[8] = "", mode_arg[512] = "";
+            // A trailing -z asks for a gzip-compressed archive
+            int gzip = 0;
+            size_t command_len = strlen(command);
+            if (command_len > 3 && strcmp(command + command_len - 3, " -z") == 0) {
+                gzip = 1;
+                command[command_len - 3] = '\0';
+            }
+
+            // Parse the command to get the file type, optional directory and
+            // optional "since <unix time>" or "after <dir of the last archive>"
+            int fields = sscanf(command, "downltar %9s %511s %7s %511s", filetype, dir_path, mode, mode_arg);
+            if (fields >= 2 && (strcmp(dir_path, "since") == 0 || strcmp(dir_path, "after") == 0)) {
+                snprintf(mode, sizeof(mode), "%s", dir_path);
+                dir_path[0] = '\0';
+                mode_arg[0] = '\0';
+                fields = sscanf(command, "downltar %*s %*s %511s", mode_arg) == 1 ? 4 : 3;
+            }
+            if (fields < 1 || fields == 3 || (fields == 4 && strcmp(mode, "since") != 0 && strcmp(mode, "after") != 0)) {
+                printf("Invalid syntax. Use: downltar .filetype|all [pathname] [since <unix time> | after <dir>] [-z] "
+                       "(.c/.pdf/.txt/.zip)\n");
                 continue;
             }
 
-            // Validate the file type
-            if (strcmp(filetype, ".c") != 0 && strcmp(filetype, ".pdf") != 0 && strcmp(filetype, ".txt") != 0) {
-                printf("Unsupported file type. Only .c, .pdf, and .txt are supported for tar download.\n");
+            // An incremental archive starts from a time or from where the last one ended
+            char sync[DFS_SYNC_MAX + 1] = "";
+            int sync_len = 0;
+            if (strcmp(mode, "since") == 0) {
+                sync_len = snprintf(sync, sizeof(sync), "since %llu\n", strtoull(mode_arg, NULL, 10));
+            } else if (strcmp(mode, "after") == 0 && (sync_len = read_sync_point(mode_arg, sync, sizeof(sync))) < 0) {
+                printf("No .dfs/*.cursor files in '%s'; unpack the previous archive there first.\n", mode_arg);
                 continue;
             }
 
-            // Create a socket for communication with the server
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            struct sockaddr_in server_addr;
-            server_addr.sin_family = AF_INET;
-            server_addr.sin_port = htons(PORT);
-            server_addr.sin_addr.s_addr = INADDR_ANY; // Connect to any available address
+            // Validate the file type
+            if (strcmp(filetype, ".c") != 0 && strcmp(filetype, ".pdf") != 0 && strcmp(filetype, ".txt") != 0 &&
+                strcmp(filetype, ".zip") != 0 && strcmp(filetype, "all") != 0) {
+                printf("Unsupported file type. Only .c, .pdf, .txt, .zip and all are supported for tar download.\n");
+                continue;
+            }
 
             // Connect to the server
-            if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
                 perror("Connect failed");
-                close(sock);
                 continue;
             }
 
-            // Send TARFETCH command and the file type to the server
-            char cmd[10] = "TARFETCH";
-            send(sock, cmd, sizeof(cmd), 0);
-            send(sock, filetype, sizeof(filetype), 0);
-
-            // Receive the size of the tar file from the server
-            int file_size = 0;
-            int bytes_received = recv(sock, &file_size, sizeof(int), 0);
-            if (bytes_received <= 0) {
+            // Send the TARFETCH request for the file type (and directory) to the server
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            if (dfs_send_request_flags(sock, DFS_OP_TARFETCH, gzip ? DFS_FLAG_GZIP : 0, id, filetype, dir_path, sync,
+                                       sync_len, sync_len) < 0 ||
+                dfs_recv_reply(sock, DFS_OP_TARFETCH, id, &reply) < 0) {
                 printf("Error receiving tar file size.\n");
                 close(sock);
                 continue;
             }
 
             // Check if the tar file exists
-            if (file_size < 0) {
+            if (reply.status != DFS_OK) {
                 printf("Tar file not found or could not be created.\n");
                 close(sock);
                 continue;
             }
-
-            printf("Receiving tar file of size %d bytes...\n", file_size);
-
-            // Allocate memory to receive the tar file data
-            char *file_data = malloc(file_size);
-            if (!file_data) {
-                perror("Memory allocation error");
-                close(sock);
-                continue;
-            }
-
-            // Receive the tar file data in chunks
-            int received = 0;
-            while (received < file_size) {
-                int r = recv(sock, file_data + received, file_size - received, 0);
-                if (r <= 0) {
-                    printf("Connection error while receiving tar file.\n");
-                    break;
-                }
-                received += r;
-            }
-
-            // Check if the entire tar file was received
-            if (received < file_size) {
-                printf("Warning: Only received %d of %d bytes\n", received, file_size);
-                free(file_data);
-                close(sock);
-                continue;
-            }
+            // Archives built as they are sent come in chunks, with no size up front
+            int chunked = (reply.flags & DFS_FLAG_CHUNKED) != 0;
+            uint64_t file_size = reply.payload_len;
+            if (chunked)
+                printf("Receiving tar file...\n");
+            else
+                printf("Receiving tar file of size %llu bytes...\n", (unsigned long long)file_size);
 
             // Determine the local tar file name based on the file type
             char tar_name[64];
@@ -350,33 +918,32 @@ int main() {
                 strcpy(tar_name, "cfiles.tar");
             else if (strcmp(filetype, ".pdf") == 0)
                 strcpy(tar_name, "pdf.tar");
-            else
+            else if (strcmp(filetype, ".txt") == 0)
                 strcpy(tar_name, "text.tar");
+            else if (strcmp(filetype, ".zip") == 0)
+                strcpy(tar_name, "zip.tar");
+            else
+                strcpy(tar_name, "all.tar");
+            if (reply.flags & DFS_FLAG_GZIP)
+                strcat(tar_name, ".gz");
 
-            // Save the received tar file data to a local file
-            FILE *fp = fopen(tar_name, "wb");
-            if (!fp) {
-                perror("Failed to create tar file locally");
-                free(file_data);
-                close(sock);
-                continue;
-            }
-
-            // Write the received tar data to the file
-            size_t written = fwrite(file_data, 1, file_size, fp);
-            if (written != file_size) {
-                printf("Warning: Only wrote %zu of %d bytes to file\n", written, file_size);
-            }
-
-            fclose(fp);
-            printf("Downloaded '%s' to current directory (%d bytes).\n", tar_name, file_size);
+            // Write the tar data to a local file as it arrives
+            int status = dfs_recv_payload_file(sock, tar_name, file_size, chunked, 0, &file_size);
+            if (status < 0)
+                printf("Connection error while receiving tar file.\n");
+            else if (status != DFS_OK)
+                printf("Failed to create tar file '%s' locally.\n", tar_name);
+            else
+                printf("Downloaded '%s' to current directory (%llu bytes).\n", tar_name,
+                       (unsigned long long)file_size);
+            if (status == DFS_OK && sync_len > 0)
+                printf("Only changes are included; removed files are listed in .dfs/S<n>.deleted.\n");
 
             // Clean up resources
-            free(file_data);
             close(sock);
         }
         // Check for display filenames command
-        else if (strncmp(command, "dispfn ames", 10) == 0) {
+        else if (strncmp(command, "dispfnames", 10) == 0) {
             // Extract the directory path from the command
             char dir_path[512];
             if (sscanf(command, "dispfnames %511[^\n]", dir_path) != 1) {
@@ -384,54 +951,188 @@ int main() {
                 continue;
             }
             
-            // Create a socket for communication with the server
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            struct sockaddr_in server_addr;
-            server_addr.sin_family = AF_INET;
-            server_addr.sin_port = htons(PORT);
-            server_addr.sin_addr.s_addr = INADDR_ANY; // Connect to any available address
-
             // Connect to the server
-            if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
                 perror("Connect failed");
-                close(sock);
                 continue;
             }
 
-            // Send LISTFILES command and the directory path to the server
-            char cmd[10] = "LISTFILES";
-            send(sock, cmd, sizeof(cmd), 0);
-            send(sock, dir_path, sizeof(dir_path), 0);
-
-            // Receive the count of files in the directory
-            int file_count = 0;
-            recv(sock, &file_count, sizeof(int), 0);
+            // Send the LISTFILES request for the directory path to the server
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            if (dfs_send_request(sock, DFS_OP_LISTFILES, id, dir_path, NULL, NULL, 0) < 0 ||
+                dfs_recv_reply(sock, DFS_OP_LISTFILES, id, &reply) < 0) {
+                printf("Error receiving file list.\n");
+                close(sock);
+                continue;
+            }
             
             // Check for errors in directory access
-            if (file_count < 0) {
+            if (reply.status != DFS_OK) {
                 printf("Error: Directory not found or access denied.\n");
                 close(sock);
                 continue;
             }
             
+            // The names arrive in batches, one per chunk; print each as it comes
+            unsigned char *batch = malloc(DFS_LIST_BATCH_BYTES);
+            uint64_t len, file_count = 0;
+            int broken = !batch || !(reply.flags & DFS_FLAG_CHUNKED);
+            while (!broken) {
+                if (dfs_recv_chunk_head(sock, &len) < 0 || len > DFS_LIST_BATCH_BYTES ||
+                    (len > 0 && recv_all(sock, batch, len) < 0)) {
+                    broken = 1;
+                    break;
+                }
+                if (len == 0)
+                    break;
+                struct dfs_list_reader reader;
+                dfs_list_reader_init(&reader, batch, len);
+                for (const char *name; (name = dfs_list_next(&reader)) != NULL; file_count++) {
+                    if (file_count == 0)
+                        printf("Files in '%s':\n", dir_path);
+                    printf("%s\n", name);
+                }
+                broken = reader.bad;
+            }
+            free(batch);
+            close(sock);
+            if (broken) {
+                printf("Connection error while receiving file list.\n");
+                continue;
+            }
+            
             // Handle case where no files are found
             if (file_count == 0) {
-                printf("No files found in directory '%s'\n", dir_path);
+                printf("No files found in directory '%s'%s\n", dir_path,
+                       reply.flags & DFS_FLAG_PARTIAL ? " (a storage server did not answer in time)" : "");
+                continue;
+            }
+            if (reply.flags & DFS_FLAG_PARTIAL)
+                printf("(Partial listing: a storage server did not answer in time.)\n");
+        }
+        // Check for the search command
+        else if (strncmp(command, "findf ", 6) == 0) {
+            struct dfs_find_query q;
+            char path[512], query[DFS_NAME_MAX + 1];
+            if (parse_find(command + 6, &q, path, sizeof(path)) < 0 || dfs_find_format(&q, query, sizeof(query)) < 0) {
+                printf("Invalid syntax. Use: findf pattern [~S1/path] [-regex] [-size [+|-]N[k|M|G]] "
+                       "[-mtime [+|-]days]\n");
+                continue;
+            }
+
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
+                perror("Connect failed");
+                continue;
+            }
+
+            // One request searches every store; matches arrive in chunks as they are found
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            if (dfs_send_request(sock, DFS_OP_FIND, id, path, query, NULL, 0) < 0 ||
+                dfs_recv_reply(sock, DFS_OP_FIND, id, &reply) < 0) {
+                printf("Error receiving search results.\n");
                 close(sock);
                 continue;
             }
-            
-            printf("Files in '%s':\n", dir_path);
-            
-            // Receive and display each filename
-            for (int i = 0; i < file_count; i++) {
-                char filename[256] = {0};
-                recv(sock, filename, sizeof(filename), 0);
-                printf("%s\n", filename);
+            if (reply.status != DFS_OK || !(reply.flags & DFS_FLAG_CHUNKED)) {
+                printf(reply.status == DFS_EINVAL ? "Error: Invalid pattern or path.\n"
+                       : reply.status == DFS_EUNAVAIL ? "Error: Storage servers unreachable.\n"
+                       : "Error: Directory not found.\n");
+                close(sock);
+                continue;
             }
-            
+
+            unsigned char *chunk = malloc(DFS_FIND_BATCH_BYTES);
+            uint64_t len, found = 0;
+            int broken = !chunk;
+            while (!broken) {
+                if (dfs_recv_chunk_head(sock, &len) < 0 || len > DFS_FIND_BATCH_BYTES ||
+                    (len > 0 && recv_all(sock, chunk, len) < 0)) {
+                    broken = 1;
+                    break;
+                }
+                if (len == 0)
+                    break;
+                for (uint64_t off = 0; off < len; found++) {
+                    size_t path_len = off + DFS_FIND_RECORD_HEAD <= len ? (chunk[off] << 8 | chunk[off + 1]) : 0;
+                    if (off + DFS_FIND_RECORD_HEAD + path_len > len || path_len == 0) {
+                        broken = 1;
+                        break;
+                    }
+                    time_t mtime = (time_t)dfs_get64(chunk + off + 10);
+                    char when[32];
+                    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+                    printf("~S1/%.*s  %llu bytes  %s\n", (int)path_len, chunk + off + DFS_FIND_RECORD_HEAD,
+                           (unsigned long long)dfs_get64(chunk + off + 2), when);
+                    off += DFS_FIND_RECORD_HEAD + path_len;
+                }
+            }
+            free(chunk);
             close(sock);
-        } 
+            if (broken) {
+                printf("Connection error while receiving search results.\n");
+                continue;
+            }
+            printf("%llu file(s) found%s\n", (unsigned long long)found,
+                   reply.flags & DFS_FLAG_PARTIAL ? " (a storage server could not be searched)" : "");
+        }
+        // Check for the server statistics command
+        else if (strcmp(command, "stats") == 0) {
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
+                perror("Connect failed");
+                continue;
+            }
+
+            // The reply is a few lines of text, one counter each
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            char text[4096];
+            if (dfs_send_request(sock, DFS_OP_STATS, id, "", NULL, NULL, 0) < 0 ||
+                dfs_recv_reply(sock, DFS_OP_STATS, id, &reply) < 0 || reply.status != DFS_OK ||
+                reply.payload_len >= sizeof(text) || recv_all(sock, text, reply.payload_len) < 0) {
+                printf("Error receiving server statistics.\n");
+                close(sock);
+                continue;
+            }
+            text[reply.payload_len] = '\0';
+            printf("%s", text);
+            close(sock);
+        }
+        // Check for the rebalancer command: report its progress, after
+        // starting a pass, pausing, resuming or changing its rate if asked
+        else if (strcmp(command, "rebalance") == 0 || strncmp(command, "rebalance ", 10) == 0) {
+            char action[16] = "", rate[16] = "";
+            int fields = sscanf(command, "rebalance %15s %15s", action, rate);
+            if ((fields >= 1 && strcmp(action, "start") != 0 && strcmp(action, "pause") != 0 &&
+                 strcmp(action, "resume") != 0 && strcmp(action, "rate") != 0) ||
+                (strcmp(action, "rate") == 0) != (fields == 2)) {
+                printf("Invalid syntax. Use: rebalance [start | pause | resume | rate KB/s]\n");
+                continue;
+            }
+            int sock = connect_to_server(PORT);
+            if (sock < 0) {
+                perror("Connect failed");
+                continue;
+            }
+
+            uint32_t id = dfs_next_request_id();
+            struct dfs_header reply;
+            char text[4096];
+            if (dfs_send_request(sock, DFS_OP_REBALANCE, id, action, rate, NULL, 0) < 0 ||
+                dfs_recv_reply(sock, DFS_OP_REBALANCE, id, &reply) < 0 || reply.status != DFS_OK ||
+                reply.payload_len >= sizeof(text) || recv_all(sock, text, reply.payload_len) < 0) {
+                printf("Error receiving the rebalancer's progress.\n");
+                close(sock);
+                continue;
+            }
+            text[reply.payload_len] = '\0';
+            printf("%s", text);
+            close(sock);
+        }
         // Check for exit command
         else if (strcmp(command, "exit") == 0) {
             break; // Exit the loop and terminate the program